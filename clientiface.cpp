@@ -82,6 +82,11 @@ void RemoteClient::GetNextBlocks (
 	if(player == NULL)
 		return;
 
+	// Let the emerge threads work on what is nearest to us first
+	emerge->setPeerFocus(peer_id,
+			getNodeBlockPos(floatToInt(player->getPosition(), BS)),
+			g_settings->getS16("max_block_send_distance"));
+
 	// Won't send anything if already sending
 	if(m_blocks_sending.size() >= g_settings->getU16
 			("max_simultaneous_block_sends_per_client"))
@@ -33,8 +33,10 @@ SQLite format specification:
 #include "settings.h"
 #include "porting.h"
 #include "util/string.h"
+#include "util/basic_macros.h"
 
 #include <cassert>
+#include <map>
 
 // When to print messages when the database is being held locked by another process
 // Note: I've seen occasional delays of over 250ms while running minetestmapper.
@@ -44,6 +46,9 @@ SQLite format specification:
 #define BUSY_FATAL_TRESHOLD	3000	// Allow SQLITE_BUSY to be returned, which will cause a minetest crash.
 #define BUSY_ERROR_INTERVAL	10000	// Safety net: report again every 10 seconds
 
+// Positions bound to one query of loadBlocks()
+#define SQLITE_READ_BATCH 64
+
 
 #define SQLRES(s, r, m) \
 	if ((s) != (r)) { \
@@ -110,6 +115,7 @@ Database_SQLite3::Database_SQLite3(const std::string &savedir) :
 	m_savedir(savedir),
 	m_database(NULL),
 	m_stmt_read(NULL),
+	m_stmt_read_batch(NULL),
 	m_stmt_write(NULL),
 	m_stmt_list(NULL),
 	m_stmt_delete(NULL),
@@ -164,6 +170,14 @@ void Database_SQLite3::openDatabase()
 			 + itos(g_settings->getU16("sqlite_synchronous"));
 	SQLOK(sqlite3_exec(m_database, query_str.c_str(), NULL, NULL, NULL),
 		"Failed to modify sqlite3 synchronous mode");
+
+	// With write-ahead logging, readers on other connections (one per
+	// emerge thread) neither block nor get blocked by the writer
+	if (g_settings->getBool("sqlite_wal")) {
+		SQLOK(sqlite3_exec(m_database, "PRAGMA journal_mode = WAL",
+				NULL, NULL, NULL),
+			"Failed to enable sqlite3 write-ahead logging");
+	}
 }
 
 void Database_SQLite3::verifyDatabase()
@@ -175,6 +189,16 @@ void Database_SQLite3::verifyDatabase()
 	PREPARE_STATEMENT(begin, "BEGIN");
 	PREPARE_STATEMENT(end, "COMMIT");
 	PREPARE_STATEMENT(read, "SELECT `data` FROM `blocks` WHERE `pos` = ? LIMIT 1");
+	{
+		// Unused parameters stay NULL, which matches no row
+		std::string query = "SELECT `pos`, `data` FROM `blocks` WHERE `pos` IN (?";
+		for (u32 i = 1; i < SQLITE_READ_BATCH; i++)
+			query += ", ?";
+		query += ")";
+		SQLOK(sqlite3_prepare_v2(m_database, query.c_str(), -1,
+				&m_stmt_read_batch, NULL),
+			"Failed to prepare query '" + query + "'");
+	}
 #ifdef __ANDROID__
 	PREPARE_STATEMENT(write,  "INSERT INTO `blocks` (`pos`, `data`) VALUES (?, ?)");
 #else
@@ -238,27 +262,102 @@ bool Database_SQLite3::saveBlock(const v3s16 &pos, const std::string &data)
 }
 
 std::string Database_SQLite3::loadBlock(const v3s16 &pos)
+{
+	std::string s;
+	if (!tryLoadBlock(pos, &s))
+		errorstream << "SQLite3: Failed to load block " << PP(pos)
+			<< ": " << sqlite3_errmsg(m_database) << std::endl;
+	return s;
+}
+
+bool Database_SQLite3::tryLoadBlock(const v3s16 &pos, std::string *s)
 {
 	verifyDatabase();
 
 	bindPos(m_stmt_read, pos);
 
-	if (sqlite3_step(m_stmt_read) != SQLITE_ROW) {
+	s->clear();
+	int res = sqlite3_step(m_stmt_read);
+	if (res != SQLITE_ROW) {
 		sqlite3_reset(m_stmt_read);
-		return "";
+		// Anything but the end of the rows is an error, SQLITE_BUSY
+		// for example
+		return res == SQLITE_DONE;
 	}
 	const char *data = (const char *) sqlite3_column_blob(m_stmt_read, 0);
 	size_t len = sqlite3_column_bytes(m_stmt_read, 0);
 
-	std::string s;
 	if (data)
-		s = std::string(data, len);
+		s->assign(data, len);
 
 	sqlite3_step(m_stmt_read);
 	// We should never get more than 1 row, so ok to reset
 	sqlite3_reset(m_stmt_read);
 
-	return s;
+	return true;
+}
+
+bool Database_SQLite3::saveBlocks(const std::vector<v3s16> &positions,
+		const std::vector<std::string> &data)
+{
+	assert(positions.size() == data.size());
+	verifyDatabase();
+
+	// Everything in one transaction, unless the caller already started one
+	bool own_transaction = sqlite3_get_autocommit(m_database) != 0;
+	if (own_transaction)
+		beginSave();
+
+	bool good = true;
+	for (size_t i = 0; i < positions.size(); i++)
+		good &= saveBlock(positions[i], data[i]);
+
+	if (own_transaction)
+		endSave();
+	return good;
+}
+
+void Database_SQLite3::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> &dst)
+{
+	verifyDatabase();
+
+	dst.clear();
+	dst.resize(positions.size());
+
+	// Where the rows go, a position may be asked for more than once
+	std::multimap<s64, size_t> indices;
+
+	for (size_t start = 0; start < positions.size();
+			start += SQLITE_READ_BATCH) {
+		size_t end = MYMIN(start + SQLITE_READ_BATCH, positions.size());
+
+		indices.clear();
+		for (size_t i = start; i < end; i++) {
+			s64 id = getBlockAsInteger(positions[i]);
+			indices.insert(std::make_pair(id, i));
+			SQLOK(sqlite3_bind_int64(m_stmt_read_batch, i - start + 1, id),
+				"Internal error: failed to bind query at " __FILE__ ":" TOSTRING(__LINE__));
+		}
+
+		while (sqlite3_step(m_stmt_read_batch) == SQLITE_ROW) {
+			s64 id = sqlite3_column_int64(m_stmt_read_batch, 0);
+			const char *data = (const char *) sqlite3_column_blob(m_stmt_read_batch, 1);
+			size_t len = sqlite3_column_bytes(m_stmt_read_batch, 1);
+			if (!data)
+				continue;
+
+			std::pair<std::multimap<s64, size_t>::iterator,
+				std::multimap<s64, size_t>::iterator> range =
+				indices.equal_range(id);
+			for (std::multimap<s64, size_t>::iterator it = range.first;
+					it != range.second; ++it)
+				dst[it->second].assign(data, len);
+		}
+
+		sqlite3_reset(m_stmt_read_batch);
+		sqlite3_clear_bindings(m_stmt_read_batch);
+	}
 }
 
 void Database_SQLite3::createDatabase()
@@ -286,6 +385,7 @@ void Database_SQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 Database_SQLite3::~Database_SQLite3()
 {
 	FINALIZE_STATEMENT(m_stmt_read)
+	FINALIZE_STATEMENT(m_stmt_read_batch)
 	FINALIZE_STATEMENT(m_stmt_write)
 	FINALIZE_STATEMENT(m_stmt_list)
 	FINALIZE_STATEMENT(m_stmt_begin)
@@ -38,6 +38,11 @@ public:
 	virtual bool saveBlock(const v3s16 &pos, const std::string &data);
 	virtual std::string loadBlock(const v3s16 &pos);
 	virtual bool deleteBlock(const v3s16 &pos);
+	virtual bool tryLoadBlock(const v3s16 &pos, std::string *data);
+	virtual bool saveBlocks(const std::vector<v3s16> &positions,
+			const std::vector<std::string> &data);
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> &dst);
 	virtual void listAllLoadableBlocks(std::vector<v3s16> &dst);
 	virtual bool initialized() const { return m_initialized; }
 	~Database_SQLite3();
@@ -58,6 +63,8 @@ private:
 
 	sqlite3 *m_database;
 	sqlite3_stmt *m_stmt_read;
+	// Reads up to SQLITE_READ_BATCH blocks at once
+	sqlite3_stmt *m_stmt_read_batch;
 	sqlite3_stmt *m_stmt_write;
 	sqlite3_stmt *m_stmt_list;
 	sqlite3_stmt *m_stmt_delete;
@@ -19,6 +19,34 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "database.h"
 #include "irrlichttypes.h"
+#include <cassert>
+
+
+bool Database::saveBlocks(const std::vector<v3s16> &positions,
+		const std::vector<std::string> &data)
+{
+	assert(positions.size() == data.size());
+	bool good = true;
+	for (size_t i = 0; i < positions.size(); i++)
+		good &= saveBlock(positions[i], data[i]);
+	return good;
+}
+
+
+bool Database::tryLoadBlock(const v3s16 &pos, std::string *data)
+{
+	*data = loadBlock(pos);
+	return true;
+}
+
+
+void Database::loadBlocks(const std::vector<v3s16> &positions,
+		std::vector<std::string> &dst)
+{
+	dst.resize(positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		dst[i] = loadBlock(positions[i]);
+}
 
 
 /****************
@@ -41,6 +41,19 @@ public:
 	virtual std::string loadBlock(const v3s16 &pos) = 0;
 	virtual bool deleteBlock(const v3s16 &pos) = 0;
 
+	// Like loadBlock(), but tells a block that doesn't exist (true, empty
+	// data) from a failed read (false)
+	virtual bool tryLoadBlock(const v3s16 &pos, std::string *data);
+
+	// Bulk versions of the above; backends that can do better than one
+	// query per block override them.
+	// data[i] is saved at positions[i]. Returns false if any block failed.
+	virtual bool saveBlocks(const std::vector<v3s16> &positions,
+			const std::vector<std::string> &data);
+	// dst[i] is the data at positions[i], empty if there is none
+	virtual void loadBlocks(const std::vector<v3s16> &positions,
+			std::vector<std::string> &dst);
+
 	static s64 getBlockAsInteger(const v3s16 &pos);
 	static v3s16 getIntegerAsBlock(s64 i);
 
@@ -241,6 +241,7 @@ void set_default_settings(Settings *settings)
 	// "map-dir" doesn't exist by default.
 	settings->setDefault("workaround_window_size","5");
 	settings->setDefault("max_packets_per_iteration","1024");
+	settings->setDefault("enable_packet_bundling", "true");
 	settings->setDefault("port", "30000");
 	settings->setDefault("bind_address", "");
 	settings->setDefault("default_game", "minetest");
@@ -277,18 +278,28 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("max_simultaneous_block_sends_per_client", "10");
 	settings->setDefault("max_simultaneous_block_sends_server_total", "40");
 	settings->setDefault("max_block_send_distance", "9");
+#if USE_ZSTD
+	settings->setDefault("block_send_compression", "zstd");
+#else
+	settings->setDefault("block_send_compression", "zlib");
+#endif
+	settings->setDefault("block_send_compression_level", "default");
 	settings->setDefault("max_block_generate_distance", "7");
 	settings->setDefault("max_clearobjects_extra_loaded_blocks", "4096");
 	settings->setDefault("time_send_interval", "5");
 	settings->setDefault("time_speed", "72");
 	settings->setDefault("server_unload_unused_data_timeout", "29");
+	settings->setDefault("mapblock_packing", "false");
 	settings->setDefault("max_objects_per_block", "49");
 	settings->setDefault("server_map_save_interval", "5.3");
 	settings->setDefault("sqlite_synchronous", "2");
+	settings->setDefault("sqlite_wal", "true");
+	settings->setDefault("map_write_queue_size", "1024");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.1");
 	settings->setDefault("active_block_mgmt_interval", "2.0");
 	settings->setDefault("abm_interval", "1.0");
+	settings->setDefault("num_abm_threads", "-1");
 	settings->setDefault("nodetimer_interval", "1.0");
 	settings->setDefault("ignore_world_load_errors", "false");
 	settings->setDefault("remote_media", "");
@@ -297,6 +308,9 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("emergequeue_limit_diskonly", "32");
 	settings->setDefault("emergequeue_limit_generate", "32");
 	settings->setDefault("num_emerge_threads", "1");
+	// Enough for the 2D maps of some dozen columns of mapchunks
+	settings->setDefault("mapgen_noise_cache_size", "512");
+	settings->setDefault("num_mapgen_threads", "-1");
 	settings->setDefault("secure.enable_security", "false");
 	settings->setDefault("secure.trusted_mods", "");
 	settings->setDefault("secure.http_mods", "");
@@ -319,6 +333,7 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("liquid_loop_max", "100000");
 	settings->setDefault("liquid_queue_purge_time", "0");
 	settings->setDefault("liquid_update", "1.0");
+	settings->setDefault("num_liquid_threads", "-1");
 
 	//mapgen stuff
 	settings->setDefault("mg_name", "v6");
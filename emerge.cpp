@@ -22,7 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "emerge.h"
 
 #include <iostream>
-#include <queue>
+#include <algorithm>
 
 #include "util/container.h"
 #include "util/thread.h"
@@ -30,6 +30,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "config.h"
 #include "constants.h"
+#include "database.h"
 #include "environment.h"
 #include "log.h"
 #include "map.h"
@@ -46,6 +47,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mg_decoration.h"
 #include "mg_schematic.h"
 #include "nodedef.h"
+#include "porting.h"
 #include "profiler.h"
 #include "scripting_game.h"
 #include "server.h"
@@ -72,7 +74,7 @@ public:
 	void signal();
 
 	// Requires queue mutex held
-	bool pushBlock(v3s16 pos);
+	bool pushBlock(v3s16 pos, EmergeLane lane);
 
 	void cancelPendingItems();
 
@@ -85,11 +87,40 @@ private:
 	ServerMap *m_map;
 	EmergeManager *m_emerge;
 	Mapgen *m_mapgen;
+	// Connection of this thread for reading blocks, may be NULL
+	Database *m_db;
 
-	Event m_queue_event;
-	std::queue<v3s16> m_block_queue;
+	struct QueuedBlock {
+		u32 priority;
+		u32 seq;
+		v3s16 pos;
 
-	bool popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata);
+		// Makes the nearest, then oldest request the top of the heap
+		bool operator<(const QueuedBlock &other) const
+		{
+			if (priority != other.priority)
+				return priority > other.priority;
+			return (s32)(seq - other.seq) > 0;
+		}
+	};
+
+	Event m_queue_event;
+	// Heaps of requests per lane, requires queue mutex held
+	std::vector<QueuedBlock> m_lanes[EMERGE_LANE_COUNT];
+	// Whether waiting for work, requires queue mutex held
+	bool m_idle;
+	// Chunk being generated, requires queue mutex held
+	bool m_generating;
+	v3s16 m_generating_chunk;
+
+	bool popBlockEmerge(v3s16 *pos, bool *loading, BlockEmergeData *bedata);
+	bool finishLoad(v3s16 pos, bool may_generate, BlockEmergeData *bedata);
+	void setGenerating(bool generating, v3s16 chunkpos);
+
+	// Require queue mutex held
+	size_t getQueueSize();
+	bool stealBlocks(EmergeLane lane);
+	void reprioritizeQueue();
 
 	EmergeAction getBlockOrStartGen(
 		v3s16 pos, bool allow_gen, MapBlock **block, BlockMakeData *data);
@@ -131,6 +162,15 @@ EmergeManager::EmergeManager(IGameDef *gamedef)
 	// EmergeThreads should be the ServerThread.
 	this->m_threads_active = false;
 
+	m_focus_generation    = 0;
+	m_queue_generation    = 0;
+	m_queue_seq           = 0;
+	m_teleport_count      = 0;
+	m_teleport_time_total = 0;
+	m_num_loaded          = 0;
+	m_num_generated       = 0;
+	m_num_stolen          = 0;
+
 	enable_mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
 
 	// If unspecified, leave a proc for the main thread and one for
@@ -155,8 +195,21 @@ EmergeManager::EmergeManager(IGameDef *gamedef)
 	if (m_qlimit_generate < 1)
 		m_qlimit_generate = 1;
 
-	for (s16 i = 0; i < nthreads; i++)
-		m_threads.push_back(new EmergeThread((Server *)gamedef, i));
+	this->noise_cache = new NoiseMapCache(
+		g_settings->getU16("mapgen_noise_cache_size"));
+
+	// Helps out whichever emerge thread is generating alone, e.g. at spawn
+	s16 nworkers = g_settings->getS16("num_mapgen_threads");
+	if (nworkers < 0)
+		nworkers = WorkerPool::getDefaultThreadCount(false);
+	this->mapgen_workers = new WorkerPool("Mapgen", nworkers);
+
+	// Threads steal from each other, so they know the manager from the start
+	for (s16 i = 0; i < nthreads; i++) {
+		EmergeThread *thread = new EmergeThread((Server *)gamedef, i);
+		thread->m_emerge = this;
+		m_threads.push_back(thread);
+	}
 
 	infostream << "EmergeManager: using " << nthreads << " threads" << std::endl;
 }
@@ -174,13 +227,18 @@ EmergeManager::~EmergeManager()
 		}
 
 		delete thread;
-		delete m_mapgens[i];
 	}
 
+	// Mapgens only exist after initMapgens()
+	for (u32 i = 0; i != m_mapgens.size(); i++)
+		delete m_mapgens[i];
+
 	delete biomemgr;
 	delete oremgr;
 	delete decomgr;
 	delete schemmgr;
+	delete noise_cache;
+	delete mapgen_workers;
 
 	delete params.sparams;
 }
@@ -259,6 +317,15 @@ void EmergeManager::stopThreads()
 		m_threads[i]->wait();
 
 	m_threads_active = false;
+
+	if (m_teleport_count != 0)
+		infostream << "EmergeManager: terrain emerged " <<
+			getMeanTeleportEmergeTime() << "ms after teleports on average ("
+			<< m_teleport_count << " teleports)" << std::endl;
+
+	infostream << "EmergeManager: 2D noise maps cached: "
+		<< noise_cache->getHits() << " hits, " << noise_cache->getMisses()
+		<< " misses" << std::endl;
 }
 
 
@@ -305,7 +372,7 @@ bool EmergeManager::enqueueBlockEmergeEx(
 			return true;
 
 		thread = getOptimalThread();
-		thread->pushBlock(blockpos);
+		thread->pushBlock(blockpos, EMERGE_LANE_LOAD);
 	}
 
 	thread->signal();
@@ -314,6 +381,63 @@ bool EmergeManager::enqueueBlockEmergeEx(
 }
 
 
+void EmergeManager::setPeerFocus(u16 peer_id, v3s16 blockpos, s16 range)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	std::pair<std::map<u16, EmergePeerFocus>::iterator, bool> res =
+		m_peer_focus.insert(std::make_pair(peer_id, EmergePeerFocus()));
+	EmergePeerFocus &focus = res.first->second;
+
+	if (!res.second && focus.blockpos == blockpos && focus.range == range)
+		return;
+
+	v3s16 moved = blockpos - focus.blockpos;
+	if (res.second || MYMAX(MYMAX(abs(moved.X), abs(moved.Y)), abs(moved.Z))
+			> range)
+		focus.teleport_time = porting::getTimeMs();
+
+	focus.blockpos = blockpos;
+	focus.range    = range;
+	m_focus_generation++;
+}
+
+
+void EmergeManager::removePeerFocus(u16 peer_id)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	if (m_peer_focus.erase(peer_id))
+		m_focus_generation++;
+}
+
+
+float EmergeManager::getMeanTeleportEmergeTime()
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	if (m_teleport_count == 0)
+		return 0;
+	return m_teleport_time_total / m_teleport_count;
+}
+
+
+void EmergeManager::getQueueStats(EmergeQueueStats *stats)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	for (u32 lane = 0; lane != EMERGE_LANE_COUNT; lane++) {
+		stats->queued[lane] = 0;
+		for (u32 i = 0; i != m_threads.size(); i++)
+			stats->queued[lane] += m_threads[i]->m_lanes[lane].size();
+	}
+
+	stats->loaded    = m_num_loaded;
+	stats->generated = m_num_generated;
+	stats->stolen    = m_num_stolen;
+}
+
+
 //
 // Mapgen-related helper functions
 //
@@ -464,17 +588,80 @@ bool EmergeManager::popBlockEmergeData(
 }
 
 
+bool EmergeManager::getEmergePriority(v3s16 pos,
+	const BlockEmergeData &bedata, u32 *priority)
+{
+	// Without anyone around, keep the order requests came in
+	*priority = 0;
+	if (m_peer_focus.empty())
+		return true;
+
+	bool in_range = false;
+	*priority = U32_MAX;
+	for (std::map<u16, EmergePeerFocus>::iterator it = m_peer_focus.begin();
+			it != m_peer_focus.end(); ++it) {
+		const EmergePeerFocus &focus = it->second;
+		v3s16 d = pos - focus.blockpos;
+		// The box distance, as blocks are requested in growing boxes
+		u32 dist = MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+		*priority = MYMIN(*priority, dist);
+		// The sender looks one block ahead of moving players
+		if (dist <= (u32)focus.range + 1)
+			in_range = true;
+	}
+
+	// Only plain requests of peers are given up
+	bool cancellable = bedata.peer_requested != PEER_ID_INEXISTENT &&
+		!(bedata.flags & BLOCK_EMERGE_FORCE_QUEUE) &&
+		bedata.callbacks.empty();
+	return in_range || !cancellable;
+}
+
+
+void EmergeManager::onBlockEmerged(v3s16 pos, EmergeAction action)
+{
+	MutexAutoLock queuelock(m_queue_mutex);
+
+	if (action == EMERGE_GENERATED)
+		m_num_generated++;
+	else
+		m_num_loaded++;
+
+	for (std::map<u16, EmergePeerFocus>::iterator it = m_peer_focus.begin();
+			it != m_peer_focus.end(); ++it) {
+		EmergePeerFocus &focus = it->second;
+		if (focus.teleport_time == 0)
+			continue;
+
+		// The block of the peer or one right next to it
+		v3s16 d = pos - focus.blockpos;
+		if (MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z)) > 1)
+			continue;
+
+		float time_ms = porting::getDeltaMs(focus.teleport_time,
+			porting::getTimeMs());
+		focus.teleport_time = 0;
+
+		m_teleport_count++;
+		m_teleport_time_total += time_ms;
+		g_profiler->avg("Emerge: time to terrain after teleport [ms]", time_ms);
+	}
+}
+
+
 EmergeThread *EmergeManager::getOptimalThread()
 {
 	size_t nthreads = m_threads.size();
 
 	FATAL_ERROR_IF(nthreads == 0, "No emerge threads!");
 
+	// A thread at work counts as one more item, so idle ones get picked
 	size_t index = 0;
-	size_t nitems_lowest = m_threads[0]->m_block_queue.size();
+	size_t nitems_lowest = m_threads[0]->getQueueSize() +
+		!m_threads[0]->m_idle;
 
 	for (size_t i = 1; i < nthreads; i++) {
-		size_t nitems = m_threads[i]->m_block_queue.size();
+		size_t nitems = m_threads[i]->getQueueSize() + !m_threads[i]->m_idle;
 		if (nitems < nitems_lowest) {
 			index = i;
 			nitems_lowest = nitems;
@@ -485,6 +672,36 @@ EmergeThread *EmergeManager::getOptimalThread()
 }
 
 
+void EmergeManager::wakeIdleThreads()
+{
+	for (size_t i = 0; i != m_threads.size(); i++) {
+		if (m_threads[i]->m_idle)
+			m_threads[i]->signal();
+	}
+}
+
+
+void EmergeManager::reprioritizeQueues()
+{
+	m_queue_generation = m_focus_generation;
+
+	for (size_t i = 0; i != m_threads.size(); i++)
+		m_threads[i]->reprioritizeQueue();
+}
+
+
+bool EmergeManager::isChunkGenerating(v3s16 chunkpos)
+{
+	for (size_t i = 0; i != m_threads.size(); i++) {
+		if (m_threads[i]->m_generating &&
+				m_threads[i]->m_generating_chunk == chunkpos)
+			return true;
+	}
+
+	return false;
+}
+
+
 ////
 //// EmergeThread
 ////
@@ -495,7 +712,10 @@ EmergeThread::EmergeThread(Server *server, int ethreadid) :
 	m_server(server),
 	m_map(NULL),
 	m_emerge(NULL),
-	m_mapgen(NULL)
+	m_mapgen(NULL),
+	m_db(NULL),
+	m_idle(true),
+	m_generating(false)
 {
 	m_name = "Emerge-" + itos(ethreadid);
 }
@@ -513,28 +733,83 @@ void EmergeThread::signal()
 }
 
 
-bool EmergeThread::pushBlock(v3s16 pos)
+bool EmergeThread::pushBlock(v3s16 pos, EmergeLane lane_id)
 {
-	m_block_queue.push(pos);
+	const BlockEmergeData &bedata = m_emerge->m_blocks_enqueued[pos];
+	std::vector<QueuedBlock> &lane = m_lanes[lane_id];
+
+	QueuedBlock item;
+	item.pos = pos;
+	item.seq = m_emerge->m_queue_seq++;
+	m_emerge->getEmergePriority(pos, bedata, &item.priority);
+
+	lane.push_back(item);
+	std::push_heap(lane.begin(), lane.end());
 	return true;
 }
 
 
+size_t EmergeThread::getQueueSize()
+{
+	size_t nitems = 0;
+	for (u32 lane = 0; lane != EMERGE_LANE_COUNT; lane++)
+		nitems += m_lanes[lane].size();
+	return nitems;
+}
+
+
 void EmergeThread::cancelPendingItems()
 {
 	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
 
-	while (!m_block_queue.empty()) {
-		BlockEmergeData bedata;
-		v3s16 pos;
+	for (u32 lane = 0; lane != EMERGE_LANE_COUNT; lane++) {
+		std::vector<QueuedBlock> &queue = m_lanes[lane];
+
+		for (size_t i = 0; i != queue.size(); i++) {
+			BlockEmergeData bedata;
+			v3s16 pos = queue[i].pos;
+
+			m_emerge->popBlockEmergeData(pos, &bedata);
+
+			runCompletionCallbacks(pos, EMERGE_CANCELLED, bedata.callbacks);
+		}
+		queue.clear();
+	}
+}
 
-		pos = m_block_queue.front();
-		m_block_queue.pop();
 
-		m_emerge->popBlockEmergeData(pos, &bedata);
+void EmergeThread::reprioritizeQueue()
+{
+	u32 num_cancelled = 0;
+
+	for (u32 lane = 0; lane != EMERGE_LANE_COUNT; lane++) {
+		std::vector<QueuedBlock> &queue = m_lanes[lane];
+
+		size_t n = 0;
+		for (size_t i = 0; i != queue.size(); i++) {
+			QueuedBlock item = queue[i];
+
+			std::map<v3s16, BlockEmergeData>::iterator it =
+				m_emerge->m_blocks_enqueued.find(item.pos);
+			if (it != m_emerge->m_blocks_enqueued.end() &&
+					!m_emerge->getEmergePriority(item.pos, it->second,
+						&item.priority)) {
+				BlockEmergeData bedata;
+				m_emerge->popBlockEmergeData(item.pos, &bedata);
+				runCompletionCallbacks(item.pos, EMERGE_CANCELLED,
+					bedata.callbacks);
+				num_cancelled++;
+				continue;
+			}
 
-		runCompletionCallbacks(pos, EMERGE_CANCELLED, bedata.callbacks);
+			queue[n++] = item;
+		}
+		queue.resize(n);
+		std::make_heap(queue.begin(), queue.end());
 	}
+
+	if (num_cancelled != 0)
+		g_profiler->add("Emerge: out of range requests cancelled", num_cancelled);
 }
 
 
@@ -555,34 +830,184 @@ void EmergeThread::runCompletionCallbacks(
 }
 
 
-bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
+/*
+	Requests popped from the load lane stay enqueued while loading, so the
+	ones made meanwhile join them; finishLoad() takes them off after that.
+*/
+bool EmergeThread::popBlockEmerge(v3s16 *pos, bool *loading,
+	BlockEmergeData *bedata)
 {
 	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
 
-	if (m_block_queue.empty())
+	// Peers moved since the queues were ordered
+	if (m_emerge->m_queue_generation != m_emerge->m_focus_generation)
+		m_emerge->reprioritizeQueues();
+
+	// Loads are quick, so any of them go before our own generations
+	std::vector<QueuedBlock> *lane = &m_lanes[EMERGE_LANE_LOAD];
+	if (lane->empty() && !stealBlocks(EMERGE_LANE_LOAD)) {
+		lane = &m_lanes[EMERGE_LANE_GENERATE];
+		if (lane->empty() && !stealBlocks(EMERGE_LANE_GENERATE)) {
+			m_idle = true;
+			return false;
+		}
+	}
+	m_idle = false;
+
+	std::pop_heap(lane->begin(), lane->end());
+	*pos = lane->back().pos;
+	lane->pop_back();
+
+	*loading = lane == &m_lanes[EMERGE_LANE_LOAD];
+	if (!*loading)
+		m_emerge->popBlockEmergeData(*pos, bedata);
+
+	return true;
+}
+
+
+// Returns true if the block went on to the generate lane instead of
+// having its request taken off the queue
+bool EmergeThread::finishLoad(v3s16 pos, bool may_generate,
+	BlockEmergeData *bedata)
+{
+	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
+
+	std::map<v3s16, BlockEmergeData>::iterator it =
+		m_emerge->m_blocks_enqueued.find(pos);
+	if (may_generate && it != m_emerge->m_blocks_enqueued.end() &&
+			(it->second.flags & BLOCK_EMERGE_ALLOW_GEN)) {
+		pushBlock(pos, EMERGE_LANE_GENERATE);
+		return true;
+	}
+
+	m_emerge->popBlockEmergeData(pos, bedata);
+	return false;
+}
+
+
+bool EmergeThread::stealBlocks(EmergeLane lane)
+{
+	std::vector<EmergeThread *> &threads = m_emerge->m_threads;
+	std::vector<QueuedBlock> &to = m_lanes[lane];
+
+	if (lane == EMERGE_LANE_LOAD) {
+		// Loads don't depend on each other, take the most urgent one of
+		// the longest queue
+		EmergeThread *victim = NULL;
+		for (size_t i = 0; i != threads.size(); i++) {
+			if (threads[i] != this && !threads[i]->m_lanes[lane].empty() &&
+					(!victim || threads[i]->m_lanes[lane].size() >
+						victim->m_lanes[lane].size()))
+				victim = threads[i];
+		}
+		if (!victim)
+			return false;
+
+		std::vector<QueuedBlock> &from = victim->m_lanes[lane];
+		std::pop_heap(from.begin(), from.end());
+		to.push_back(from.back());
+		std::push_heap(to.begin(), to.end());
+		from.pop_back();
+
+		m_emerge->m_num_stolen++;
+		g_profiler->add("Emerge: requests stolen", 1);
+		return true;
+	}
+
+	/*
+		Requests of a chunk end up generating it at once, so the whole chunk
+		is taken. Skip chunks already in the works, they will be done by the
+		time these requests come up.
+	*/
+	s16 csize = m_emerge->params.chunksize;
+	EmergeThread *victim = NULL;
+	QueuedBlock best = QueuedBlock();
+	for (size_t i = 0; i != threads.size(); i++) {
+		if (threads[i] == this)
+			continue;
+
+		std::vector<QueuedBlock> &from = threads[i]->m_lanes[lane];
+		for (size_t j = 0; j != from.size(); j++) {
+			if ((victim && !(best < from[j])) || m_emerge->isChunkGenerating(
+					EmergeManager::getContainingChunk(from[j].pos, csize)))
+				continue;
+
+			victim = threads[i];
+			best = from[j];
+		}
+	}
+	if (!victim)
 		return false;
 
-	*pos = m_block_queue.front();
-	m_block_queue.pop();
+	v3s16 chunkpos = EmergeManager::getContainingChunk(best.pos, csize);
+	std::vector<QueuedBlock> &from = victim->m_lanes[lane];
 
-	m_emerge->popBlockEmergeData(*pos, bedata);
+	size_t n = 0;
+	u32 num_stolen = 0;
+	for (size_t i = 0; i != from.size(); i++) {
+		if (EmergeManager::getContainingChunk(from[i].pos, csize) != chunkpos) {
+			from[n++] = from[i];
+			continue;
+		}
+
+		to.push_back(from[i]);
+		std::push_heap(to.begin(), to.end());
+		num_stolen++;
+	}
+	from.resize(n);
+	std::make_heap(from.begin(), from.end());
 
+	m_emerge->m_num_stolen += num_stolen;
+	g_profiler->add("Emerge: requests stolen", num_stolen);
 	return true;
 }
 
 
+void EmergeThread::setGenerating(bool generating, v3s16 chunkpos)
+{
+	MutexAutoLock queuelock(m_emerge->m_queue_mutex);
+
+	m_generating       = generating;
+	m_generating_chunk = chunkpos;
+
+	// Generating takes a while, let others do what we have queued
+	if (generating && getQueueSize() != 0)
+		m_emerge->wakeIdleThreads();
+}
+
+
 EmergeAction EmergeThread::getBlockOrStartGen(
 	v3s16 pos, bool allow_gen, MapBlock **block, BlockMakeData *bmdata)
 {
+	// 1). Attempt to fetch block from memory
+	{
+		MutexAutoLock envlock(m_server->m_env_mutex);
+		*block = m_map->getBlockNoCreateNoEx(pos);
+		if (*block && !(*block)->isDummy() && (*block)->isGenerated())
+			return EMERGE_FROM_MEMORY;
+	}
+
+	// Read from the database without the environment lock. If that
+	// failed, the block is read under the lock instead, so that
+	// initBlockMake() doesn't generate over saved terrain.
+	std::string blob;
+	u32 write_stamp = 0;
+	bool have_blob = m_db &&
+		m_map->readBlock(m_db, pos, &blob, &write_stamp);
+
 	MutexAutoLock envlock(m_server->m_env_mutex);
 
-	// 1). Attempt to fetch block from memory
+	// Another thread may have loaded it meanwhile
 	*block = m_map->getBlockNoCreateNoEx(pos);
 	if (*block && !(*block)->isDummy() && (*block)->isGenerated())
 		return EMERGE_FROM_MEMORY;
 
 	// 2). Attempt to load block from disk
-	*block = m_map->loadBlock(pos);
+	if (have_blob)
+		*block = m_map->loadBlock(pos, &blob, write_stamp);
+	else
+		*block = m_map->loadBlock(pos);
 	if (*block && (*block)->isGenerated())
 		return EMERGE_FROM_DISK;
 
@@ -654,8 +1079,8 @@ void *EmergeThread::run()
 	v3s16 pos;
 
 	m_map    = (ServerMap *)&(m_server->m_env->getMap());
-	m_emerge = m_server->m_emerge;
 	m_mapgen = m_emerge->m_mapgens[id];
+	m_db     = m_map->createReadDatabase();
 	enable_mapgen_debug_info = m_emerge->enable_mapgen_debug_info;
 
 	try {
@@ -666,19 +1091,29 @@ void *EmergeThread::run()
 		EmergeAction action;
 		MapBlock *block;
 
-		if (!popBlockEmerge(&pos, &bedata)) {
+		bool loading;
+		if (!popBlockEmerge(&pos, &loading, &bedata)) {
 			m_queue_event.wait();
 			continue;
 		}
 
-		if (blockpos_over_limit(pos))
+		if (blockpos_over_limit(pos)) {
+			if (loading)
+				finishLoad(pos, false, &bedata);
 			continue;
+		}
 
-		bool allow_gen = bedata.flags & BLOCK_EMERGE_ALLOW_GEN;
+		bool allow_gen = !loading && (bedata.flags & BLOCK_EMERGE_ALLOW_GEN);
 		EMERGE_DBG_OUT("pos=" PP(pos) " allow_gen=" << allow_gen);
 
 		action = getBlockOrStartGen(pos, allow_gen, &block, &bmdata);
+
+		// Not on disk, generate it if that's allowed
+		if (loading && finishLoad(pos, action == EMERGE_CANCELLED, &bedata))
+			continue;
+
 		if (action == EMERGE_GENERATED) {
+			setGenerating(true, bmdata.blockpos_min);
 			{
 				ScopeProfiler sp(g_profiler,
 					"EmergeThread: Mapgen::makeChunk", SPT_AVG);
@@ -691,12 +1126,15 @@ void *EmergeThread::run()
 			}
 
 			block = finishGen(pos, &bmdata, &modified_blocks);
+			setGenerating(false, bmdata.blockpos_min);
 		}
 
 		runCompletionCallbacks(pos, action, bedata.callbacks);
 
-		if (block)
+		if (block) {
 			modified_blocks[pos] = block;
+			m_emerge->onBlockEmerged(pos, action);
+		}
 
 		if (modified_blocks.size() > 0)
 			m_server->SetBlocksNotSent(modified_blocks);
@@ -721,6 +1159,9 @@ void *EmergeThread::run()
 		m_server->setAsyncFatalError(err.str());
 	}
 
+	delete m_db;
+	m_db = NULL;
+
 	END_DEBUG_EXCEPTION_HANDLER
 	return NULL;
 }
@@ -88,6 +88,32 @@ struct BlockEmergeData {
 	EmergeCallbackList callbacks;
 };
 
+// Where a peer is, for ordering and cancelling the emerge queues
+struct EmergePeerFocus {
+	v3s16 blockpos;
+	// Blocks farther than this in any direction are not of interest
+	s16 range;
+	// Time of the last teleport until terrain there got emerged, else 0
+	u32 teleport_time;
+};
+
+// Requests are queued for loading first, and for generating only once
+// they turned out not to be on disk, so loads never wait for generations
+enum EmergeLane {
+	EMERGE_LANE_LOAD,
+	EMERGE_LANE_GENERATE,
+	EMERGE_LANE_COUNT,
+};
+
+struct EmergeQueueStats {
+	// Requests currently queued, per lane
+	u32 queued[EMERGE_LANE_COUNT];
+	// Totals since startup
+	u32 loaded;
+	u32 generated;
+	u32 stolen;
+};
+
 class EmergeManager {
 public:
 	INodeDefManager *ndef;
@@ -106,6 +132,12 @@ public:
 	DecorationManager *decomgr;
 	SchematicManager *schemmgr;
 
+	// 2D noise maps shared by the mapgens
+	NoiseMapCache *noise_cache;
+
+	// Runs independent stages within a mapchunk, shared by the mapgens
+	WorkerPool *mapgen_workers;
+
 	// Methods
 	EmergeManager(IGameDef *gamedef);
 	~EmergeManager();
@@ -130,6 +162,18 @@ public:
 		EmergeCompletionCallback callback,
 		void *callback_param);
 
+	// Queues are ordered by distance to the nearest peer, and requests
+	// of peers out of everyone's range are cancelled.
+	// A move farther than range counts as a teleport.
+	void setPeerFocus(u16 peer_id, v3s16 blockpos, s16 range);
+	void removePeerFocus(u16 peer_id);
+
+	// Mean time from teleports until a block at the destination was
+	// emerged, in ms
+	float getMeanTeleportEmergeTime();
+
+	void getQueueStats(EmergeQueueStats *stats);
+
 	v3s16 getContainingChunk(v3s16 blockpos);
 
 	Mapgen *getCurrentMapgen();
@@ -154,12 +198,29 @@ private:
 	std::map<v3s16, BlockEmergeData> m_blocks_enqueued;
 	std::map<u16, u16> m_peer_queue_count;
 
+	// Also protected by m_queue_mutex
+	std::map<u16, EmergePeerFocus> m_peer_focus;
+	// Changes whenever a focus moves, the queues are re-ordered then
+	u32 m_focus_generation;
+	u32 m_queue_generation;
+	// Keeps requests of equal distance in order
+	u32 m_queue_seq;
+	u32 m_teleport_count;
+	float m_teleport_time_total;
+	u32 m_num_loaded;
+	u32 m_num_generated;
+	u32 m_num_stolen;
+
 	u16 m_qlimit_total;
 	u16 m_qlimit_diskonly;
 	u16 m_qlimit_generate;
 
 	// Requires m_queue_mutex held
 	EmergeThread *getOptimalThread();
+	// Hands pending work of busy threads to idle ones
+	void wakeIdleThreads();
+	void reprioritizeQueues();
+	bool isChunkGenerating(v3s16 chunkpos);
 
 	bool pushBlockEmergeData(
 		v3s16 pos,
@@ -171,6 +232,13 @@ private:
 
 	bool popBlockEmergeData(v3s16 pos, BlockEmergeData *bedata);
 
+	// Requires m_queue_mutex held.
+	// Returns false if the request may be cancelled, as it is out of range.
+	bool getEmergePriority(v3s16 pos, const BlockEmergeData &bedata,
+		u32 *priority);
+	// Updates the teleport metric and throughput counters
+	void onBlockEmerged(v3s16 pos, EmergeAction action);
+
 	friend class EmergeThread;
 
 	DISABLE_CLASS_COPY(EmergeManager);
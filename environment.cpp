@@ -43,7 +43,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "daynightratio.h"
 #include "map.h"
 #include "emerge.h"
+#include "noise.h"
 #include "util/serialize.h"
+#include "util/thread.h"
 #include "threading/mutex_auto_lock.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
@@ -486,6 +488,25 @@ void LBMManager::applyLBMs(ServerEnvironment *env, MapBlock *block, u32 stamp)
 	MapNode n;
 	content_t c;
 	lbm_lookup_map::const_iterator it = getLBMsIntroducedAfter(stamp);
+
+	// Don't scan blocks which contain none of the trigger contents
+	if (block->hasContentSummary()) {
+		bool found = false;
+		const std::vector<content_t> &contents = block->getContentSummary();
+		for (std::vector<content_t>::const_iterator ci = contents.begin();
+				ci != contents.end() && !found; ++ci) {
+			for (LBMManager::lbm_lookup_map::const_iterator iit = it;
+					iit != m_lbm_lookup.end(); ++iit) {
+				if (iit->second.lookup(*ci)) {
+					found = true;
+					break;
+				}
+			}
+		}
+		if (!found)
+			return;
+	}
+
 	for (pos.X = 0; pos.X < MAP_BLOCKSIZE; pos.X++)
 	for (pos.Y = 0; pos.Y < MAP_BLOCKSIZE; pos.Y++)
 	for (pos.Z = 0; pos.Z < MAP_BLOCKSIZE; pos.Z++)
@@ -587,6 +608,7 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_gamedef(gamedef),
 	m_path_world(path_world),
 	m_send_recommended_timer(0),
+	m_node_timer_wheel(m_cache_nodetimer_interval),
 	m_active_block_interval_overload_skip(0),
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
@@ -594,10 +616,23 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_recommended_send_interval(0.1),
 	m_max_lag_estimate(0.1)
 {
+	s16 nthreads = g_settings->getS16("num_abm_threads");
+	if (nthreads < 0)
+		nthreads = WorkerPool::getDefaultThreadCount(true);
+	m_abm_workers = new WorkerPool("ABM", nthreads);
 }
 
 ServerEnvironment::~ServerEnvironment()
 {
+	// The timer wheel goes away with us, blocks may live longer
+	for(std::set<v3s16>::iterator
+			i = m_active_blocks.m_list.begin();
+			i != m_active_blocks.m_list.end(); ++i) {
+		MapBlock *block = m_map->getBlockNoCreateNoEx(*i);
+		if(block)
+			block->m_node_timers.detach();
+	}
+
 	// Clear active block list.
 	// This makes the next one delete all active objects.
 	m_active_blocks.clear();
@@ -608,6 +643,8 @@ ServerEnvironment::~ServerEnvironment()
 	// Drop/delete map
 	m_map->drop();
 
+	delete m_abm_workers;
+
 	// Delete ActiveBlockModifiers
 	for(std::vector<ABMWithState>::iterator
 			i = m_abms.begin(); i != m_abms.end(); ++i){
@@ -818,6 +855,10 @@ struct ActiveABM
 	ActiveBlockModifier *abm;
 	int chance;
 	std::set<content_t> required_neighbors;
+	bool batched;
+	// Triggers of the block being dispatched if batched
+	std::vector<v3s16> batch_positions;
+	std::vector<MapNode> batch_nodes;
 };
 
 class ABMHandler
@@ -853,6 +894,7 @@ public:
 				chance = 1;
 			ActiveABM aabm;
 			aabm.abm = abm;
+			aabm.batched = abm->getBatched();
 			if(abm->getSimpleCatchUp()) {
 				float intervals = actual_interval / trigger_interval;
 				if(intervals == 0)
@@ -895,6 +937,10 @@ public:
 			}
 		}
 	}
+	bool empty()
+	{
+		return m_aabms.empty();
+	}
 	// Find out how many objects the given block and its neighbours contain.
 	// Returns the number of objects in the block, and also in 'wider' the
 	// number of objects in the block and all its neighbours. The latter
@@ -923,25 +969,65 @@ public:
 		return active_object_count;
 
 	}
-	void apply(MapBlock *block)
+	// Server thread: looks up the neighbour blocks and draws the seed
+	void prepare(ABMBlockScan &scan, MapBlock *block)
 	{
-		if(m_aabms.empty())
-			return;
-
 		ServerMap *map = &m_env->getServerMap();
 
-		u32 active_object_count_wider;
-		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
-		m_env->m_added_objects = 0;
+		scan.blockpos = block->getPos();
+		scan.seed = myrand();
+		scan.triggers.clear();
+
+		v3s16 d;
+		for(d.Z=-1; d.Z<=1; d.Z++)
+		for(d.Y=-1; d.Y<=1; d.Y++)
+		for(d.X=-1; d.X<=1; d.X++)
+		{
+			scan.blocks[(d.Z+1)*9 + (d.Y+1)*3 + (d.X+1)] = (d == v3s16(0,0,0)) ?
+					block : map->getBlockNoCreateNoEx(scan.blockpos + d);
+		}
+	}
+	// Node relative to the scanned block, at most one node outside of it
+	static MapNode getScanNode(const ABMBlockScan &scan, v3s16 p)
+	{
+		v3s16 d(p.X < 0 ? -1 : p.X >= MAP_BLOCKSIZE ? 1 : 0,
+				p.Y < 0 ? -1 : p.Y >= MAP_BLOCKSIZE ? 1 : 0,
+				p.Z < 0 ? -1 : p.Z >= MAP_BLOCKSIZE ? 1 : 0);
+		MapBlock *block = scan.blocks[(d.Z+1)*9 + (d.Y+1)*3 + (d.X+1)];
+		if(block == NULL)
+			return MapNode(CONTENT_IGNORE);
+		return block->getNodeNoEx(p - d * MAP_BLOCKSIZE);
+	}
+	// Whether any of the contents the block may contain has ABMs
+	bool mayTrigger(MapBlock *block)
+	{
+		if(!block->hasContentSummary())
+			return true;
+
+		const std::vector<content_t> &contents = block->getContentSummary();
+		for(std::vector<content_t>::const_iterator
+				i = contents.begin(); i != contents.end(); ++i) {
+			if(m_aabms.find(*i) != m_aabms.end())
+				return true;
+		}
+		return false;
+	}
+	// Any thread: only reads the blocks of the scan, doesn't touch the Map
+	void scan(ABMBlockScan &scan)
+	{
+		MapBlock *block = scan.blocks[13];
+		if(!mayTrigger(block))
+			return;
+
+		v3s16 pos_relative = block->getPosRelative();
+		PcgRandom rnd(scan.seed);
 
 		v3s16 p0;
 		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
 		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
 		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
 		{
-			MapNode n = block->getNodeNoEx(p0);
-			content_t c = n.getContent();
-			v3s16 p = p0 + block->getPosRelative();
+			content_t c = block->getNodeNoEx(p0).getContent();
 
 			std::map<content_t, std::vector<ActiveABM> >::iterator j;
 			j = m_aabms.find(c);
@@ -950,21 +1036,20 @@ public:
 
 			for(std::vector<ActiveABM>::iterator
 					i = j->second.begin(); i != j->second.end(); ++i) {
-				if(myrand() % i->chance != 0)
+				if(rnd.next() % i->chance != 0)
 					continue;
 
 				// Check neighbors
 				if(!i->required_neighbors.empty())
 				{
 					v3s16 p1;
-					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
-					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
-					for(p1.Z = p.Z-1; p1.Z <= p.Z+1; p1.Z++)
+					for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
+					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
+					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
 					{
-						if(p1 == p)
+						if(p1 == p0)
 							continue;
-						MapNode n = map->getNodeNoEx(p1);
-						content_t c = n.getContent();
+						content_t c = getScanNode(scan, p1).getContent();
 						std::set<content_t>::const_iterator k;
 						k = i->required_neighbors.find(c);
 						if(k != i->required_neighbors.end()){
@@ -976,19 +1061,103 @@ public:
 				}
 neighbor_found:
 
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
+				ABMTrigger trigger;
+				trigger.aabm = &(*i);
+				trigger.p = p0 + pos_relative;
+				trigger.c = c;
+				scan.triggers.push_back(trigger);
+			}
+		}
+	}
+	// Server thread: runs the collected triggers in scan order
+	void dispatch(ABMBlockScan &scan)
+	{
+		if(scan.triggers.empty())
+			return;
 
-				// Count surrounding objects again if the abms added any
-				if(m_env->m_added_objects > 0) {
-					active_object_count = countObjects(block, map, active_object_count_wider);
-					m_env->m_added_objects = 0;
-				}
+		ServerMap *map = &m_env->getServerMap();
+		MapBlock *block = map->getBlockNoCreateNoEx(scan.blockpos);
+		if(block == NULL)
+			return;
+
+		u32 active_object_count_wider;
+		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
+		m_env->m_added_objects = 0;
+
+		// Batched ABMs in order of their first trigger
+		std::vector<ActiveABM *> batched;
+
+		for(std::vector<ABMTrigger>::iterator
+				i = scan.triggers.begin(); i != scan.triggers.end(); ++i) {
+			// Skip nodes changed by a trigger that ran before
+			MapNode n = map->getNodeNoEx(i->p);
+			if(n.getContent() != i->c)
+				continue;
+
+			ActiveABM *aabm = i->aabm;
+			if(aabm->batched) {
+				if(aabm->batch_positions.empty())
+					batched.push_back(aabm);
+				aabm->batch_positions.push_back(i->p);
+				aabm->batch_nodes.push_back(n);
+				continue;
+			}
+
+			// Call all the trigger variations
+			aabm->abm->trigger(m_env, i->p, n);
+			aabm->abm->trigger(m_env, i->p, n,
+					active_object_count, active_object_count_wider);
+
+			// Count surrounding objects again if the abms added any
+			if(m_env->m_added_objects > 0) {
+				active_object_count = countObjects(block, map, active_object_count_wider);
+				m_env->m_added_objects = 0;
 			}
 		}
+
+		for(std::vector<ActiveABM *>::iterator
+				i = batched.begin(); i != batched.end(); ++i) {
+			ActiveABM *aabm = *i;
+			aabm->abm->triggerBatch(m_env, aabm->batch_positions,
+					aabm->batch_nodes,
+					active_object_count, active_object_count_wider);
+			aabm->batch_positions.clear();
+			aabm->batch_nodes.clear();
+
+			if(m_env->m_added_objects > 0) {
+				active_object_count = countObjects(block, map, active_object_count_wider);
+				m_env->m_added_objects = 0;
+			}
+		}
+	}
+	void apply(MapBlock *block)
+	{
+		if(m_aabms.empty())
+			return;
+
+		ABMBlockScan blockscan;
+		prepare(blockscan, block);
+		scan(blockscan);
+		dispatch(blockscan);
+	}
+};
+
+class ABMScanJob : public WorkerPool::Job
+{
+public:
+	ABMScanJob(ABMHandler *handler, std::vector<ABMBlockScan> &scans):
+		m_handler(handler),
+		m_scans(scans)
+	{}
+
+	void run(u32 index)
+	{
+		m_handler->scan(m_scans[index]);
 	}
+
+private:
+	ABMHandler *m_handler;
+	std::vector<ABMBlockScan> &m_scans;
 };
 
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
@@ -1029,19 +1198,16 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	/* Handle LoadingBlockModifiers */
 	m_lbm_mgr.applyLBMs(this, block, stamp);
 
-	// Run node timers
-	std::map<v3s16, NodeTimer> elapsed_timers =
-		block->m_node_timers.step((float)dtime_s);
-	if(!elapsed_timers.empty()){
-		MapNode n;
-		for(std::map<v3s16, NodeTimer>::iterator
-				i = elapsed_timers.begin();
-				i != elapsed_timers.end(); ++i){
-			n = block->getNodeNoEx(i->first);
-			v3s16 p = i->first + block->getPosRelative();
-			if(m_script->node_on_timer(p,n,i->second.elapsed))
-				block->setNodeTimer(i->first,NodeTimer(i->second.timeout,0));
-		}
+	// Run node timers that elapsed while the block was inactive
+	std::vector<std::pair<v3s16, NodeTimer> > elapsed_timers;
+	block->m_node_timers.step((float)dtime_s, elapsed_timers);
+	for(std::vector<std::pair<v3s16, NodeTimer> >::iterator
+			i = elapsed_timers.begin();
+			i != elapsed_timers.end(); ++i){
+		MapNode n = block->getNodeNoEx(i->first);
+		v3s16 p = i->first + block->getPosRelative();
+		if(m_script->node_on_timer(p,n,i->second.elapsed))
+			block->setNodeTimer(i->first,NodeTimer(i->second.timeout,0));
 	}
 
 	/* Handle ActiveBlockModifiers */
@@ -1377,6 +1543,8 @@ void ServerEnvironment::step(float dtime)
 
 			// Set current time as timestamp (and let it set ChangedFlag)
 			block->setTimestamp(m_game_time);
+
+			block->m_node_timers.detach();
 		}
 
 		/*
@@ -1396,6 +1564,7 @@ void ServerEnvironment::step(float dtime)
 			}
 
 			activateBlock(block);
+			block->m_node_timers.attach(&m_node_timer_wheel, p);
 			/* infostream<<"Server: Block " << PP(p)
 				<< " became active"<<std::endl; */
 		}
@@ -1407,8 +1576,6 @@ void ServerEnvironment::step(float dtime)
 	if (m_active_blocks_nodemetadata_interval.step(dtime, m_cache_nodetimer_interval)) {
 		ScopeProfiler sp(g_profiler, "SEnv: mess in act. blocks avg per interval", SPT_AVG);
 
-		float dtime = m_cache_nodetimer_interval;
-
 		for(std::set<v3s16>::iterator
 				i = m_active_blocks.m_list.begin();
 				i != m_active_blocks.m_list.end(); ++i)
@@ -1433,20 +1600,26 @@ void ServerEnvironment::step(float dtime)
 				block->raiseModified(MOD_STATE_WRITE_AT_UNLOAD,
 					MOD_REASON_BLOCK_EXPIRED);
 
-			// Run node timers
-			std::map<v3s16, NodeTimer> elapsed_timers =
-				block->m_node_timers.step((float)dtime);
-			if(!elapsed_timers.empty()){
-				MapNode n;
-				for(std::map<v3s16, NodeTimer>::iterator
-						i = elapsed_timers.begin();
-						i != elapsed_timers.end(); ++i){
-					n = block->getNodeNoEx(i->first);
-					p = i->first + block->getPosRelative();
-					if(m_script->node_on_timer(p,n,i->second.elapsed))
-						block->setNodeTimer(i->first,NodeTimer(i->second.timeout,0));
-				}
-			}
+			// Blocks replaced while active (e.g. reloaded) need attaching
+			block->m_node_timers.attach(&m_node_timer_wheel, p);
+		}
+
+		// Run node timers
+		std::vector<NodeTimerWheel::Entry> expired;
+		m_node_timer_wheel.step(expired);
+		for(std::vector<NodeTimerWheel::Entry>::iterator
+				i = expired.begin();
+				i != expired.end(); ++i)
+		{
+			MapBlock *block = m_map->getBlockNoCreateNoEx(i->blockpos);
+			NodeTimer t;
+			// Skip timers that were changed, removed or unloaded since
+			if(block == NULL || !block->m_node_timers.takeExpired(i->p, i->tick, t))
+				continue;
+			MapNode n = block->getNodeNoEx(i->p);
+			v3s16 p = i->p + block->getPosRelative();
+			if(m_script->node_on_timer(p,n,t.elapsed))
+				block->setNodeTimer(i->p,NodeTimer(t.timeout,0));
 		}
 	}
 
@@ -1463,6 +1636,8 @@ void ServerEnvironment::step(float dtime)
 		// Initialize handling of ActiveBlockModifiers
 		ABMHandler abmhandler(m_abms, m_cache_abm_interval, this, true);
 
+		m_abm_scans.resize(m_active_blocks.m_list.size());
+		u32 num_scans = 0;
 		for(std::set<v3s16>::iterator
 				i = m_active_blocks.m_list.begin();
 				i != m_active_blocks.m_list.end(); ++i)
@@ -1479,9 +1654,22 @@ void ServerEnvironment::step(float dtime)
 			// Set current time as timestamp
 			block->setTimestampNoChangedFlag(m_game_time);
 
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
+			if(!abmhandler.empty())
+				abmhandler.prepare(m_abm_scans[num_scans++], block);
+		}
+
+		/*
+			Handle ActiveBlockModifiers: scan the blocks on the worker
+			pool, then run the triggers block by block in the order of
+			the active block list.
+		*/
+		{
+			ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg", SPT_AVG);
+			ABMScanJob job(&abmhandler, m_abm_scans);
+			m_abm_workers->run(&job, num_scans);
 		}
+		for(u32 i = 0; i < num_scans; i++)
+			abmhandler.dispatch(m_abm_scans[i]);
 
 		u32 time_ms = timer.stop(true);
 		u32 max_time_ms = 200;
@@ -45,6 +45,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 class ServerEnvironment;
 class ActiveBlockModifier;
+struct ActiveABM;
+class WorkerPool;
 class ServerActiveObject;
 class ITextureSource;
 class IGameDef;
@@ -175,6 +177,13 @@ public:
 	virtual void trigger(ServerEnvironment *env, v3s16 p, MapNode n){};
 	virtual void trigger(ServerEnvironment *env, v3s16 p, MapNode n,
 			u32 active_object_count, u32 active_object_count_wider){};
+	// If true, triggerBatch is called once per block with all the nodes
+	// that got triggered in it, instead of trigger for every node
+	virtual bool getBatched() { return false; }
+	virtual void triggerBatch(ServerEnvironment *env,
+			const std::vector<v3s16> &positions,
+			const std::vector<MapNode> &nodes,
+			u32 active_object_count, u32 active_object_count_wider){};
 };
 
 struct ABMWithState
@@ -185,6 +194,28 @@ struct ABMWithState
 	ABMWithState(ActiveBlockModifier *abm_);
 };
 
+struct ABMTrigger
+{
+	ActiveABM *aabm;
+	v3s16 p;
+	content_t c;
+};
+
+/*
+	Everything needed to scan a block for ABM triggers without going
+	through the Map, so that blocks can be scanned by worker threads
+	while the server thread holds the map. Triggers are only collected
+	and run later on the server thread.
+*/
+struct ABMBlockScan
+{
+	v3s16 blockpos;
+	u32 seed;
+	// The block and its neighbours, index (z+1)*9 + (y+1)*3 + (x+1)
+	MapBlock *blocks[27];
+	std::vector<ABMTrigger> triggers;
+};
+
 struct LoadingBlockModifierDef
 {
 	// Set of contents to trigger on
@@ -502,6 +533,8 @@ private:
 	IntervalLimiter m_active_blocks_management_interval;
 	IntervalLimiter m_active_block_modifier_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
+	// Node timers of the active blocks
+	NodeTimerWheel m_node_timer_wheel;
 	int m_active_block_interval_overload_skip;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
@@ -513,6 +546,9 @@ private:
 	u32 m_last_clear_objects_time;
 	// Active block modifiers
 	std::vector<ABMWithState> m_abms;
+	// Scans active blocks for ABM triggers, reused every interval
+	WorkerPool *m_abm_workers;
+	std::vector<ABMBlockScan> m_abm_scans;
 	LBMManager m_lbm_mgr;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval;
@@ -22,6 +22,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 #include "filesys.h"
 #include "voxel.h"
+#include "voxelalgorithms.h"
 #include "porting.h"
 #include "serialization.h"
 #include "nodemetadata.h"
@@ -32,6 +33,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "gamedef.h"
 #include "util/directiontables.h"
 #include "util/mathconstants.h"
+#include "util/thread.h"
+#include "threading/thread.h"
+#include "threading/mutex_auto_lock.h"
 #include "rollback_interface.h"
 #include "environment.h"
 #include "emerge.h"
@@ -42,8 +46,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "database.h"
 #include "database-dummy.h"
 #include "database-sqlite3.h"
+#include "mapwriter.h"
+#include <cstring>
 #include <deque>
-#include <queue>
 #if USE_LEVELDB
 #include "database-leveldb.h"
 #endif
@@ -58,10 +63,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	Map
 */
 
+// Ids of Map objects, 0 is never used
+static u32 g_next_map_id = 0;
+
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
 	m_sector_cache(NULL),
+	m_id(++g_next_map_id),
+	m_block_index_generation(0),
+	m_usage_head(NULL),
+	m_usage_tail(NULL),
+	m_usage_time(0),
+	m_pack_blocks(g_settings->getBool("mapblock_packing")),
+	m_pack_next(NULL),
+	m_liquid_workers(NULL),
 	m_transforming_liquid_loop_count_multiplier(1.0f),
 	m_unprocessed_count(0),
 	m_inc_trending_up_start_time(0),
@@ -71,6 +87,8 @@ Map::Map(std::ostream &dout, IGameDef *gamedef):
 
 Map::~Map()
 {
+	delete m_liquid_workers;
+
 	/*
 		Free all MapSectors
 	*/
@@ -136,14 +154,97 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 	return sector;
 }
 
+/*
+	Last block found by getBlockNoCreateNoEx in each thread. A plain struct,
+	as THREAD_LOCAL does not support constructors everywhere.
+*/
+struct LastBlockCache
+{
+	u32 map_id;
+	u32 generation;
+	s16 x, y, z;
+	MapBlock *block;
+};
+
+static THREAD_LOCAL LastBlockCache t_last_block;
+
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
+	LastBlockCache &cache = t_last_block;
+	if (cache.block != NULL && cache.map_id == m_id &&
+			cache.generation == m_block_index_generation &&
+			cache.x == p3d.X && cache.y == p3d.Y && cache.z == p3d.Z)
+		return cache.block;
+
+	MapBlock **block = m_block_index.find(p3d);
+	if (block == NULL)
 		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
+
+	cache.map_id = m_id;
+	cache.generation = m_block_index_generation;
+	cache.x = p3d.X;
+	cache.y = p3d.Y;
+	cache.z = p3d.Z;
+	cache.block = *block;
+	return *block;
+}
+
+void Map::indexBlock(MapBlock *block)
+{
+	m_block_index.set(block->getPos(), block);
+	block->m_usage_timer = m_usage_time;
+	unlinkUsedBlock(block);
+	linkUsedBlock(block);
+}
+
+void Map::unindexBlock(v3s16 p)
+{
+	MapBlock **block = m_block_index.find(p);
+	if (block == NULL)
+		return;
+	unlinkUsedBlock(*block);
+	m_block_index.erase(p);
+	m_block_index_generation++;
+}
+
+void Map::touchBlock(MapBlock *block)
+{
+	block->m_usage_timer = m_usage_time;
+	if (!block->m_usage_listed || block == m_usage_head)
+		return;
+	unlinkUsedBlock(block);
+	linkUsedBlock(block);
+}
+
+void Map::linkUsedBlock(MapBlock *block)
+{
+	block->m_usage_prev = NULL;
+	block->m_usage_next = m_usage_head;
+	if (m_usage_head)
+		m_usage_head->m_usage_prev = block;
+	else
+		m_usage_tail = block;
+	m_usage_head = block;
+	block->m_usage_listed = true;
+}
+
+void Map::unlinkUsedBlock(MapBlock *block)
+{
+	if (!block->m_usage_listed)
+		return;
+	if (block == m_pack_next)
+		m_pack_next = block->m_usage_prev;
+	if (block->m_usage_prev)
+		block->m_usage_prev->m_usage_next = block->m_usage_next;
+	else
+		m_usage_head = block->m_usage_next;
+	if (block->m_usage_next)
+		block->m_usage_next->m_usage_prev = block->m_usage_prev;
+	else
+		m_usage_tail = block->m_usage_prev;
+	block->m_usage_prev = NULL;
+	block->m_usage_next = NULL;
+	block->m_usage_listed = false;
 }
 
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
@@ -233,19 +334,87 @@ void Map::setNode(v3s16 p, MapNode & n)
 
 
 /*
-	Goes recursively through the neighbours of the node.
+	Node access for voxalgo::spreadLight and unspreadLight. Keeps the
+	pointers of the last used block and its neighbours, so following the
+	light around needs no map lookups for most nodes. Blocks that get
+	changed are added to modified_blocks.
+*/
+class MapLightNodes
+{
+public:
+	MapLightNodes(Map *map, std::map<v3s16, MapBlock*> &modified_blocks):
+		m_map(map),
+		m_modified_blocks(modified_blocks),
+		m_center(0, 0, 0)
+	{
+		memset(m_state, 0, sizeof(m_state));
+	}
 
-	Alters only transparent nodes.
+	bool get(v3s16 p, MapNode &n)
+	{
+		v3s16 blockpos, relpos;
+		getNodeBlockPosWithOffset(p, blockpos, relpos);
+		MapBlock *block = getBlock(blockpos);
+		if (block == NULL)
+			return false;
+		bool is_valid_position;
+		n = block->getNodeNoCheck(relpos, &is_valid_position);
+		return true;
+	}
 
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
+	void set(v3s16 p, MapNode &n)
+	{
+		v3s16 blockpos, relpos;
+		getNodeBlockPosWithOffset(p, blockpos, relpos);
+		u32 i;
+		MapBlock *block = getBlock(blockpos, &i);
+		if (block == NULL)
+			return;
+		block->setNode(relpos, n);
+		if (m_state[i] != STATE_MODIFIED) {
+			m_modified_blocks[blockpos] = block;
+			m_state[i] = STATE_MODIFIED;
+		}
+	}
+
+private:
+	enum {
+		STATE_UNKNOWN = 0,
+		STATE_LOOKED_UP,
+		STATE_MODIFIED,
+	};
 
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
+	// Moves the cache if blockpos is not next to the current center
+	MapBlock *getBlock(v3s16 blockpos, u32 *index = NULL)
+	{
+		v3s16 d = blockpos - m_center;
+		if (d.X < -1 || d.X > 1 || d.Y < -1 || d.Y > 1 ||
+				d.Z < -1 || d.Z > 1) {
+			m_center = blockpos;
+			memset(m_state, 0, sizeof(m_state));
+			d = v3s16(0, 0, 0);
+		}
+		u32 i = (d.Z + 1) * 9 + (d.Y + 1) * 3 + (d.X + 1);
+		if (index)
+			*index = i;
+		if (m_state[i] == STATE_UNKNOWN) {
+			MapBlock *block = m_map->getBlockNoCreateNoEx(blockpos);
+			// Dummy blocks have no data to light
+			m_blocks[i] = (block && !block->isDummy()) ? block : NULL;
+			m_state[i] = STATE_LOOKED_UP;
+		}
+		return m_blocks[i];
+	}
+
+	Map *m_map;
+	std::map<v3s16, MapBlock*> &m_modified_blocks;
+	v3s16 m_center;
+	MapBlock *m_blocks[27];
+	u8 m_state[27];
+};
+
+/*
+	See voxalgo::unspreadLight.
 
 	values of from_nodes are lighting values.
 */
@@ -254,160 +423,9 @@ void Map::unspreadLight(enum LightBank bank,
 		std::set<v3s16> & light_sources,
 		std::map<v3s16, MapBlock*>  & modified_blocks)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.empty())
-		return;
-
-	u32 blockchangecount = 0;
-
-	std::map<v3s16, u8> unlighted_nodes;
-
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-	// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
-	{
-		v3s16 pos = j->first;
-		v3s16 blockpos = getNodeBlockPos(pos);
-
-		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
-		}
-
-		if(block->isDummy())
-			continue;
-
-		// Calculate relative position in block
-		//v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
-
-		// Get node straight from the block
-		//MapNode n = block->getNode(relpos);
-
-		u8 oldlight = j->second;
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
-		{
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos, relpos;
-			getNodeBlockPosWithOffset(n2pos, blockpos, relpos);
-
-			// Only fetch a new block if the block position has changed
-			try {
-				if(block == NULL || blockpos != blockpos_last){
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
-
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
-			}
-			catch(InvalidPositionException &e) {
-				continue;
-			}
-
-			// Get node straight from the block
-			bool is_valid_position;
-			MapNode n2 = block->getNode(relpos, &is_valid_position);
-			if (!is_valid_position)
-				continue;
-
-			bool changed = false;
-
-			//TODO: Optimize output by optimizing light_sources?
-
-			/*
-				If the neighbor is dimmer than what was specified
-				as oldlight (the light of the previous node)
-			*/
-			if(n2.getLight(bank, nodemgr) < oldlight)
-			{
-				/*
-					And the neighbor is transparent and it has some light
-				*/
-				if(nodemgr->get(n2).light_propagates
-						&& n2.getLight(bank, nodemgr) != 0)
-				{
-					/*
-						Set light to 0 and add to queue
-					*/
-
-					u8 current_light = n2.getLight(bank, nodemgr);
-					n2.setLight(bank, 0, nodemgr);
-					block->setNode(relpos, n2);
-
-					unlighted_nodes[n2pos] = current_light;
-					changed = true;
-
-					/*
-						Remove from light_sources if it is there
-						NOTE: This doesn't happen nearly at all
-					*/
-					/*if(light_sources.find(n2pos))
-					{
-						infostream<<"Removed from light_sources"<<std::endl;
-						light_sources.remove(n2pos);
-					}*/
-				}
-
-				/*// DEBUG
-				if(light_sources.find(n2pos) != NULL)
-					light_sources.remove(n2pos);*/
-			}
-			else{
-				light_sources.insert(n2pos);
-			}
-
-			// Add to modified_blocks
-			if(changed == true && block_checked_in_modified == false)
-			{
-				// If the block is not found in modified_blocks, add.
-				if(modified_blocks.find(blockpos) == modified_blocks.end())
-				{
-					modified_blocks[blockpos] = block;
-				}
-				block_checked_in_modified = true;
-			}
-		}
-	}
-
-	/*infostream<<"unspreadLight(): Changed block "
-	<<blockchangecount<<" times"
-	<<" for "<<from_nodes.size()<<" nodes"
-	<<std::endl;*/
-
-	if(!unlighted_nodes.empty())
-		unspreadLight(bank, unlighted_nodes, light_sources, modified_blocks);
+	MapLightNodes nodes(this, modified_blocks);
+	voxalgo::unspreadLight(nodes, bank, m_gamedef->ndef(),
+		from_nodes, light_sources);
 }
 
 /*
@@ -425,144 +443,14 @@ void Map::unLightNeighbors(enum LightBank bank,
 }
 
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	See voxalgo::spreadLight.
 */
 void Map::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes,
 		std::map<v3s16, MapBlock*> & modified_blocks)
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.empty())
-		return;
-
-	u32 blockchangecount = 0;
-
-	std::set<v3s16> lighted_nodes;
-
-	/*
-		Initialize block cache
-	*/
-	v3s16 blockpos_last;
-	MapBlock *block = NULL;
-		// Cache this a bit, too
-	bool block_checked_in_modified = false;
-
-	for(std::set<v3s16>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
-	{
-		v3s16 pos = *j;
-		v3s16 blockpos, relpos;
-
-		getNodeBlockPosWithOffset(pos, blockpos, relpos);
-
-		// Only fetch a new block if the block position has changed
-		try {
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
-
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e) {
-			continue;
-		}
-
-		if(block->isDummy())
-			continue;
-
-		// Get node straight from the block
-		bool is_valid_position;
-		MapNode n = block->getNode(relpos, &is_valid_position);
-
-		u8 oldlight = is_valid_position ? n.getLight(bank, nodemgr) : 0;
-		u8 newlight = diminish_light(oldlight);
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++){
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			// Get the block where the node is located
-			v3s16 blockpos, relpos;
-			getNodeBlockPosWithOffset(n2pos, blockpos, relpos);
-
-			// Only fetch a new block if the block position has changed
-			try {
-				if(block == NULL || blockpos != blockpos_last){
-					block = getBlockNoCreate(blockpos);
-					blockpos_last = blockpos;
-
-					block_checked_in_modified = false;
-					blockchangecount++;
-				}
-			}
-			catch(InvalidPositionException &e) {
-				continue;
-			}
-
-			// Get node straight from the block
-			MapNode n2 = block->getNode(relpos, &is_valid_position);
-			if (!is_valid_position)
-				continue;
-
-			bool changed = false;
-			/*
-				If the neighbor is brighter than the current node,
-				add to list (it will light up this node on its turn)
-			*/
-			if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
-			{
-				lighted_nodes.insert(n2pos);
-				changed = true;
-			}
-			/*
-				If the neighbor is dimmer than how much light this node
-				would spread on it, add to list
-			*/
-			if(n2.getLight(bank, nodemgr) < newlight)
-			{
-				if(nodemgr->get(n2).light_propagates)
-				{
-					n2.setLight(bank, newlight, nodemgr);
-					block->setNode(relpos, n2);
-					lighted_nodes.insert(n2pos);
-					changed = true;
-				}
-			}
-
-			// Add to modified_blocks
-			if(changed == true && block_checked_in_modified == false)
-			{
-				// If the block is not found in modified_blocks, add.
-				if(modified_blocks.find(blockpos) == modified_blocks.end())
-				{
-					modified_blocks[blockpos] = block;
-				}
-				block_checked_in_modified = true;
-			}
-		}
-	}
-
-	/*infostream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(!lighted_nodes.empty())
-		spreadLight(bank, lighted_nodes, modified_blocks);
+	MapLightNodes nodes(this, modified_blocks);
+	voxalgo::spreadLight(nodes, bank, m_gamedef->ndef(), from_nodes);
 }
 
 /*
@@ -1400,21 +1288,6 @@ bool Map::getDayNightDiff(v3s16 blockpos)
 	return false;
 }
 
-struct TimeOrderedMapBlock {
-	MapSector *sect;
-	MapBlock *block;
-
-	TimeOrderedMapBlock(MapSector *sect, MapBlock *block) :
-		sect(sect),
-		block(block)
-	{}
-
-	bool operator<(const TimeOrderedMapBlock &b) const
-	{
-		return block->getUsageTimer() < b.block->getUsageTimer();
-	};
-};
-
 /*
 	Updates usage timers
 */
@@ -1429,114 +1302,72 @@ void Map::timerUpdate(float dtime, float unload_timeout, u32 max_loaded_blocks,
 	std::vector<v2s16> sector_deletion_queue;
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
-	u32 block_count_all = 0;
-
-	beginSave();
-
-	// If there is no practical limit, we spare creation of mapblock_queue
-	if (max_loaded_blocks == U32_MAX) {
-		for (std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
-				si != m_sectors.end(); ++si) {
-			MapSector *sector = si->second;
+	u32 block_count_all = m_block_index.size();
 
-			bool all_blocks_deleted = true;
-
-			MapBlockVect blocks;
-			sector->getBlocks(blocks);
-
-			for (MapBlockVect::iterator i = blocks.begin();
-					i != blocks.end(); ++i) {
-				MapBlock *block = (*i);
-
-				block->incrementUsageTimer(dtime);
-
-				if (block->refGet() == 0
-						&& block->getUsageTimer() > unload_timeout) {
-					v3s16 p = block->getPos();
-
-					// Save if modified
-					if (block->getModified() != MOD_STATE_CLEAN
-							&& save_before_unloading) {
-						modprofiler.add(block->getModifiedReasonString(), 1);
-						if (!saveBlock(block))
-							continue;
-						saved_blocks_count++;
-					}
+	m_usage_time += dtime;
 
-					// Delete from memory
-					sector->deleteBlock(block);
-
-					if (unloaded_blocks)
-						unloaded_blocks->push_back(p);
+	beginSave();
 
-					deleted_blocks_count++;
-				} else {
-					all_blocks_deleted = false;
-					block_count_all++;
-				}
-			}
+	/*
+		Walk from the least recently used block until the blocks are
+		recent enough and within the limit. The list is ordered by usage
+		time, so the walk only passes blocks that are unloaded and those
+		that are still referenced.
+	*/
+	MapBlock *block = m_usage_tail;
+	while (block != NULL && (block_count_all > max_loaded_blocks
+			|| block->getUsageTimer() > unload_timeout)) {
+		MapBlock *more_recent = block->m_usage_prev;
 
-			if (all_blocks_deleted) {
-				sector_deletion_queue.push_back(si->first);
-			}
+		if (block->refGet() != 0) {
+			block = more_recent;
+			continue;
 		}
-	} else {
-		std::priority_queue<TimeOrderedMapBlock> mapblock_queue;
-		for (std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
-				si != m_sectors.end(); ++si) {
-			MapSector *sector = si->second;
-
-			MapBlockVect blocks;
-			sector->getBlocks(blocks);
 
-			for(MapBlockVect::iterator i = blocks.begin();
-					i != blocks.end(); ++i) {
-				MapBlock *block = (*i);
+		v3s16 p = block->getPos();
 
-				block->incrementUsageTimer(dtime);
-				mapblock_queue.push(TimeOrderedMapBlock(sector, block));
+		// Save if modified
+		if (block->getModified() != MOD_STATE_CLEAN && save_before_unloading) {
+			modprofiler.add(block->getModifiedReasonString(), 1);
+			if (!saveBlock(block)) {
+				block = more_recent;
+				continue;
 			}
+			saved_blocks_count++;
 		}
-		block_count_all = mapblock_queue.size();
-		// Delete old blocks, and blocks over the limit from the memory
-		while (!mapblock_queue.empty() && (mapblock_queue.size() > max_loaded_blocks
-				|| mapblock_queue.top().block->getUsageTimer() > unload_timeout)) {
-			TimeOrderedMapBlock b = mapblock_queue.top();
-			mapblock_queue.pop();
-
-			MapBlock *block = b.block;
-
-			if (block->refGet() != 0)
-				continue;
-
-			v3s16 p = block->getPos();
 
-			// Save if modified
-			if (block->getModified() != MOD_STATE_CLEAN && save_before_unloading) {
-				modprofiler.add(block->getModifiedReasonString(), 1);
-				if (!saveBlock(block))
-					continue;
-				saved_blocks_count++;
-			}
+		// Delete from memory
+		MapSector *sector = getSectorNoGenerateNoEx(v2s16(p.X, p.Z));
+		sector->deleteBlock(block);
+		if (sector->empty())
+			sector_deletion_queue.push_back(sector->getPos());
 
-			// Delete from memory
-			b.sect->deleteBlock(block);
+		if (unloaded_blocks)
+			unloaded_blocks->push_back(p);
 
-			if (unloaded_blocks)
-				unloaded_blocks->push_back(p);
+		deleted_blocks_count++;
+		block_count_all--;
+		block = more_recent;
+	}
+	endSave();
 
-			deleted_blocks_count++;
-			block_count_all--;
-		}
-		// Delete empty sectors
-		for (std::map<v2s16, MapSector*>::iterator si = m_sectors.begin();
-			si != m_sectors.end(); ++si) {
-			if (si->second->empty()) {
-				sector_deletion_queue.push_back(si->first);
-			}
+	/*
+		Pack blocks from the least recently used one on, up to the first
+		one that is still in use. Only a part of them is looked at per
+		call, so loaded but idle areas are packed over several updates.
+	*/
+	u32 packed_blocks_count = 0;
+	if (m_pack_blocks) {
+		block = m_pack_next ? m_pack_next : m_usage_tail;
+		u32 budget = MAPBLOCK_PACK_MAX_PER_UPDATE;
+		while (block != NULL && budget != 0 &&
+				block->getUsageTimer() > MAPBLOCK_PACK_IDLE_TIME) {
+			packed_blocks_count += block->packIfUnwritten();
+			block = block->m_usage_prev;
+			budget--;
 		}
+		m_pack_next = budget == 0 ? block : NULL;
 	}
-	endSave();
 
 	// Finally delete the empty sectors
 	deleteSectors(sector_deletion_queue);
@@ -1549,6 +1380,8 @@ void Map::timerUpdate(float dtime, float unload_timeout, u32 max_loaded_blocks,
 		if(save_before_unloading)
 			infostream<<", of which "<<saved_blocks_count<<" were written";
 		infostream<<", "<<block_count_all<<" blocks in memory";
+		if(m_pack_blocks)
+			infostream<<", "<<packed_blocks_count<<" packed";
 		infostream<<"."<<std::endl;
 		if(saved_blocks_count != 0){
 			PrintInfo(infostream); // ServerMap/ClientMap:
@@ -1614,60 +1447,48 @@ s32 Map::transforming_liquid_size() {
         return m_transforming_liquid.size();
 }
 
-void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks)
+MapNode LiquidBucket::getNode(v3s16 p) const
 {
+	v3s16 bp = getNodeBlockPos(p);
+	v3s16 d = bp - blockpos;
+	MapBlock *block = blocks[(d.Z + 1) * 9 + (d.Y + 1) * 3 + (d.X + 1)];
+	if (block == NULL)
+		return MapNode(CONTENT_IGNORE);
+	bool is_valid_position;
+	return block->getNodeNoCheck(p - bp * MAP_BLOCKSIZE, &is_valid_position);
+}
 
-	INodeDefManager *nodemgr = m_gamedef->ndef();
-
-	DSTACK(FUNCTION_NAME);
-	//TimeTaker timer("transformLiquids()");
-
-	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
-
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
-
-	// list of nodes that due to viscosity have not reached their max level height
-	std::deque<v3s16> must_reflow;
-
-	// List of MapBlocks that will require a lighting update (due to lava)
-	std::map<v3s16, MapBlock *> lighting_modified_blocks;
-
-	u32 liquid_loop_max = g_settings->getS32("liquid_loop_max");
-	u32 loop_max = liquid_loop_max;
-
-#if 0
+class LiquidBucketJob : public WorkerPool::Job
+{
+public:
+	LiquidBucketJob(Map *map, std::vector<LiquidBucket> &buckets,
+			void (Map::*transform)(LiquidBucket &)):
+		m_map(map),
+		m_buckets(buckets),
+		m_transform(transform)
+	{}
 
-	/* If liquid_loop_max is not keeping up with the queue size increase
-	 * loop_max up to a maximum of liquid_loop_max * dedicated_server_step.
-	 */
-	if (m_transforming_liquid.size() > loop_max * 2) {
-		// "Burst" mode
-		float server_step = g_settings->getFloat("dedicated_server_step");
-		if (m_transforming_liquid_loop_count_multiplier - 1.0 < server_step)
-			m_transforming_liquid_loop_count_multiplier *= 1.0 + server_step / 10;
-	} else {
-		m_transforming_liquid_loop_count_multiplier = 1.0;
+	void run(u32 index)
+	{
+		(m_map->*m_transform)(m_buckets[index]);
 	}
 
-	loop_max *= m_transforming_liquid_loop_count_multiplier;
-#endif
+private:
+	Map *m_map;
+	std::vector<LiquidBucket> &m_buckets;
+	void (Map::*m_transform)(LiquidBucket &);
+};
 
-	while (m_transforming_liquid.size() != 0)
-	{
-		// This should be done here so that it is done when continue is used
-		if (loopcount >= initial_size || loopcount >= loop_max)
-			break;
-		loopcount++;
+void Map::transformLiquidBucket(LiquidBucket &bucket)
+{
+	INodeDefManager *nodemgr = m_gamedef->ndef();
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.front();
-		m_transforming_liquid.pop_front();
+	for (std::vector<v3s16>::const_iterator
+			it = bucket.positions.begin();
+			it != bucket.positions.end(); ++it) {
+		v3s16 p0 = *it;
 
-		MapNode n0 = getNodeNoEx(p0);
+		MapNode n0 = bucket.getNode(p0);
 
 		/*
 			Collect information about current node
@@ -1720,7 +1541,7 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks)
 					break;
 			}
 			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb(getNodeNoEx(npos), nt, npos);
+			NodeNeighbor nb(bucket.getNode(npos), nt, npos);
 			const ContentFeatures &cfnb = nodemgr->get(nb.n);
 			switch (nodemgr->get(nb.n.getContent()).liquid_type) {
 				case LIQUID_NONE:
@@ -1730,7 +1551,7 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks)
 						// should be enqueded for transformation regardless of whether the
 						// current node changes or not.
 						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
+							bucket.queued.push_back(npos);
 						// if the current node happens to be a flowing node, it will start to flow down here.
 						if (nb.t == NEIGHBOR_LOWER)
 							flowing_down = true;
@@ -1828,7 +1649,7 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks)
 				else if (level_inc > 0)
 					new_node_level = liquid_level + 1;
 				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
+					bucket.reflow.push_back(p0);
 			} else {
 				new_node_level = max_node_level;
 			}
@@ -1854,7 +1675,9 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks)
 		/*
 			update the current node
 		 */
-		MapNode n00 = n0;
+		LiquidUpdate update;
+		update.p = p0;
+		update.oldnode = n0;
 		//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
 		if (nodemgr->get(new_node_content).liquid_type == LIQUID_FLOWING) {
 			// set level to last 3 bits, flowing down bit to 4th bit
@@ -1864,64 +1687,178 @@ void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks)
 			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
 		}
 		n0.setContent(new_node_content);
-
-		// Find out whether there is a suspect for this action
-		std::string suspect;
-		if (m_gamedef->rollback())
-			suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
-
-		if (m_gamedef->rollback() && !suspect.empty()) {
-			// Blame suspect
-			RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
-			// Get old node for rollback
-			RollbackNode rollback_oldnode(this, p0, m_gamedef);
-			// Set node
-			setNode(p0, n0);
-			// Report
-			RollbackNode rollback_newnode(this, p0, m_gamedef);
-			RollbackAction action;
-			action.setSetNode(p0, rollback_oldnode, rollback_newnode);
-			m_gamedef->rollback()->reportAction(action);
-		} else {
-			// Set node
-			setNode(p0, n0);
-		}
-
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if (block != NULL) {
-			modified_blocks[blockpos] =  block;
-			// If new or old node emits light, MapBlock requires lighting update
-			if (nodemgr->get(n0).light_source != 0 ||
-					nodemgr->get(n00).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
-		}
+		update.newnode = n0;
+		bucket.updates.push_back(update);
 
 		/*
 			enqueue neighbors for update if neccessary
 		 */
-		switch (nodemgr->get(n0.getContent()).liquid_type) {
+		switch (nodemgr->get(new_node_content).liquid_type) {
 			case LIQUID_SOURCE:
 			case LIQUID_FLOWING:
 				// make sure source flows into all neighboring nodes
 				for (u16 i = 0; i < num_flows; i++)
 					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
+						bucket.queued.push_back(flows[i].p);
 				for (u16 i = 0; i < num_airs; i++)
 					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
+						bucket.queued.push_back(airs[i].p);
 				break;
 			case LIQUID_NONE:
 				// this flow has turned to air; neighboring flows might need to do the same
 				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
+					bucket.queued.push_back(flows[i].p);
 				break;
 		}
 	}
+}
+
+void Map::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks)
+{
+
+	INodeDefManager *nodemgr = m_gamedef->ndef();
+
+	DSTACK(FUNCTION_NAME);
+	//TimeTaker timer("transformLiquids()");
+
+	u32 initial_size = m_transforming_liquid.size();
+
+	/*if(initial_size != 0)
+		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+
+	// List of MapBlocks that will require a lighting update (due to lava)
+	std::map<v3s16, MapBlock *> lighting_modified_blocks;
+
+	u32 liquid_loop_max = g_settings->getS32("liquid_loop_max");
+	u32 loop_max = liquid_loop_max;
+
+#if 0
+
+	/* If liquid_loop_max is not keeping up with the queue size increase
+	 * loop_max up to a maximum of liquid_loop_max * dedicated_server_step.
+	 */
+	if (m_transforming_liquid.size() > loop_max * 2) {
+		// "Burst" mode
+		float server_step = g_settings->getFloat("dedicated_server_step");
+		if (m_transforming_liquid_loop_count_multiplier - 1.0 < server_step)
+			m_transforming_liquid_loop_count_multiplier *= 1.0 + server_step / 10;
+	} else {
+		m_transforming_liquid_loop_count_multiplier = 1.0;
+	}
+
+	loop_max *= m_transforming_liquid_loop_count_multiplier;
+#endif
+
+	/*
+		Take the queued nodes and bucket them by MapBlock, in the order
+		the blocks first appear in the queue
+	*/
+	u32 loopcount = MYMIN(initial_size, loop_max);
+	u32 num_buckets = 0;
+	std::map<v3s16, u32> bucket_indices;
+	for (u32 i = 0; i < loopcount; i++) {
+		v3s16 p0 = m_transforming_liquid.front();
+		m_transforming_liquid.pop_front();
+
+		v3s16 blockpos = getNodeBlockPos(p0);
+		std::pair<std::map<v3s16, u32>::iterator, bool> r =
+			bucket_indices.insert(std::make_pair(blockpos, num_buckets));
+		if (r.second) {
+			if (m_liquid_buckets.size() <= num_buckets)
+				m_liquid_buckets.resize(num_buckets + 1);
+			LiquidBucket &bucket = m_liquid_buckets[num_buckets++];
+			bucket.blockpos = blockpos;
+			bucket.positions.clear();
+			bucket.updates.clear();
+			bucket.queued.clear();
+			bucket.reflow.clear();
+			v3s16 d;
+			for (d.Z = -1; d.Z <= 1; d.Z++)
+			for (d.Y = -1; d.Y <= 1; d.Y++)
+			for (d.X = -1; d.X <= 1; d.X++) {
+				MapBlock *block = getBlockNoCreateNoEx(blockpos + d);
+				if (block != NULL && block->isDummy())
+					block = NULL;
+				bucket.blocks[(d.Z + 1) * 9 + (d.Y + 1) * 3 + (d.X + 1)] = block;
+			}
+		}
+		m_liquid_buckets[r.first->second].positions.push_back(p0);
+	}
+
+	/*
+		Compute the new nodes. This only reads the map, so the buckets are
+		independent of each other and can be done in parallel.
+	*/
+	if (num_buckets > 0) {
+		if (m_liquid_workers == NULL) {
+			s16 nthreads = g_settings->getS16("num_liquid_threads");
+			if (nthreads < 0)
+				nthreads = WorkerPool::getDefaultThreadCount(true);
+			m_liquid_workers = new WorkerPool("Liquid", nthreads);
+		}
+		LiquidBucketJob job(this, m_liquid_buckets, &Map::transformLiquidBucket);
+		m_liquid_workers->run(&job, num_buckets);
+	}
+
+	/*
+		Apply the results
+	*/
+	for (u32 i = 0; i < num_buckets; i++) {
+		LiquidBucket &bucket = m_liquid_buckets[i];
+
+		for (std::vector<LiquidUpdate>::const_iterator
+				it = bucket.updates.begin();
+				it != bucket.updates.end(); ++it) {
+			v3s16 p0 = it->p;
+			MapNode n0 = it->newnode;
+
+			// Find out whether there is a suspect for this action
+			std::string suspect;
+			if (m_gamedef->rollback())
+				suspect = m_gamedef->rollback()->getSuspect(p0, 83, 1);
+
+			if (m_gamedef->rollback() && !suspect.empty()) {
+				// Blame suspect
+				RollbackScopeActor rollback_scope(m_gamedef->rollback(), suspect, true);
+				// Get old node for rollback
+				RollbackNode rollback_oldnode(this, p0, m_gamedef);
+				// Set node
+				setNode(p0, n0);
+				// Report
+				RollbackNode rollback_newnode(this, p0, m_gamedef);
+				RollbackAction action;
+				action.setSetNode(p0, rollback_oldnode, rollback_newnode);
+				m_gamedef->rollback()->reportAction(action);
+			} else {
+				// Set node
+				setNode(p0, n0);
+			}
+
+			// If new or old node emits light, MapBlock requires lighting update
+			MapBlock *block = bucket.blocks[13];
+			if (block != NULL && (nodemgr->get(n0).light_source != 0 ||
+					nodemgr->get(it->oldnode).light_source != 0))
+				lighting_modified_blocks[bucket.blockpos] = block;
+		}
+
+		// All updates of a bucket are in its own block
+		if (!bucket.updates.empty() && bucket.blocks[13] != NULL)
+			modified_blocks[bucket.blockpos] = bucket.blocks[13];
+
+		for (std::vector<v3s16>::const_iterator
+				it = bucket.queued.begin();
+				it != bucket.queued.end(); ++it)
+			m_transforming_liquid.push_back(*it);
+	}
 	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 
-	for (std::deque<v3s16>::iterator iter = must_reflow.begin(); iter != must_reflow.end(); ++iter)
-		m_transforming_liquid.push_back(*iter);
+	for (u32 i = 0; i < num_buckets; i++) {
+		LiquidBucket &bucket = m_liquid_buckets[i];
+		for (std::vector<v3s16>::const_iterator
+				it = bucket.reflow.begin();
+				it != bucket.reflow.end(); ++it)
+			m_transforming_liquid.push_back(*it);
+	}
 
 	updateLighting(lighting_modified_blocks, modified_blocks);
 
@@ -2125,7 +2062,8 @@ void Map::removeNodeTimer(v3s16 p)
 ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emerge):
 	Map(dout_server, gamedef),
 	m_emerge(emerge),
-	m_map_metadata_changed(true)
+	m_map_metadata_changed(true),
+	m_block_writes(0)
 {
 	verbosestream<<FUNCTION_NAME<<std::endl;
 
@@ -2141,8 +2079,33 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 		// fall back to sqlite3
 		conf.set("backend", "sqlite3");
 	}
-	std::string backend = conf.get("backend");
-	dbase = createDatabase(backend, savedir, conf);
+	m_backend = conf.get("backend");
+	dbase = createDatabase(m_backend, savedir, conf);
+
+	// Block compression codec, worlds without the key stay on zlib
+	m_block_codec = BLOCK_CODEC_ZLIB;
+	m_block_codec_level = BLOCK_CODEC_LEVEL_DEFAULT;
+	if (conf.exists("block_compression")) {
+		std::string codec = conf.get("block_compression");
+		if (!parse_block_codec(codec, &m_block_codec)) {
+			errorstream << "ServerMap: Block compression \"" << codec
+				<< "\" not supported, writing zlib blocks" << std::endl;
+			m_block_codec = BLOCK_CODEC_ZLIB;
+		}
+	}
+	if (conf.exists("block_compression_level"))
+		m_block_codec_level = parse_block_codec_level(
+			conf.get("block_compression_level"));
+
+	// Blocks are compressed and written on a separate thread, unless
+	// map_write_queue_size is set to 0
+	u16 write_queue_size = g_settings->getU16("map_write_queue_size");
+	m_writer = NULL;
+	if (write_queue_size > 0) {
+		m_writer = new MapWriteThread(dbase, m_block_codec,
+			m_block_codec_level, write_queue_size);
+		m_writer->start();
+	}
 
 	if (!conf.updateConfigFile(conf_path.c_str()))
 		errorstream << "ServerMap::ServerMap(): Failed to update world.mt!" << std::endl;
@@ -2236,8 +2199,9 @@ ServerMap::~ServerMap()
 	}
 
 	/*
-		Close database if it was opened
+		Write everything still queued, then close database if it was opened
 	*/
+	delete m_writer;
 	delete dbase;
 
 #if 0
@@ -2978,7 +2942,14 @@ void ServerMap::listAllLoadableBlocks(std::vector<v3s16> &dst)
 		errorstream << "Map::listAllLoadableBlocks(): Result will be missing "
 				<< "all blocks that are stored in flat files." << std::endl;
 	}
-	dbase->listAllLoadableBlocks(dst);
+	if (m_writer) {
+		// Include the blocks that are still queued
+		m_writer->flush();
+		MutexAutoLock lock(m_writer->getDatabaseMutex());
+		dbase->listAllLoadableBlocks(dst);
+	} else {
+		dbase->listAllLoadableBlocks(dst);
+	}
 }
 
 void ServerMap::listAllLoadedBlocks(std::vector<v3s16> &dst)
@@ -3246,20 +3217,54 @@ Database *ServerMap::createDatabase(
 
 void ServerMap::beginSave()
 {
-	dbase->beginSave();
+	// The writer thread does its own transactions
+	if (!m_writer)
+		dbase->beginSave();
 }
 
 void ServerMap::endSave()
 {
-	dbase->endSave();
+	if (!m_writer)
+		dbase->endSave();
+	m_block_writes++;
 }
 
 bool ServerMap::saveBlock(MapBlock *block)
 {
-	return saveBlock(block, dbase);
+	// Before and after, so no read overlapping the write is taken as current
+	m_block_writes++;
+	bool ret = writeBlock(block);
+	m_block_writes++;
+	return ret;
 }
 
-bool ServerMap::saveBlock(MapBlock *block, Database *db)
+bool ServerMap::writeBlock(MapBlock *block)
+{
+	if (!m_writer)
+		return saveBlock(block, dbase, m_block_codec, m_block_codec_level);
+
+	// Dummy blocks are not written
+	if (block->isDummy()) {
+		warningstream << "saveBlock: Not writing dummy block "
+			<< PP(block->getPos()) << std::endl;
+		return true;
+	}
+
+	u8 version = SER_FMT_VER_HIGHEST_WRITE;
+	if (m_block_codec != BLOCK_CODEC_ZLIB)
+		version = SER_FMT_VER_BLOCK_CODEC;
+
+	// Only the copy is made here, compression happens on the writer
+	MapBlockSnapshot *snapshot = new MapBlockSnapshot;
+	block->takeSnapshot(*snapshot, version, true);
+	m_writer->queueBlock(snapshot);
+
+	// The snapshot has everything, so the block is as good as written
+	block->resetModified();
+	return true;
+}
+
+bool ServerMap::saveBlock(MapBlock *block, Database *db, u8 codec, int level)
 {
 	v3s16 p3d = block->getPos();
 
@@ -3272,6 +3277,8 @@ bool ServerMap::saveBlock(MapBlock *block, Database *db)
 
 	// Format used for writing
 	u8 version = SER_FMT_VER_HIGHEST_WRITE;
+	if (codec != BLOCK_CODEC_ZLIB)
+		version = SER_FMT_VER_BLOCK_CODEC;
 
 	/*
 		[0] u8 serialization version
@@ -3279,7 +3286,7 @@ bool ServerMap::saveBlock(MapBlock *block, Database *db)
 	*/
 	std::ostringstream o(std::ios_base::binary);
 	o.write((char*) &version, 1);
-	block->serialize(o, version, true);
+	block->serialize(o, version, true, codec, level);
 
 	std::string data = o.str();
 	bool ret = db->saveBlock(p3d, data);
@@ -3344,6 +3351,8 @@ void ServerMap::loadBlock(std::string sectordir, std::string blockfile,
 		if(version < SER_FMT_VER_HIGHEST_WRITE || save_after_load)
 		{
 			saveBlock(block);
+			if (m_writer)
+				m_writer->flush();
 
 			// Should be in database now, so delete the old file
 			fs::RecursiveDelete(fullpath);
@@ -3439,13 +3448,79 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 {
 	DSTACK(FUNCTION_NAME);
 
-	v2s16 p2d(blockpos.X, blockpos.Z);
-
 	std::string ret;
 
-	ret = dbase->loadBlock(blockpos);
-	if (ret != "") {
-		loadBlock(&ret, blockpos, createSector(p2d), false);
+	if (!m_writer) {
+		ret = dbase->loadBlock(blockpos);
+	} else if (!m_writer->getPendingBlock(blockpos, &ret)) {
+		MutexAutoLock lock(m_writer->getDatabaseMutex());
+		ret = dbase->loadBlock(blockpos);
+	}
+	return loadBlockData(blockpos, &ret);
+}
+
+MapBlock* ServerMap::loadBlock(v3s16 blockpos, std::string *blob,
+		u32 write_stamp)
+{
+	// Something was written since the data was read, it may be outdated
+	if (write_stamp != m_block_writes)
+		return loadBlock(blockpos);
+	return loadBlockData(blockpos, blob);
+}
+
+void ServerMap::loadBlocks(const std::vector<v3s16> &positions)
+{
+	DSTACK(FUNCTION_NAME);
+
+	std::vector<std::string> blobs(positions.size());
+
+	// Queued writes are newer than the database
+	std::vector<v3s16> read_positions;
+	std::vector<size_t> read_indices;
+	for (size_t i = 0; i < positions.size(); i++) {
+		if (m_writer && m_writer->getPendingBlock(positions[i], &blobs[i]))
+			continue;
+		read_positions.push_back(positions[i]);
+		read_indices.push_back(i);
+	}
+
+	std::vector<std::string> read_blobs;
+	if (m_writer) {
+		MutexAutoLock lock(m_writer->getDatabaseMutex());
+		dbase->loadBlocks(read_positions, read_blobs);
+	} else {
+		dbase->loadBlocks(read_positions, read_blobs);
+	}
+	for (size_t i = 0; i < read_indices.size(); i++)
+		blobs[read_indices[i]].swap(read_blobs[i]);
+
+	for (size_t i = 0; i < positions.size(); i++)
+		loadBlockData(positions[i], &blobs[i]);
+}
+
+Database *ServerMap::createReadDatabase()
+{
+	// The other backends share their only connection
+	if (m_backend != "sqlite3")
+		return NULL;
+	return new Database_SQLite3(m_savedir);
+}
+
+bool ServerMap::readBlock(Database *db, v3s16 blockpos, std::string *blob,
+		u32 *write_stamp)
+{
+	*write_stamp = m_block_writes;
+	if (m_writer && m_writer->getPendingBlock(blockpos, blob))
+		return true;
+	return db->tryLoadBlock(blockpos, blob);
+}
+
+MapBlock* ServerMap::loadBlockData(v3s16 blockpos, std::string *blob)
+{
+	v2s16 p2d(blockpos.X, blockpos.Z);
+
+	if (*blob != "") {
+		loadBlock(blob, blockpos, createSector(p2d), false);
 		return getBlockNoCreateNoEx(blockpos);
 	}
 	// Not found in database, try the files
@@ -3509,7 +3584,14 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 bool ServerMap::deleteBlock(v3s16 blockpos)
 {
-	if (!dbase->deleteBlock(blockpos))
+	m_block_writes++;
+	bool deleted = true;
+	if (m_writer)
+		m_writer->queueDelete(blockpos);
+	else
+		deleted = dbase->deleteBlock(blockpos);
+	m_block_writes++;
+	if (!deleted)
 		return false;
 
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
@@ -3564,6 +3646,25 @@ void MMVManip::initialEmerge(v3s16 blockpos_min, v3s16 blockpos_max,
 
 	addArea(block_area_nodes);
 
+	// Load the blocks that are not in memory with one database query
+	if (load_if_inexistent) {
+		std::vector<v3s16> missing;
+		for (s16 z = p_min.Z; z <= p_max.Z; z++)
+		for (s16 y = p_min.Y; y <= p_max.Y; y++)
+		for (s16 x = p_min.X; x <= p_max.X; x++) {
+			v3s16 p(x, y, z);
+			if (m_loaded_blocks.find(p) != m_loaded_blocks.end())
+				continue;
+			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+			if (block == NULL || block->isDummy())
+				missing.push_back(p);
+		}
+		if (!missing.empty()) {
+			TimeTaker timer1("emerge load", &emerge_load_time);
+			((ServerMap *)m_map)->loadBlocks(missing);
+		}
+	}
+
 	for(s32 z=p_min.Z; z<=p_max.Z; z++)
 	for(s32 y=p_min.Y; y<=p_max.Y; y++)
 	for(s32 x=p_min.X; x<=p_max.X; x++)
@@ -3596,10 +3697,9 @@ void MMVManip::initialEmerge(v3s16 blockpos_min, v3s16 blockpos_max,
 		{
 
 			if (load_if_inexistent) {
+				// Loading was already tried above
 				ServerMap *svrmap = (ServerMap *)m_map;
-				block = svrmap->emergeBlock(p, false);
-				if (block == NULL)
-					block = svrmap->createBlock(p);
+				block = svrmap->createBlock(p);
 				block->copyTo(*this);
 			} else {
 				flags |= VMANIP_BLOCK_DATA_INEXIST;
@@ -32,7 +32,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "voxel.h"
 #include "modifiedstate.h"
 #include "util/container.h"
+#include "util/numeric.h"
+#include "threading/atomic.h"
 #include "nodetimer.h"
+#include "serialization.h"
 
 class Settings;
 class Database;
@@ -45,10 +48,41 @@ class IGameDef;
 class IRollbackManager;
 class EmergeManager;
 class ServerEnvironment;
+class WorkerPool;
+class MapWriteThread;
 struct BlockMakeData;
 struct MapgenParams;
 
 
+/*
+	Queued liquid positions of one MapBlock, processed as a unit by
+	Map::transformLiquids
+*/
+
+struct LiquidUpdate
+{
+	v3s16 p;
+	MapNode oldnode;
+	MapNode newnode;
+};
+
+struct LiquidBucket
+{
+	v3s16 blockpos;
+	// The block and its neighbours, NULL if not loaded
+	MapBlock *blocks[27];
+	std::vector<v3s16> positions;
+
+	// Results
+	std::vector<LiquidUpdate> updates;
+	// Positions to queue again in this order
+	std::vector<v3s16> queued;
+	// Nodes that have not reached their level due to viscosity
+	std::vector<v3s16> reflow;
+
+	MapNode getNode(v3s16 p) const;
+};
+
 /*
 	MapEditEvent
 */
@@ -57,6 +91,11 @@ struct MapgenParams;
 #define MAPTYPE_SERVER 1
 #define MAPTYPE_CLIENT 2
 
+// Seconds a block must go unused before timerUpdate packs its node data
+#define MAPBLOCK_PACK_IDLE_TIME 10.0f
+// Blocks timerUpdate looks at for packing per call
+#define MAPBLOCK_PACK_MAX_PER_UPDATE 256
+
 enum MapEditEventType{
 	// Node added (changed from air or something else to something)
 	MEET_ADDNODE,
@@ -186,7 +225,7 @@ public:
 
 	// Returns InvalidPositionException if not found
 	MapBlock * getBlockNoCreate(v3s16 p);
-	// Returns NULL if not found
+	// Returns NULL if not found. Looks in the block index, not in sectors.
 	MapBlock * getBlockNoCreateNoEx(v3s16 p);
 
 	/* Server overrides */
@@ -276,6 +315,11 @@ public:
 	/*
 		Updates usage timers and unloads unused blocks and sectors.
 		Saves modified blocks before unloading on MAPTYPE_SERVER.
+		Packs the node data of blocks unused for MAPBLOCK_PACK_IDLE_TIME
+		that weren't written to since they were last looked at, see
+		MapBlock::packIfUnwritten(). At most MAPBLOCK_PACK_MAX_PER_UPDATE
+		blocks are looked at per call, continuing where the last call
+		stopped.
 	*/
 	void timerUpdate(float dtime, float unload_timeout, u32 max_loaded_blocks,
 			std::vector<v3s16> *unloaded_blocks=NULL);
@@ -286,6 +330,9 @@ public:
 	*/
 	void unloadUnreferencedBlocks(std::vector<v3s16> *unloaded_blocks=NULL);
 
+	// Sum of the dtimes passed to timerUpdate, see MapBlock::getUsageTimer()
+	double getUsageTime() const { return m_usage_time; }
+
 	// Deletes sectors and their blocks from memory
 	// Takes cache into account
 	// If deleted sector is in sector cache, clears cache
@@ -344,6 +391,17 @@ public:
 
 protected:
 	friend class LuaVoxelManip;
+	friend class MapSector;
+	friend class MapBlock;
+
+	// Called by MapSector for every block it gets or loses
+	void indexBlock(MapBlock *block);
+	void unindexBlock(v3s16 p);
+
+	// Called by MapBlock::resetUsageTimer()
+	void touchBlock(MapBlock *block);
+	void linkUsedBlock(MapBlock *block);
+	void unlinkUsedBlock(MapBlock *block);
 
 	std::ostream &m_dout; // A bit deprecated, could be removed
 
@@ -357,10 +415,35 @@ protected:
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	// All blocks of all sectors by position
+	FlatHashMap<v3s16, MapBlock*, V3s16Hash> m_block_index;
+	// Validate the per-thread last block caches of getBlockNoCreateNoEx,
+	// the generation changes whenever a block leaves the index
+	u32 m_id;
+	u32 m_block_index_generation;
+
+	// Indexed blocks from the most to the least recently used
+	MapBlock *m_usage_head;
+	MapBlock *m_usage_tail;
+	double m_usage_time;
+	// Whether timerUpdate packs the node data of blocks not written to
+	bool m_pack_blocks;
+	// Where timerUpdate continues packing, NULL to start at m_usage_tail
+	MapBlock *m_pack_next;
+
 	// Queued transforming water nodes
-	UniqueQueue<v3s16> m_transforming_liquid;
+	UniqueQueue<v3s16, FlatHashSet<v3s16, V3s16Hash> > m_transforming_liquid;
 
 private:
+	// Computes the new state of the bucket's nodes, without modifying
+	// the map. Called from the liquid worker threads.
+	void transformLiquidBucket(LiquidBucket &bucket);
+
+	// Threads for transformLiquids, created on first use
+	WorkerPool *m_liquid_workers;
+	// Reused between calls to transformLiquids
+	std::vector<LiquidBucket> m_liquid_buckets;
+
 	f32 m_transforming_liquid_loop_count_multiplier;
 	u32 m_unprocessed_count;
 	u32 m_inc_trending_up_start_time; // milliseconds
@@ -487,12 +570,30 @@ public:
 	//bool deFlushSector(v2s16 p2d);
 
 	bool saveBlock(MapBlock *block);
-	static bool saveBlock(MapBlock *block, Database *db);
+	// A codec other than zlib writes SER_FMT_VER_BLOCK_CODEC blocks
+	static bool saveBlock(MapBlock *block, Database *db,
+			u8 codec = BLOCK_CODEC_ZLIB, int level = BLOCK_CODEC_LEVEL_DEFAULT);
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
+	// Loads whichever of the blocks exist, reading the database at once
+	void loadBlocks(const std::vector<v3s16> &positions);
+
+	/*
+		Emerge threads read blocks through a database connection of their
+		own while not holding the environment lock. createReadDatabase()
+		returns NULL if the backend has no use for that.
+
+		readBlock() may be called without the environment lock and sets
+		a stamp for loadBlock(), which reads the block again if anything
+		was written in the meantime. It returns false if db couldn't be
+		read, then only loadBlock(p) can tell whether the block exists.
+	*/
+	Database *createReadDatabase();
+	bool readBlock(Database *db, v3s16 p, std::string *blob, u32 *write_stamp);
+	MapBlock* loadBlock(v3s16 p, std::string *blob, u32 write_stamp);
 
 	bool deleteBlock(v3s16 blockpos);
 
@@ -507,6 +608,11 @@ public:
 	s16 getWaterLevel();
 
 private:
+	bool writeBlock(MapBlock *block);
+	// Loads the block from database data, or from the legacy files if
+	// blob is empty
+	MapBlock* loadBlockData(v3s16 p, std::string *blob);
+
 	// Emerge manager
 	EmergeManager *m_emerge;
 
@@ -526,7 +632,16 @@ private:
 		This is reset to false when written on disk.
 	*/
 	bool m_map_metadata_changed;
+	std::string m_backend;
 	Database *dbase;
+	// Changed around every block write, see readBlock()
+	Atomic<u32> m_block_writes;
+	// Writes blocks behind the server thread, NULL if saving is synchronous
+	MapWriteThread *m_writer;
+
+	// Block compression of this world, from world.mt
+	u8 m_block_codec;
+	int m_block_codec_level;
 };
 
 
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <string.h>
 #include "map.h"
 #include "light.h"
 #include "nodedef.h"
@@ -62,6 +63,108 @@ static const char *modified_reason_strings[] = {
 };
 
 
+/*
+	PackedNodes
+*/
+
+static inline u32 packed_node_key(const MapNode &n)
+{
+	return n.param0 | (n.param1 << 16) | ((u32)n.param2 << 24);
+}
+
+bool PackedNodes::pack(const MapNode *nodes, u32 count)
+{
+	clear();
+	if (count == 0)
+		return false;
+
+	u32 first = packed_node_key(nodes[0]);
+	u32 i = 1;
+	while (i < count && packed_node_key(nodes[i]) == first)
+		i++;
+	if (i == count) {
+		m_palette.assign(1, nodes[0]);
+		return true;
+	}
+
+	/*
+		Find the palette index of each node with a small open addressing
+		hash of the node values. Nodes come in runs, so the index of the
+		previous node is tried first.
+	*/
+	static const u32 hash_bits = 10;
+	u32 hash_keys[1 << hash_bits];
+	u16 hash_indices[1 << hash_bits];
+	memset(hash_indices, 0xFF, sizeof(hash_indices));
+
+	MapNode palette[256];
+	u32 palette_size = 0;
+	std::vector<u8> indices(count);
+
+	u32 last_key = first;
+	u8 last_index = 0;
+	hash_keys[(first * 2654435761U) >> (32 - hash_bits)] = first;
+	hash_indices[(first * 2654435761U) >> (32 - hash_bits)] = 0;
+	palette[palette_size++] = nodes[0];
+
+	for (i = 0; i < count; i++) {
+		u32 key = packed_node_key(nodes[i]);
+		if (key != last_key) {
+			u32 h = (key * 2654435761U) >> (32 - hash_bits);
+			while (hash_indices[h] != 0xFFFF && hash_keys[h] != key)
+				h = (h + 1) & ((1 << hash_bits) - 1);
+
+			if (hash_indices[h] == 0xFFFF) {
+				if (palette_size == 256)
+					return false;
+				hash_keys[h] = key;
+				hash_indices[h] = palette_size;
+				palette[palette_size++] = nodes[i];
+			}
+
+			last_key = key;
+			last_index = hash_indices[h];
+		}
+		indices[i] = last_index;
+	}
+
+	m_bits = (palette_size <= 2) ? 1 : (palette_size <= 4) ? 2 :
+		(palette_size <= 16) ? 4 : 8;
+	m_palette.assign(palette, palette + palette_size);
+	m_indices.assign((count * m_bits + 31) / 32, 0);
+	for (i = 0; i < count; i++) {
+		u32 bit = i * m_bits;
+		m_indices[bit >> 5] |= (u32)indices[i] << (bit & 31);
+	}
+
+	return true;
+}
+
+void PackedNodes::unpack(MapNode *nodes, u32 count) const
+{
+	if (m_bits == 0) {
+		std::fill(nodes, nodes + count, m_palette[0]);
+		return;
+	}
+
+	for (u32 i = 0; i < count; i++)
+		nodes[i] = get(i);
+}
+
+void PackedNodes::clear()
+{
+	std::vector<MapNode>().swap(m_palette);
+	std::vector<u32>().swap(m_indices);
+	m_bits = 0;
+}
+
+size_t PackedNodes::getMemoryUsage() const
+{
+	return m_palette.capacity() * sizeof(MapNode) +
+		m_indices.capacity() * sizeof(u32);
+}
+
+
 /*
 	MapBlock
 */
@@ -80,10 +183,16 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
-		m_usage_timer(0),
+		m_usage_timer(parent ? parent->getUsageTime() : 0),
+		m_usage_prev(NULL),
+		m_usage_next(NULL),
+		m_usage_listed(false),
 		m_refcount(0)
 {
 	data = NULL;
+	m_written = false;
+	m_pack_failed = false;
+	m_contents_overflow = false;
 	if(dummy == false)
 		reallocate();
 
@@ -110,6 +219,19 @@ MapBlock::~MapBlock()
 		delete[] data;
 }
 
+void MapBlock::resetUsageTimer()
+{
+	if (m_parent)
+		m_parent->touchBlock(this);
+}
+
+float MapBlock::getUsageTimer()
+{
+	if (m_parent == NULL)
+		return 0;
+	return m_parent->getUsageTime() - m_usage_timer;
+}
+
 bool MapBlock::isValidPositionParent(v3s16 p)
 {
 	if(isValidPosition(p))
@@ -126,14 +248,49 @@ MapNode MapBlock::getNodeParent(v3s16 p, bool *is_valid_position)
 	if (isValidPosition(p) == false)
 		return m_parent->getNodeNoEx(getPosRelative() + p, is_valid_position);
 
-	if (data == NULL) {
+	if (isDummy()) {
 		if (is_valid_position)
 			*is_valid_position = false;
 		return MapNode(CONTENT_IGNORE);
 	}
 	if (is_valid_position)
 		*is_valid_position = true;
-	return data[p.Z * zstride + p.Y * ystride + p.X];
+	return getNodeAt(p.Z * zstride + p.Y * ystride + p.X);
+}
+
+bool MapBlock::packIfUnwritten()
+{
+	if (data == NULL)
+		return isPacked();
+
+	if (m_written) {
+		m_written = false;
+		m_pack_failed = false;
+		return false;
+	}
+
+	if (m_pack_failed || !m_packed.pack(data, nodecount)) {
+		m_pack_failed = true;
+		return false;
+	}
+
+	delete[] data;
+	data = NULL;
+	return true;
+}
+
+void MapBlock::unpack()
+{
+	data = new MapNode[nodecount];
+	m_packed.unpack(data, nodecount);
+	m_packed.clear();
+}
+
+size_t MapBlock::getNodeDataMemoryUsage() const
+{
+	if (data)
+		return nodecount * sizeof(MapNode);
+	return m_packed.getMemoryUsage();
 }
 
 std::string MapBlock::getModifiedReasonString()
@@ -352,13 +509,60 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 }
 
 
+bool MapBlock::mayContainAny(const std::set<content_t> &contents) const
+{
+	if (m_contents_overflow)
+		return true;
+
+	for (std::vector<content_t>::const_iterator it = m_contents.begin();
+			it != m_contents.end(); ++it) {
+		if (contents.find(*it) != contents.end())
+			return true;
+	}
+	return false;
+}
+
+void MapBlock::updateContentSummary()
+{
+	m_contents.clear();
+	m_contents_overflow = false;
+	if (isDummy())
+		return;
+
+	if (data == NULL) {
+		const std::vector<MapNode> &palette = m_packed.getPalette();
+		for (size_t i = 0; i < palette.size() && !m_contents_overflow; i++)
+			addToContentSummary(palette[i].getContent());
+		return;
+	}
+
+	// Nodes come in runs, only look up content changes
+	content_t last = data[0].getContent();
+	addToContentSummary(last);
+	for (u32 i = 1; i < nodecount && !m_contents_overflow; i++) {
+		content_t c = data[i].getContent();
+		if (c != last) {
+			addToContentSummary(c);
+			last = c;
+		}
+	}
+}
+
 void MapBlock::copyTo(VoxelManipulator &dst)
 {
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
 	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
+	if (data) {
+		dst.copyFrom(data, data_area, v3s16(0,0,0),
+				getPosRelative(), data_size);
+		return;
+	}
+
+	MapNode nodes[nodecount];
+	m_packed.unpack(nodes, nodecount);
+	dst.copyFrom(nodes, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
 }
 
@@ -368,8 +572,11 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
 	// Copy from VoxelManipulator to data
+	expand();
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	updateContentSummary();
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
@@ -379,18 +586,26 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
-	if (data == NULL) {
+	if (isDummy()) {
 		m_day_night_differs = false;
 		return;
 	}
 
-	bool differs;
+	// Of packed blocks, only the palette needs to be checked
+	const MapNode *nodes = data;
+	u32 count = nodecount;
+	if (data == NULL) {
+		nodes = &m_packed.getPalette()[0];
+		count = m_packed.getPalette().size();
+	}
+
+	bool differs = false;
 
 	/*
 		Check if any lighting value differs
 	*/
-	for (u32 i = 0; i < nodecount; i++) {
-		MapNode &n = data[i];
+	for (u32 i = 0; i < count; i++) {
+		const MapNode &n = nodes[i];
 
 		differs = !n.isLightDayNightEq(nodemgr);
 		if (differs)
@@ -403,8 +618,8 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	*/
 	if (differs) {
 		bool only_air = true;
-		for (u32 i = 0; i < nodecount; i++) {
-			MapNode &n = data[i];
+		for (u32 i = 0; i < count; i++) {
+			const MapNode &n = nodes[i];
 			if (n.getContent() != CONTENT_AIR) {
 				only_air = false;
 				break;
@@ -422,7 +637,7 @@ void MapBlock::expireDayNightDiff()
 {
 	//INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -440,7 +655,10 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			bool is_valid_position;
+			MapNode n = getNode(p2d.X, y, p2d.Y, &is_valid_position);
+			if (!is_valid_position)
+				return -3;
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -554,95 +772,187 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	}
 }
 
-void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+/*
+	Writes everything but the disk-only data, the part of the format
+	both MapBlock::serialize and MapBlockSnapshot::serialize write
+*/
+static void serialize_block_data(std::ostream &os, u8 version, u8 flags,
+		const MapNode *nodes, const std::string &metadata, u8 codec, int level)
 {
-	if(!ser_ver_supported(version))
-		throw VersionMismatchException("ERROR: MapBlock format not supported");
+	writeU8(os, flags);
 
-	if(data == NULL)
-	{
-		throw SerializationError("ERROR: Not writing dummy block.");
+	bool use_codec = version >= SER_FMT_VER_BLOCK_CODEC;
+	if (use_codec) {
+		if (!block_codec_supported(codec))
+			throw SerializationError("MapBlock::serialize(): unsupported codec");
+		writeU8(os, codec);
 	}
 
-	FATAL_ERROR_IF(version < SER_FMT_VER_LOWEST_WRITE, "Serialisation version error");
-
-	// First byte
-	u8 flags = 0;
-	if(is_underground)
-		flags |= 0x01;
-	if(getDayNightDiff())
-		flags |= 0x02;
-	if(m_lighting_expired)
-		flags |= 0x04;
-	if(m_generated == false)
-		flags |= 0x08;
-	writeU8(os, flags);
-
 	/*
 		Bulk node data
 	*/
-	NameIdMapping nimap;
-	if(disk)
-	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
-		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
-
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+
+	if (use_codec) {
+		// Serialized uncompressed, then compressed with the codec
+		std::ostringstream oss(std::ios_base::binary);
+		MapNode::serializeBulk(oss, version, nodes, MapBlock::nodecount,
+				content_width, params_width, false);
+		compressBlockCodec(oss.str(), os, codec, level);
+	} else {
+		MapNode::serializeBulk(os, version, nodes, MapBlock::nodecount,
 				content_width, params_width, true);
-		delete[] tmp_nodes;
 	}
+
+	/*
+		Node metadata
+	*/
+	if (use_codec)
+		compressBlockCodec(metadata, os, codec, level);
 	else
-	{
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
+		compressZlib(metadata, os);
+}
+
+void MapBlock::serialize(std::ostream &os, u8 version, bool disk,
+		u8 codec, int level)
+{
+	u8 flags = getSerializationFlags(version);
+
+	/*
+		Bulk node data, copied only if the ids are changed or it's packed
+	*/
+	NameIdMapping nimap;
+	const MapNode *nodes = data;
+	std::vector<MapNode> copy;
+	if (disk || data == NULL) {
+		if (data) {
+			copy.assign(data, data + nodecount);
+		} else {
+			copy.resize(nodecount);
+			m_packed.unpack(&copy[0], nodecount);
+		}
+		if (disk)
+			getBlockNodeIdMapping(&nimap, &copy[0], m_gamedef->ndef());
+		nodes = &copy[0];
+	}
+
+	std::ostringstream oss(std::ios_base::binary);
+	m_node_metadata.serialize(oss);
+
+	serialize_block_data(os, version, flags, nodes, oss.str(), codec, level);
+
+	/*
+		Data that goes to disk, but not the network
+	*/
+	if (disk)
+		serializeDiskData(os, version, nimap);
+}
+
+void MapBlock::takeSnapshot(MapBlockSnapshot &snapshot, u8 version, bool disk)
+{
+	snapshot.pos = m_pos;
+	snapshot.version = version;
+	snapshot.disk = disk;
+	snapshot.flags = getSerializationFlags(version);
+
+	/*
+		Bulk node data
+	*/
+	NameIdMapping nimap;
+	if (data) {
+		snapshot.nodes.assign(data, data + nodecount);
+	} else {
+		snapshot.nodes.resize(nodecount);
+		m_packed.unpack(&snapshot.nodes[0], nodecount);
 	}
+	if(disk)
+		getBlockNodeIdMapping(&nimap, &snapshot.nodes[0], m_gamedef->ndef());
 
 	/*
 		Node metadata
 	*/
 	std::ostringstream oss(std::ios_base::binary);
 	m_node_metadata.serialize(oss);
-	compressZlib(oss.str(), os);
+	snapshot.metadata = oss.str();
 
 	/*
 		Data that goes to disk, but not the network
 	*/
+	snapshot.disk_data.clear();
 	if(disk)
 	{
-		if(version <= 24){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+		std::ostringstream os(std::ios_base::binary);
+		serializeDiskData(os, version, nimap);
+		snapshot.disk_data = os.str();
+	}
+}
 
-		// Static objects
-		m_static_objects.serialize(os);
+u8 MapBlock::getSerializationFlags(u8 version)
+{
+	if(!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
-		// Timestamp
-		writeU32(os, getTimestamp());
+	if(isDummy())
+	{
+		throw SerializationError("ERROR: Not writing dummy block.");
+	}
 
-		// Write block-specific node definition id mapping
-		nimap.serialize(os);
+	FATAL_ERROR_IF(version < SER_FMT_VER_LOWEST_WRITE, "Serialisation version error");
 
-		if(version >= 25){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+	// First byte
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(getDayNightDiff())
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(m_generated == false)
+		flags |= 0x08;
+	return flags;
+}
+
+void MapBlock::serializeDiskData(std::ostream &os, u8 version,
+		const NameIdMapping &nimap)
+{
+	if(version <= 24){
+		// Node timers
+		m_node_timers.serialize(os, version);
+	}
+
+	// Static objects
+	m_static_objects.serialize(os);
+
+	// Timestamp
+	writeU32(os, getTimestamp());
+
+	// Write block-specific node definition id mapping
+	nimap.serialize(os);
+
+	if(version >= 25){
+		// Node timers
+		m_node_timers.serialize(os, version);
 	}
 }
 
+void MapBlockSnapshot::serialize(std::ostream &os, u8 codec, int level) const
+{
+	serialize_block_data(os, version, flags, &nodes[0], metadata,
+			codec, level);
+
+	/*
+		Data that goes to disk, but not the network
+	*/
+	if (disk)
+		os.write(disk_data.c_str(), disk_data.size());
+}
+
 void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 {
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -664,9 +974,13 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 
 	m_day_night_differs_expired = false;
 
+	// All of the node data gets replaced
+	expand();
+
 	if(version <= 21)
 	{
 		deSerialize_pre22(is, version, disk);
+		updateContentSummary();
 		return;
 	}
 
@@ -676,6 +990,13 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	m_lighting_expired = (flags & 0x04) ? true : false;
 	m_generated = (flags & 0x08) ? false : true;
 
+	u8 codec = BLOCK_CODEC_ZLIB;
+	if (version >= SER_FMT_VER_BLOCK_CODEC) {
+		codec = readU8(is);
+		if (!block_codec_supported(codec))
+			throw SerializationError("MapBlock::deSerialize(): unsupported codec");
+	}
+
 	/*
 		Bulk node data
 	*/
@@ -687,8 +1008,16 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		throw SerializationError("MapBlock::deSerialize(): invalid content_width");
 	if(params_width != 2)
 		throw SerializationError("MapBlock::deSerialize(): invalid params_width");
-	MapNode::deSerializeBulk(is, version, data, nodecount,
-			content_width, params_width, true);
+	if (version >= SER_FMT_VER_BLOCK_CODEC) {
+		std::ostringstream oss(std::ios_base::binary);
+		decompressBlockCodec(is, oss, codec);
+		std::istringstream iss(oss.str(), std::ios_base::binary);
+		MapNode::deSerializeBulk(iss, version, data, nodecount,
+				content_width, params_width, false);
+	} else {
+		MapNode::deSerializeBulk(is, version, data, nodecount,
+				content_width, params_width, true);
+	}
 
 	/*
 		NodeMetadata
@@ -698,7 +1027,7 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	// Ignore errors
 	try {
 		std::ostringstream oss(std::ios_base::binary);
-		decompressZlib(is, oss);
+		decompressBlockCodec(is, oss, codec);
 		std::istringstream iss(oss.str(), std::ios_base::binary);
 		if (version >= 23)
 			m_node_metadata.deSerialize(iss, m_gamedef->idef());
@@ -753,6 +1082,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		}
 	}
 
+	updateContentSummary();
+
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Done."<<std::endl);
 }
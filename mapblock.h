@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAPBLOCK_HEADER
 
 #include <set>
+#include <vector>
+#include <algorithm>
 #include "debug.h"
 #include "irr_v3d.h"
 #include "mapnode.h"
@@ -30,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodemetadata.h"
 #include "nodetimer.h"
 #include "modifiedstate.h"
+#include "serialization.h"
 #include "util/numeric.h" // getContainerPos
 #include "settings.h"
 
@@ -38,9 +41,13 @@ class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
 class VoxelManipulator;
+class NameIdMapping;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
+// Most different contents a MapBlock keeps a content summary for
+#define CONTENT_SUMMARY_MAX 64
+
 /*// Named by looking towards z+
 enum{
 	FACE_BACK=0,
@@ -123,6 +130,92 @@ public:
 #define MOD_REASON_EXPIRE_DAYNIGHTDIFF       (1 << 18)
 #define MOD_REASON_UNKNOWN                   (1 << 19)
 
+////
+//// Packed node data
+////
+
+/*
+	Node data of a block that isn't being written to, packed to keep more
+	blocks resident: the different nodes of the block in a palette and,
+	unless there is only one, the palette index of each node in 1, 2, 4
+	or 8 bits.
+*/
+class PackedNodes
+{
+public:
+	PackedNodes():
+		m_bits(0)
+	{}
+
+	// Fails and stays empty if there are more than 256 different nodes
+	bool pack(const MapNode *nodes, u32 count);
+	void unpack(MapNode *nodes, u32 count) const;
+	void clear();
+
+	inline bool empty() const
+	{
+		return m_palette.empty();
+	}
+
+	inline MapNode get(u32 i) const
+	{
+		if (m_bits == 0)
+			return m_palette[0];
+
+		u32 bit = i * m_bits;
+		u32 index = (m_indices[bit >> 5] >> (bit & 31)) & ((1 << m_bits) - 1);
+		return m_palette[index];
+	}
+
+	inline const std::vector<MapNode> &getPalette() const
+	{
+		return m_palette;
+	}
+
+	// Bits per node in the packed indices, 0 if all nodes are the same
+	inline u8 getBits() const
+	{
+		return m_bits;
+	}
+
+	// Heap memory held, in bytes
+	size_t getMemoryUsage() const;
+
+private:
+	std::vector<MapNode> m_palette;
+	std::vector<u32> m_indices;
+	u8 m_bits;
+};
+
+////
+//// MapBlock snapshot
+////
+
+/*
+	A copy of everything MapBlock::serialize writes, taken while the block
+	may be accessed. Serializing it does not touch the block, so it can be
+	compressed and written on another thread while the block changes or
+	gets unloaded.
+*/
+struct MapBlockSnapshot
+{
+	v3s16 pos;
+	u8 version;
+	bool disk;
+	u8 flags;
+	// Copied node data, with block-local content ids when taken for disk
+	std::vector<MapNode> nodes;
+	// Serialized node metadata, not compressed yet
+	std::string metadata;
+	// Serialized node timers, static objects, timestamp and name-id
+	// mapping; only on disk
+	std::string disk_data;
+
+	// Writes the same data as MapBlock::serialize did when taking it
+	void serialize(std::ostream &os, u8 codec = BLOCK_CODEC_ZLIB,
+			int level = BLOCK_CODEC_LEVEL_DEFAULT) const;
+};
+
 ////
 //// MapBlock itself
 ////
@@ -149,6 +242,13 @@ public:
 		data = new MapNode[nodecount];
 		for (u32 i = 0; i < nodecount; i++)
 			data[i] = MapNode(CONTENT_IGNORE);
+		m_packed.clear();
+		m_written = true;
+		m_pack_failed = false;
+
+		m_contents.clear();
+		m_contents.push_back(CONTENT_IGNORE);
+		m_contents_overflow = false;
 
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_REALLOCATE);
 	}
@@ -192,9 +292,24 @@ public:
 
 	inline bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_packed.empty());
+	}
+
+	// Whether the node data is held in packed form, see PackedNodes
+	inline bool isPacked() const
+	{
+		return !m_packed.empty();
 	}
 
+	/*
+		Packs the node data if nothing was written to it since the last
+		call. Writes expand it again. Returns true if the block is packed.
+	*/
+	bool packIfUnwritten();
+
+	// Heap memory held by the node data, in bytes
+	size_t getNodeDataMemoryUsage() const;
+
 	inline void unDummify()
 	{
 		assert(isDummy()); // Pre-condition
@@ -243,7 +358,7 @@ public:
 	{
 		if (m_lighting_expired)
 			return false;
-		if (data == NULL)
+		if (isDummy())
 			return false;
 		return true;
 	}
@@ -276,7 +391,7 @@ public:
 
 	inline bool isValidPosition(s16 x, s16 y, s16 z)
 	{
-		return data != NULL
+		return !isDummy()
 			&& x >= 0 && x < MAP_BLOCKSIZE
 			&& y >= 0 && y < MAP_BLOCKSIZE
 			&& z >= 0 && z < MAP_BLOCKSIZE;
@@ -294,7 +409,7 @@ public:
 		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
 
-		return data[z * zstride + y * ystride + x];
+		return getNodeAt(z * zstride + y * ystride + x);
 	}
 
 	inline MapNode getNode(v3s16 p, bool *valid_position)
@@ -314,7 +429,9 @@ public:
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
+		expand();
 		data[z * zstride + y * ystride + x] = n;
+		addToContentSummary(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE);
 	}
 
@@ -329,11 +446,11 @@ public:
 
 	inline MapNode getNodeNoCheck(s16 x, s16 y, s16 z, bool *valid_position)
 	{
-		*valid_position = data != NULL;
-		if (!valid_position)
+		*valid_position = !isDummy();
+		if (!*valid_position)
 			return MapNode(CONTENT_IGNORE);
 
-		return data[z * zstride + y * ystride + x];
+		return getNodeAt(z * zstride + y * ystride + x);
 	}
 
 	inline MapNode getNodeNoCheck(v3s16 p, bool *valid_position)
@@ -343,10 +460,12 @@ public:
 
 	inline void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if (data == NULL)
+		if (isDummy())
 			throw InvalidPositionException();
 
+		expand();
 		data[z * zstride + y * ystride + x] = n;
+		addToContentSummary(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE_NO_CHECK);
 	}
 
@@ -395,6 +514,36 @@ public:
 		return m_day_night_differs;
 	}
 
+	////
+	//// Content summary
+	////
+
+	/*
+		Sorted list of the contents the block may contain. It's a superset
+		of the actual contents: setNode only ever adds to it, it's rebuilt
+		on deserialization and VoxelManipulator blits. Blocks with more
+		than CONTENT_SUMMARY_MAX different contents don't keep a list.
+	*/
+	inline bool hasContentSummary() const
+	{
+		return !m_contents_overflow;
+	}
+
+	inline const std::vector<content_t> &getContentSummary() const
+	{
+		return m_contents;
+	}
+
+	inline bool mayContain(content_t c) const
+	{
+		return m_contents_overflow ||
+			std::binary_search(m_contents.begin(), m_contents.end(), c);
+	}
+
+	bool mayContainAny(const std::set<content_t> &contents) const;
+
+	void updateContentSummary();
+
 	////
 	//// Miscellaneous stuff
 	////
@@ -440,20 +589,10 @@ public:
 	//// Usage timer (see m_usage_timer)
 	////
 
-	inline void resetUsageTimer()
-	{
-		m_usage_timer = 0;
-	}
+	// Also moves the block to the recently used end of the parent's list
+	void resetUsageTimer();
 
-	inline void incrementUsageTimer(float dtime)
-	{
-		m_usage_timer += dtime;
-	}
-
-	inline float getUsageTimer()
-	{
-		return m_usage_timer;
-	}
+	float getUsageTimer();
 
 	////
 	//// Reference counting (see m_refcount)
@@ -505,7 +644,12 @@ public:
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
 	// Precondition: version >= SER_FMT_VER_LOWEST_WRITE
-	void serialize(std::ostream &os, u8 version, bool disk);
+	// codec and level are only used from SER_FMT_VER_BLOCK_CODEC on
+	void serialize(std::ostream &os, u8 version, bool disk,
+			u8 codec = BLOCK_CODEC_ZLIB, int level = BLOCK_CODEC_LEVEL_DEFAULT);
+	// Takes a snapshot that writes the same as serialize() later on; the
+	// costly compression happens in MapBlockSnapshot::serialize()
+	void takeSnapshot(MapBlockSnapshot &snapshot, u8 version, bool disk);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
 	void deSerialize(std::istream &is, u8 version, bool disk);
@@ -520,15 +664,53 @@ private:
 
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
+	// Shared by serialize() and takeSnapshot()
+	u8 getSerializationFlags(u8 version);
+	void serializeDiskData(std::ostream &os, u8 version,
+			const NameIdMapping &nimap);
+
 	/*
 		Used only internally, because changes can't be tracked
 	*/
 
+	inline void addToContentSummary(content_t c)
+	{
+		if (m_contents_overflow)
+			return;
+		std::vector<content_t>::iterator it =
+			std::lower_bound(m_contents.begin(), m_contents.end(), c);
+		if (it != m_contents.end() && *it == c)
+			return;
+		if (m_contents.size() >= CONTENT_SUMMARY_MAX) {
+			m_contents_overflow = true;
+			m_contents.clear();
+			return;
+		}
+		m_contents.insert(it, c);
+	}
+
+	inline MapNode getNodeAt(u32 i) const
+	{
+		return data ? data[i] : m_packed.get(i);
+	}
+
+	// Unpacks the node data before it's written to
+	inline void expand()
+	{
+		m_written = true;
+		m_pack_failed = false;
+		if (data == NULL && !m_packed.empty())
+			unpack();
+	}
+
+	void unpack();
+
 	inline MapNode &getNodeRef(s16 x, s16 y, s16 z)
 	{
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
+		expand();
 		return data[z * zstride + y * ystride + x];
 	}
 
@@ -556,6 +738,9 @@ public:
 	static const u32 nodecount = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
 
 private:
+	// Map keeps the usage list
+	friend class Map;
+
 	/*
 		Private member variables
 	*/
@@ -576,11 +761,22 @@ private:
 	IGameDef *m_gamedef;
 
 	/*
-		If NULL, block is a dummy block.
+		If NULL and there is no packed data, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode *data;
 
+	// Node data while data is NULL, see packIfUnwritten()
+	PackedNodes m_packed;
+	// Whether the node data was written since packIfUnwritten() last ran
+	bool m_written;
+	// Whether packing failed since the last write
+	bool m_pack_failed;
+
+	// See getContentSummary()
+	std::vector<content_t> m_contents;
+	bool m_contents_overflow;
+
 	/*
 		- On the server, this is used for telling whether the
 		  block has been modified from the one on disk.
@@ -623,10 +819,14 @@ private:
 	u32 m_disk_timestamp;
 
 	/*
-		When the block is accessed, this is set to 0.
-		Map will unload the block when this reaches a timeout.
+		Usage time of the parent Map when the block was last accessed.
+		Map will unload the block when it has not been accessed for a
+		timeout, starting from the least recently used end of its list.
 	*/
-	float m_usage_timer;
+	double m_usage_timer;
+	MapBlock *m_usage_prev;
+	MapBlock *m_usage_next;
+	bool m_usage_listed;
 
 	/*
 		Reference count; currently used for determining if this block is in
@@ -40,6 +40,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "filesys.h"
 #include "log.h"
 
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
 FlagDesc flagdesc_mapgen[] = {
 	{"trees",       MG_TREES},
 	{"caves",       MG_CAVES},
@@ -440,6 +444,265 @@ void GenerateNotifier::getEvents(
 }
 
 
+////
+//// NoiseMapCache
+////
+
+bool NoiseMapCache::Key::operator==(const Key &other) const
+{
+	if (x != other.x || y != other.y || seed != other.seed ||
+			sx != other.sx || sy != other.sy ||
+			has_persist != other.has_persist ||
+			!(np == other.np))
+		return false;
+
+	return !has_persist || (persist_seed == other.persist_seed &&
+		persist_np == other.persist_np);
+}
+
+
+size_t NoiseMapCache::KeyHash::operator()(const Key &key) const
+{
+	// The spot tells most maps apart, the noise the rest
+	u32 h = (s32)key.x * 73856093 ^ (s32)key.y * 19349663;
+	h = h * 31 + key.np.seed;
+	h = h * 31 + key.seed;
+	h = h * 31 + key.np.octaves;
+	h = h * 31 + (u32)key.np.spread.X;
+	return h;
+}
+
+
+NoiseMapCache::NoiseMapCache(size_t limit) :
+	m_head(NULL),
+	m_tail(NULL),
+	m_limit(limit),
+	m_hits(0),
+	m_misses(0)
+{
+}
+
+
+NoiseMapCache::~NoiseMapCache()
+{
+	Entry *entry = m_head;
+	while (entry) {
+		Entry *next = entry->next;
+		delete[] entry->map;
+		delete entry;
+		entry = next;
+	}
+}
+
+
+void NoiseMapCache::unlink(Entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		m_head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		m_tail = entry->prev;
+}
+
+
+void NoiseMapCache::linkFront(Entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = m_head;
+	if (m_head)
+		m_head->prev = entry;
+	else
+		m_tail = entry;
+	m_head = entry;
+}
+
+
+void NoiseMapCache::perlinMap2D(Noise *noise, float x, float y, Noise *persist)
+{
+	size_t mapsize = noise->sx * noise->sy;
+
+	Key key;
+	key.np          = noise->np;
+	key.seed        = noise->seed;
+	key.sx          = noise->sx;
+	key.sy          = noise->sy;
+	key.x           = x;
+	key.y           = y;
+	key.has_persist = persist != NULL;
+	if (persist) {
+		key.persist_np   = persist->np;
+		key.persist_seed = persist->seed;
+	} else {
+		key.persist_seed = 0;
+	}
+
+	{
+		MutexAutoLock lock(m_mutex);
+
+		Entry **found = m_entries.find(key);
+		if (found) {
+			Entry *entry = *found;
+			memcpy(noise->result, entry->map, mapsize * sizeof(float));
+			unlink(entry);
+			linkFront(entry);
+			m_hits++;
+			return;
+		}
+		m_misses++;
+	}
+
+	// Other threads may look up maps meanwhile
+	noise->perlinMap2D(x, y, persist ? persist->result : NULL);
+
+	MutexAutoLock lock(m_mutex);
+
+	// Someone else might have been quicker
+	if (m_limit == 0 || m_entries.find(key))
+		return;
+
+	Entry *entry;
+	if (m_entries.size() >= m_limit) {
+		entry = m_tail;
+		unlink(entry);
+		m_entries.erase(entry->key);
+		if (entry->key.sx * entry->key.sy != mapsize) {
+			delete[] entry->map;
+			entry->map = new float[mapsize];
+		}
+	} else {
+		entry = new Entry;
+		entry->map = new float[mapsize];
+	}
+
+	entry->key = key;
+	memcpy(entry->map, noise->result, mapsize * sizeof(float));
+	linkFront(entry);
+	m_entries.set(key, entry);
+}
+
+
+u32 NoiseMapCache::getHits()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_hits;
+}
+
+
+u32 NoiseMapCache::getMisses()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_misses;
+}
+
+
+////
+//// NoiseMapBatch
+////
+
+void NoiseMapBatch::add2D(Noise *noise, float x, float y, Noise *persist)
+{
+	Item item;
+	item.noise   = noise;
+	item.persist = persist;
+	item.pos     = v3f(x, y, 0);
+	item.is_3d   = false;
+	m_items.push_back(item);
+}
+
+
+void NoiseMapBatch::add3D(Noise *noise, float x, float y, float z)
+{
+	Item item;
+	item.noise   = noise;
+	item.persist = NULL;
+	item.pos     = v3f(x, y, z);
+	item.is_3d   = true;
+	m_items.push_back(item);
+}
+
+
+void NoiseMapBatch::compute(WorkerPool *workers)
+{
+	workers->run(this, m_items.size());
+	m_items.clear();
+}
+
+
+void NoiseMapBatch::run(u32 index)
+{
+	Item &item = m_items[index];
+
+	if (item.is_3d)
+		item.noise->perlinMap3D(item.pos.X, item.pos.Y, item.pos.Z);
+	else
+		m_cache->perlinMap2D(item.noise, item.pos.X, item.pos.Y, item.persist);
+}
+
+
+////
+//// ContentFilter
+////
+
+ContentFilter::ContentFilter() :
+	m_bits((1 << (sizeof(content_t) * 8)) / 32, 0)
+{
+}
+
+
+void ContentFilter::set(const std::vector<content_t> &ids)
+{
+	m_bits.assign(m_bits.size(), 0);
+	m_ids.clear();
+
+	for (size_t i = 0; i != ids.size(); i++) {
+		if (contains(ids[i]))
+			continue;
+		m_bits[ids[i] >> 5] |= 1U << (ids[i] & 31);
+		m_ids.push_back(ids[i]);
+	}
+}
+
+
+u32 ContentFilter::find(const MapNode *nodes, u32 begin, u32 end) const
+{
+	u32 i = begin;
+
+#ifdef __SSE2__
+	// Compare the param0 of 4 nodes against each id at once
+	STATIC_ASSERT(sizeof(MapNode) == 4, mapnode_is_4_bytes);
+	if (!m_ids.empty() && m_ids.size() <= 4) {
+		const __m128i mask = _mm_set1_epi32(0xFFFF);
+
+		for (; i + 4 <= end; i += 4) {
+			__m128i c = _mm_and_si128(
+				_mm_loadu_si128((const __m128i *)&nodes[i]), mask);
+			__m128i eq = _mm_setzero_si128();
+			for (size_t j = 0; j != m_ids.size(); j++)
+				eq = _mm_or_si128(eq, _mm_cmpeq_epi32(c, _mm_set1_epi32(m_ids[j])));
+
+			int bits = _mm_movemask_ps(_mm_castsi128_ps(eq));
+			if (bits) {
+				for (; !(bits & 1); bits >>= 1)
+					i++;
+				return i;
+			}
+		}
+	}
+#endif
+
+	for (; i != end; i++) {
+		if (contains(nodes[i].getContent()))
+			return i;
+	}
+
+	return end;
+}
+
+
 ////
 //// MapgenParams
 ////
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapnode.h"
 #include "util/string.h"
 #include "util/container.h"
+#include "util/thread.h"
 
 #define DEFAULT_MAPGEN "v6"
 
@@ -102,6 +103,116 @@ private:
 	std::list<GenNotifyEvent> m_notify_events;
 };
 
+/*
+	Recent 2D noise maps, shared by the mapgens of all emerge threads.
+	Mapchunks stacked in a column need the same 2D maps, so these are only
+	computed once per column while the column is being generated.
+*/
+class NoiseMapCache {
+public:
+	NoiseMapCache(size_t limit);
+	~NoiseMapCache();
+
+	// Fills noise->result like Noise::perlinMap2D(). A persistence map is
+	// passed as the noise it is the result of, computed at the same spot.
+	void perlinMap2D(Noise *noise, float x, float y, Noise *persist=NULL);
+
+	u32 getHits();
+	u32 getMisses();
+
+private:
+	struct Key {
+		NoiseParams np;
+		s32 seed;
+		u32 sx;
+		u32 sy;
+		float x;
+		float y;
+		bool has_persist;
+		NoiseParams persist_np;
+		s32 persist_seed;
+
+		bool operator==(const Key &other) const;
+	};
+
+	struct KeyHash {
+		size_t operator()(const Key &key) const;
+	};
+
+	// Maps in order of use, most recent first
+	struct Entry {
+		Key key;
+		float *map;
+		Entry *prev;
+		Entry *next;
+	};
+
+	Mutex m_mutex;
+	FlatHashMap<Key, Entry *, KeyHash> m_entries;
+	Entry *m_head;
+	Entry *m_tail;
+	size_t m_limit;
+	u32 m_hits;
+	u32 m_misses;
+
+	void unlink(Entry *entry);
+	void linkFront(Entry *entry);
+
+	DISABLE_CLASS_COPY(NoiseMapCache);
+};
+
+/*
+	Independent noise maps of one mapchunk, computed at the same time on the
+	mapgen workers. A map that another one depends on, like a persistence
+	map, has to be computed before the batch holding its user.
+*/
+class NoiseMapBatch : public WorkerPool::Job {
+public:
+	NoiseMapBatch(NoiseMapCache *cache) : m_cache(cache) {}
+
+	// 2D maps go through the cache
+	void add2D(Noise *noise, float x, float y, Noise *persist=NULL);
+	void add3D(Noise *noise, float x, float y, float z);
+
+	void compute(WorkerPool *workers);
+	void run(u32 index);
+
+private:
+	struct Item {
+		Noise *noise;
+		Noise *persist;
+		v3f pos;
+		bool is_3d;
+	};
+
+	NoiseMapCache *m_cache;
+	std::vector<Item> m_items;
+};
+
+/*
+	A set of content ids that nodes of a VoxelManip are tested against,
+	e.g. the nodes an ore may replace. Lookups go through a bitmap, and
+	rows of nodes are scanned a few at a time for small sets.
+*/
+class ContentFilter {
+public:
+	ContentFilter();
+
+	void set(const std::vector<content_t> &ids);
+
+	bool contains(content_t c) const
+	{
+		return m_bits[c >> 5] & (1U << (c & 31));
+	}
+
+	// Index of the first node in [begin, end) that is in the set, or end
+	u32 find(const MapNode *nodes, u32 begin, u32 end) const;
+
+private:
+	std::vector<u32> m_bits;
+	std::vector<content_t> m_ids;
+};
+
 struct MapgenSpecificParams {
 	virtual void readParams(const Settings *settings) = 0;
 	virtual void writeParams(Settings *settings) const = 0;
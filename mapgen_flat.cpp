@@ -336,17 +336,21 @@ void MapgenFlat::calculateNoise()
 	s16 x = node_min.X;
 	s16 z = node_min.Z;
 
+	NoiseMapBatch batch(m_emerge->noise_cache);
+
 	if ((spflags & MGFLAT_LAKES) || (spflags & MGFLAT_HILLS))
-		noise_terrain->perlinMap2D(x, z);
+		batch.add2D(noise_terrain, x, z);
 
 	// Cave noises are calculated in generateCaves()
 	// only if solid terrain is present in mapchunk
 
-	noise_filler_depth->perlinMap2D(x, z);
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
-	noise_heat_blend->perlinMap2D(x, z);
-	noise_humidity_blend->perlinMap2D(x, z);
+	batch.add2D(noise_filler_depth, x, z);
+	batch.add2D(noise_heat, x, z);
+	batch.add2D(noise_humidity, x, z);
+	batch.add2D(noise_heat_blend, x, z);
+	batch.add2D(noise_humidity_blend, x, z);
+
+	batch.compute(m_emerge->mapgen_workers);
 
 	for (s32 i = 0; i < csize.X * csize.Z; i++) {
 		noise_heat->result[i] += noise_heat_blend->result[i];
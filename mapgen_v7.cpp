@@ -364,31 +364,37 @@ void MapgenV7::calculateNoise()
 	s16 y = node_min.Y - 1;
 	s16 z = node_min.Z;
 
-	noise_terrain_persist->perlinMap2D(x, z);
-	float *persistmap = noise_terrain_persist->result;
+	NoiseMapCache *cache = m_emerge->noise_cache;
 
-	noise_terrain_base->perlinMap2D(x, z, persistmap);
-	noise_terrain_alt->perlinMap2D(x, z, persistmap);
-	noise_height_select->perlinMap2D(x, z);
+	// The terrain maps depend on it, everything else is independent
+	cache->perlinMap2D(noise_terrain_persist, x, z);
+
+	NoiseMapBatch batch(cache);
+
+	batch.add2D(noise_terrain_base, x, z, noise_terrain_persist);
+	batch.add2D(noise_terrain_alt, x, z, noise_terrain_persist);
+	batch.add2D(noise_height_select, x, z);
 
 	if (spflags & MGV7_MOUNTAINS) {
-		noise_mountain->perlinMap3D(x, y, z);
-		noise_mount_height->perlinMap2D(x, z);
+		batch.add3D(noise_mountain, x, y, z);
+		batch.add2D(noise_mount_height, x, z);
 	}
 
 	if ((spflags & MGV7_RIDGES) && node_max.Y >= water_level) {
-		noise_ridge->perlinMap3D(x, y, z);
-		noise_ridge_uwater->perlinMap2D(x, z);
+		batch.add3D(noise_ridge, x, y, z);
+		batch.add2D(noise_ridge_uwater, x, z);
 	}
 
 	// Cave noises are calculated in generateCaves()
 	// only if solid terrain is present in mapchunk
 
-	noise_filler_depth->perlinMap2D(x, z);
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
-	noise_heat_blend->perlinMap2D(x, z);
-	noise_humidity_blend->perlinMap2D(x, z);
+	batch.add2D(noise_filler_depth, x, z);
+	batch.add2D(noise_heat, x, z);
+	batch.add2D(noise_humidity, x, z);
+	batch.add2D(noise_heat_blend, x, z);
+	batch.add2D(noise_humidity_blend, x, z);
+
+	batch.compute(m_emerge->mapgen_workers);
 
 	for (s32 i = 0; i < csize.X * csize.Z; i++) {
 		noise_heat->result[i] += noise_heat_blend->result[i];
@@ -466,18 +472,51 @@ bool MapgenV7::getMountainTerrainFromMap(int idx_xyz, int idx_xz, s16 y)
 }
 
 
+// Slices along Z don't share any nodes or heightmap entries
+class MapgenV7TerrainJob : public WorkerPool::Job {
+public:
+	MapgenV7TerrainJob(MapgenV7 *mg, int *slice_max_y) :
+		m_mg(mg),
+		m_slice_max_y(slice_max_y)
+	{
+	}
+
+	void run(u32 index)
+	{
+		m_slice_max_y[index] = m_mg->generateTerrainSlice(m_mg->node_min.Z + index);
+	}
+
+private:
+	MapgenV7 *m_mg;
+	int *m_slice_max_y;
+};
+
+
 int MapgenV7::generateTerrain()
+{
+	std::vector<int> slice_max_y(csize.Z);
+	MapgenV7TerrainJob job(this, &slice_max_y[0]);
+	m_emerge->mapgen_workers->run(&job, csize.Z);
+
+	int stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
+	for (s16 i = 0; i < csize.Z; i++)
+		stone_surface_max_y = MYMAX(stone_surface_max_y, slice_max_y[i]);
+
+	return stone_surface_max_y;
+}
+
+
+int MapgenV7::generateTerrainSlice(s16 z)
 {
 	MapNode n_air(CONTENT_AIR);
 	MapNode n_stone(c_stone);
 	MapNode n_water(c_water_source);
 
 	v3s16 em = vm->m_area.getExtent();
-	s16 stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
-	u32 index2d = 0;
+	int stone_surface_max_y = -MAX_MAP_GENERATION_LIMIT;
+	u32 index2d = (z - node_min.Z) * csize.X;
 	bool mountain_flag = spflags & MGV7_MOUNTAINS;
 
-	for (s16 z = node_min.Z; z <= node_max.Z; z++)
 	for (s16 x = node_min.X; x <= node_max.X; x++, index2d++) {
 		s16 surface_y = baseTerrainLevelFromMap(index2d);
 		heightmap[index2d]       = surface_y;  // Create base terrain heightmap
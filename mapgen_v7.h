@@ -117,6 +117,7 @@ public:
 	void calculateNoise();
 
 	int generateTerrain();
+	int generateTerrainSlice(s16 z);
 	void generateRidgeTerrain();
 
 	MgStoneType generateBiomes(float *heat_map, float *humidity_map);
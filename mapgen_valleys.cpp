@@ -388,20 +388,25 @@ void MapgenValleys::calculateNoise()
 	int y = node_min.Y - 1;
 	int z = node_min.Z;
 
+	NoiseMapBatch batch(m_emerge->noise_cache);
+
 	//TimeTaker tcn("actualNoise");
 
-	noise_filler_depth->perlinMap2D(x, z);
-	noise_heat_blend->perlinMap2D(x, z);
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity_blend->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
-	noise_inter_valley_slope->perlinMap2D(x, z);
-	noise_rivers->perlinMap2D(x, z);
-	noise_terrain_height->perlinMap2D(x, z);
-	noise_valley_depth->perlinMap2D(x, z);
-	noise_valley_profile->perlinMap2D(x, z);
-
-	noise_inter_valley_fill->perlinMap3D(x, y, z);
+	// The 3D map takes longest, so it is handed out first
+	batch.add3D(noise_inter_valley_fill, x, y, z);
+
+	batch.add2D(noise_filler_depth, x, z);
+	batch.add2D(noise_heat_blend, x, z);
+	batch.add2D(noise_heat, x, z);
+	batch.add2D(noise_humidity_blend, x, z);
+	batch.add2D(noise_humidity, x, z);
+	batch.add2D(noise_inter_valley_slope, x, z);
+	batch.add2D(noise_rivers, x, z);
+	batch.add2D(noise_terrain_height, x, z);
+	batch.add2D(noise_valley_depth, x, z);
+	batch.add2D(noise_valley_profile, x, z);
+
+	batch.compute(m_emerge->mapgen_workers);
 
 	//mapgen_profiler->avg("noisemaps", tcn.stop() / 1000.f);
 
@@ -0,0 +1,231 @@
+/*
+Minetest
+Copyright (C) 2010-2015 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapwriter.h"
+
+#include <sstream>
+#include "database.h"
+#include "mapblock.h"
+#include "debug.h"
+#include "log.h"
+#include "threading/mutex_auto_lock.h"
+
+// Most writes committed in one database transaction
+#define MAP_WRITE_BATCH_MAX 64
+
+static std::string serialize_snapshot(const MapBlockSnapshot &snapshot,
+		u8 codec, int level)
+{
+	/*
+		[0] u8 serialization version
+		[1] data
+	*/
+	std::ostringstream o(std::ios_base::binary);
+	o.write((char*) &snapshot.version, 1);
+	snapshot.serialize(o, codec, level);
+	return o.str();
+}
+
+
+MapWriteThread::MapWriteThread(Database *db, u8 codec, int level,
+		u32 queue_limit) :
+	Thread("MapWrite"),
+	m_db(db),
+	m_codec(codec),
+	m_level(level),
+	m_free_slots(queue_limit)
+{
+}
+
+MapWriteThread::~MapWriteThread()
+{
+	if (isRunning()) {
+		flush();
+		stop();
+		m_queued.post();
+		wait();
+	}
+}
+
+void MapWriteThread::queueBlock(MapBlockSnapshot *snapshot)
+{
+	m_free_slots.wait();
+
+	Write *write = new Write;
+	write->pos = snapshot->pos;
+	write->snapshot = snapshot;
+	write->flushed = NULL;
+	push(write);
+}
+
+void MapWriteThread::queueDelete(v3s16 pos)
+{
+	m_free_slots.wait();
+
+	Write *write = new Write;
+	write->pos = pos;
+	write->snapshot = NULL;
+	write->flushed = NULL;
+	push(write);
+}
+
+void MapWriteThread::push(Write *write)
+{
+	MutexAutoLock lock(m_queue_mutex);
+	m_queue.push_back(write);
+	if (!write->flushed)
+		m_latest[write->pos] = write;
+	m_queued.post();
+}
+
+bool MapWriteThread::getPendingBlock(v3s16 pos, std::string *blob)
+{
+	// The writer frees the snapshot once it's committed, so it's copied
+	// under the lock and compressed after releasing it
+	MapBlockSnapshot snapshot;
+	{
+		MutexAutoLock lock(m_queue_mutex);
+
+		std::map<v3s16, Write*>::iterator it = m_latest.find(pos);
+		if (it == m_latest.end())
+			return false;
+
+		if (!it->second->snapshot) {
+			blob->clear();
+			return true;
+		}
+		snapshot = *it->second->snapshot;
+	}
+
+	*blob = serialize_snapshot(snapshot, m_codec, m_level);
+	return true;
+}
+
+void MapWriteThread::flush()
+{
+	if (!isRunning())
+		return;
+
+	Semaphore flushed;
+	Write *write = new Write;
+	write->snapshot = NULL;
+	write->flushed = &flushed;
+	push(write);
+	flushed.wait();
+}
+
+void *MapWriteThread::run()
+{
+	DSTACK(FUNCTION_NAME);
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	std::vector<Write*> batch;
+
+	while (true) {
+		m_queued.wait();
+
+		{
+			MutexAutoLock lock(m_queue_mutex);
+			if (m_queue.empty() && stopRequested())
+				break;
+		}
+
+		// Commit whatever else is queued by now in the same transaction
+		u32 count = 1;
+		while (count < MAP_WRITE_BATCH_MAX && m_queued.wait(0))
+			count++;
+
+		{
+			MutexAutoLock lock(m_queue_mutex);
+			for (u32 i = 0; i < count; i++) {
+				batch.push_back(m_queue.front());
+				m_queue.pop_front();
+			}
+		}
+
+		writeBatch(batch);
+		batch.clear();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER
+	return NULL;
+}
+
+void MapWriteThread::writeBatch(std::vector<Write*> &batch)
+{
+	// Compression happens outside of all locks
+	std::vector<std::string> blobs(batch.size());
+	for (size_t i = 0; i < batch.size(); i++) {
+		if (batch[i]->snapshot)
+			blobs[i] = serialize_snapshot(*batch[i]->snapshot,
+				m_codec, m_level);
+	}
+
+	{
+		MutexAutoLock lock(m_db_mutex);
+		m_db->beginSave();
+		// Runs of saves go to the database at once, deletions keep
+		// their place in between
+		std::vector<v3s16> positions;
+		std::vector<std::string> data;
+		for (size_t i = 0; i <= batch.size(); i++) {
+			Write *write = i < batch.size() ? batch[i] : NULL;
+			if (write && write->flushed)
+				continue;
+			if (write && write->snapshot) {
+				positions.push_back(write->pos);
+				data.push_back("");
+				data.back().swap(blobs[i]);
+				continue;
+			}
+			if (!positions.empty() && !m_db->saveBlocks(positions, data))
+				errorstream << "MapWriteThread: Failed to write some of "
+					<< positions.size() << " blocks" << std::endl;
+			positions.clear();
+			data.clear();
+			if (write)
+				m_db->deleteBlock(write->pos);
+		}
+		m_db->endSave();
+	}
+
+	// Committed, reads can go to the database again
+	{
+		MutexAutoLock lock(m_queue_mutex);
+		for (size_t i = 0; i < batch.size(); i++) {
+			Write *write = batch[i];
+			if (write->flushed)
+				continue;
+			std::map<v3s16, Write*>::iterator it = m_latest.find(write->pos);
+			if (it != m_latest.end() && it->second == write)
+				m_latest.erase(it);
+		}
+	}
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		Write *write = batch[i];
+		if (write->flushed) {
+			write->flushed->post();
+		} else {
+			delete write->snapshot;
+			m_free_slots.post();
+		}
+		delete write;
+	}
+}
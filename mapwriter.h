@@ -0,0 +1,96 @@
+/*
+Minetest
+Copyright (C) 2010-2015 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPWRITER_HEADER
+#define MAPWRITER_HEADER
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include "irr_v3d.h"
+#include "threading/thread.h"
+#include "threading/mutex.h"
+#include "threading/semaphore.h"
+
+class Database;
+struct MapBlockSnapshot;
+
+/*
+	Compresses block snapshots and writes them to a Database on its own
+	thread, so saving does not hold the environment lock.
+
+	The database is shared with the map: everyone else has to hold
+	getDatabaseMutex() while using it. Writes that are queued but not
+	committed yet are returned by getPendingBlock(), so reading a block
+	back never sees older data than was queued.
+*/
+class MapWriteThread : public Thread
+{
+public:
+	// At most queue_limit blocks are queued, queueBlock() waits for the
+	// writer beyond that
+	MapWriteThread(Database *db, u8 codec, int level, u32 queue_limit);
+	// Writes everything still queued
+	~MapWriteThread();
+
+	// Takes ownership of snapshot, which must be taken for disk
+	void queueBlock(MapBlockSnapshot *snapshot);
+	void queueDelete(v3s16 pos);
+
+	// Returns true if a write of pos is pending; blob is what will be
+	// written, or empty if the block is going to be deleted
+	bool getPendingBlock(v3s16 pos, std::string *blob);
+
+	// Returns when everything queued before has been committed
+	void flush();
+
+	Mutex &getDatabaseMutex() { return m_db_mutex; }
+
+	void *run();
+
+private:
+	struct Write
+	{
+		v3s16 pos;
+		// NULL deletes the block
+		MapBlockSnapshot *snapshot;
+		// Set on flush() markers
+		Semaphore *flushed;
+	};
+
+	void push(Write *write);
+	void writeBatch(std::vector<Write*> &batch);
+
+	Database *m_db;
+	Mutex m_db_mutex;
+	u8 m_codec;
+	int m_level;
+
+	Mutex m_queue_mutex;
+	std::deque<Write*> m_queue;
+	// Latest write of each position, queued or in progress
+	std::map<v3s16, Write*> m_latest;
+	// Posted once per queued write
+	Semaphore m_queued;
+	// Free queue slots
+	Semaphore m_free_slots;
+};
+
+#endif
@@ -76,9 +76,40 @@ BiomeManager::~BiomeManager()
 void BiomeManager::calcBiomes(s16 sx, s16 sy, float *heat_map,
 	float *humidity_map, s16 *height_map, u8 *biomeid_map)
 {
-	for (s32 i = 0; i != sx * sy; i++) {
-		Biome *biome = getBiome(heat_map[i], humidity_map[i], height_map[i]);
-		biomeid_map[i] = biome->index;
+	s32 size = sx * sy;
+	std::vector<float> dist_min(size, FLT_MAX);
+
+	// Same result as getBiome() for every column, but with the biomes in
+	// the outer loop the inner one is a branch-free pass over the maps
+	u8 biome_default = ((Biome *)m_objects[0])->index;
+	for (s32 i = 0; i != size; i++)
+		biomeid_map[i] = biome_default;
+
+	for (size_t j = 1; j < m_objects.size(); j++) {
+		Biome *b = (Biome *)m_objects[j];
+		if (!b)
+			continue;
+
+		const float heat_point     = b->heat_point;
+		const float humidity_point = b->humidity_point;
+		const s16 y_min = b->y_min;
+		const s16 y_max = b->y_max;
+		const u8 id = b->index;
+
+		// Loads first and no short-circuiting, so that this vectorizes
+		for (s32 i = 0; i != size; i++) {
+			float d_heat     = heat_map[i]     - heat_point;
+			float d_humidity = humidity_map[i] - humidity_point;
+			float dist = (d_heat * d_heat) +
+						 (d_humidity * d_humidity);
+			float dist_prev = dist_min[i];
+			u8 id_prev = biomeid_map[i];
+			s16 y = height_map[i];
+
+			bool closer = (dist < dist_prev) & (y >= y_min) & (y <= y_max);
+			dist_min[i]    = closer ? dist : dist_prev;
+			biomeid_map[i] = closer ? id : id_prev;
+		}
 	}
 }
 
@@ -48,13 +48,14 @@ size_t DecorationManager::placeAllDecos(Mapgen *mg, u32 blockseed,
 	v3s16 nmin, v3s16 nmax)
 {
 	size_t nplaced = 0;
+	DecorationSurface surface(mg, nmin, nmax);
 
 	for (size_t i = 0; i != m_objects.size(); i++) {
 		Decoration *deco = (Decoration *)m_objects[i];
 		if (!deco)
 			continue;
 
-		nplaced += deco->placeDeco(mg, blockseed, nmin, nmax);
+		nplaced += deco->placeDeco(&surface, blockseed);
 		blockseed++;
 	}
 
@@ -65,6 +66,76 @@ size_t DecorationManager::placeAllDecos(Mapgen *mg, u32 blockseed,
 ///////////////////////////////////////////////////////////////////////////////
 
 
+DecorationSurface::DecorationSurface(Mapgen *mg, v3s16 nmin, v3s16 nmax)
+{
+	this->mg      = mg;
+	this->nmin    = nmin;
+	this->nmax    = nmax;
+	this->csize_x = nmax.X - nmin.X + 1;
+}
+
+
+void DecorationSurface::findGroundLevels()
+{
+	// Mapgens without a heightmap get one here, once a decoration is about
+	// to change the surface or needs the ground level
+	if (mg->heightmap || !m_ground_level.empty())
+		return;
+
+	m_ground_level.resize(csize_x * (nmax.Z - nmin.Z + 1));
+
+	u32 i = 0;
+	for (s16 z = nmin.Z; z <= nmax.Z; z++)
+	for (s16 x = nmin.X; x <= nmax.X; x++, i++)
+		m_ground_level[i] = mg->findGroundLevel(v2s16(x, z), nmin.Y, nmax.Y);
+}
+
+
+s16 DecorationSurface::getGroundLevel(s16 x, s16 z)
+{
+	u32 i = index(x, z);
+	if (mg->heightmap)
+		return mg->heightmap[i];
+
+	findGroundLevels();
+	return m_ground_level[i];
+}
+
+
+const float *DecorationSurface::getDivisionNoise(const NoiseParams &np,
+	int seed, s16 sidelen)
+{
+	for (std::list<DivisionNoise>::iterator it = m_division_noise.begin();
+			it != m_division_noise.end(); ++it) {
+		if (it->np == np && it->seed == seed && it->sidelen == sidelen)
+			return &it->values[0];
+	}
+
+	s16 divlen = csize_x / sidelen;
+
+	m_division_noise.push_back(DivisionNoise());
+	DivisionNoise &dn = m_division_noise.back();
+	dn.np      = np;
+	dn.seed    = seed;
+	dn.sidelen = sidelen;
+	dn.values.resize(divlen * divlen);
+
+	u32 i = 0;
+	for (s16 z0 = 0; z0 < divlen; z0++)
+	for (s16 x0 = 0; x0 < divlen; x0++, i++) {
+		dn.values[i] = NoisePerlin2D(&np,
+			nmin.X + sidelen / 2 + sidelen * x0,
+			nmin.Z + sidelen / 2 + sidelen * z0,
+			seed);
+	}
+
+	return &dn.values[0];
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+
+
 Decoration::Decoration()
 {
 	mapseed    = 0;
@@ -82,11 +153,17 @@ Decoration::~Decoration()
 void Decoration::resolveNodeNames()
 {
 	getIdsFromNrBacklog(&c_place_on);
+
+	place_on.set(c_place_on);
 }
 
 
-size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
+size_t Decoration::placeDeco(DecorationSurface *surface, u32 blockseed)
 {
+	Mapgen *mg = surface->mg;
+	v3s16 nmin = surface->nmin;
+	v3s16 nmax = surface->nmax;
+
 	PcgRandom ps(blockseed + 53);
 	int carea_size = nmax.X - nmin.X + 1;
 
@@ -98,12 +175,20 @@ size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 	s16 divlen = carea_size / sidelen;
 	int area = sidelen * sidelen;
 
+	const float *division_noise = (flags & DECO_USE_NOISE) ?
+		surface->getDivisionNoise(np, mapseed, sidelen) : NULL;
+
+	// The biome set may be cleared after node resolution, so the
+	// lookup table is made here
+	bool in_biome[256];
+	bool check_biome = mg->biomemap && !biomes.empty();
+	if (check_biome) {
+		for (u32 i = 0; i != 256; i++)
+			in_biome[i] = biomes.count(i);
+	}
+
 	for (s16 z0 = 0; z0 < divlen; z0++)
 	for (s16 x0 = 0; x0 < divlen; x0++) {
-		v2s16 p2d_center( // Center position of part of division
-			nmin.X + sidelen / 2 + sidelen * x0,
-			nmin.Z + sidelen / 2 + sidelen * z0
-		);
 		v2s16 p2d_min( // Minimum edge of part of division
 			nmin.X + sidelen * x0,
 			nmin.Z + sidelen * z0
@@ -114,9 +199,8 @@ size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 		);
 
 		// Amount of decorations
-		float nval = (flags & DECO_USE_NOISE) ?
-			NoisePerlin2D(&np, p2d_center.X, p2d_center.Y, mapseed) :
-			fill_ratio;
+		float nval = division_noise ?
+			division_noise[divlen * z0 + x0] : fill_ratio;
 		u32 deco_count = 0;
 		float deco_count_f = (float)area * nval;
 		if (deco_count_f >= 1.f) {
@@ -131,15 +215,11 @@ size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 			s16 x = ps.range(p2d_min.X, p2d_max.X);
 			s16 z = ps.range(p2d_min.Y, p2d_max.Y);
 
-			int mapindex = carea_size * (z - nmin.Z) + (x - nmin.X);
+			u32 mapindex = surface->index(x, z);
 
-			s16 y = -MAX_MAP_GENERATION_LIMIT;
-			if (flags & DECO_LIQUID_SURFACE)
-				y = mg->findLiquidSurface(v2s16(x, z), nmin.Y, nmax.Y);
-			else if (mg->heightmap)
-				y = mg->heightmap[mapindex];
-			else
-				y = mg->findGroundLevel(v2s16(x, z), nmin.Y, nmax.Y);
+			s16 y = (flags & DECO_LIQUID_SURFACE) ?
+				mg->findLiquidSurface(v2s16(x, z), nmin.Y, nmax.Y) :
+				surface->getGroundLevel(x, z);
 
 			if (y < nmin.Y || y > nmax.Y ||
 				y < y_min  || y > y_max)
@@ -155,15 +235,10 @@ size_t Decoration::placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 #endif
 			}
 
-			if (mg->biomemap) {
-				std::set<u8>::iterator iter;
+			if (check_biome && !in_biome[mg->biomemap[mapindex]])
+				continue;
 
-				if (!biomes.empty()) {
-					iter = biomes.find(mg->biomemap[mapindex]);
-					if (iter == biomes.end())
-						continue;
-				}
-			}
+			surface->findGroundLevels();
 
 			v3s16 pos(x, y, z);
 			if (generate(mg->vm, &ps, pos))
@@ -237,6 +312,8 @@ void DecoSimple::resolveNodeNames()
 	Decoration::resolveNodeNames();
 	getIdsFromNrBacklog(&c_decos);
 	getIdsFromNrBacklog(&c_spawnby);
+
+	spawnby.set(c_spawnby);
 }
 
 
@@ -249,7 +326,7 @@ bool DecoSimple::canPlaceDecoration(MMVManip *vm, v3s16 p)
 	u32 vi = vm->m_area.index(p);
 
 	// Check if the decoration can be placed on this node
-	if (!CONTAINS(c_place_on, vm->m_data[vi].getContent()))
+	if (!place_on.contains(vm->m_data[vi].getContent()))
 		return false;
 
 	// Don't continue if there are no spawnby constraints
@@ -283,7 +360,7 @@ bool DecoSimple::canPlaceDecoration(MMVManip *vm, v3s16 p)
 		if (!vm->m_area.contains(index))
 			continue;
 
-		if (CONTAINS(c_spawnby, vm->m_data[index].getContent()))
+		if (spawnby.contains(vm->m_data[index].getContent()))
 			nneighs++;
 	}
 
@@ -347,7 +424,7 @@ size_t DecoSchematic::generate(MMVManip *vm, PcgRandom *pr, v3s16 p)
 
 	u32 vi = vm->m_area.index(p);
 	content_t c = vm->m_data[vi].getContent();
-	if (!CONTAINS(c_place_on, c))
+	if (!place_on.contains(c))
 		return 0;
 
 	if (flags & DECO_PLACE_CENTER_X)
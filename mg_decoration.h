@@ -21,11 +21,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MG_DECORATION_HEADER
 
 #include <set>
+#include <list>
 #include "objdef.h"
 #include "noise.h"
 #include "nodedef.h"
+#include "mapgen.h"
 
-class Mapgen;
 class MMVManip;
 class PcgRandom;
 class Schematic;
@@ -61,6 +62,49 @@ struct CutoffData {
 };
 #endif
 
+/*
+	The surface of a mapchunk as seen by its decorations.  Built once per chunk
+	by DecorationManager::placeAllDecos() and shared by every decoration, so
+	that ground levels and density noise aren't searched for per decoration.
+*/
+class DecorationSurface {
+public:
+	DecorationSurface(Mapgen *mg, v3s16 nmin, v3s16 nmax);
+
+	// Ground level of the column before any decoration was placed,
+	// or -MAX_MAP_GENERATION_LIMIT if there is none within the chunk
+	s16 getGroundLevel(s16 x, s16 z);
+
+	// Must be called before the first decoration is generated, so ground
+	// levels found afterwards don't include earlier decorations
+	void findGroundLevels();
+
+	// Density noise sampled at the center of each sidelen * sidelen division,
+	// shared between decorations with the same noise parameters
+	const float *getDivisionNoise(const NoiseParams &np, int seed, s16 sidelen);
+
+	u32 index(s16 x, s16 z) const
+	{
+		return csize_x * (z - nmin.Z) + (x - nmin.X);
+	}
+
+	Mapgen *mg;
+	v3s16 nmin;
+	v3s16 nmax;
+	s16 csize_x;
+
+private:
+	struct DivisionNoise {
+		NoiseParams np;
+		int seed;
+		s16 sidelen;
+		std::vector<float> values;
+	};
+
+	std::vector<s16> m_ground_level;
+	std::list<DivisionNoise> m_division_noise;
+};
+
 class Decoration : public ObjDef, public NodeResolver {
 public:
 	Decoration();
@@ -68,7 +112,7 @@ public:
 
 	virtual void resolveNodeNames();
 
-	size_t placeDeco(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax);
+	size_t placeDeco(DecorationSurface *surface, u32 blockseed);
 	//size_t placeCutoffs(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax);
 
 	virtual size_t generate(MMVManip *vm, PcgRandom *pr, v3s16 p) = 0;
@@ -83,6 +127,9 @@ public:
 	float fill_ratio;
 	NoiseParams np;
 
+	// Lookup table for c_place_on, built with the node ids
+	ContentFilter place_on;
+
 	std::set<u8> biomes;
 	//std::list<CutoffData> cutoffs;
 	//Mutex cutoff_mutex;
@@ -98,6 +145,7 @@ public:
 
 	std::vector<content_t> c_decos;
 	std::vector<content_t> c_spawnby;
+	ContentFilter spawnby;
 	s16 deco_height;
 	s16 deco_height_max;
 	s16 nspawnby;
@@ -75,6 +75,9 @@ Ore::Ore()
 {
 	flags = 0;
 	noise = NULL;
+
+	for (u32 i = 0; i != 256; i++)
+		in_biome[i] = true;
 }
 
 
@@ -88,6 +91,10 @@ void Ore::resolveNodeNames()
 {
 	getIdFromNrBacklog(&c_ore, "", CONTENT_AIR);
 	getIdsFromNrBacklog(&c_wherein);
+
+	wherein.set(c_wherein);
+	for (u32 i = 0; i != 256; i++)
+		in_biome[i] = biomes.empty() || biomes.count(i);
 }
 
 
@@ -120,6 +127,28 @@ size_t Ore::placeOre(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax)
 }
 
 
+void Ore::placeColumn(MMVManip *vm, s16 x, int y0, int y1, s16 z, MapNode n_ore)
+{
+	const VoxelArea &area = vm->m_area;
+	if (x < area.MinEdge.X || x > area.MaxEdge.X ||
+			z < area.MinEdge.Z || z > area.MaxEdge.Z)
+		return;
+
+	y0 = MYMAX(y0, area.MinEdge.Y);
+	y1 = MYMIN(y1, area.MaxEdge.Y);
+	if (y0 > y1)
+		return;
+
+	v3s16 em = area.getExtent();
+	u32 vi = area.index(x, y0, z);
+	for (int y = y0; y <= y1; y++) {
+		if (wherein.contains(vm->m_data[vi].getContent()))
+			vm->m_data[vi] = n_ore;
+		area.add_y(em, vi, 1);
+	}
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 
 
@@ -146,24 +175,20 @@ void OreScatter::generate(MMVManip *vm, int mapseed, u32 blockseed,
 			(NoisePerlin3D(&np, x0, y0, z0, mapseed) < nthresh))
 			continue;
 
-		if (biomemap && !biomes.empty()) {
-			u32 index = sizex * (z0 - nmin.Z) + (x0 - nmin.X);
-			std::set<u8>::iterator it = biomes.find(biomemap[index]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (biomemap && !in_biome[biomemap[sizex * (z0 - nmin.Z) + (x0 - nmin.X)]])
+			continue;
 
 		for (u32 z1 = 0; z1 != csize; z1++)
-		for (u32 y1 = 0; y1 != csize; y1++)
-		for (u32 x1 = 0; x1 != csize; x1++) {
-			if (pr.range(1, cvolume) > clust_num_ores)
-				continue;
-
-			u32 i = vm->m_area.index(x0 + x1, y0 + y1, z0 + z1);
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
-				continue;
-
-			vm->m_data[i] = n_ore;
+		for (u32 y1 = 0; y1 != csize; y1++) {
+			MapNode *row = &vm->m_data[vm->m_area.index(x0, y0 + y1, z0 + z1)];
+			for (u32 x1 = 0; x1 != csize; x1++) {
+				if (pr.range(1, cvolume) > clust_num_ores)
+					continue;
+				if (!wherein.contains(row[x1].getContent()))
+					continue;
+
+				row[x1] = n_ore;
+			}
 		}
 	}
 }
@@ -201,26 +226,15 @@ void OreSheet::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		if (noiseval < nthresh)
 			continue;
 
-		if (biomemap && !biomes.empty()) {
-			std::set<u8>::iterator it = biomes.find(biomemap[index]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (biomemap && !in_biome[biomemap[index]])
+			continue;
 
 		u16 height = pr.range(column_height_min, column_height_max);
 		int ymidpoint = y_start + noiseval;
 		int y0 = MYMAX(nmin.Y, ymidpoint - height * (1 - column_midpoint_factor));
 		int y1 = MYMIN(nmax.Y, y0 + height - 1);
 
-		for (int y = y0; y <= y1; y++) {
-			u32 i = vm->m_area.index(x, y, z);
-			if (!vm->m_area.contains(i))
-				continue;
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
-				continue;
-
-			vm->m_data[i] = n_ore;
-		}
+		placeColumn(vm, x, y0, y1, z, n_ore);
 	}
 }
 
@@ -269,11 +283,8 @@ void OrePuff::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		if (noiseval < nthresh)
 			continue;
 
-		if (biomemap && !biomes.empty()) {
-			std::set<u8>::iterator it = biomes.find(biomemap[index]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (biomemap && !in_biome[biomemap[index]])
+			continue;
 
 		if (!noise_generated) {
 			noise_generated = true;
@@ -299,15 +310,7 @@ void OrePuff::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		if ((flags & OREFLAG_PUFF_ADDITIVE) && (y0 > y1))
 			SWAP(int, y0, y1);
 
-		for (int y = y0; y <= y1; y++) {
-			u32 i = vm->m_area.index(x, y, z);
-			if (!vm->m_area.contains(i))
-				continue;
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
-				continue;
-
-			vm->m_data[i] = n_ore;
-		}
+		placeColumn(vm, x, y0, y1, z, n_ore);
 	}
 }
 
@@ -336,43 +339,42 @@ void OreBlob::generate(MMVManip *vm, int mapseed, u32 blockseed,
 		int y0 = pr.range(nmin.Y, nmax.Y - csize + 1);
 		int z0 = pr.range(nmin.Z, nmax.Z - csize + 1);
 
-		if (biomemap && !biomes.empty()) {
-			u32 bmapidx = sizex * (z0 - nmin.Z) + (x0 - nmin.X);
-			std::set<u8>::iterator it = biomes.find(biomemap[bmapidx]);
-			if (it == biomes.end())
-				continue;
-		}
+		if (biomemap && !in_biome[biomemap[sizex * (z0 - nmin.Z) + (x0 - nmin.X)]])
+			continue;
 
 		bool noise_generated = false;
 		noise->seed = blockseed + i;
 
 		size_t index = 0;
 		for (u32 z1 = 0; z1 != csize; z1++)
-		for (u32 y1 = 0; y1 != csize; y1++)
-		for (u32 x1 = 0; x1 != csize; x1++, index++) {
-			u32 i = vm->m_area.index(x0 + x1, y0 + y1, z0 + z1);
-			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
-				continue;
+		for (u32 y1 = 0; y1 != csize; y1++, index += csize) {
+			u32 vi = vm->m_area.index(x0, y0 + y1, z0 + z1);
+			u32 vend = vi + csize;
 
-			// Lazily generate noise only if there's a chance of ore being placed
-			// This simple optimization makes calls 6x faster on average
-			if (!noise_generated) {
-				noise_generated = true;
-				noise->perlinMap3D(x0, y0, z0);
-			}
+			for (u32 ni = wherein.find(vm->m_data, vi, vend); ni != vend;
+					ni = wherein.find(vm->m_data, ni + 1, vend)) {
+				u32 x1 = ni - vi;
 
-			float noiseval = noise->result[index];
+				// Lazily generate noise only if there's a chance of ore being placed
+				// This simple optimization makes calls 6x faster on average
+				if (!noise_generated) {
+					noise_generated = true;
+					noise->perlinMap3D(x0, y0, z0);
+				}
 
-			float xdist = (s32)x1 - (s32)csize / 2;
-			float ydist = (s32)y1 - (s32)csize / 2;
-			float zdist = (s32)z1 - (s32)csize / 2;
+				float noiseval = noise->result[index + x1];
 
-			noiseval -= (sqrt(xdist * xdist + ydist * ydist + zdist * zdist) / csize);
+				float xdist = (s32)x1 - (s32)csize / 2;
+				float ydist = (s32)y1 - (s32)csize / 2;
+				float zdist = (s32)z1 - (s32)csize / 2;
 
-			if (noiseval < nthresh)
-				continue;
+				noiseval -= (sqrt(xdist * xdist + ydist * ydist + zdist * zdist) / csize);
 
-			vm->m_data[i] = n_ore;
+				if (noiseval < nthresh)
+					continue;
+
+				vm->m_data[ni] = n_ore;
+			}
 		}
 	}
 }
@@ -412,35 +414,37 @@ void OreVein::generate(MMVManip *vm, int mapseed, u32 blockseed,
 
 	size_t index = 0;
 	for (int z = nmin.Z; z <= nmax.Z; z++)
-	for (int y = nmin.Y; y <= nmax.Y; y++)
-	for (int x = nmin.X; x <= nmax.X; x++, index++) {
-		u32 i = vm->m_area.index(x, y, z);
-		if (!vm->m_area.contains(i))
-			continue;
-		if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+	for (int y = nmin.Y; y <= nmax.Y; y++, index += sizex) {
+		if (!vm->m_area.contains(v3s16(nmin.X, y, z)) ||
+				!vm->m_area.contains(v3s16(nmax.X, y, z)))
 			continue;
 
-		if (biomemap && !biomes.empty()) {
-			u32 bmapidx = sizex * (z - nmin.Z) + (x - nmin.X);
-			std::set<u8>::iterator it = biomes.find(biomemap[bmapidx]);
-			if (it == biomes.end())
+		u32 vi = vm->m_area.index(nmin.X, y, z);
+		u32 vend = vi + sizex;
+		u8 *biomerow = biomemap ? &biomemap[sizex * (z - nmin.Z)] : NULL;
+
+		for (u32 ni = wherein.find(vm->m_data, vi, vend); ni != vend;
+				ni = wherein.find(vm->m_data, ni + 1, vend)) {
+			u32 x1 = ni - vi;
+
+			if (biomerow && !in_biome[biomerow[x1]])
 				continue;
-		}
 
-		// Same lazy generation optimization as in OreBlob
-		if (!noise_generated) {
-			noise_generated = true;
-			noise->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
-			noise2->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
-		}
+			// Same lazy generation optimization as in OreBlob
+			if (!noise_generated) {
+				noise_generated = true;
+				noise->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
+				noise2->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
+			}
 
-		// randval ranges from -1..1
-		float randval   = (float)pr.next() / (pr.RANDOM_RANGE / 2) - 1.f;
-		float noiseval  = contour(noise->result[index]);
-		float noiseval2 = contour(noise2->result[index]);
-		if (noiseval * noiseval2 + randval * random_factor < nthresh)
-			continue;
+			// randval ranges from -1..1
+			float randval   = (float)pr.next() / (pr.RANDOM_RANGE / 2) - 1.f;
+			float noiseval  = contour(noise->result[index + x1]);
+			float noiseval2 = contour(noise2->result[index + x1]);
+			if (noiseval * noiseval2 + randval * random_factor < nthresh)
+				continue;
 
-		vm->m_data[i] = n_ore;
+			vm->m_data[ni] = n_ore;
+		}
 	}
 }
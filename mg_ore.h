@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "objdef.h"
 #include "noise.h"
 #include "nodedef.h"
+#include "mapgen.h"
 
 class Noise;
 class Mapgen;
@@ -66,6 +67,10 @@ public:
 	Noise *noise;
 	std::set<u8> biomes;
 
+	// Lookup tables for c_wherein and biomes, built with the node ids
+	ContentFilter wherein;
+	bool in_biome[256];
+
 	Ore();
 	virtual ~Ore();
 
@@ -74,6 +79,9 @@ public:
 	size_t placeOre(Mapgen *mg, u32 blockseed, v3s16 nmin, v3s16 nmax);
 	virtual void generate(MMVManip *vm, int mapseed, u32 blockseed,
 		v3s16 nmin, v3s16 nmax, u8 *biomemap) = 0;
+
+	// Replaces the wherein nodes from y0 to y1 of a column, clipped to the vm
+	void placeColumn(MMVManip *vm, s16 x, int y0, int y1, s16 z, MapNode n_ore);
 };
 
 class OreScatter : public Ore {
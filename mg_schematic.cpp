@@ -19,6 +19,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <fstream>
 #include <typeinfo>
+#include <string.h>
 #include "mg_schematic.h"
 #include "gamedef.h"
 #include "mapgen.h"
@@ -71,6 +72,8 @@ Schematic::Schematic()
 	slice_probs = NULL;
 	flags       = 0;
 	size        = v3s16(0, 0, 0);
+
+	m_spans_compiled = false;
 }
 
 
@@ -91,6 +94,101 @@ void Schematic::resolveNodeNames()
 		content_t c_new = c_nodes[c_original];
 		schemdata[i].setContent(c_new);
 	}
+
+	compileSpans();
+}
+
+
+void Schematic::compileSpans()
+{
+	sanity_check(m_ndef != NULL);
+
+	for (int r = ROTATE_0; r <= ROTATE_270; r++) {
+		RotatedSpans &rs = m_spans[r];
+		rs.rows.clear();
+		rs.spans.clear();
+		rs.nodes.clear();
+		rs.probs.clear();
+
+		// Walks the schematic in the same order as blitToVManip() does
+		int xstride = 1;
+		int ystride = size.X;
+		int zstride = size.X * size.Y;
+
+		s16 sx = size.X;
+		s16 sy = size.Y;
+		s16 sz = size.Z;
+
+		int i_start, i_step_x, i_step_z;
+		switch (r) {
+			case ROTATE_90:
+				i_start  = sx - 1;
+				i_step_x = zstride;
+				i_step_z = -xstride;
+				SWAP(s16, sx, sz);
+				break;
+			case ROTATE_180:
+				i_start  = zstride * (sz - 1) + sx - 1;
+				i_step_x = -xstride;
+				i_step_z = -zstride;
+				break;
+			case ROTATE_270:
+				i_start  = zstride * (sz - 1);
+				i_step_x = -zstride;
+				i_step_z = xstride;
+				SWAP(s16, sx, sz);
+				break;
+			default:
+				i_start  = 0;
+				i_step_x = xstride;
+				i_step_z = zstride;
+		}
+
+		rs.size = v3s16(sx, sy, sz);
+
+		for (s16 y = 0; y != sy; y++)
+		for (s16 z = 0; z != sz; z++) {
+			rs.rows.push_back(rs.spans.size());
+
+			Span *span = NULL;
+			u32 i = z * i_step_z + y * ystride + i_start;
+			for (s16 x = 0; x != sx; x++, i += i_step_x) {
+				u8 placement_prob     = schemdata[i].param1 & MTSCHEM_PROB_MASK;
+				bool force_place_node = schemdata[i].param1 & MTSCHEM_FORCE_PLACE;
+				bool always = placement_prob == MTSCHEM_PROB_ALWAYS;
+
+				if (schemdata[i].getContent() == CONTENT_IGNORE ||
+						placement_prob == MTSCHEM_PROB_NEVER) {
+					span = NULL;
+					continue;
+				}
+
+				if (!span || span->always != always ||
+						span->force != force_place_node) {
+					Span new_span;
+					new_span.x      = x;
+					new_span.len    = 0;
+					new_span.node   = rs.nodes.size();
+					new_span.always = always;
+					new_span.force  = force_place_node;
+					rs.spans.push_back(new_span);
+					span = &rs.spans.back();
+				}
+
+				MapNode n = schemdata[i];
+				n.param1 = 0;
+				if (r != ROTATE_0)
+					n.rotateAlongYAxis(m_ndef, (Rotation)r);
+
+				rs.nodes.push_back(n);
+				rs.probs.push_back(placement_prob);
+				span->len++;
+			}
+		}
+		rs.rows.push_back(rs.spans.size());
+	}
+
+	m_spans_compiled = true;
 }
 
 
@@ -98,6 +196,11 @@ void Schematic::blitToVManip(MMVManip *vm, v3s16 p, Rotation rot, bool force_pla
 {
 	sanity_check(m_ndef != NULL);
 
+	if (m_spans_compiled && rot <= ROTATE_270) {
+		blitSpans(vm, p, rot, force_place);
+		return;
+	}
+
 	int xstride = 1;
 	int ystride = size.X;
 	int zstride = size.X * size.Y;
@@ -175,6 +278,71 @@ void Schematic::blitToVManip(MMVManip *vm, v3s16 p, Rotation rot, bool force_pla
 }
 
 
+void Schematic::blitSpans(MMVManip *vm, v3s16 p, Rotation rot, bool force_place)
+{
+	const RotatedSpans &rs = m_spans[rot];
+	const VoxelArea &area = vm->m_area;
+
+	// One draw from the shared generator instead of one per node
+	PcgRandom pr(myrand());
+
+	// Nodes of a row that are inside the vmanip
+	s32 x_min = area.MinEdge.X - p.X;
+	s32 x_max = area.MaxEdge.X - p.X;
+
+	// Skipped slices collapse, only placed ones advance y_map
+	s16 y_map = p.Y - 1;
+	for (s16 y = 0; y != rs.size.Y; y++) {
+		if ((slice_probs[y] != MTSCHEM_PROB_ALWAYS) &&
+			(slice_probs[y] <= pr.range(1, MTSCHEM_PROB_ALWAYS)))
+			continue;
+
+		y_map++;
+		if (y_map < area.MinEdge.Y || y_map > area.MaxEdge.Y)
+			continue;
+
+		for (s16 z = 0; z != rs.size.Z; z++) {
+			s16 z_map = p.Z + z;
+			if (z_map < area.MinEdge.Z || z_map > area.MaxEdge.Z)
+				continue;
+
+			u32 row = y * rs.size.Z + z;
+			for (u32 j = rs.rows[row]; j != rs.rows[row + 1]; j++) {
+				const Span &span = rs.spans[j];
+				s32 x0 = MYMAX((s32)span.x, x_min);
+				s32 x1 = MYMIN((s32)span.x + span.len - 1, x_max);
+				if (x0 > x1)
+					continue;
+
+				u32 count = x1 - x0 + 1;
+				const MapNode *src = &rs.nodes[span.node + x0 - span.x];
+				const u8 *probs    = &rs.probs[span.node + x0 - span.x];
+				MapNode *dst = &vm->m_data[area.index(p.X + x0, y_map, z_map)];
+				bool replace = force_place || span.force;
+
+				if (span.always && replace) {
+					memcpy(dst, src, count * sizeof(MapNode));
+					continue;
+				}
+
+				for (u32 k = 0; k != count; k++) {
+					if (!replace) {
+						content_t c = dst[k].getContent();
+						if (c != CONTENT_AIR && c != CONTENT_IGNORE)
+							continue;
+					}
+
+					if (!span.always && probs[k] <= pr.range(1, MTSCHEM_PROB_ALWAYS))
+						continue;
+
+					dst[k] = src[k];
+				}
+			}
+		}
+	}
+}
+
+
 bool Schematic::placeOnVManip(MMVManip *vm, v3s16 p, u32 flags,
 	Rotation rot, bool force_place)
 {
@@ -114,11 +114,38 @@ public:
 		std::vector<std::pair<v3s16, u8> > *plist,
 		std::vector<std::pair<s16, u8> > *splist);
 
+	// Prepares the placement spans of every rotation, from then on
+	// blitToVManip() uses them. Done when the node names are resolved.
+	void compileSpans();
+
 	std::vector<content_t> c_nodes;
 	u32 flags;
 	v3s16 size;
 	MapNode *schemdata;
 	u8 *slice_probs;
+
+private:
+	// A run of placeable nodes in one row of a rotated schematic
+	struct Span {
+		u16 x;
+		u16 len;
+		u32 node;    // Index of the first node in RotatedSpans::nodes
+		bool always; // Every node has MTSCHEM_PROB_ALWAYS
+		bool force;  // Every node has MTSCHEM_FORCE_PLACE
+	};
+
+	struct RotatedSpans {
+		v3s16 size;
+		std::vector<u32> rows;  // First span of row (y, z), one extra at the end
+		std::vector<Span> spans;
+		std::vector<MapNode> nodes;  // Rotated, with param1 cleared
+		std::vector<u8> probs;
+	};
+
+	RotatedSpans m_spans[ROTATE_270 + 1];
+	bool m_spans_compiled;
+
+	void blitSpans(MMVManip *vm, v3s16 p, Rotation rot, bool force_place);
 };
 
 class SchematicManager : public ObjDefManager {
@@ -72,6 +72,13 @@ static inline float CALC_DTIME(unsigned int lasttime, unsigned int curtime) {
 #define PROTOCOL_ID_PDATA_COUNTER 2
 
 #define PING_TIMEOUT 5.0
+/* capacity of the command and event queues of a connection */
+#define CONNECTION_QUEUE_SIZE 0x4000
+/* commands taken from the command queue at once */
+#define COMMAND_BATCH_SIZE 64
+
+/* send thread sleep time while packets wait for pacing budget (ms) */
+#define PACING_WAKEUP_MS 5
 int counter=1;
 int counter_kinect = 1;
 int counter_pdata = 1;
@@ -206,6 +213,67 @@ SharedBuffer<u8> makeReliablePacket(
 	return b;
 }
 
+BufferedPacket makeBundlePacket(const std::vector<BufferedPacket> &packets,
+		u32 protocol_id, u16 sender_peer_id)
+{
+	u32 packet_size = BASE_HEADER_SIZE + BUNDLE_HEADER_SIZE;
+	for (std::vector<BufferedPacket>::const_iterator i = packets.begin();
+			i != packets.end(); ++i)
+		packet_size += BUNDLE_PART_HEADER_SIZE
+				+ i->data.getSize() - BASE_HEADER_SIZE;
+
+	BufferedPacket p(packet_size);
+	p.address = packets[0].address;
+
+	writeU32(&p.data[0], protocol_id);
+	writeU16(&p.data[4], sender_peer_id);
+	writeU8(&p.data[6], 0);
+	writeU8(&p.data[BASE_HEADER_SIZE], TYPE_BUNDLE);
+
+	u32 pos = BASE_HEADER_SIZE + BUNDLE_HEADER_SIZE;
+	for (std::vector<BufferedPacket>::const_iterator i = packets.begin();
+			i != packets.end(); ++i) {
+		u16 size = i->data.getSize() - BASE_HEADER_SIZE;
+		writeU8(&p.data[pos], readChannel(*(i->data)));
+		writeU16(&p.data[pos + 1], size);
+		memcpy(&p.data[pos + BUNDLE_PART_HEADER_SIZE],
+				&(i->data[BASE_HEADER_SIZE]), size);
+		pos += BUNDLE_PART_HEADER_SIZE + size;
+	}
+
+	return p;
+}
+
+bool splitBundlePacket(SharedBuffer<u8> data, std::vector<BundlePart> &parts)
+{
+	if (data.getSize() < BUNDLE_HEADER_SIZE ||
+			readU8(&data[0]) != TYPE_BUNDLE)
+		return false;
+
+	u32 pos = BUNDLE_HEADER_SIZE;
+	while (pos < data.getSize()) {
+		if (pos + BUNDLE_PART_HEADER_SIZE > data.getSize())
+			return false;
+
+		u8 channelnum = readU8(&data[pos]);
+		u16 size = readU16(&data[pos + 1]);
+		pos += BUNDLE_PART_HEADER_SIZE;
+
+		if (channelnum >= CHANNEL_COUNT || pos + size > data.getSize())
+			return false;
+
+		/* nested bundles are not allowed */
+		if (size != 0 && readU8(&data[pos]) != TYPE_BUNDLE) {
+			BundlePart part;
+			part.channelnum = channelnum;
+			part.data = SharedBuffer<u8>(&data[pos], size);
+			parts.push_back(part);
+		}
+		pos += size;
+	}
+	return true;
+}
+
 /*
 	ReliablePacketBuffer
 */
@@ -445,10 +513,91 @@ std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout,
 	return timed_outs;
 }
 
+/*
+	IncomingSplitPacket
+*/
+
+/* largest packet we accept to reassemble, same limit as for sending */
+#define MAX_SPLIT_PACKET_SIZE (MAX_RELIABLE_WINDOW_SIZE * 512)
+
+IncomingSplitPacket::IncomingSplitPacket(u16 chunk_count_, bool reliable_) :
+	chunk_count(chunk_count_),
+	reliable(reliable_),
+	expiry_tick(0),
+	chunk_size(0),
+	last_chunk_size(0),
+	received((chunk_count_ + 31) / 32, 0),
+	chunks_received(0)
+{
+}
+
+bool IncomingSplitPacket::insert(u16 chunk_num, const u8 *chunkdata, u32 size)
+{
+	if (chunk_num >= chunk_count)
+		return false;
+
+	// If chunk already exists, ignore it.
+	// Sometimes two identical packets may arrive when there is network
+	// lag and the server re-sends stuff.
+	if (isReceived(chunk_num))
+		return true;
+
+	if (chunk_num == chunk_count - 1) {
+		if (chunk_size != 0 && size > chunk_size)
+			return false;
+		last_chunk_size = size;
+		if (chunk_size == 0)
+			pending_last = SharedBuffer<u8>(chunkdata, size);
+		else if (size > 0)
+			memcpy(&data[chunk_num * chunk_size], chunkdata, size);
+	} else {
+		if (chunk_size == 0) {
+			/* first full chunk tells us the size of the whole packet */
+			if (size == 0 || (u64)size * chunk_count > MAX_SPLIT_PACKET_SIZE ||
+					pending_last.getSize() > size)
+				return false;
+			chunk_size = size;
+			data = SharedBuffer<u8>(chunk_size * chunk_count);
+			if (pending_last.getSize() > 0) {
+				memcpy(&data[(chunk_count - 1) * chunk_size],
+						*pending_last, pending_last.getSize());
+				pending_last = SharedBuffer<u8>();
+			}
+		} else if (size != chunk_size) {
+			return false;
+		}
+		memcpy(&data[chunk_num * chunk_size], chunkdata, size);
+	}
+
+	received[chunk_num / 32] |= 1u << (chunk_num % 32);
+	chunks_received++;
+	return true;
+}
+
+SharedBuffer<u8> IncomingSplitPacket::getData()
+{
+	assert(allReceived()); // Pre-condition
+
+	/* a single chunk never got a full chunk size */
+	if (chunk_size == 0)
+		return pending_last;
+
+	SharedBuffer<u8> result = data;
+	result.truncate((chunk_count - 1) * chunk_size + last_chunk_size);
+	return result;
+}
+
 /*
 	IncomingSplitBuffer
 */
 
+IncomingSplitBuffer::IncomingSplitBuffer() :
+	m_tick(0),
+	m_tick_time(0.0),
+	m_timeout(CONNECTION_TIMEOUT)
+{
+}
+
 IncomingSplitBuffer::~IncomingSplitBuffer()
 {
 	MutexAutoLock listlock(m_map_mutex);
@@ -458,22 +607,19 @@ IncomingSplitBuffer::~IncomingSplitBuffer()
 		delete i->second;
 	}
 }
-/*
-	This will throw a GotSplitPacketException when a full
-	split packet is constructed.
-*/
-SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
+
+SharedBuffer<u8> IncomingSplitBuffer::insert(const SharedBuffer<u8> &packetdata,
+		bool reliable)
 {
 	MutexAutoLock listlock(m_map_mutex);
-	u32 headersize = BASE_HEADER_SIZE + 7;
-	if (p.data.getSize() < headersize) {
+	if (packetdata.getSize() < SPLIT_HEADER_SIZE) {
 		errorstream << "Invalid data size for split packet" << std::endl;
 		return SharedBuffer<u8>();
 	}
-	u8 type = readU8(&p.data[BASE_HEADER_SIZE+0]);
-	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
-	u16 chunk_count = readU16(&p.data[BASE_HEADER_SIZE+3]);
-	u16 chunk_num = readU16(&p.data[BASE_HEADER_SIZE+5]);
+	u8 type = readU8(&packetdata[0]);
+	u16 seqnum = readU16(&packetdata[1]);
+	u16 chunk_count = readU16(&packetdata[3]);
+	u16 chunk_num = readU16(&packetdata[5]);
 
 	if (type != TYPE_SPLIT) {
 		errorstream << "IncomingSplitBuffer::insert(): type is not split"
@@ -482,15 +628,22 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 	}
 
 	// Add if doesn't exist
-	if (m_buf.find(seqnum) == m_buf.end())
-	{
-		IncomingSplitPacket *sp = new IncomingSplitPacket();
-		sp->chunk_count = chunk_count;
-		sp->reliable = reliable;
-		m_buf[seqnum] = sp;
+	std::map<u16, IncomingSplitPacket*>::iterator it = m_buf.find(seqnum);
+	if (it == m_buf.end()) {
+		if (chunk_count == 0)
+			return SharedBuffer<u8>();
+
+		IncomingSplitPacket *sp = new IncomingSplitPacket(chunk_count,
+				reliable);
+		it = m_buf.insert(std::make_pair(seqnum, sp)).first;
+
+		if (!reliable) {
+			sp->expiry_tick = m_tick + 1 + (u32)(m_timeout / SPLIT_WHEEL_TICK);
+			m_wheel[sp->expiry_tick % SPLIT_WHEEL_SLOTS].push_back(seqnum);
+		}
 	}
 
-	IncomingSplitPacket *sp = m_buf[seqnum];
+	IncomingSplitPacket *sp = it->second;
 
 	// TODO: These errors should be thrown or something? Dunno.
 	if (chunk_count != sp->chunk_count)
@@ -502,76 +655,60 @@ SharedBuffer<u8> IncomingSplitBuffer::insert(BufferedPacket &p, bool reliable)
 				<<" != sp->reliable="<<sp->reliable
 				<<std::endl);
 
-	// If chunk already exists, ignore it.
-	// Sometimes two identical packets may arrive when there is network
-	// lag and the server re-sends stuff.
-	if (sp->chunks.find(chunk_num) != sp->chunks.end())
+	if (!sp->insert(chunk_num, &packetdata[SPLIT_HEADER_SIZE],
+			packetdata.getSize() - SPLIT_HEADER_SIZE)) {
+		LOG(derr_con<<"Connection: WARNING: chunk "<<chunk_num
+				<<" doesn't fit split packet "<<seqnum<<std::endl);
 		return SharedBuffer<u8>();
-
-	// Cut chunk data out of packet
-	u32 chunkdatasize = p.data.getSize() - headersize;
-	SharedBuffer<u8> chunkdata(chunkdatasize);
-	memcpy(*chunkdata, &(p.data[headersize]), chunkdatasize);
-
-	// Set chunk data in buffer
-	sp->chunks[chunk_num] = chunkdata;
+	}
 
 	// If not all chunks are received, return empty buffer
-	if (sp->allReceived() == false)
+	if (!sp->allReceived())
 		return SharedBuffer<u8>();
 
-	// Calculate total size
-	u32 totalsize = 0;
-	for(std::map<u16, SharedBuffer<u8> >::iterator i = sp->chunks.begin();
-		i != sp->chunks.end(); ++i)
-	{
-		totalsize += i->second.getSize();
-	}
-
-	SharedBuffer<u8> fulldata(totalsize);
-
-	// Copy chunks to data buffer
-	u32 start = 0;
-	for(u32 chunk_i=0; chunk_i<sp->chunk_count;
-			chunk_i++)
-	{
-		SharedBuffer<u8> buf = sp->chunks[chunk_i];
-		u16 chunkdatasize = buf.getSize();
-		memcpy(&fulldata[start], *buf, chunkdatasize);
-		start += chunkdatasize;;
-	}
+	SharedBuffer<u8> fulldata = sp->getData();
 
-	// Remove sp from buffer
-	m_buf.erase(seqnum);
+	// Remove sp from buffer, a stale wheel entry is skipped later
+	m_buf.erase(it);
 	delete sp;
 
 	return fulldata;
 }
+
 void IncomingSplitBuffer::removeUnreliableTimedOuts(float dtime, float timeout)
 {
-	std::list<u16> remove_queue;
-	{
-		MutexAutoLock listlock(m_map_mutex);
-		for(std::map<u16, IncomingSplitPacket*>::iterator i = m_buf.begin();
-			i != m_buf.end(); ++i)
-		{
+	MutexAutoLock listlock(m_map_mutex);
+	m_timeout = timeout;
+	m_tick_time += dtime;
+
+	while (m_tick_time >= SPLIT_WHEEL_TICK) {
+		m_tick_time -= SPLIT_WHEEL_TICK;
+		m_tick++;
+
+		std::vector<u16> slot;
+		slot.swap(m_wheel[m_tick % SPLIT_WHEEL_SLOTS]);
+
+		for (std::vector<u16>::iterator j = slot.begin();
+				j != slot.end(); ++j) {
+			std::map<u16, IncomingSplitPacket*>::iterator i = m_buf.find(*j);
+			/* completed already, or the seqnum got reused */
+			if (i == m_buf.end() || i->second->reliable)
+				continue;
+
 			IncomingSplitPacket *p = i->second;
-			// Reliable ones are not removed by timeout
-			if (p->reliable == true)
+			if (p->expiry_tick > m_tick) {
+				/* more than one wheel turn away (or reused seqnum) */
+				m_wheel[p->expiry_tick % SPLIT_WHEEL_SLOTS].push_back(*j);
 				continue;
-			p->time += dtime;
-			if (p->time >= timeout)
-				remove_queue.push_back(i->first);
+			}
+			if (p->expiry_tick < m_tick)
+				continue;
+
+			LOG(dout_con<<"NOTE: Removing timed out unreliable split packet"<<std::endl);
+			delete p;
+			m_buf.erase(i);
 		}
 	}
-	for(std::list<u16>::iterator j = remove_queue.begin();
-		j != remove_queue.end(); ++j)
-	{
-		MutexAutoLock listlock(m_map_mutex);
-		LOG(dout_con<<"NOTE: Removing timed out unreliable split packet"<<std::endl);
-		delete m_buf[*j];
-		m_buf.erase(*j);
-	}
 }
 
 /*
@@ -720,88 +857,21 @@ void Channel::UpdatePacketTooLateCounter()
 	current_packet_too_late++;
 }
 
-void Channel::UpdateTimers(float dtime,bool legacy_peer)
+void Channel::UpdateTimers(float dtime)
 {
 	bpm_counter += dtime;
 	packet_loss_counter += dtime;
 
+	/* the reliable window itself is maintained by the peer's congestion
+	 * controller, just reset the per second loss statistics here */
 	if (packet_loss_counter > 1.0)
 	{
 		packet_loss_counter -= 1.0;
 
-		unsigned int packet_loss = 11; /* use a neutral value for initialization */
-		unsigned int packets_successfull = 0;
-		//unsigned int packet_too_late = 0;
-
-		bool reasonable_amount_of_data_transmitted = false;
-
-		{
-			MutexAutoLock internal(m_internal_mutex);
-			packet_loss = current_packet_loss;
-			//packet_too_late = current_packet_too_late;
-			packets_successfull = current_packet_successfull;
-
-			if (current_bytes_transfered > (unsigned int) (window_size*512/2))
-			{
-				reasonable_amount_of_data_transmitted = true;
-			}
-			current_packet_loss = 0;
-			current_packet_too_late = 0;
-			current_packet_successfull = 0;
-		}
-
-		/* dynamic window size is only available for non legacy peers */
-		if (!legacy_peer) {
-			float successfull_to_lost_ratio = 0.0;
-			bool done = false;
-
-			if (packets_successfull > 0) {
-				successfull_to_lost_ratio = packet_loss/packets_successfull;
-			}
-			else if (packet_loss > 0)
-			{
-				window_size = MYMAX(
-						(window_size - 10),
-						MIN_RELIABLE_WINDOW_SIZE);
-				done = true;
-			}
-
-			if (!done)
-			{
-				if ((successfull_to_lost_ratio < 0.01) &&
-					(window_size < MAX_RELIABLE_WINDOW_SIZE))
-				{
-					/* don't even think about increasing if we didn't even
-					 * use major parts of our window */
-					if (reasonable_amount_of_data_transmitted)
-						window_size = MYMIN(
-								(window_size + 100),
-								MAX_RELIABLE_WINDOW_SIZE);
-				}
-				else if ((successfull_to_lost_ratio < 0.05) &&
-						(window_size < MAX_RELIABLE_WINDOW_SIZE))
-				{
-					/* don't even think about increasing if we didn't even
-					 * use major parts of our window */
-					if (reasonable_amount_of_data_transmitted)
-						window_size = MYMIN(
-								(window_size + 50),
-								MAX_RELIABLE_WINDOW_SIZE);
-				}
-				else if (successfull_to_lost_ratio > 0.15)
-				{
-					window_size = MYMAX(
-							(window_size - 100),
-							MIN_RELIABLE_WINDOW_SIZE);
-				}
-				else if (successfull_to_lost_ratio > 0.1)
-				{
-					window_size = MYMAX(
-							(window_size - 50),
-							MIN_RELIABLE_WINDOW_SIZE);
-				}
-			}
-		}
+		MutexAutoLock internal(m_internal_mutex);
+		current_packet_loss = 0;
+		current_packet_too_late = 0;
+		current_packet_successfull = 0;
 	}
 
 	if (bpm_counter > 10.0)
@@ -845,6 +915,254 @@ void Channel::UpdateTimers(float dtime,bool legacy_peer)
 	}
 }
 
+/*
+	CongestionControl
+*/
+
+/* gain used while searching for the bottleneck bandwidth, 2/ln(2) */
+#define CC_STARTUP_GAIN 2.885
+/* a round is at least this long even on very low rtt links (seconds) */
+#define CC_MIN_ROUND_TIME 0.05
+/* min rtt samples older than this are replaced by newer ones (seconds) */
+#define CC_MIN_RTT_WINDOW 10.0
+/* share of window and pacing budget reserved for realtime channels */
+#define CC_REALTIME_SHARE 0.25
+/* pacing buckets hold at most this much time worth of data (seconds) */
+#define CC_PACING_BURST_TIME 0.02
+/* ... but never less than this many bytes */
+#define CC_PACING_MIN_BURST 4096
+/* bandwidth estimate is scaled by this on heavy loss */
+#define CC_LOSS_BACKOFF 0.85
+
+static const float cc_probe_gains[8] = {
+	1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0
+};
+
+CongestionControl::CongestionControl() :
+	m_mode(CC_STARTUP),
+	m_pacing_gain(CC_STARTUP_GAIN),
+	m_window_gain(CC_STARTUP_GAIN),
+	m_probe_cycle(0),
+	m_min_rtt(-1.0),
+	m_min_rtt_age(0.0),
+	m_bw_sample_next(0),
+	m_btl_bw(0.0),
+	m_full_bw(0.0),
+	m_full_bw_rounds(0),
+	m_delivered_bytes(0),
+	m_delivered_packets(0),
+	m_sample_time(0.0),
+	m_app_limited(false),
+	m_avg_packet_size(0.0),
+	m_lost_packets(0),
+	m_realtime_budget(0.0),
+	m_bulk_budget(0.0)
+{
+	for (u8 i = 0; i < ARRLEN(m_bw_samples); i++)
+		m_bw_samples[i] = 0.0;
+}
+
+void CongestionControl::onAck(float rtt, u32 bytes)
+{
+	MutexAutoLock lock(m_mutex);
+
+	if (rtt > 0.0 && (m_min_rtt < 0.0 || rtt <= m_min_rtt ||
+			m_min_rtt_age > CC_MIN_RTT_WINDOW)) {
+		m_min_rtt = rtt;
+		m_min_rtt_age = 0.0;
+	}
+
+	m_delivered_bytes += bytes;
+	m_delivered_packets++;
+
+	if (m_avg_packet_size <= 0.0)
+		m_avg_packet_size = bytes;
+	else
+		m_avg_packet_size = m_avg_packet_size * 0.99 + bytes * 0.01;
+}
+
+void CongestionControl::onLoss(u32 count)
+{
+	MutexAutoLock lock(m_mutex);
+	m_lost_packets += count;
+}
+
+void CongestionControl::onSendQueueEmpty()
+{
+	MutexAutoLock lock(m_mutex);
+	m_app_limited = true;
+}
+
+void CongestionControl::step(float dtime)
+{
+	MutexAutoLock lock(m_mutex);
+
+	m_min_rtt_age += dtime;
+	m_sample_time += dtime;
+
+	/* take one delivery rate sample per round */
+	float round_time = MYMAX(m_min_rtt, CC_MIN_ROUND_TIME);
+	if (m_sample_time >= round_time) {
+		if (m_delivered_packets > 0) {
+			bool heavy_loss = m_lost_packets * 5 > m_delivered_packets;
+			updateBandwidth(m_delivered_bytes / m_sample_time, m_app_limited);
+
+			if (heavy_loss) {
+				for (u8 i = 0; i < ARRLEN(m_bw_samples); i++)
+					m_bw_samples[i] *= CC_LOSS_BACKOFF;
+				m_btl_bw *= CC_LOSS_BACKOFF;
+				if (m_mode == CC_STARTUP)
+					m_mode = CC_DRAIN;
+			}
+			updateGains();
+		}
+		/* rounds without acks are application limited and don't tell us
+		 * anything about the path */
+		m_delivered_bytes = 0;
+		m_delivered_packets = 0;
+		m_lost_packets = 0;
+		m_sample_time = 0.0;
+		m_app_limited = false;
+	}
+
+	/* refill pacing buckets */
+	if (m_btl_bw <= 0.0)
+		return;
+
+	float rate = m_btl_bw * m_pacing_gain;
+	float burst = MYMAX(rate * CC_PACING_BURST_TIME, CC_PACING_MIN_BURST);
+
+	m_realtime_budget += rate * CC_REALTIME_SHARE * dtime;
+	m_bulk_budget += rate * (1.0 - CC_REALTIME_SHARE) * dtime;
+
+	if (m_realtime_budget > burst) {
+		m_bulk_budget += m_realtime_budget - burst;
+		m_realtime_budget = burst;
+	}
+	if (m_bulk_budget > burst)
+		m_bulk_budget = burst;
+}
+
+void CongestionControl::updateBandwidth(float bw, bool app_limited)
+{
+	/* an application limited sample underestimates the path, it only
+	 * counts if it beats the current estimate anyway */
+	if (!app_limited || bw > m_btl_bw) {
+		m_bw_samples[m_bw_sample_next] = bw;
+		m_bw_sample_next = (m_bw_sample_next + 1) % ARRLEN(m_bw_samples);
+
+		m_btl_bw = 0.0;
+		for (u8 i = 0; i < ARRLEN(m_bw_samples); i++)
+			m_btl_bw = MYMAX(m_btl_bw, m_bw_samples[i]);
+	}
+
+	switch (m_mode) {
+	case CC_STARTUP:
+		/* bandwidth stopped growing by at least 25% for three rounds,
+		 * the pipe is full. Application limited rounds don't fill it. */
+		if (app_limited && m_btl_bw < m_full_bw * 1.25)
+			break;
+		if (m_btl_bw >= m_full_bw * 1.25) {
+			m_full_bw = m_btl_bw;
+			m_full_bw_rounds = 0;
+		} else if (++m_full_bw_rounds >= 3) {
+			m_mode = CC_DRAIN;
+		}
+		break;
+	case CC_DRAIN:
+		/* one round at inverse startup gain empties the queue built up
+		 * during startup */
+		m_mode = CC_PROBE_BW;
+		m_probe_cycle = 0;
+		break;
+	case CC_PROBE_BW:
+		m_probe_cycle = (m_probe_cycle + 1) % ARRLEN(cc_probe_gains);
+		break;
+	}
+}
+
+void CongestionControl::updateGains()
+{
+	switch (m_mode) {
+	case CC_STARTUP:
+		m_pacing_gain = CC_STARTUP_GAIN;
+		m_window_gain = CC_STARTUP_GAIN;
+		break;
+	case CC_DRAIN:
+		m_pacing_gain = 1.0 / CC_STARTUP_GAIN;
+		m_window_gain = CC_STARTUP_GAIN;
+		break;
+	case CC_PROBE_BW:
+		m_pacing_gain = cc_probe_gains[m_probe_cycle];
+		m_window_gain = 2.0;
+		break;
+	}
+}
+
+u16 CongestionControl::getWindowSize(u8 channel)
+{
+	MutexAutoLock lock(m_mutex);
+
+	/* no estimate yet, keep whatever window the channel has */
+	if (m_btl_bw <= 0.0 || m_min_rtt <= 0.0 || m_avg_packet_size <= 0.0)
+		return 0;
+
+	float bdp = m_btl_bw * m_min_rtt / m_avg_packet_size;
+	float window = bdp * m_window_gain;
+
+	if (isBulk(channel))
+		window *= 1.0 - CC_REALTIME_SHARE;
+	else
+		window *= CC_REALTIME_SHARE;
+
+	return rangelim(window, MIN_RELIABLE_WINDOW_SIZE, MAX_RELIABLE_WINDOW_SIZE);
+}
+
+bool CongestionControl::canSend(u8 channel)
+{
+	MutexAutoLock lock(m_mutex);
+
+	if (m_btl_bw <= 0.0)
+		return true;
+
+	/* realtime packets may use the bulk budget too, not vice versa */
+	if (isBulk(channel))
+		return m_bulk_budget > 0.0;
+
+	return m_realtime_budget > 0.0 || m_bulk_budget > 0.0;
+}
+
+void CongestionControl::onSent(u8 channel, u32 bytes)
+{
+	MutexAutoLock lock(m_mutex);
+
+	if (m_btl_bw <= 0.0)
+		return;
+
+	if (!isBulk(channel) && m_realtime_budget > 0.0)
+		m_realtime_budget -= bytes;
+	else
+		m_bulk_budget -= bytes;
+}
+
+float CongestionControl::getBandwidth()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_btl_bw;
+}
+
+float CongestionControl::getPacingRate()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_btl_bw * m_pacing_gain;
+}
+
+float CongestionControl::getMinRTT()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_min_rtt;
+}
+
 
 /*
 	Peer
@@ -1019,7 +1337,9 @@ UDPPeer::UDPPeer(u16 a_id, Address a_address, Connection* connection) :
 	Peer(a_address,a_id,connection),
 	m_pending_disconnect(false),
 	resend_timeout(0.5),
-	m_legacy_peer(true)
+	m_legacy_peer(true),
+	m_bundling(false),
+	m_bundling_announced(false)
 {
 }
 
@@ -1249,7 +1569,7 @@ void UDPPeer::setNextSplitSequenceNumber(u8 channel, u16 seqnum)
 }
 
 SharedBuffer<u8> UDPPeer::addSpiltPacket(u8 channel,
-											BufferedPacket toadd,
+											const SharedBuffer<u8> &toadd,
 											bool reliable)
 {
 	assert(channel < CHANNEL_COUNT); // Pre-condition
@@ -1268,7 +1588,8 @@ ConnectionSendThread::ConnectionSendThread(unsigned int max_packet_size,
 	m_timeout(timeout),
 	m_max_commands_per_iteration(1),
 	m_max_data_packets_per_iteration(g_settings->getU16("max_packets_per_iteration")),
-	m_max_packets_requeued(256)
+	m_max_packets_requeued(256),
+	m_pacing_blocked(false)
 {
 }
 
@@ -1293,8 +1614,10 @@ void * ConnectionSendThread::run()
 
 		m_iteration_packets_avaialble = m_max_data_packets_per_iteration;
 
-		/* wait for trigger or timeout */
-		m_send_sleep_semaphore.wait(50);
+		/* wait for trigger or timeout, wake up early if packets are held
+		 * back by pacing */
+		m_send_sleep_semaphore.wait(m_pacing_blocked ? PACING_WAKEUP_MS : 50);
+		m_pacing_blocked = false;
 
 		/* remove all triggers */
 		while(m_send_sleep_semaphore.wait(0)) {}
@@ -1306,28 +1629,34 @@ void * ConnectionSendThread::run()
 		/* first do all the reliable stuff */
 		runTimeouts(dtime);
 
-		/* translate commands to packets */
-		ConnectionCommand c = m_connection->m_command_queue.pop_frontNoEx(0);
-		
-		if (c.address.serializeString() == LOCAL_ADDRESS)
-	{
-		dstream << "ConnectionCommand :      "<<     c.type<<" !!! "
-			<< std::endl;
-	}
-		
-		while(c.type != CONNCMD_NONE)
+		/* translate commands to packets, drain the queue in batches so
+		 * producers get free slots back early */
+		std::vector<ConnectionCommand> commands;
+		while (m_connection->m_command_queue.popBatch(commands,
+				COMMAND_BATCH_SIZE) > 0) {
+			for (std::vector<ConnectionCommand>::iterator
+					c = commands.begin(); c != commands.end(); ++c) {
+				if (c->address.serializeString() == LOCAL_ADDRESS)
 				{
-			if (c.reliable)
-				processReliableCommand(c);
-			else
-				processNonReliableCommand(c);
+					dstream << "ConnectionCommand :      "<<     c->type<<" !!! "
+						<< std::endl;
+				}
 
-			c = m_connection->m_command_queue.pop_frontNoEx(0);
+				if (c->reliable)
+					processReliableCommand(*c);
+				else
+					processNonReliableCommand(*c);
+			}
+			commands.clear();
 		}
 
 		/* send non reliable packets */
 		sendPackets(dtime);
 
+		/* everything queued for a peer this iteration leaves in as few
+		 * datagrams as possible */
+		flushBundles();
+
 		END_DEBUG_EXCEPTION_HANDLER
 	}
 
@@ -1410,7 +1739,8 @@ void ConnectionSendThread::runTimeouts(float dtime)
 			continue;
 		}
 
-		float resend_timeout = dynamic_cast<UDPPeer*>(&peer)->getResendTimeout();
+		UDPPeer *udp_peer = dynamic_cast<UDPPeer*>(&peer);
+		float resend_timeout = udp_peer->getResendTimeout();
 		for(u16 i=0; i<CHANNEL_COUNT; i++)
 		{
 			std::list<BufferedPacket> timed_outs;
@@ -1436,6 +1766,7 @@ void ConnectionSendThread::runTimeouts(float dtime)
 							(m_max_data_packets_per_iteration/numpeers));
 
 			channel->UpdatePacketLossCounter(timed_outs.size());
+			udp_peer->m_congestion.onLoss(timed_outs.size());
 			g_profiler->graphAdd("packets_lost", timed_outs.size());
 
 			m_iteration_packets_avaialble -= timed_outs.size();
@@ -1459,14 +1790,22 @@ void ConnectionSendThread::runTimeouts(float dtime)
 						<<", seqnum="<<seqnum
 						<<std::endl);
 
-				rawSend(*k);
+				sendBundled(udp_peer, *k);
 
 				// do not handle rtt here as we can't decide if this packet was
 				// lost or really takes more time to transmit
 			}
-			channel->UpdateTimers(dtime,dynamic_cast<UDPPeer*>(&peer)->getLegacyPeer());
+			channel->UpdateTimers(dtime);
+
+			if (!udp_peer->getLegacyPeer()) {
+				u16 window_size = udp_peer->m_congestion.getWindowSize(i);
+				if (window_size != 0)
+					channel->setWindowSize(window_size);
+			}
 		}
 
+		udp_peer->m_congestion.step(dtime);
+
 		/* send ping if necessary */
 		if (dynamic_cast<UDPPeer*>(&peer)->Ping(dtime,data)) {
 			LOG(dout_con<<m_connection->getDesc()
@@ -1495,11 +1834,13 @@ void ConnectionSendThread::runTimeouts(float dtime)
 	}
 }
 
-void ConnectionSendThread::rawSend(const BufferedPacket &packet)
+void ConnectionSendThread::rawSend(const BufferedPacket &packet,
+		u32 num_packets)
 {
 	try{
 		m_connection->m_udpSocket.Send(packet.address, *packet.data,
 				packet.data.getSize());
+		m_connection->addSendStats(num_packets, packet.data.getSize());
 		LOG(dout_con <<m_connection->getDesc()
 				<< " rawSend: " << packet.data.getSize()
 				<< " bytes sent" << std::endl);
@@ -1510,7 +1851,8 @@ void ConnectionSendThread::rawSend(const BufferedPacket &packet)
 	}
 }
 
-void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* channel)
+void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p,
+		Channel* channel, UDPPeer *peer)
 {
 	try{
 		p.absolute_send_time = porting::getTimeMs();
@@ -1527,7 +1869,53 @@ void ConnectionSendThread::sendAsPacketReliable(BufferedPacket& p, Channel* chan
 	}
 
 	// Send the packet
-	rawSend(p);
+	sendBundled(peer, p);
+}
+
+void ConnectionSendThread::sendBundled(UDPPeer *peer,
+		const BufferedPacket &packet)
+{
+	if (!peer->getBundling()) {
+		rawSend(packet);
+		return;
+	}
+
+	u32 partsize = BUNDLE_PART_HEADER_SIZE
+			+ packet.data.getSize() - BASE_HEADER_SIZE;
+
+	if (m_bundles[peer->id].size + partsize > MAX_BUNDLE_SIZE)
+		flushBundle(peer->id);
+
+	PendingBundle &bundle = m_bundles[peer->id];
+	bundle.packets.push_back(packet);
+	bundle.size += partsize;
+}
+
+void ConnectionSendThread::flushBundle(u16 peer_id)
+{
+	std::map<u16, PendingBundle>::iterator it = m_bundles.find(peer_id);
+	if (it == m_bundles.end() || it->second.packets.empty())
+		return;
+
+	std::vector<BufferedPacket> &packets = it->second.packets;
+
+	/* nothing to bundle, don't waste header bytes */
+	if (packets.size() == 1) {
+		rawSend(packets[0]);
+	} else {
+		BufferedPacket bundle = makeBundlePacket(packets,
+				m_connection->GetProtocolID(), m_connection->GetPeerID());
+		g_profiler->avg("rudp_packets_per_bundle", packets.size());
+		rawSend(bundle, packets.size());
+	}
+
+	m_bundles.erase(it);
+}
+
+void ConnectionSendThread::flushBundles()
+{
+	while (!m_bundles.empty())
+		flushBundle(m_bundles.begin()->first);
 }
 
 bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
@@ -1568,7 +1956,7 @@ bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
 					<<" INFO: sending a reliable packet to peer_id " << peer_id
 					<<" channel: " << channelnum
 					<<" seqnum: " << seqnum << std::endl);
-			sendAsPacketReliable(p,channel);
+			sendAsPacketReliable(p, channel, dynamic_cast<UDPPeer*>(&peer));
 			return true;
 		}
 		else {
@@ -1592,7 +1980,7 @@ bool ConnectionSendThread::rawSendAsPacket(u16 peer_id, u8 channelnum,
 					channelnum);
 
 			// Send the packet
-			rawSend(p);
+			sendBundled(dynamic_cast<UDPPeer*>(&peer), p);
 			return true;
 		}
 		else {
@@ -1649,6 +2037,16 @@ void ConnectionSendThread::processReliableCommand(ConnectionCommand &c)
 		}
 		return;
 
+	case CONCMD_ENABLE_BUNDLING:
+		LOG(dout_con<<m_connection->getDesc()
+				<<"UDP processing reliable CONCMD_ENABLE_BUNDLING"<<std::endl);
+		if (!rawSendAsPacket(c.peer_id,c.channelnum,c.data,c.reliable))
+		{
+			/* put to queue if we couldn't send it immediately */
+			sendReliable(c);
+		}
+		return;
+
 	case CONNCMD_SERVE:
 	case CONNCMD_CONNECT:
 	case CONNCMD_DISCONNECT:
@@ -1911,6 +2309,7 @@ void ConnectionSendThread::sendPackets(float dtime)
 				<< " Handle per peer queues: peer_id=" << *j
 				<< " packet quota: " << peer->m_increment_packets_remaining << std::endl);
 		// first send queued reliable packets for all peers (if possible)
+		bool queue_empty = true;
 		for (unsigned int i=0; i < CHANNEL_COUNT; i++)
 		{
 			u16 next_to_ack = 0;
@@ -1939,11 +2338,17 @@ void ConnectionSendThread::sendPackets(float dtime)
 						<< dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_commands.size()
 						<< std::endl);
 
+			CongestionControl *congestion = &dynamic_cast<UDPPeer*>(&peer)->m_congestion;
 			while ((dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.size() > 0) &&
 					(dynamic_cast<UDPPeer*>(&peer)->channels[i].outgoing_reliables_sent.size()
 							< dynamic_cast<UDPPeer*>(&peer)->channels[i].getWindowSize())&&
 							(peer->m_increment_packets_remaining > 0))
 			{
+				/* out of pacing budget, retry as soon as it's refilled */
+				if (!congestion->canSend(i)) {
+					m_pacing_blocked = true;
+					break;
+				}
 				BufferedPacket p = dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.front();
 				dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.pop();
 				Channel* channel = &(dynamic_cast<UDPPeer*>(&peer)->channels[i]);
@@ -1952,10 +2357,15 @@ void ConnectionSendThread::sendPackets(float dtime)
 						<<" channel: " << i
 						<<", seqnum: " << readU16(&p.data[BASE_HEADER_SIZE+1])
 						<< std::endl);
-				sendAsPacketReliable(p,channel);
+				sendAsPacketReliable(p, channel, dynamic_cast<UDPPeer*>(&peer));
+				congestion->onSent(i, p.data.getSize());
 				peer->m_increment_packets_remaining--;
 			}
+			if (dynamic_cast<UDPPeer*>(&peer)->channels[i].queued_reliables.size() > 0)
+				queue_empty = false;
 		}
+		if (queue_empty)
+			dynamic_cast<UDPPeer*>(&peer)->m_congestion.onSendQueueEmpty();
 	}
 
 	if (m_outgoing_queue.size())
@@ -2702,27 +3112,10 @@ void ConnectionReceiveThread::receive()
 				memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
 					strippeddata.getSize());
 
-				try {
-					// Process it (the result is some data with no headers made by us)
-					SharedBuffer<u8> resultdata = processPacket
-					(channel, strippeddata, peer_id, channelnum, false);
-
-					ConnectionEvent e;
-					e.dataReceived(peer_id, resultdata);
-					m_connection->putEvent(e);
-					checkforend = true;
-					if (sender.serializeString() == LOCAL_ADDRESS)
-					{
-						//dstream << m_connection->getDesc() << " REACH    HERE     [KINECT STEP 2] !!! : " << "       sender is:   " << sender.serializeString() << "   peer id:    " << peer_id << "    channel:   " << channel << std::endl;   //	FOR KINECT
-					}
-				}
-				catch (ProcessedSilentlyException &e) {
-				}
-				catch (ProcessedQueued &e) {
+				if (handlePacket(dynamic_cast<UDPPeer*>(&peer), strippeddata,
+						peer_id, channelnum))
 					packet_queued = true;
-				}
-
-				//dstream << "===================POST" << std::endl;
+				checkforend = true;
 			}
 			catch (InvalidIncomingDataException &e) {
 			}
@@ -2733,6 +3126,54 @@ void ConnectionReceiveThread::receive()
 
 }
 
+bool ConnectionReceiveThread::handlePacket(UDPPeer *peer,
+		SharedBuffer<u8> packetdata, u16 peer_id, u8 channelnum)
+{
+	if (peer == NULL)
+		throw InvalidIncomingDataException("Peer isn't an UDP peer");
+
+	if (packetdata.getSize() < 1 || readU8(&packetdata[0]) != TYPE_BUNDLE) {
+		try {
+			// Process it (the result is some data with no headers made by us)
+			SharedBuffer<u8> resultdata = processPacket(
+					&peer->channels[channelnum], packetdata, peer_id,
+					channelnum, false);
+
+			ConnectionEvent e;
+			e.dataReceived(peer_id, resultdata);
+			m_connection->putEvent(e);
+		}
+		catch (ProcessedSilentlyException &e) {
+		}
+		catch (ProcessedQueued &e) {
+			return true;
+		}
+		return false;
+	}
+
+	/* unpack a bundle, every part is handled like a datagram of its own */
+	std::vector<BundlePart> parts;
+	bool valid = splitBundlePacket(packetdata, parts);
+
+	bool queued = false;
+	for (std::vector<BundlePart>::iterator i = parts.begin();
+			i != parts.end(); ++i) {
+		try {
+			if (handlePacket(peer, i->data, peer_id, i->channelnum))
+				queued = true;
+		}
+		catch (InvalidIncomingDataException &e) {
+			/* a broken part doesn't invalidate the others */
+		}
+	}
+
+	/* the parts before a broken one are kept */
+	if (!valid)
+		LOG(derr_con<<m_connection->getDesc()
+				<<"Invalid bundle part from peer_id="<<peer_id<<std::endl);
+	return queued;
+}
+
 bool ConnectionReceiveThread::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst)
 {
 	std::list<u16> peerids = m_connection->getPeerIDs();
@@ -2869,6 +3310,7 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,				//1
 			try{
 				BufferedPacket p =
 						channel->outgoing_reliables_sent.popSeqnum(seqnum);
+				float rtt = -1.0;
 
 				// only calculate rtt from straight sent packets
 				if (p.resend_count == 0) {
@@ -2879,7 +3321,7 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,				//1
 					// rtt miscalculation we handle it here
 					if (current_time > p.absolute_send_time)
 					{
-						float rtt = (current_time - p.absolute_send_time) / 1000.0;
+						rtt = (current_time - p.absolute_send_time) / 1000.0;
 
 						// Let peer calculate stuff according to it
 						// (avg_rtt and resend_timeout)
@@ -2887,13 +3329,16 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,				//1
 					}
 					else if (p.totaltime > 0)
 					{
-						float rtt = p.totaltime;
+						rtt = p.totaltime;
 
 						// Let peer calculate stuff according to it
 						// (avg_rtt and resend_timeout)
 						dynamic_cast<UDPPeer*>(&peer)->reportRTT(rtt);
 					}
 				}
+				// resent packets still count as delivered data
+				dynamic_cast<UDPPeer*>(&peer)->m_congestion.onAck(rtt,
+						p.data.getSize());
 				//put bytes for max bandwidth calculation
 				channel->UpdateBytesSent(p.data.getSize(),1);
 				if (channel->outgoing_reliables_sent.size() == 0)
@@ -2939,6 +3384,16 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,				//1
 			cmd.disableLegacy(PEER_ID_SERVER,reply);
 			m_connection->putCommand(cmd);
 
+			if (g_settings->getBool("enable_packet_bundling") &&
+					dynamic_cast<UDPPeer*>(&peer)->setBundlingAnnounced()) {
+				ConnectionCommand bundlecmd;
+				SharedBuffer<u8> announce(2);
+				writeU8(&announce[0], TYPE_CONTROL);
+				writeU8(&announce[1], CONTROLTYPE_ENABLE_BUNDLING);
+				bundlecmd.enableBundling(PEER_ID_SERVER, announce);
+				m_connection->putCommand(bundlecmd);
+			}
+
 			throw ProcessedSilentlyException("Got a SET_PEER_ID");
 		}
 		else if (controltype == CONTROLTYPE_PING)
@@ -2968,6 +3423,25 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,				//1
 			dynamic_cast<UDPPeer*>(&peer)->setNonLegacyPeer();
 			throw ProcessedSilentlyException("Got non legacy control");
 		}
+		else if (controltype == CONTROLTYPE_ENABLE_BUNDLING)
+		{
+			if (!g_settings->getBool("enable_packet_bundling"))
+				throw ProcessedSilentlyException("Bundling disabled");
+
+			UDPPeer *udp_peer = dynamic_cast<UDPPeer*>(&peer);
+			udp_peer->setBundling();
+
+			/* tell the peer we accept bundles too, unless it's an answer */
+			if (udp_peer->setBundlingAnnounced()) {
+				ConnectionCommand cmd;
+				SharedBuffer<u8> reply(2);
+				writeU8(&reply[0], TYPE_CONTROL);
+				writeU8(&reply[1], CONTROLTYPE_ENABLE_BUNDLING);
+				cmd.enableBundling(peer_id, reply);
+				m_connection->putCommand(cmd);
+			}
+			throw ProcessedSilentlyException("Got bundling control");
+		}
 		else{
 			LOG(derr_con<<m_connection->getDesc()
 					<<"INVALID TYPE_CONTROL: invalid controltype="
@@ -2996,42 +3470,25 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,				//1
 	}
 	else if (type == TYPE_SPLIT)
 	{
-		Address peer_address;
-
 		if (temp.serializeString() == PDATA_ADDRESS || temp.serializeString() == LOCAL_ADDRESS)
 		{
 
 			dstream << m_connection->getDesc() << " REACH    HERE     type == TYPE_SPLIT !!! : " << "         from address:    " << temp.serializeString() << "                 peer id:    " << peer_id << "    channel:   " << channel << "    type:   " << id_str << std::endl;   //	FOR KINECT
 		}
 
-		if (peer->getAddress(MTP_UDP, peer_address)) {
+		// Buffer the chunk, the header is parsed by the split buffer
+		SharedBuffer<u8> data =
+				peer->addSpiltPacket(channelnum, packetdata, reliable);
 
-			// We have to create a packet again for buffering
-			// This isn't actually too bad an idea.
-			BufferedPacket packet = makePacket(
-					peer_address,
-					packetdata,
-					m_connection->GetProtocolID(),
-					peer_id,
-					channelnum);
-
-			// Buffer the packet
-			SharedBuffer<u8> data =
-					peer->addSpiltPacket(channelnum,packet,reliable);
-
-			if (data.getSize() != 0)
-			{
-				LOG(dout_con<<m_connection->getDesc()
-						<<"RETURNING TYPE_SPLIT: Constructed full data, "
-						<<"size="<<data.getSize()<<std::endl);
-				return data;
-			}
-			LOG(dout_con<<m_connection->getDesc()<<"BUFFERED TYPE_SPLIT"<<std::endl);
-			throw ProcessedSilentlyException("Buffered a split packet chunk");
-		}
-		else {
-			//TODO throw some error
+		if (data.getSize() != 0)
+		{
+			LOG(dout_con<<m_connection->getDesc()
+					<<"RETURNING TYPE_SPLIT: Constructed full data, "
+					<<"size="<<data.getSize()<<std::endl);
+			return data;
 		}
+		LOG(dout_con<<m_connection->getDesc()<<"BUFFERED TYPE_SPLIT"<<std::endl);
+		throw ProcessedSilentlyException("Buffered a split packet chunk");
 	}
 	else if (type == TYPE_RELIABLE)
 	{
@@ -3202,8 +3659,8 @@ SharedBuffer<u8> ConnectionReceiveThread::processPacket(Channel *channel,				//1
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 		bool ipv6, PeerHandler *peerhandler) :
 	m_udpSocket(ipv6),
-	m_command_queue(),
-	m_event_queue(),
+	m_command_queue(CONNECTION_QUEUE_SIZE),
+	m_event_queue(CONNECTION_QUEUE_SIZE),
 	m_peer_id(0),
 	m_protocol_id(protocol_id),
 	m_sendThread(max_packet_size, timeout),
@@ -3226,8 +3683,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	bool ipv6, PeerHandler *peerhandler, bool kinect) :
 	m_udpSocket(ipv6),
-	m_command_queue(),
-	m_event_queue(),
+	m_command_queue(CONNECTION_QUEUE_SIZE),
+	m_event_queue(CONNECTION_QUEUE_SIZE),
 	m_peer_id(0),
 	m_protocol_id(protocol_id),
 	m_sendThread(max_packet_size, timeout),			
@@ -3251,8 +3708,8 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	bool ipv6, PeerHandler *peerhandler, bool kinect, bool pdata) :
 	m_udpSocket(ipv6),
-	m_command_queue(),
-	m_event_queue(),
+	m_command_queue(CONNECTION_QUEUE_SIZE),
+	m_event_queue(CONNECTION_QUEUE_SIZE),
 	m_peer_id(0),
 	m_protocol_id(protocol_id),
 	m_sendThread(max_packet_size, timeout),
@@ -3302,7 +3759,10 @@ Connection::~Connection()
 void Connection::putEvent(ConnectionEvent &e)
 {
 	assert(e.type != CONNEVENT_NONE); // Pre-condition
-	m_event_queue.push_back(e);
+
+	/* called by the receive and send threads too, which must never wait
+	 * for the user to catch up */
+	m_event_queue.pushUnbounded(e);
 }
 
 PeerHelper Connection::getPeer(u16 peer_id)
@@ -3405,19 +3865,18 @@ bool Connection::deletePeer(u16 peer_id, bool timeout)
 
 ConnectionEvent Connection::waitEvent(u32 timeout_ms)
 {
-	try {
-		return m_event_queue.pop_front(timeout_ms);
-	} catch(ItemNotFoundException &ex) {
-		ConnectionEvent e;
+	ConnectionEvent e;
+	if (!m_event_queue.pop(e, timeout_ms))
 		e.type = CONNEVENT_NONE;
-		return e;
-	}
+	return e;
 }
 
 void Connection::putCommand(ConnectionCommand &c)
 {
 	if (!m_shutting_down) {
-		m_command_queue.push_back(c);
+		/* called by the send and receive threads too, so waiting for the
+		 * send thread to make room could deadlock it */
+		m_command_queue.pushUnbounded(c);
 		m_sendThread.Trigger();
 	}
 
@@ -3580,6 +4039,20 @@ float Connection::getLocalStat(rate_stat_type type)
 	return retval;
 }
 
+SendStats Connection::getSendStats()
+{
+	MutexAutoLock lock(m_send_stats_mutex);
+	return m_send_stats;
+}
+
+void Connection::addSendStats(u32 num_packets, u32 size)
+{
+	MutexAutoLock lock(m_send_stats_mutex);
+	m_send_stats.packets += num_packets;
+	m_send_stats.datagrams++;
+	m_send_stats.bytes += size;
+}
+
 u16 Connection::createPeer(Address& sender, MTProtocols protocol, int fd)
 {
 	// Somebody wants to make a new connection
@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <map>
+#include <vector>
 
 class NetworkPacket;
 
@@ -210,23 +211,66 @@ SharedBuffer<u8> makeReliablePacket(
 		SharedBuffer<u8> data,
 		u16 seqnum);
 
+// Pack packets with base headers to the same peer into a TYPE_BUNDLE packet
+BufferedPacket makeBundlePacket(const std::vector<BufferedPacket> &packets,
+		u32 protocol_id, u16 sender_peer_id);
+
+// A packet taken from a TYPE_BUNDLE packet
+struct BundlePart
+{
+	u8 channelnum;
+	SharedBuffer<u8> data; // Without base header
+};
+
+/*
+	Splits the data of a TYPE_BUNDLE packet with the base header stripped
+	into its parts. Empty parts and nested bundles are dropped.
+	Returns false if the bundle is malformed, the parts before the broken
+	one are returned anyway.
+*/
+bool splitBundlePacket(SharedBuffer<u8> data, std::vector<BundlePart> &parts);
+
+/*
+	A split packet being reassembled.
+	All chunks but the last one have the same size, so every chunk is
+	copied straight to its final place in a single buffer allocated as soon
+	as that size is known. Received chunks are tracked in a bitmap.
+*/
 struct IncomingSplitPacket
 {
-	IncomingSplitPacket()
+	IncomingSplitPacket(u16 chunk_count_, bool reliable_);
+
+	/*
+		Copies a chunk payload to the reassembly buffer. Duplicates are
+		ignored. Returns false if the chunk doesn't fit the packet.
+	*/
+	bool insert(u16 chunk_num, const u8 *data, u32 size);
+
+	bool allReceived() const
 	{
-		time = 0.0;
-		reliable = false;
+		return chunks_received == chunk_count;
 	}
-	// Key is chunk number, value is data without headers
-	std::map<u16, SharedBuffer<u8> > chunks;
-	u32 chunk_count;
-	float time; // Seconds from adding
+
+	// Returns the reassembled data, only valid once allReceived()
+	SharedBuffer<u8> getData();
+
+	u16 chunk_count;
 	bool reliable; // If true, isn't deleted on timeout
+	u32 expiry_tick; // Timer wheel tick this is deleted at if unreliable
 
-	bool allReceived()
+private:
+	bool isReceived(u16 chunk_num) const
 	{
-		return (chunks.size() == chunk_count);
+		return received[chunk_num / 32] & (1u << (chunk_num % 32));
 	}
+
+	SharedBuffer<u8> data;
+	u32 chunk_size; // Payload size of all chunks but the last, 0 if unknown
+	u32 last_chunk_size;
+	// Last chunk if it arrived before the chunk size was known
+	SharedBuffer<u8> pending_last;
+	std::vector<u32> received;
+	u16 chunks_received;
 };
 
 /*
@@ -266,6 +310,11 @@ controltype and data description:
 	- There is no actual reply, but this can be sent in a reliable
 	  packet to get a reply
 	CONTROLTYPE_DISCO
+	CONTROLTYPE_ENABLE_BIG_SEND_WINDOW
+	CONTROLTYPE_ENABLE_BUNDLING
+	- Sender accepts TYPE_BUNDLE packets. The client announces it after
+	  getting its peer id, the server answers with the same control if it
+	  accepts bundles too. Peers not knowing it simply drop it.
 */
 #define TYPE_CONTROL 0
 #define CONTROLTYPE_ACK 0
@@ -273,6 +322,7 @@ controltype and data description:
 #define CONTROLTYPE_PING 2
 #define CONTROLTYPE_DISCO 3
 #define CONTROLTYPE_ENABLE_BIG_SEND_WINDOW 4
+#define CONTROLTYPE_ENABLE_BUNDLING 5
 
 /*
 ORIGINAL: This is a plain packet with no control and no error
@@ -299,6 +349,10 @@ data.
 	[5] u16 chunk_num
 */
 #define TYPE_SPLIT 2
+#define SPLIT_HEADER_SIZE 7
+// Timer wheel used to drop incomplete unreliable split packets
+#define SPLIT_WHEEL_SLOTS 64
+#define SPLIT_WHEEL_TICK 0.25
 /*
 RELIABLE: Delivery of all RELIABLE packets shall be forced by ACKs,
 and they shall be delivered in the same order as sent. This is done
@@ -313,6 +367,24 @@ with a buffer in the receiving and transmitting end.
 #define TYPE_RELIABLE 3
 #define RELIABLE_HEADER_SIZE 3
 #define SEQNUM_INITIAL 65500
+/*
+BUNDLE: Several small packets to the same peer packed into one datagram.
+Only sent to peers that announced CONTROLTYPE_ENABLE_BUNDLING.
+- Every part is processed as if it had arrived in a datagram of its own,
+  reliable parts are acked (and their acks bundled) individually.
+- The channel in the base header is ignored, every part names its own.
+	Header (1 byte):
+	[0] u8 type
+	Followed by parts:
+	[0] u8 channel
+	[1] u16 size
+	[3] u8[size] packet without base header
+*/
+#define TYPE_BUNDLE 4
+#define BUNDLE_HEADER_SIZE 1
+#define BUNDLE_PART_HEADER_SIZE 3
+// Bundles must fit a single datagram below the common ethernet MTU
+#define MAX_BUNDLE_SIZE 1400
 
 /*
 	A buffer which stores reliable packets and sorts them internally
@@ -361,19 +433,31 @@ private:
 class IncomingSplitBuffer
 {
 public:
+	IncomingSplitBuffer();
 	~IncomingSplitBuffer();
 	/*
+		Takes a TYPE_SPLIT packet without base header.
 		Returns a reference counted buffer of length != 0 when a full split
 		packet is constructed. If not, returns one of length 0.
 	*/
-	SharedBuffer<u8> insert(BufferedPacket &p, bool reliable);
+	SharedBuffer<u8> insert(const SharedBuffer<u8> &packetdata, bool reliable);
 
+	/*
+		Advances the timer wheel, dropping unreliable split packets which
+		are incomplete after timeout seconds.
+	*/
 	void removeUnreliableTimedOuts(float dtime, float timeout);
 
 private:
 	// Key is seqnum
 	std::map<u16, IncomingSplitPacket*> m_buf;
 
+	// Timer wheel of unreliable split packets, slots hold seqnums
+	std::vector<u16> m_wheel[SPLIT_WHEEL_SLOTS];
+	u32 m_tick;
+	float m_tick_time;
+	float m_timeout;
+
 	Mutex m_map_mutex;
 };
 
@@ -406,7 +490,8 @@ enum ConnectionCommandType{
 	CONNCMD_SEND_TO_ALL,
 	CONCMD_ACK,
 	CONCMD_CREATE_PEER,
-	CONCMD_DISABLE_LEGACY
+	CONCMD_DISABLE_LEGACY,
+	CONCMD_ENABLE_BUNDLING
 };
 
 struct ConnectionCommand
@@ -478,6 +563,16 @@ struct ConnectionCommand
 		reliable = true;
 		raw = true;
 	}
+
+	void enableBundling(u16 peer_id_, SharedBuffer<u8> data_)
+	{
+		type = CONCMD_ENABLE_BUNDLING;
+		peer_id = peer_id_;
+		data = data_;
+		channelnum = 0;
+		reliable = true;
+		raw = true;
+	}
 };
 
 class Channel
@@ -518,7 +613,7 @@ public:
 	void UpdateBytesLost(unsigned int bytes);
 	void UpdateBytesReceived(unsigned int bytes);
 
-	void UpdateTimers(float dtime, bool legacy_peer);
+	void UpdateTimers(float dtime);
 
 	const float getCurrentDownloadRateKB()
 		{ MutexAutoLock lock(m_internal_mutex); return cur_kbps; };
@@ -650,6 +745,16 @@ typedef enum {
 	AVG_LOSS_RATE,
 } rate_stat_type;
 
+// What a connection put on the wire so far, see Connection::getSendStats()
+struct SendStats
+{
+	SendStats() : packets(0), datagrams(0), bytes(0) {}
+
+	u64 packets;   // Protocol packets, bundled ones counted individually
+	u64 datagrams; // UDP datagrams
+	u64 bytes;     // UDP payload bytes
+};
+
 class Peer {
 	public:
 		friend class PeerHelper;
@@ -710,7 +815,7 @@ class Peer {
 		virtual u16 getNextSplitSequenceNumber(u8 channel) { return 0; };
 		virtual void setNextSplitSequenceNumber(u8 channel, u16 seqnum) {};
 		virtual SharedBuffer<u8> addSpiltPacket(u8 channel,
-												BufferedPacket toadd,
+												const SharedBuffer<u8> &toadd,
 												bool reliable)
 				{
 					fprintf(stderr,"Peer: addSplitPacket called, this is supposed to be never called!\n");
@@ -782,6 +887,94 @@ class Peer {
 		bool m_has_sent_with_id;
 };
 
+/*
+	Congestion controller of a UDPPeer.
+
+	Estimates the bottleneck bandwidth from the delivery rate of acked
+	reliable packets and the propagation delay from the windowed minimum
+	rtt (in the spirit of BBR). The product of both gives the amount of
+	data the path can hold; the reliable windows of the channels and the
+	pacing rate of the send thread are derived from it.
+
+	Channels 0 and 1 carry small realtime messages, channel 2 carries bulk
+	transfers (map blocks, media). Both groups get separate window and
+	pacing budgets so a map flood can't starve the realtime traffic.
+	Pacing budget unused by the realtime channels flows over to bulk.
+*/
+#define CONGESTION_BULK_CHANNEL 2
+
+class CongestionControl
+{
+public:
+	CongestionControl();
+
+	// Called for every acked reliable packet; rtt < 0 if the packet was
+	// resent and gives no valid rtt sample
+	void onAck(float rtt, u32 bytes);
+	// Called with the number of reliable packets that timed out
+	void onLoss(u32 count);
+	// Called when the sender ran out of queued reliables; the delivery
+	// rate of such a round is limited by the application, not the path
+	void onSendQueueEmpty();
+	// Advances the model and refills the pacing budgets
+	void step(float dtime);
+
+	// Reliable window in packets for a channel
+	u16 getWindowSize(u8 channel);
+	// True if the pacing budget of the channel allows sending a packet
+	bool canSend(u8 channel);
+	void onSent(u8 channel, u32 bytes);
+
+	// Estimated bottleneck bandwidth in bytes per second, 0 if unknown
+	float getBandwidth();
+	// Current pacing rate in bytes per second, 0 if not pacing yet
+	float getPacingRate();
+	float getMinRTT();
+
+private:
+	enum Mode {
+		CC_STARTUP,
+		CC_DRAIN,
+		CC_PROBE_BW
+	};
+
+	void updateBandwidth(float bw, bool app_limited);
+	void updateGains();
+	static bool isBulk(u8 channel)
+	{ return channel == CONGESTION_BULK_CHANNEL; }
+
+	Mutex m_mutex;
+
+	Mode m_mode;
+	float m_pacing_gain;
+	float m_window_gain;
+	u8 m_probe_cycle;
+
+	// Windowed minimum rtt
+	float m_min_rtt;
+	float m_min_rtt_age;
+
+	// Delivery rate samples, the bandwidth estimate is their maximum
+	float m_bw_samples[10];
+	u8 m_bw_sample_next;
+	float m_btl_bw;
+	float m_full_bw;
+	u8 m_full_bw_rounds;
+
+	// Bytes acked in the current delivery rate sample
+	u32 m_delivered_bytes;
+	u32 m_delivered_packets;
+	float m_sample_time;
+	bool m_app_limited;
+	float m_avg_packet_size;
+
+	u32 m_lost_packets;
+
+	// Pacing token buckets in bytes
+	float m_realtime_budget;
+	float m_bulk_budget;
+};
+
 class UDPPeer : public Peer
 {
 public:
@@ -807,11 +1000,27 @@ public:
 	bool getLegacyPeer()
 	{ return m_legacy_peer; }
 
+	// Returns true if the peer accepts TYPE_BUNDLE packets
+	bool getBundling()
+	{ MutexAutoLock lock(m_exclusive_access_mutex); return m_bundling; }
+
+	void setBundling()
+	{ MutexAutoLock lock(m_exclusive_access_mutex); m_bundling = true; }
+
+	// Returns false if we've already announced bundling to the peer
+	bool setBundlingAnnounced()
+	{
+		MutexAutoLock lock(m_exclusive_access_mutex);
+		bool first = !m_bundling_announced;
+		m_bundling_announced = true;
+		return first;
+	}
+
 	u16 getNextSplitSequenceNumber(u8 channel);
 	void setNextSplitSequenceNumber(u8 channel, u16 seqnum);
 
 	SharedBuffer<u8> addSpiltPacket(u8 channel,
-									BufferedPacket toadd,
+									const SharedBuffer<u8> &toadd,
 									bool reliable);
 
 
@@ -835,6 +1044,7 @@ protected:
 	bool Ping(float dtime,SharedBuffer<u8>& data);
 
 	Channel channels[CHANNEL_COUNT];
+	CongestionControl m_congestion;
 	bool m_pending_disconnect;
 private:
 	// This is changed dynamically
@@ -845,6 +1055,8 @@ private:
 					unsigned int max_packet_size);
 
 	bool m_legacy_peer;
+	bool m_bundling;
+	bool m_bundling_announced;
 };
 
 /*
@@ -933,7 +1145,8 @@ public:
 
 private:
 	void runTimeouts    (float dtime);
-	void rawSend        (const BufferedPacket &packet);
+	// num_packets is the number of protocol packets in a bundle
+	void rawSend        (const BufferedPacket &packet, u32 num_packets=1);
 	bool rawSendAsPacket(u16 peer_id, u8 channelnum,
 							SharedBuffer<u8> data, bool reliable);
 
@@ -955,7 +1168,14 @@ private:
 	void sendAsPacket   (u16 peer_id, u8 channelnum,
 							SharedBuffer<u8> data,bool ack=false);
 
-	void sendAsPacketReliable(BufferedPacket& p, Channel* channel);
+	void sendAsPacketReliable(BufferedPacket& p, Channel* channel,
+							UDPPeer *peer);
+
+	// Sends a packet, appending it to the peer's pending bundle if it
+	// accepts bundles
+	void sendBundled    (UDPPeer *peer, const BufferedPacket &packet);
+	void flushBundle    (u16 peer_id);
+	void flushBundles   ();
 
 	bool packetsQueued();
 
@@ -965,10 +1185,19 @@ private:
 	std::queue<OutgoingPacket> m_outgoing_queue;
 	Semaphore             m_send_sleep_semaphore;
 
+	struct PendingBundle {
+		PendingBundle() : size(BASE_HEADER_SIZE + BUNDLE_HEADER_SIZE) {}
+		std::vector<BufferedPacket> packets;
+		u32 size; // size of the bundle datagram including headers
+	};
+	// Key is peer id
+	std::map<u16, PendingBundle> m_bundles;
+
 	unsigned int          m_iteration_packets_avaialble;
 	unsigned int          m_max_commands_per_iteration;
 	unsigned int          m_max_data_packets_per_iteration;
 	unsigned int          m_max_packets_requeued;
+	bool                  m_pacing_blocked;
 };
 
 class ConnectionReceiveThread : public Thread {
@@ -993,6 +1222,14 @@ private:
 	bool checkIncomingBuffers(Channel *channel, u16 &peer_id,
 							SharedBuffer<u8> &dst);
 
+	/*
+		Processes a packet with the base header stripped out and queues
+		the resulting data as event. Unpacks bundles.
+		Returns true if a reliable packet was buffered for later.
+	*/
+	bool handlePacket(UDPPeer *peer, SharedBuffer<u8> packetdata,
+							u16 peer_id, u8 channelnum);
+
 	/*
 		Processes a packet with the basic header stripped out.
 		Parameters:
@@ -1039,6 +1276,7 @@ public:
 	Address GetPeerAddress(u16 peer_id);
 	float getPeerStat(u16 peer_id, rtt_stat_type type);
 	float getLocalStat(rate_stat_type type);
+	SendStats getSendStats();
 	const u32 GetProtocolID() const { return m_protocol_id; };
 	const std::string getDesc();
 	void DisconnectPeer(u16 peer_id);
@@ -1066,16 +1304,21 @@ protected:
 	}
 
 	UDPSocket m_udpSocket;
-	MutexedQueue<ConnectionCommand> m_command_queue;
+	// Filled by the user and the receive thread, drained by the send thread
+	MPSCQueue<ConnectionCommand> m_command_queue;
 
 	void putEvent(ConnectionEvent &e);
 
 	void TriggerSend()
 		{ m_sendThread.Trigger(); }
+
+	// Called by the send thread for every datagram sent
+	void addSendStats(u32 num_packets, u32 size);
 private:
 	std::list<Peer*> getPeers();
 
-	MutexedQueue<ConnectionEvent> m_event_queue;
+	// Filled by both connection threads, drained by the user
+	MPSCQueue<ConnectionEvent> m_event_queue;
 
 	u16 m_peer_id;
 	u32 m_protocol_id;
@@ -1087,6 +1330,9 @@ private:
 	ConnectionSendThread m_sendThread;
 	ConnectionReceiveThread m_receiveThread;
 
+	SendStats m_send_stats;
+	Mutex m_send_stats_mutex;
+
 	Mutex m_info_mutex;
 
 	// Backwards compatibility
@@ -22,6 +22,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"
 #include "util/serialize.h"
 #include "constants.h" // MAP_BLOCKSIZE
+#include "util/basic_macros.h"
+#include <cmath>
 
 /*
 	NodeTimer
@@ -60,11 +62,11 @@ void NodeTimerList::serialize(std::ostream &os, u8 map_format_version) const
 		writeU16(os, m_data.size());
 	}
 
-	for (std::map<v3s16, NodeTimer>::const_iterator
+	for (std::map<v3s16, Timer>::const_iterator
 			i = m_data.begin();
 			i != m_data.end(); ++i) {
 		v3s16 p = i->first;
-		NodeTimer t = i->second;
+		NodeTimer t(i->second.timeout, getElapsed(i->second));
 
 		u16 p16 = p.Z * MAP_BLOCKSIZE * MAP_BLOCKSIZE + p.Y * MAP_BLOCKSIZE + p.X;
 		writeU16(os, p16);
@@ -124,31 +126,155 @@ void NodeTimerList::deSerialize(std::istream &is, u8 map_format_version)
 			continue;
 		}
 
-		m_data.insert(std::make_pair(p, t));
+		set(p, t);
 	}
 }
 
-std::map<v3s16, NodeTimer> NodeTimerList::step(float dtime)
+void NodeTimerList::set(v3s16 p, NodeTimer t)
 {
-	std::map<v3s16, NodeTimer> elapsed_timers;
-	// Increment timers
-	for(std::map<v3s16, NodeTimer>::iterator
+	Timer &timer = m_data[p];
+	timer.timeout = t.timeout;
+	if (m_wheel) {
+		timer.elapsed_or_start = m_wheel->getTime() - t.elapsed;
+		timer.tick = m_wheel->schedule(m_blockpos, p,
+			timer.elapsed_or_start + t.timeout);
+	} else {
+		timer.elapsed_or_start = t.elapsed;
+		timer.tick = 0;
+	}
+}
+
+void NodeTimerList::attach(NodeTimerWheel *wheel, v3s16 blockpos)
+{
+	if (m_wheel == wheel && m_blockpos == blockpos)
+		return;
+	detach();
+	m_wheel = wheel;
+	m_blockpos = blockpos;
+	double now = m_wheel->getTime();
+	for (std::map<v3s16, Timer>::iterator
 			i = m_data.begin();
-			i != m_data.end(); ++i){
-		v3s16 p = i->first;
-		NodeTimer t = i->second;
-		t.elapsed += dtime;
-		if(t.elapsed >= t.timeout)
-			elapsed_timers.insert(std::make_pair(p, t));
-		else
-			i->second = t;
+			i != m_data.end(); ++i) {
+		Timer &timer = i->second;
+		timer.elapsed_or_start = now - timer.elapsed_or_start;
+		timer.tick = m_wheel->schedule(m_blockpos, i->first,
+			timer.elapsed_or_start + timer.timeout);
 	}
-	// Delete elapsed timers
-	for(std::map<v3s16, NodeTimer>::const_iterator
-			i = elapsed_timers.begin();
-			i != elapsed_timers.end(); ++i){
-		v3s16 p = i->first;
-		m_data.erase(p);
+}
+
+void NodeTimerList::detach()
+{
+	if (!m_wheel)
+		return;
+	double now = m_wheel->getTime();
+	for (std::map<v3s16, Timer>::iterator
+			i = m_data.begin();
+			i != m_data.end(); ++i) {
+		Timer &timer = i->second;
+		timer.elapsed_or_start = now - timer.elapsed_or_start;
+		// Entries left in the wheel never match again
+		timer.tick = 0;
 	}
-	return elapsed_timers;
+	m_wheel = NULL;
+}
+
+bool NodeTimerList::takeExpired(v3s16 p, u64 tick, NodeTimer &t)
+{
+	std::map<v3s16, Timer>::iterator n = m_data.find(p);
+	if (!m_wheel || n == m_data.end() || n->second.tick != tick)
+		return false;
+	t = NodeTimer(n->second.timeout, getElapsed(n->second));
+	m_data.erase(n);
+	return true;
+}
+
+void NodeTimerList::step(float dtime,
+		std::vector<std::pair<v3s16, NodeTimer> > &elapsed)
+{
+	// Attached timers are driven by the wheel
+	if (m_wheel)
+		return;
+	for (std::map<v3s16, Timer>::iterator
+			i = m_data.begin();
+			i != m_data.end(); ) {
+		Timer &timer = i->second;
+		timer.elapsed_or_start += dtime;
+		if (timer.elapsed_or_start >= timer.timeout) {
+			elapsed.push_back(std::make_pair(i->first,
+				NodeTimer(timer.timeout, timer.elapsed_or_start)));
+			m_data.erase(i++);
+		} else {
+			++i;
+		}
+	}
+}
+
+/*
+	NodeTimerWheel
+*/
+
+NodeTimerWheel::NodeTimerWheel(float resolution):
+	m_resolution(MYMAX(resolution, 0.001f)),
+	m_tick(0),
+	m_size(0)
+{
+}
+
+u64 NodeTimerWheel::schedule(v3s16 blockpos, v3s16 p, double expire_time)
+{
+	// Allow for float inaccuracy so a timeout that is a multiple of the
+	// resolution does not end up one tick late
+	double ticks = ceil(expire_time / m_resolution - 0.001);
+	Entry e;
+	e.blockpos = blockpos;
+	e.p = p;
+	e.tick = ticks > (double)m_tick ? (u64)ticks : m_tick + 1;
+	insert(e);
+	m_size++;
+	return e.tick;
+}
+
+void NodeTimerWheel::insert(const Entry &e)
+{
+	u64 delta = e.tick - m_tick;
+	for (u32 level = 0; level < LEVELS; level++) {
+		if (delta < (u64)1 << (SLOT_BITS * (level + 1))) {
+			u32 slot = (e.tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+			m_slots[level][slot].push_back(e);
+			return;
+		}
+	}
+	m_overflow.push_back(e);
+}
+
+void NodeTimerWheel::cascade(u32 level)
+{
+	std::vector<Entry> entries;
+	if (level == LEVELS) {
+		entries.swap(m_overflow);
+	} else {
+		u32 slot = (m_tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+		entries.swap(m_slots[level][slot]);
+	}
+	for (size_t i = 0; i < entries.size(); i++)
+		insert(entries[i]);
+}
+
+void NodeTimerWheel::step(std::vector<Entry> &expired)
+{
+	m_tick++;
+
+	// When the index of a level wraps around, the next slot of the level
+	// above is due and is spread over the lower levels, highest first
+	u32 wrapped = 0;
+	while (wrapped < LEVELS &&
+			((m_tick >> (SLOT_BITS * wrapped)) & (SLOTS - 1)) == 0)
+		wrapped++;
+	for (u32 level = wrapped; level >= 1; level--)
+		cascade(level);
+
+	std::vector<Entry> &slot = m_slots[0][m_tick & (SLOTS - 1)];
+	m_size -= slot.size();
+	expired.insert(expired.end(), slot.begin(), slot.end());
+	slot.clear();
 }
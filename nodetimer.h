@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irr_v3d.h"
 #include <iostream>
 #include <map>
+#include <vector>
 
 /*
 	NodeTimer provides per-node timed callback functionality.
@@ -39,7 +40,7 @@ public:
 	NodeTimer(f32 timeout_, f32 elapsed_):
 		timeout(timeout_), elapsed(elapsed_) {}
 	~NodeTimer() {}
-	
+
 	void serialize(std::ostream &os) const;
 	void deSerialize(std::istream &is);
 	
@@ -47,44 +48,127 @@ public:
 	f32 elapsed;
 };
 
+/*
+	Hierarchical timer wheel shared by the node timers of all active blocks.
+	It advances one tick of the given resolution per step() and only
+	touches the timers that expire in that tick; timers further away are
+	kept in coarser levels and cascaded down when their time comes.
+
+	Entries are not removed when a timer is changed or deleted. The owner
+	checks every expired entry against the timer list of its block.
+*/
+
+class NodeTimerWheel
+{
+public:
+	struct Entry
+	{
+		v3s16 blockpos;
+		v3s16 p; // relative to the block
+		u64 tick;
+	};
+
+	NodeTimerWheel(float resolution);
+	~NodeTimerWheel() {}
+
+	double getTime() const { return m_tick * m_resolution; }
+
+	// Schedules a timer expiring at the given wheel time. Returns the tick
+	// it was put in, which is at least the next one.
+	u64 schedule(v3s16 blockpos, v3s16 p, double expire_time);
+
+	// Advances one tick and appends the entries expiring in it
+	void step(std::vector<Entry> &expired);
+
+	u32 size() const { return m_size; }
+
+private:
+	static const u32 LEVELS = 4;
+	static const u32 SLOT_BITS = 6;
+	static const u32 SLOTS = 1 << SLOT_BITS;
+
+	void insert(const Entry &e);
+	void cascade(u32 level);
+
+	double m_resolution;
+	u64 m_tick;
+	u32 m_size;
+	std::vector<Entry> m_slots[LEVELS][SLOTS];
+	// Entries beyond the range of the highest level
+	std::vector<Entry> m_overflow;
+};
+
 /*
 	List of timers of all the nodes of a block
+
+	While the block is active the list is attached to the environment's
+	NodeTimerWheel and elapsed times are derived from the wheel time,
+	so nothing has to be done per timer and step.
 */
 
 class NodeTimerList
 {
 public:
-	NodeTimerList() {}
+	NodeTimerList(): m_wheel(NULL) {}
 	~NodeTimerList() {}
-	
+
 	void serialize(std::ostream &os, u8 map_format_version) const;
 	void deSerialize(std::istream &is, u8 map_format_version);
-	
+
 	// Get timer
-	NodeTimer get(v3s16 p){
-		std::map<v3s16, NodeTimer>::iterator n = m_data.find(p);
+	NodeTimer get(v3s16 p) const {
+		std::map<v3s16, Timer>::const_iterator n = m_data.find(p);
 		if(n == m_data.end())
 			return NodeTimer();
-		return n->second;
+		return NodeTimer(n->second.timeout, getElapsed(n->second));
 	}
 	// Deletes timer
 	void remove(v3s16 p){
 		m_data.erase(p);
 	}
 	// Deletes old timer and sets a new one
-	void set(v3s16 p, NodeTimer t){
-		m_data[p] = t;
-	}
+	void set(v3s16 p, NodeTimer t);
 	// Deletes all timers
 	void clear(){
 		m_data.clear();
 	}
 
-	// A step in time. Returns map of elapsed timers.
-	std::map<v3s16, NodeTimer> step(float dtime);
+	// Hands the timers over to a wheel, or takes them back from it
+	void attach(NodeTimerWheel *wheel, v3s16 blockpos);
+	void detach();
+	bool isAttached() const { return m_wheel != NULL; }
+
+	/*
+		Called for an entry expired in the attached wheel. If it still
+		refers to the timer at p, the timer is removed, returned in t and
+		true is returned.
+	*/
+	bool takeExpired(v3s16 p, u64 tick, NodeTimer &t);
+
+	// A step in time for a list that is not attached. Appends the elapsed
+	// timers to the vector and removes them.
+	void step(float dtime, std::vector<std::pair<v3s16, NodeTimer> > &elapsed);
 
 private:
-	std::map<v3s16, NodeTimer> m_data;
+	struct Timer
+	{
+		f32 timeout;
+		// Elapsed time while detached, start time in the wheel otherwise
+		double elapsed_or_start;
+		// Tick of the wheel entry; 0 while detached
+		u64 tick;
+	};
+
+	f32 getElapsed(const Timer &t) const
+	{
+		if(m_wheel)
+			return m_wheel->getTime() - t.elapsed_or_start;
+		return t.elapsed_or_start;
+	}
+
+	std::map<v3s16, Timer> m_data;
+	NodeTimerWheel *m_wheel;
+	v3s16 m_blockpos;
 };
 
 #endif
@@ -37,6 +37,14 @@
 #define NOISE_MAGIC_Z    52591
 #define NOISE_MAGIC_SEED 1013
 
+// SIMD kernels are compiled for their own targets and picked at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || \
+		(defined(__GNUC__) && (__GNUC__ > 4 || \
+		(__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+	#define NOISE_X86_KERNELS
+	#include <immintrin.h>
+#endif
+
 typedef float (*Interp2dFxn)(
 		float v00, float v10, float v01, float v11,
 		float x, float y);
@@ -416,6 +424,498 @@ float NoisePerlin3D(NoiseParams *np, float x, float y, float z, int seed)
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+	Inner loops of the bulk noise functions.
+
+	A map row is interpolated from the lattice rows around it, with each map
+	column using the lattice column and weight in noisex[] and tx[]. Every
+	kernel does the same operations in the same order, so results are
+	bit-identical unless the compiler may reorder floating point math. With
+	-ffast-math, as in release builds, they differ by a few ulp.
+*/
+
+struct NoiseKernelFuncs {
+	void (*interpRow2D)(float *out,
+		const float *row0, const float *row1,
+		const u32 *noisex, const float *tx, float ty, u32 n);
+	void (*interpRow3D)(float *out,
+		const float *row00, const float *row10,
+		const float *row01, const float *row11,
+		const u32 *noisex, const float *tx, float ty, float tz, u32 n);
+	void (*accumulate)(float *result, const float *gradient,
+		float g, size_t n);
+	void (*accumulateAbs)(float *result, const float *gradient,
+		float g, size_t n);
+	void (*accumulatePersist)(float *result, const float *gradient,
+		float *gmap, const float *persistence_map, size_t n);
+	void (*accumulatePersistAbs)(float *result, const float *gradient,
+		float *gmap, const float *persistence_map, size_t n);
+};
+
+
+static void interp_row_2d_scalar(float *out,
+	const float *row0, const float *row1,
+	const u32 *noisex, const float *tx, float ty, u32 n)
+{
+	for (u32 i = 0; i != n; i++) {
+		u32 nx = noisex[i];
+		float u = linearInterpolation(row0[nx], row0[nx + 1], tx[i]);
+		float v = linearInterpolation(row1[nx], row1[nx + 1], tx[i]);
+		out[i] = linearInterpolation(u, v, ty);
+	}
+}
+
+static void interp_row_3d_scalar(float *out,
+	const float *row00, const float *row10,
+	const float *row01, const float *row11,
+	const u32 *noisex, const float *tx, float ty, float tz, u32 n)
+{
+	for (u32 i = 0; i != n; i++) {
+		u32 nx = noisex[i];
+		float u = biLinearInterpolationNoEase(
+			row00[nx], row00[nx + 1], row10[nx], row10[nx + 1], tx[i], ty);
+		float v = biLinearInterpolationNoEase(
+			row01[nx], row01[nx + 1], row11[nx], row11[nx + 1], tx[i], ty);
+		out[i] = linearInterpolation(u, v, tz);
+	}
+}
+
+static void accumulate_scalar(float *result, const float *gradient,
+	float g, size_t n)
+{
+	for (size_t i = 0; i != n; i++)
+		result[i] += g * gradient[i];
+}
+
+static void accumulate_abs_scalar(float *result, const float *gradient,
+	float g, size_t n)
+{
+	for (size_t i = 0; i != n; i++)
+		result[i] += g * fabs(gradient[i]);
+}
+
+static void accumulate_persist_scalar(float *result, const float *gradient,
+	float *gmap, const float *persistence_map, size_t n)
+{
+	for (size_t i = 0; i != n; i++) {
+		result[i] += gmap[i] * gradient[i];
+		gmap[i] *= persistence_map[i];
+	}
+}
+
+static void accumulate_persist_abs_scalar(float *result, const float *gradient,
+	float *gmap, const float *persistence_map, size_t n)
+{
+	for (size_t i = 0; i != n; i++) {
+		result[i] += gmap[i] * fabs(gradient[i]);
+		gmap[i] *= persistence_map[i];
+	}
+}
+
+static const NoiseKernelFuncs noise_kernel_scalar = {
+	interp_row_2d_scalar,
+	interp_row_3d_scalar,
+	accumulate_scalar,
+	accumulate_abs_scalar,
+	accumulate_persist_scalar,
+	accumulate_persist_abs_scalar,
+};
+
+
+#ifdef NOISE_X86_KERNELS
+
+#define SSE2_TARGET __attribute__((target("sse2")))
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+SSE2_TARGET static inline __m128 lerp_sse2(__m128 v0, __m128 v1, __m128 t)
+{
+	return _mm_add_ps(v0, _mm_mul_ps(_mm_sub_ps(v1, v0), t));
+}
+
+SSE2_TARGET static inline __m128 abs_sse2(__m128 v)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.f), v);
+}
+
+// No gathers in SSE2, the lattice values are picked one by one
+#define GATHER_SSE2(row, nx, i) _mm_setr_ps( \
+	(row)[(nx)[(i)]],     (row)[(nx)[(i) + 1]], \
+	(row)[(nx)[(i) + 2]], (row)[(nx)[(i) + 3]])
+#define GATHER_NEXT_SSE2(row, nx, i) _mm_setr_ps( \
+	(row)[(nx)[(i)] + 1],     (row)[(nx)[(i) + 1] + 1], \
+	(row)[(nx)[(i) + 2] + 1], (row)[(nx)[(i) + 3] + 1])
+
+SSE2_TARGET static void interp_row_2d_sse2(float *out,
+	const float *row0, const float *row1,
+	const u32 *noisex, const float *tx, float ty, u32 n)
+{
+	__m128 vty = _mm_set1_ps(ty);
+
+	u32 i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 vtx = _mm_loadu_ps(&tx[i]);
+		__m128 u = lerp_sse2(GATHER_SSE2(row0, noisex, i),
+			GATHER_NEXT_SSE2(row0, noisex, i), vtx);
+		__m128 v = lerp_sse2(GATHER_SSE2(row1, noisex, i),
+			GATHER_NEXT_SSE2(row1, noisex, i), vtx);
+		_mm_storeu_ps(&out[i], lerp_sse2(u, v, vty));
+	}
+
+	interp_row_2d_scalar(out + i, row0, row1, noisex + i, tx + i, ty, n - i);
+}
+
+SSE2_TARGET static void interp_row_3d_sse2(float *out,
+	const float *row00, const float *row10,
+	const float *row01, const float *row11,
+	const u32 *noisex, const float *tx, float ty, float tz, u32 n)
+{
+	__m128 vty = _mm_set1_ps(ty);
+	__m128 vtz = _mm_set1_ps(tz);
+
+	u32 i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 vtx = _mm_loadu_ps(&tx[i]);
+		__m128 u = lerp_sse2(
+			lerp_sse2(GATHER_SSE2(row00, noisex, i),
+				GATHER_NEXT_SSE2(row00, noisex, i), vtx),
+			lerp_sse2(GATHER_SSE2(row10, noisex, i),
+				GATHER_NEXT_SSE2(row10, noisex, i), vtx),
+			vty);
+		__m128 v = lerp_sse2(
+			lerp_sse2(GATHER_SSE2(row01, noisex, i),
+				GATHER_NEXT_SSE2(row01, noisex, i), vtx),
+			lerp_sse2(GATHER_SSE2(row11, noisex, i),
+				GATHER_NEXT_SSE2(row11, noisex, i), vtx),
+			vty);
+		_mm_storeu_ps(&out[i], lerp_sse2(u, v, vtz));
+	}
+
+	interp_row_3d_scalar(out + i, row00, row10, row01, row11,
+		noisex + i, tx + i, ty, tz, n - i);
+}
+
+#undef GATHER_SSE2
+#undef GATHER_NEXT_SSE2
+
+SSE2_TARGET static void accumulate_sse2(float *result, const float *gradient,
+	float g, size_t n)
+{
+	__m128 vg = _mm_set1_ps(g);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 r = _mm_add_ps(_mm_loadu_ps(&result[i]),
+			_mm_mul_ps(vg, _mm_loadu_ps(&gradient[i])));
+		_mm_storeu_ps(&result[i], r);
+	}
+
+	accumulate_scalar(result + i, gradient + i, g, n - i);
+}
+
+SSE2_TARGET static void accumulate_abs_sse2(float *result,
+	const float *gradient, float g, size_t n)
+{
+	__m128 vg = _mm_set1_ps(g);
+
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 r = _mm_add_ps(_mm_loadu_ps(&result[i]),
+			_mm_mul_ps(vg, abs_sse2(_mm_loadu_ps(&gradient[i]))));
+		_mm_storeu_ps(&result[i], r);
+	}
+
+	accumulate_abs_scalar(result + i, gradient + i, g, n - i);
+}
+
+SSE2_TARGET static void accumulate_persist_sse2(float *result,
+	const float *gradient, float *gmap, const float *persistence_map,
+	size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 vg = _mm_loadu_ps(&gmap[i]);
+		__m128 r = _mm_add_ps(_mm_loadu_ps(&result[i]),
+			_mm_mul_ps(vg, _mm_loadu_ps(&gradient[i])));
+		_mm_storeu_ps(&result[i], r);
+		_mm_storeu_ps(&gmap[i],
+			_mm_mul_ps(vg, _mm_loadu_ps(&persistence_map[i])));
+	}
+
+	accumulate_persist_scalar(result + i, gradient + i,
+		gmap + i, persistence_map + i, n - i);
+}
+
+SSE2_TARGET static void accumulate_persist_abs_sse2(float *result,
+	const float *gradient, float *gmap, const float *persistence_map,
+	size_t n)
+{
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 vg = _mm_loadu_ps(&gmap[i]);
+		__m128 r = _mm_add_ps(_mm_loadu_ps(&result[i]),
+			_mm_mul_ps(vg, abs_sse2(_mm_loadu_ps(&gradient[i]))));
+		_mm_storeu_ps(&result[i], r);
+		_mm_storeu_ps(&gmap[i],
+			_mm_mul_ps(vg, _mm_loadu_ps(&persistence_map[i])));
+	}
+
+	accumulate_persist_abs_scalar(result + i, gradient + i,
+		gmap + i, persistence_map + i, n - i);
+}
+
+static const NoiseKernelFuncs noise_kernel_sse2 = {
+	interp_row_2d_sse2,
+	interp_row_3d_sse2,
+	accumulate_sse2,
+	accumulate_abs_sse2,
+	accumulate_persist_sse2,
+	accumulate_persist_abs_sse2,
+};
+
+
+AVX2_TARGET static inline __m256 lerp_avx2(__m256 v0, __m256 v1, __m256 t)
+{
+	return _mm256_add_ps(v0, _mm256_mul_ps(_mm256_sub_ps(v1, v0), t));
+}
+
+AVX2_TARGET static inline __m256 abs_avx2(__m256 v)
+{
+	return _mm256_andnot_ps(_mm256_set1_ps(-0.f), v);
+}
+
+/*
+	Gathers are slow on many CPUs. With the usual spreads, eight map columns
+	fall within a few lattice columns, so these are loaded at once and
+	permuted into place instead.
+*/
+struct LatticeColumnsAVX2 {
+	__m256i nx, nx1;
+	u32 base;
+	bool near;
+	__m256i mask;
+};
+
+AVX2_TARGET static inline void get_lattice_columns_avx2(
+	LatticeColumnsAVX2 *cols, const u32 *noisex)
+{
+	cols->nx  = _mm256_loadu_si256((const __m256i *)noisex);
+	cols->nx1 = _mm256_add_epi32(cols->nx, _mm256_set1_epi32(1));
+
+	cols->base = noisex[0];
+	u32 last = noisex[7] + 1 - cols->base;
+	cols->near = last < 8;
+	if (!cols->near)
+		return;
+
+	// Rows end right after the last column needed, so mask off the rest
+	cols->mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(last + 1),
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	__m256i base = _mm256_set1_epi32(cols->base);
+	cols->nx  = _mm256_sub_epi32(cols->nx, base);
+	cols->nx1 = _mm256_sub_epi32(cols->nx1, base);
+}
+
+AVX2_TARGET static inline __m256 lerp_lattice_avx2(
+	const LatticeColumnsAVX2 &cols, const float *row, __m256 tx)
+{
+	if (cols.near) {
+		__m256 v = _mm256_maskload_ps(row + cols.base, cols.mask);
+		return lerp_avx2(_mm256_permutevar8x32_ps(v, cols.nx),
+			_mm256_permutevar8x32_ps(v, cols.nx1), tx);
+	}
+
+	return lerp_avx2(_mm256_i32gather_ps(row, cols.nx, 4),
+		_mm256_i32gather_ps(row, cols.nx1, 4), tx);
+}
+
+AVX2_TARGET static void interp_row_2d_avx2(float *out,
+	const float *row0, const float *row1,
+	const u32 *noisex, const float *tx, float ty, u32 n)
+{
+	__m256 vty = _mm256_set1_ps(ty);
+
+	u32 i = 0;
+	for (; i + 8 <= n; i += 8) {
+		LatticeColumnsAVX2 cols;
+		get_lattice_columns_avx2(&cols, &noisex[i]);
+		__m256 vtx = _mm256_loadu_ps(&tx[i]);
+		__m256 u = lerp_lattice_avx2(cols, row0, vtx);
+		__m256 v = lerp_lattice_avx2(cols, row1, vtx);
+		_mm256_storeu_ps(&out[i], lerp_avx2(u, v, vty));
+	}
+
+	// The scalar code is not VEX encoded
+	_mm256_zeroupper();
+	interp_row_2d_scalar(out + i, row0, row1, noisex + i, tx + i, ty, n - i);
+}
+
+AVX2_TARGET static void interp_row_3d_avx2(float *out,
+	const float *row00, const float *row10,
+	const float *row01, const float *row11,
+	const u32 *noisex, const float *tx, float ty, float tz, u32 n)
+{
+	__m256 vty = _mm256_set1_ps(ty);
+	__m256 vtz = _mm256_set1_ps(tz);
+
+	u32 i = 0;
+	for (; i + 8 <= n; i += 8) {
+		LatticeColumnsAVX2 cols;
+		get_lattice_columns_avx2(&cols, &noisex[i]);
+		__m256 vtx = _mm256_loadu_ps(&tx[i]);
+		__m256 u = lerp_avx2(
+			lerp_lattice_avx2(cols, row00, vtx),
+			lerp_lattice_avx2(cols, row10, vtx),
+			vty);
+		__m256 v = lerp_avx2(
+			lerp_lattice_avx2(cols, row01, vtx),
+			lerp_lattice_avx2(cols, row11, vtx),
+			vty);
+		_mm256_storeu_ps(&out[i], lerp_avx2(u, v, vtz));
+	}
+
+	// The scalar code is not VEX encoded
+	_mm256_zeroupper();
+	interp_row_3d_scalar(out + i, row00, row10, row01, row11,
+		noisex + i, tx + i, ty, tz, n - i);
+}
+
+AVX2_TARGET static void accumulate_avx2(float *result, const float *gradient,
+	float g, size_t n)
+{
+	__m256 vg = _mm256_set1_ps(g);
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(&result[i]),
+			_mm256_mul_ps(vg, _mm256_loadu_ps(&gradient[i])));
+		_mm256_storeu_ps(&result[i], r);
+	}
+
+	// The scalar code is not VEX encoded
+	_mm256_zeroupper();
+	accumulate_scalar(result + i, gradient + i, g, n - i);
+}
+
+AVX2_TARGET static void accumulate_abs_avx2(float *result,
+	const float *gradient, float g, size_t n)
+{
+	__m256 vg = _mm256_set1_ps(g);
+
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(&result[i]),
+			_mm256_mul_ps(vg, abs_avx2(_mm256_loadu_ps(&gradient[i]))));
+		_mm256_storeu_ps(&result[i], r);
+	}
+
+	// The scalar code is not VEX encoded
+	_mm256_zeroupper();
+	accumulate_abs_scalar(result + i, gradient + i, g, n - i);
+}
+
+AVX2_TARGET static void accumulate_persist_avx2(float *result,
+	const float *gradient, float *gmap, const float *persistence_map,
+	size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 vg = _mm256_loadu_ps(&gmap[i]);
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(&result[i]),
+			_mm256_mul_ps(vg, _mm256_loadu_ps(&gradient[i])));
+		_mm256_storeu_ps(&result[i], r);
+		_mm256_storeu_ps(&gmap[i],
+			_mm256_mul_ps(vg, _mm256_loadu_ps(&persistence_map[i])));
+	}
+
+	// The scalar code is not VEX encoded
+	_mm256_zeroupper();
+	accumulate_persist_scalar(result + i, gradient + i,
+		gmap + i, persistence_map + i, n - i);
+}
+
+AVX2_TARGET static void accumulate_persist_abs_avx2(float *result,
+	const float *gradient, float *gmap, const float *persistence_map,
+	size_t n)
+{
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 vg = _mm256_loadu_ps(&gmap[i]);
+		__m256 r = _mm256_add_ps(_mm256_loadu_ps(&result[i]),
+			_mm256_mul_ps(vg, abs_avx2(_mm256_loadu_ps(&gradient[i]))));
+		_mm256_storeu_ps(&result[i], r);
+		_mm256_storeu_ps(&gmap[i],
+			_mm256_mul_ps(vg, _mm256_loadu_ps(&persistence_map[i])));
+	}
+
+	// The scalar code is not VEX encoded
+	_mm256_zeroupper();
+	accumulate_persist_abs_scalar(result + i, gradient + i,
+		gmap + i, persistence_map + i, n - i);
+}
+
+static const NoiseKernelFuncs noise_kernel_avx2 = {
+	interp_row_2d_avx2,
+	interp_row_3d_avx2,
+	accumulate_avx2,
+	accumulate_abs_avx2,
+	accumulate_persist_avx2,
+	accumulate_persist_abs_avx2,
+};
+
+#undef SSE2_TARGET
+#undef AVX2_TARGET
+
+#endif // NOISE_X86_KERNELS
+
+
+bool noise_kernel_supported(NoiseKernel kernel)
+{
+	switch (kernel) {
+	case NOISE_KERNEL_SCALAR:
+		return true;
+#ifdef NOISE_X86_KERNELS
+	case NOISE_KERNEL_SSE2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sse2");
+	case NOISE_KERNEL_AVX2:
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return false;
+	}
+}
+
+
+NoiseKernel noise_best_kernel()
+{
+	static const NoiseKernel best =
+		noise_kernel_supported(NOISE_KERNEL_AVX2) ? NOISE_KERNEL_AVX2 :
+		noise_kernel_supported(NOISE_KERNEL_SSE2) ? NOISE_KERNEL_SSE2 :
+		NOISE_KERNEL_SCALAR;
+	return best;
+}
+
+
+static const NoiseKernelFuncs *get_noise_kernel_funcs(NoiseKernel kernel)
+{
+	switch (kernel) {
+#ifdef NOISE_X86_KERNELS
+	case NOISE_KERNEL_SSE2:
+		return &noise_kernel_sse2;
+	case NOISE_KERNEL_AVX2:
+		return &noise_kernel_avx2;
+#endif
+	default:
+		return &noise_kernel_scalar;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+
 Noise::Noise(NoiseParams *np_, int seed, u32 sx, u32 sy, u32 sz)
 {
 	memcpy(&np, np_, sizeof(np));
@@ -427,6 +927,9 @@ Noise::Noise(NoiseParams *np_, int seed, u32 sx, u32 sy, u32 sz)
 	this->persist_buf  = NULL;
 	this->gradient_buf = NULL;
 	this->result       = NULL;
+	this->noisex_buf   = NULL;
+	this->tx_buf       = NULL;
+	this->kernel       = noise_best_kernel();
 
 	allocBuffers();
 }
@@ -438,6 +941,8 @@ Noise::~Noise()
 	delete[] persist_buf;
 	delete[] noise_buf;
 	delete[] result;
+	delete[] noisex_buf;
+	delete[] tx_buf;
 }
 
 
@@ -456,12 +961,16 @@ void Noise::allocBuffers()
 	delete[] gradient_buf;
 	delete[] persist_buf;
 	delete[] result;
+	delete[] noisex_buf;
+	delete[] tx_buf;
 
 	try {
 		size_t bufsize = sx * sy * sz;
 		this->persist_buf  = NULL;
 		this->gradient_buf = new float[bufsize];
 		this->result       = new float[bufsize];
+		this->noisex_buf   = new u32[sx];
+		this->tx_buf       = new float[sx];
 	} catch (std::bad_alloc &e) {
 		throw InvalidNoiseParamsException();
 	}
@@ -539,26 +1048,40 @@ void Noise::resizeNoiseBuf(bool is3d)
  * values from the previous noise lattice as midpoints in the new lattice for the
  * next octave.
  */
+void Noise::calcColumns(float u, float step_x, bool eased)
+{
+	u32 noisex = 0;
+	for (u32 i = 0; i != sx; i++) {
+		noisex_buf[i] = noisex;
+		tx_buf[i] = eased ? easeCurve(u) : u;
+
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+}
+
+
 #define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(
 		float x, float y,
 		float step_x, float step_y,
 		int seed)
 {
-	float v00, v01, v10, v11, u, v, orig_u;
-	u32 index, i, j, noisex, noisey;
+	float u, v;
+	u32 index, i, j, noisey;
 	u32 nlx, nly;
 	s32 x0, y0;
 
 	bool eased = np.flags & (NOISE_FLAG_DEFAULTS | NOISE_FLAG_EASED);
-	Interp2dFxn interpolate = eased ?
-		biLinearInterpolation : biLinearInterpolationNoEase;
+	const NoiseKernelFuncs *funcs = get_noise_kernel_funcs(kernel);
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (u32)(u + sx * step_x) + 2;
@@ -568,30 +1091,18 @@ void Noise::gradientMap2D(
 		for (i = 0; i != nlx; i++)
 			noise_buf[index++] = noise2d(x0 + i, y0 + j, seed);
 
+	//the lattice columns are the same for every row
+	calcColumns(u, step_x, eased);
+
 	//calculate interpolations
 	index  = 0;
 	noisey = 0;
 	for (j = 0; j != sy; j++) {
-		v00 = noise_buf[idx(0, noisey)];
-		v10 = noise_buf[idx(1, noisey)];
-		v01 = noise_buf[idx(0, noisey + 1)];
-		v11 = noise_buf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			gradient_buf[index++] = interpolate(v00, v10, v01, v11, u, v);
-
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noise_buf[idx(noisex + 1, noisey)];
-				v11 = noise_buf[idx(noisex + 1, noisey + 1)];
-			}
-		}
+		funcs->interpRow2D(&gradient_buf[index],
+			&noise_buf[idx(0, noisey)],
+			&noise_buf[idx(0, noisey + 1)],
+			noisex_buf, tx_buf, eased ? easeCurve(v) : v, sx);
+		index += sx;
 
 		v += step_y;
 		if (v >= 1.0) {
@@ -609,15 +1120,13 @@ void Noise::gradientMap3D(
 		float step_x, float step_y, float step_z,
 		int seed)
 {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	u32 index, i, j, k, noisex, noisey, noisez;
+	float u, v, w, orig_v;
+	u32 index, i, j, k, noisey, noisez;
 	u32 nlx, nly, nlz;
 	s32 x0, y0, z0;
 
-	Interp3dFxn interpolate = (np.flags & NOISE_FLAG_EASED) ?
-		triLinearInterpolation : triLinearInterpolationNoEase;
+	bool eased = np.flags & NOISE_FLAG_EASED;
+	const NoiseKernelFuncs *funcs = get_noise_kernel_funcs(kernel);
 
 	x0 = floor(x);
 	y0 = floor(y);
@@ -625,7 +1134,6 @@ void Noise::gradientMap3D(
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
 	orig_v = v;
 
 	//calculate noise point lattice
@@ -638,45 +1146,26 @@ void Noise::gradientMap3D(
 			for (i = 0; i != nlx; i++)
 				noise_buf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
 
+	//the lattice columns are the same for every row
+	calcColumns(u, step_x, eased);
+
 	//calculate interpolations
 	index  = 0;
 	noisey = 0;
 	noisez = 0;
 	for (k = 0; k != sz; k++) {
+		float tz = eased ? easeCurve(w) : w;
+
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
-			v000 = noise_buf[idx(0, noisey,     noisez)];
-			v100 = noise_buf[idx(1, noisey,     noisez)];
-			v010 = noise_buf[idx(0, noisey + 1, noisez)];
-			v110 = noise_buf[idx(1, noisey + 1, noisez)];
-			v001 = noise_buf[idx(0, noisey,     noisez + 1)];
-			v101 = noise_buf[idx(1, noisey,     noisez + 1)];
-			v011 = noise_buf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noise_buf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				gradient_buf[index++] = interpolate(
-					v000, v100, v010, v110,
-					v001, v101, v011, v111,
-					u, v, w);
-
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noise_buf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noise_buf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noise_buf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noise_buf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
-			}
+			funcs->interpRow3D(&gradient_buf[index],
+				&noise_buf[idx(0, noisey,     noisez)],
+				&noise_buf[idx(0, noisey + 1, noisez)],
+				&noise_buf[idx(0, noisey,     noisez + 1)],
+				&noise_buf[idx(0, noisey + 1, noisez + 1)],
+				noisex_buf, tx_buf, eased ? easeCurve(v) : v, tz, sx);
+			index += sx;
 
 			v += step_y;
 			if (v >= 1.0) {
@@ -773,27 +1262,21 @@ float *Noise::perlinMap3D(float x, float y, float z, float *persistence_map)
 void Noise::updateResults(float g, float *gmap,
 	float *persistence_map, size_t bufsize)
 {
-	// This looks very ugly, but it is 50-70% faster than having
-	// conditional statements inside the loop
+	const NoiseKernelFuncs *funcs = get_noise_kernel_funcs(kernel);
+
+	// Separate loops are 50-70% faster than having conditional
+	// statements inside the loop
 	if (np.flags & NOISE_FLAG_ABSVALUE) {
-		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * fabs(gradient_buf[i]);
-				gmap[i] *= persistence_map[i];
-			}
-		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * fabs(gradient_buf[i]);
-		}
+		if (persistence_map)
+			funcs->accumulatePersistAbs(result, gradient_buf,
+				gmap, persistence_map, bufsize);
+		else
+			funcs->accumulateAbs(result, gradient_buf, g, bufsize);
 	} else {
-		if (persistence_map) {
-			for (size_t i = 0; i != bufsize; i++) {
-				result[i] += gmap[i] * gradient_buf[i];
-				gmap[i] *= persistence_map[i];
-			}
-		} else {
-			for (size_t i = 0; i != bufsize; i++)
-				result[i] += g * gradient_buf[i];
-		}
+		if (persistence_map)
+			funcs->accumulatePersist(result, gradient_buf,
+				gmap, persistence_map, bufsize);
+		else
+			funcs->accumulate(result, gradient_buf, g, bufsize);
 	}
 }
@@ -136,8 +136,28 @@ struct NoiseParams {
 		lacunarity = lacunarity_;
 		flags      = flags_;
 	}
+
+	bool operator==(const NoiseParams &other) const
+	{
+		return offset == other.offset && scale == other.scale &&
+			spread == other.spread && seed == other.seed &&
+			octaves == other.octaves && persist == other.persist &&
+			lacunarity == other.lacunarity && flags == other.flags;
+	}
+};
+
+
+// Implementations of the bulk noise loops, picked at runtime
+enum NoiseKernel {
+	NOISE_KERNEL_SCALAR,
+	NOISE_KERNEL_SSE2,
+	NOISE_KERNEL_AVX2,
 };
 
+bool noise_kernel_supported(NoiseKernel kernel);
+// The fastest kernel this CPU supports
+NoiseKernel noise_best_kernel();
+
 
 // Convenience macros for getting/setting NoiseParams in Settings as a string
 // WARNING:  Deprecated, use Settings::getNoiseParamsFromValue() instead
@@ -156,6 +176,8 @@ public:
 	float *gradient_buf;
 	float *persist_buf;
 	float *result;
+	// Defaults to noise_best_kernel()
+	NoiseKernel kernel;
 
 	Noise(NoiseParams *np, int seed, u32 sx, u32 sy, u32 sz=1);
 	~Noise();
@@ -196,8 +218,13 @@ public:
 	}
 
 private:
+	// Lattice column and interpolation weight of each map column
+	u32 *noisex_buf;
+	float *tx_buf;
+
 	void allocBuffers();
 	void resizeNoiseBuf(bool is3d);
+	void calcColumns(float u, float step_x, bool eased);
 	void updateResults(float g, float *gmap, float *persistence_map, size_t bufsize);
 
 };
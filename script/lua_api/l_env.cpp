@@ -90,6 +90,79 @@ void LuaABM::trigger(ServerEnvironment *env, v3s16 p, MapNode n,
 	lua_pop(L, 1); // Pop error handler
 }
 
+/*
+	Calls action(pos_list, node_list, active_object_count,
+	active_object_count_wider) once for all triggered nodes of a block.
+	node_list and the node tables in it are reused between calls, so the
+	callback must copy entries it wants to keep.
+*/
+void LuaABM::triggerBatch(ServerEnvironment *env,
+		const std::vector<v3s16> &positions,
+		const std::vector<MapNode> &nodes,
+		u32 active_object_count, u32 active_object_count_wider)
+{
+	GameScripting *scriptIface = env->getScriptIface();
+	scriptIface->realityCheck();
+
+	lua_State *L = scriptIface->getStack();
+	sanity_check(lua_checkstack(L, 20));
+	StackUnroller stack_unroller(L);
+
+	INodeDefManager *ndef = env->getGameDef()->ndef();
+
+	int error_handler = PUSH_ERROR_HANDLER(L);
+
+	// Get registered_abms
+	lua_getglobal(L, "core");
+	lua_getfield(L, -1, "registered_abms");
+	luaL_checktype(L, -1, LUA_TTABLE);
+	lua_remove(L, -2); // Remove core
+
+	// Get registered_abms[m_id]
+	lua_pushnumber(L, m_id);
+	lua_gettable(L, -2);
+	if(lua_isnil(L, -1))
+		FATAL_ERROR("");
+	lua_remove(L, -2); // Remove registered_abms
+
+	scriptIface->setOriginFromTable(-1);
+
+	// Call action
+	luaL_checktype(L, -1, LUA_TTABLE);
+	lua_getfield(L, -1, "action");
+	luaL_checktype(L, -1, LUA_TFUNCTION);
+	lua_remove(L, -2); // Remove registered_abms[m_id]
+
+	lua_createtable(L, positions.size(), 0);
+	for (u32 i = 0; i < positions.size(); i++) {
+		push_v3s16(L, positions[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	// Fresh tables every time, the action may keep them
+	lua_createtable(L, nodes.size(), 0);
+	for (u32 i = 0; i < nodes.size(); i++) {
+		const MapNode &n = nodes[i];
+		lua_createtable(L, 0, 3);
+		lua_pushstring(L, ndef->get(n).name.c_str());
+		lua_setfield(L, -2, "name");
+		lua_pushnumber(L, n.getParam1());
+		lua_setfield(L, -2, "param1");
+		lua_pushnumber(L, n.getParam2());
+		lua_setfield(L, -2, "param2");
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	lua_pushnumber(L, active_object_count);
+	lua_pushnumber(L, active_object_count_wider);
+
+	int result = lua_pcall(L, 4, 0, error_handler);
+	if (result)
+		scriptIface->scriptError(result, "LuaABM::triggerBatch");
+
+	lua_pop(L, 1); // Pop error handler
+}
+
 void LuaLBM::trigger(ServerEnvironment *env, v3s16 p, MapNode n)
 {
 	GameScripting *scriptIface = env->getScriptIface();
@@ -620,6 +693,17 @@ int ModApiEnvMod::l_find_node_near(lua_State *L)
 	return 0;
 }
 
+// Whether a block may contain nodes of the filter, using its content
+// summary. Nodes of unloaded blocks read as ignore.
+static bool block_may_contain(Map &map, v3s16 blockpos,
+		const std::set<content_t> &filter)
+{
+	MapBlock *block = map.getBlockNoCreateNoEx(blockpos);
+	if (block == NULL || block->isDummy())
+		return filter.count(CONTENT_IGNORE) != 0;
+	return block->mayContainAny(filter);
+}
+
 // find_nodes_in_area(minp, maxp, nodenames) -> list of positions
 // nodenames: eg. {"ignore", "group:tree"} or "default:dirt"
 int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
@@ -646,13 +730,29 @@ int ModApiEnvMod::l_find_nodes_in_area(lua_State *L)
 
 	std::map<content_t, u16> individual_count;
 
+	Map &map = env->getMap();
+	v3s16 last_blockpos(0, 0, 0);
+	bool last_may_contain = false;
+	bool have_last = false;
+
 	lua_newtable(L);
 	u64 i = 0;
 	for (s16 x = minp.X; x <= maxp.X; x++)
 		for (s16 y = minp.Y; y <= maxp.Y; y++)
 			for (s16 z = minp.Z; z <= maxp.Z; z++) {
 				v3s16 p(x, y, z);
-				content_t c = env->getMap().getNodeNoEx(p).getContent();
+				v3s16 blockpos = getNodeBlockPos(p);
+				if (!have_last || blockpos != last_blockpos) {
+					last_blockpos = blockpos;
+					last_may_contain = block_may_contain(map, blockpos, filter);
+					have_last = true;
+				}
+				// Skip the rest of this row inside the block
+				if (!last_may_contain) {
+					z = MYMIN(maxp.Z, blockpos.Z * MAP_BLOCKSIZE + MAP_BLOCKSIZE - 1);
+					continue;
+				}
+				content_t c = map.getNodeNoEx(p).getContent();
 				if (filter.count(c) != 0) {
 					push_v3s16(L, p);
 					lua_rawseti(L, -2, ++i);
@@ -186,17 +186,20 @@ private:
 	float m_trigger_interval;
 	u32 m_trigger_chance;
 	bool m_simple_catch_up;
+	bool m_batch;
 public:
 	LuaABM(lua_State *L, int id,
 			const std::set<std::string> &trigger_contents,
 			const std::set<std::string> &required_neighbors,
-			float trigger_interval, u32 trigger_chance, bool simple_catch_up):
+			float trigger_interval, u32 trigger_chance, bool simple_catch_up,
+			bool batch = false):
 		m_id(id),
 		m_trigger_contents(trigger_contents),
 		m_required_neighbors(required_neighbors),
 		m_trigger_interval(trigger_interval),
 		m_trigger_chance(trigger_chance),
-		m_simple_catch_up(simple_catch_up)
+		m_simple_catch_up(simple_catch_up),
+		m_batch(batch)
 	{
 	}
 	virtual std::set<std::string> getTriggerContents()
@@ -219,8 +222,16 @@ public:
 	{
 		return m_simple_catch_up;
 	}
+	virtual bool getBatched()
+	{
+		return m_batch;
+	}
 	virtual void trigger(ServerEnvironment *env, v3s16 p, MapNode n,
 			u32 active_object_count, u32 active_object_count_wider);
+	virtual void triggerBatch(ServerEnvironment *env,
+			const std::vector<v3s16> &positions,
+			const std::vector<MapNode> &nodes,
+			u32 active_object_count, u32 active_object_count_wider);
 };
 
 class LuaLBM : public LoadingBlockModifierDef
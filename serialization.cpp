@@ -20,10 +20,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"
 
 #include "util/serialize.h"
+#include "util/string.h"
 #ifdef _WIN32
 	#define ZLIB_WINAPI
 #endif
 #include "zlib.h"
+#if USE_ZSTD
+	#include <zstd.h>
+#endif
 
 /* report a zlib or i/o error */
 void zerr(int ret)
@@ -186,6 +190,122 @@ void decompressZlib(std::istream &is, std::ostream &os)
 	inflateEnd(&z);
 }
 
+#if USE_ZSTD
+// Limits what a peer or database can make decompressZstd allocate
+#define ZSTD_MAX_CONTENT_SIZE 0x4000000
+
+void compressZstd(const std::string &data, std::ostream &os, int level)
+{
+	size_t bound = ZSTD_compressBound(data.size());
+	Buffer<char> output(bound + 4);
+	size_t size = ZSTD_compress(&output[4], bound,
+			data.c_str(), data.size(), level);
+	if (ZSTD_isError(size)) {
+		dstream << "compressZstd: " << ZSTD_getErrorName(size) << std::endl;
+		throw SerializationError("compressZstd: compress failed");
+	}
+	writeU32((u8 *)&output[0], size);
+	os.write(&output[0], size + 4);
+}
+
+void decompressZstd(std::istream &is, std::ostream &os)
+{
+	u8 tmp[4];
+	is.read((char *)tmp, 4);
+	if (is.gcount() != 4)
+		throw SerializationError("decompressZstd: stream ended early");
+	u32 size = readU32(tmp);
+	if (size > ZSTD_compressBound(ZSTD_MAX_CONTENT_SIZE))
+		throw SerializationError("decompressZstd: frame too large");
+
+	std::string input(size, '\0');
+	is.read(&input[0], size);
+	if ((u32)is.gcount() != size)
+		throw SerializationError("decompressZstd: stream ended early");
+
+	unsigned long long content_size =
+			ZSTD_getFrameContentSize(input.c_str(), size);
+	if (content_size == ZSTD_CONTENTSIZE_ERROR ||
+			content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+			content_size > ZSTD_MAX_CONTENT_SIZE)
+		throw SerializationError("decompressZstd: invalid frame");
+
+	Buffer<char> output(content_size);
+	size_t ret = ZSTD_decompress(*output, content_size, input.c_str(), size);
+	if (ZSTD_isError(ret) || ret != content_size) {
+		dstream << "decompressZstd: " << ZSTD_getErrorName(ret) << std::endl;
+		throw SerializationError("decompressZstd: decompress failed");
+	}
+	os.write(*output, content_size);
+}
+#endif
+
+bool block_codec_supported(u8 codec)
+{
+	switch (codec) {
+	case BLOCK_CODEC_ZLIB:
+		return true;
+#if USE_ZSTD
+	case BLOCK_CODEC_ZSTD:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+bool parse_block_codec(const std::string &name, u8 *codec)
+{
+	if (name == "zlib")
+		*codec = BLOCK_CODEC_ZLIB;
+	else if (name == "zstd")
+		*codec = BLOCK_CODEC_ZSTD;
+	else
+		return false;
+	return block_codec_supported(*codec);
+}
+
+int parse_block_codec_level(const std::string &value)
+{
+	if (value.empty() || value == "default")
+		return BLOCK_CODEC_LEVEL_DEFAULT;
+	return stoi(value);
+}
+
+void compressBlockCodec(const std::string &data, std::ostream &os,
+		u8 codec, int level)
+{
+	bool use_default = level == BLOCK_CODEC_LEVEL_DEFAULT;
+	switch (codec) {
+	case BLOCK_CODEC_ZLIB:
+		compressZlib(data, os, use_default ? Z_DEFAULT_COMPRESSION : level);
+		return;
+#if USE_ZSTD
+	case BLOCK_CODEC_ZSTD:
+		compressZstd(data, os, use_default ? 0 : level);
+		return;
+#endif
+	default:
+		throw SerializationError("compressBlockCodec: unsupported codec");
+	}
+}
+
+void decompressBlockCodec(std::istream &is, std::ostream &os, u8 codec)
+{
+	switch (codec) {
+	case BLOCK_CODEC_ZLIB:
+		decompressZlib(is, os);
+		return;
+#if USE_ZSTD
+	case BLOCK_CODEC_ZSTD:
+		decompressZstd(is, os);
+		return;
+#endif
+	default:
+		throw SerializationError("decompressBlockCodec: unsupported codec");
+	}
+}
+
 void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
 {
 	if(version >= 11)
@@ -22,7 +22,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "irrlichttypes.h"
 #include "exceptions.h"
+#include "config.h"
 #include <iostream>
+#include <climits>
 #include "util/pointer.h"
 
 /*
@@ -62,11 +64,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	24: 16-bit node ids and node timers (never released as stable)
 	25: Improved node timer format
 	26: Never written; read the same as 25
+	27: MapBlock compression codec byte (zlib or zstd)
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
+// Only builds that can decode every codec may advertise 27
+#if USE_ZSTD
+#define SER_FMT_VER_HIGHEST_READ 27
+#else
 #define SER_FMT_VER_HIGHEST_READ 26
+#endif
 // Saved on disk version
 #define SER_FMT_VER_HIGHEST_WRITE 25
 // Lowest supported serialization version
@@ -75,6 +83,21 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 // Can't do < 24 anymore; we have 16-bit dynamically allocated node IDs
 // in memory; conversion just won't work in this direction.
 #define SER_FMT_VER_LOWEST_WRITE 24
+// Lowest version which stores the MapBlock compression codec
+#define SER_FMT_VER_BLOCK_CODEC 27
+
+/*
+	MapBlock compression codecs, stored as u8 from version 27 on
+*/
+#define BLOCK_CODEC_ZLIB 0
+#define BLOCK_CODEC_ZSTD 1
+
+/*
+	Compression level selecting the default level of the codec. Every other
+	level is passed to the codec as is; zstd takes negative levels for
+	faster compression, so this is out of the range of both.
+*/
+#define BLOCK_CODEC_LEVEL_DEFAULT INT_MIN
 
 inline bool ser_ver_supported(s32 v) {
 	return v >= SER_FMT_VER_LOWEST_READ && v <= SER_FMT_VER_HIGHEST_READ;
@@ -88,6 +111,22 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os, int level = -1);
 void compressZlib(const std::string &data, std::ostream &os, int level = -1);
 void decompressZlib(std::istream &is, std::ostream &os);
 
+#if USE_ZSTD
+// Written with a u32 length prefix as zstd frames can't be unget.
+// The level is passed to zstd as is, 0 is its default.
+void compressZstd(const std::string &data, std::ostream &os, int level = 0);
+void decompressZstd(std::istream &is, std::ostream &os);
+#endif
+
+bool block_codec_supported(u8 codec);
+// Returns false if the name isn't known or not compiled in
+bool parse_block_codec(const std::string &name, u8 *codec);
+// Returns BLOCK_CODEC_LEVEL_DEFAULT for "default" or ""
+int parse_block_codec_level(const std::string &value);
+void compressBlockCodec(const std::string &data, std::ostream &os,
+		u8 codec, int level = BLOCK_CODEC_LEVEL_DEFAULT);
+void decompressBlockCodec(std::istream &is, std::ostream &os, u8 codec);
+
 // These choose between zlib and a self-made one according to version
 void compress(SharedBuffer<u8> data, std::ostream &os, u8 version);
 //void compress(const std::string &data, std::ostream &os, u8 version);
@@ -193,6 +193,15 @@ Server::Server(
 	m_step_dtime = 0.0;
 	m_lag = g_settings->getFloat("dedicated_server_step");
 
+	std::string block_codec = g_settings->get("block_send_compression");
+	if (!parse_block_codec(block_codec, &m_block_send_codec)) {
+		warningstream << "Block compression \"" << block_codec
+			<< "\" not supported, sending zlib blocks" << std::endl;
+		m_block_send_codec = BLOCK_CODEC_ZLIB;
+	}
+	m_block_send_codec_level = parse_block_codec_level(
+		g_settings->get("block_send_compression_level"));
+
 	if(path_world == "")
 		throw ServerError("Supplied empty world path");
 
@@ -601,6 +610,15 @@ void Server::AsyncRunStep(bool initial_step)
 		Do background stuff
 	*/
 
+	/* Emerge queue lengths, counted once per step */
+	{
+		EmergeQueueStats stats;
+		m_emerge->getQueueStats(&stats);
+		g_profiler->avg("Emerge: queued loads", stats.queued[EMERGE_LANE_LOAD]);
+		g_profiler->avg("Emerge: queued generations",
+			stats.queued[EMERGE_LANE_GENERATE]);
+	}
+
 	/* Transform liquids */
 	m_liquid_transform_timer += dtime;
 	if(m_liquid_transform_timer >= m_liquid_transform_every)
@@ -2149,7 +2167,8 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 	*/
 
 	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
+	block->serialize(os, ver, false, m_block_send_codec,
+			m_block_send_codec_level);
 	block->serializeNetworkSpecific(os, net_proto_version);
 	std::string s = os.str();
 
@@ -2657,6 +2676,9 @@ void Server::DeleteClient(u16 peer_id, ClientDeletionReason reason)
 				++i;
 		}
 
+		// Queued blocks are no longer ordered for this peer
+		m_emerge->removePeerFocus(peer_id);
+
 		Player *player = m_env->getPlayer(peer_id);
 
 		// Collect information about leaving in chat
@@ -594,6 +594,10 @@ private:
 	// Uptime of server in seconds
 	MutexedVariable<double> m_uptime;
 
+	// MapBlock compression for clients supporting SER_FMT_VER_BLOCK_CODEC
+	u8 m_block_send_codec;
+	int m_block_send_codec_level;
+
 	/*
 	 Client interface
 	 */
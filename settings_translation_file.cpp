@@ -325,6 +325,8 @@ fake_function() {
 	gettext("To reduce lag, block transfers are slowed down when a player is building something.\nThis determines how long they are slowed down after placing or removing a node.");
 	gettext("Max. packets per iteration");
 	gettext("Maximum number of packets sent per send step, if you have a slow connection\ntry reducing it, but don't reduce it to a number below double of targeted\nclient number.");
+	gettext("Packet bundling");
+	gettext("Pack small packets sent to the same peer during one send step into a single\ndatagram, which saves datagrams and header bytes. Only used with peers that\nsupport it.");
 	gettext("Game");
 	gettext("Default game");
 	gettext("Default game when creating a new world.\nThis will be overridden when creating a world from the main menu.");
@@ -372,6 +374,10 @@ fake_function() {
 	gettext("How large area of blocks are subject to the active block stuff, stated in mapblocks (16 nodes).\nIn active blocks objects are loaded and ABMs run.");
 	gettext("Max block send distance");
 	gettext("From how far blocks are sent to clients, stated in mapblocks (16 nodes).");
+	gettext("Block send compression");
+	gettext("Codec used to compress mapblocks sent to clients: zlib or zstd.\nzstd compresses about as well as zlib at a fraction of the CPU time,\nbut is only available if the server was built with zstd.\nClients too old to know the codec still get zlib mapblocks.");
+	gettext("Block send compression level");
+	gettext("Compression level of mapblocks sent to clients, passed to the codec as is.\nzlib takes 0 to 9, zstd takes negative levels for faster compression up to 22.\ndefault = the default level of the codec.");
 	gettext("Maximum forceloaded blocks");
 	gettext("Maximum number of forceloaded mapblocks.");
 	gettext("Time send interval");
@@ -407,16 +413,24 @@ fake_function() {
 	gettext("Number of extra blocks that can be loaded by /clearobjects at once.\nThis is a trade-off between sqlite transaction overhead and\nmemory consumption (4096=100MB, as a rule of thumb).");
 	gettext("Unload unused server data");
 	gettext("How much the server will wait before unloading unused mapblocks.\nHigher value is smoother, but will use more RAM.");
+	gettext("Mapblock packing");
+	gettext("Pack the nodes of mapblocks that were not used or changed for a while\nwith a palette of their few node types. Saves memory on large worlds,\nreads of packed mapblocks are slower.");
 	gettext("Maxmimum objects per block");
 	gettext("Maximum number of statically stored objects in a block.");
 	gettext("Synchronous SQLite");
 	gettext("See http://www.sqlite.org/pragma.html#pragma_synchronous");
+	gettext("SQLite write-ahead log");
+	gettext("Open the sqlite3 map database in write-ahead log mode, so that loading\nmapblocks on the emerge threads doesn't wait for the server saving them.\nSee http://www.sqlite.org/wal.html");
+	gettext("Map write queue size");
+	gettext("Number of mapblock saves compressed and written behind the server thread.\nSaving waits for the writer when this many are queued.\n0 = save synchronously.");
 	gettext("Dedicated server step");
 	gettext("Length of a server tick and the interval at which objects are generally updated over network.");
 	gettext("Active Block Management interval");
 	gettext("Time in between active block management cycles");
 	gettext("Active Block Modifier interval");
 	gettext("Length of time between ABM execution cycles");
+	gettext("Number of ABM threads");
+	gettext("Threads that scan active blocks for ABM matches next to the server thread.\n-1 = half of the processors, after leaving two for the server and other threads.\n0 = scan on the server thread only.");
 	gettext("NodeTimer interval");
 	gettext("Length of time between NodeTimer execution cycles");
 	gettext("Ignore world errors");
@@ -427,6 +441,8 @@ fake_function() {
 	gettext("The time (in seconds) that the liquids queue may grow beyond processing\ncapacity until an attempt is made to decrease its size by dumping old queue\nitems.  A value of 0 disables the functionality.");
 	gettext("Liquid update tick");
 	gettext("Liquid update interval in seconds.");
+	gettext("Number of liquid threads");
+	gettext("Threads that compute liquid flow next to the server thread.\n-1 = half of the processors, after leaving two for the server and other threads.\n0 = compute it on the server thread only.");
 	gettext("Mapgen");
 	gettext("Mapgen name");
 	gettext("Name of map generator to be used when creating a new world.\nCreating a world in the main menu will override this.");
@@ -451,6 +467,10 @@ fake_function() {
 	gettext("Maximum number of blocks to be queued that are to be generated.\nSet to blank for an appropriate amount to be chosen automatically.");
 	gettext("Number of emerge threads");
 	gettext("Number of emerge threads to use. Make this field blank, or increase this number\nto use multiple threads. On multiprocessor systems, this will improve mapgen speed greatly\nat the cost of slightly buggy caves.");
+	gettext("Mapgen noise cache size");
+	gettext("Number of 2D noise maps kept for mapchunks in the same column.\nMapchunks above and below each other reuse them instead of computing them again.\n0 = no cache.");
+	gettext("Number of mapgen worker threads");
+	gettext("Threads that help the emerge threads with the noise of a mapchunk.\n-1 = half of the processors, after leaving two for the server and other threads.\n0 = no helpers.");
 	gettext("Mapgen biome heat noise parameters");
 	gettext("Noise parameters for biome API temperature, humidity and biome blend.");
 	gettext("Mapgen heat blend noise parameters");
@@ -51,6 +51,18 @@ DEALINGS IN THE SOFTWARE.
 	#define THREAD_PRIORITY_HIGHEST      4
 #endif
 
+/*
+ * Storage class for thread local variables. Only use it with POD types,
+ * __thread and __declspec(thread) don't run constructors.
+ */
+#if __cplusplus >= 201103L
+	#define THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 
 class Thread {
 public:
@@ -24,8 +24,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes_extrabloated.h"
 #include "log.h"
 #include "serialization.h"
+#include "util/serialize.h"
 #include "nodedef.h"
 #include "noise.h"
+#include "mapblock.h"
 
 class TestCompression : public TestBase {
 public:
@@ -37,6 +39,8 @@ public:
 	void testRLECompression();
 	void testZlibCompression();
 	void testZlibLargeData();
+	void testBlockCodecs(IGameDef *gamedef);
+	void testBlockCodecBenchmark();
 };
 
 static TestCompression g_test_instance;
@@ -46,6 +50,37 @@ void TestCompression::runTests(IGameDef *gamedef)
 	TEST(testRLECompression);
 	TEST(testZlibCompression);
 	TEST(testZlibLargeData);
+	TEST(testBlockCodecs, gamedef);
+	TEST(testBlockCodecBenchmark);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const u8 block_codecs[] = { BLOCK_CODEC_ZLIB, BLOCK_CODEC_ZSTD };
+static const char *block_codec_names[] = { "zlib", "zstd" };
+
+/*
+	Fills nodes like a generated mapblock: stone below a noise heightmap,
+	a water level and air with full sunlight above.
+*/
+static void make_test_block(MapNode *nodes, v3s16 blockpos)
+{
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++) {
+		v3s16 p = blockpos * MAP_BLOCKSIZE + v3s16(x, 0, z);
+		s16 height = 20 * noise2d_perlin(p.X / 40.0, p.Z / 40.0, 1337, 4, 0.6);
+		for (s16 y = 0; y < MAP_BLOCKSIZE; y++) {
+			MapNode &n = nodes[z * MapBlock::zstride +
+				y * MapBlock::ystride + x];
+			s16 abs_y = p.Y + y;
+			if (abs_y <= height)
+				n = MapNode(abs_y == height ? t_CONTENT_GRASS : t_CONTENT_STONE);
+			else if (abs_y <= 0)
+				n = MapNode(t_CONTENT_WATER, 15 - MYMIN(-abs_y, 15));
+			else
+				n = MapNode(CONTENT_AIR, LIGHT_SUN);
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -170,3 +205,140 @@ void TestCompression::testZlibLargeData()
 				i, str_decompressed[i], i, data_in[i]);
 	}
 }
+
+void TestCompression::testBlockCodecs(IGameDef *gamedef)
+{
+	u8 codec;
+	UASSERT(parse_block_codec("zlib", &codec) && codec == BLOCK_CODEC_ZLIB);
+	UASSERT(!parse_block_codec("rle", &codec));
+	UASSERT(!block_codec_supported(0xFF));
+
+	UASSERT(parse_block_codec_level("default") == BLOCK_CODEC_LEVEL_DEFAULT);
+	UASSERT(parse_block_codec_level("-1") == -1);
+	UASSERT(parse_block_codec_level("5") == 5);
+
+	std::string data_in(3000, 'a');
+	for (u32 i = 0; i < data_in.size(); i += 7)
+		data_in[i] = i;
+
+	for (u32 i = 0; i < ARRLEN(block_codecs); i++) {
+		if (!block_codec_supported(block_codecs[i]))
+			continue;
+
+		// Trailing data must be left in the stream
+		std::ostringstream os(std::ios_base::binary);
+		compressBlockCodec(data_in, os, block_codecs[i]);
+		os << "tail";
+
+		std::istringstream is(os.str(), std::ios_base::binary);
+		std::ostringstream os2(std::ios_base::binary);
+		decompressBlockCodec(is, os2, block_codecs[i]);
+		UASSERT(os2.str() == data_in);
+
+		std::string tail;
+		is >> tail;
+		UASSERT(tail == "tail");
+	}
+
+#if USE_ZSTD
+	// Negative levels are fast levels of zstd
+	std::ostringstream os_fast(std::ios_base::binary);
+	compressBlockCodec(data_in, os_fast, BLOCK_CODEC_ZSTD, -5);
+	std::istringstream is_fast(os_fast.str(), std::ios_base::binary);
+	std::ostringstream os_out(std::ios_base::binary);
+	decompressBlockCodec(is_fast, os_out, BLOCK_CODEC_ZSTD);
+	UASSERT(os_out.str() == data_in);
+
+	// Size prefixes must be checked before anything is allocated
+	std::string compressed = os_fast.str();
+	std::string oversized = compressed;
+	writeU32((u8 *)&oversized[0], 0xFFFFFFFF);
+	std::string truncated = compressed.substr(0, compressed.size() / 2);
+	std::string short_prefix = compressed.substr(0, 3);
+
+	std::istringstream is_oversized(oversized, std::ios_base::binary);
+	std::istringstream is_truncated(truncated, std::ios_base::binary);
+	std::istringstream is_short(short_prefix, std::ios_base::binary);
+	EXCEPTION_CHECK(SerializationError,
+		decompressBlockCodec(is_oversized, os_out, BLOCK_CODEC_ZSTD));
+	EXCEPTION_CHECK(SerializationError,
+		decompressBlockCodec(is_truncated, os_out, BLOCK_CODEC_ZSTD));
+	EXCEPTION_CHECK(SerializationError,
+		decompressBlockCodec(is_short, os_out, BLOCK_CODEC_ZSTD));
+#endif
+
+	if (SER_FMT_VER_HIGHEST_READ < SER_FMT_VER_BLOCK_CODEC)
+		return;
+
+	// Whole block over the network with the non-default codec
+	MapNode nodes[MapBlock::nodecount];
+	make_test_block(nodes, v3s16(0, 0, 0));
+
+	MapBlock block(NULL, v3s16(0, 0, 0), gamedef);
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		block.setNodeNoCheck(x, y, z,
+			nodes[z * MapBlock::zstride + y * MapBlock::ystride + x]);
+
+	std::ostringstream os(std::ios_base::binary);
+	block.serialize(os, SER_FMT_VER_BLOCK_CODEC, false, BLOCK_CODEC_ZSTD);
+
+	MapBlock block2(NULL, v3s16(0, 0, 0), gamedef);
+	std::istringstream is(os.str(), std::ios_base::binary);
+	block2.deSerialize(is, SER_FMT_VER_BLOCK_CODEC, false);
+
+	bool valid;
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		UASSERT(block2.getNodeNoCheck(x, y, z, &valid) ==
+			nodes[z * MapBlock::zstride + y * MapBlock::ystride + x]);
+}
+
+void TestCompression::testBlockCodecBenchmark()
+{
+	// Node data of a 4x4x16 block column around the water level
+	std::vector<std::string> corpus;
+	size_t corpus_size = 0;
+	MapNode nodes[MapBlock::nodecount];
+	for (s16 z = -2; z < 2; z++)
+	for (s16 x = -2; x < 2; x++)
+	for (s16 y = -8; y < 8; y++) {
+		make_test_block(nodes, v3s16(x, y, z));
+		std::ostringstream os(std::ios_base::binary);
+		MapNode::serializeBulk(os, SER_FMT_VER_HIGHEST_WRITE, nodes,
+			MapBlock::nodecount, 2, 2, false);
+		corpus.push_back(os.str());
+		corpus_size += corpus.back().size();
+	}
+
+	for (u32 i = 0; i < ARRLEN(block_codecs); i++) {
+		if (!block_codec_supported(block_codecs[i]))
+			continue;
+
+		std::vector<std::string> compressed(corpus.size());
+		size_t compressed_size = 0;
+
+		u32 t0 = porting::getTimeMs();
+		for (u32 j = 0; j < corpus.size(); j++) {
+			std::ostringstream os(std::ios_base::binary);
+			compressBlockCodec(corpus[j], os, block_codecs[i]);
+			compressed[j] = os.str();
+			compressed_size += compressed[j].size();
+		}
+		u32 t1 = porting::getTimeMs();
+		for (u32 j = 0; j < corpus.size(); j++) {
+			std::istringstream is(compressed[j], std::ios_base::binary);
+			std::ostringstream os(std::ios_base::binary);
+			decompressBlockCodec(is, os, block_codecs[i]);
+			UASSERT(os.str() == corpus[j]);
+		}
+		u32 t2 = porting::getTimeMs();
+
+		infostream << "Block codec " << block_codec_names[i] << ": "
+			<< corpus.size() << " blocks, " << corpus_size << " -> "
+			<< compressed_size << " bytes, compress " << (t1 - t0)
+			<< "ms, decompress " << (t2 - t1) << "ms" << std::endl;
+	}
+}
@@ -38,7 +38,12 @@ public:
 	void runTests(IGameDef *gamedef);
 
 	void testHelpers();
+	void testCongestionControl();
+	void testSplitReassembly();
 	void testConnectSendReceive();
+	void testBundlePackets();
+	void testBundlingNegotiation();
+	void testBundlingBenchmark();
 };
 
 static TestConnection g_test_instance;
@@ -46,7 +51,12 @@ static TestConnection g_test_instance;
 void TestConnection::runTests(IGameDef *gamedef)
 {
 	TEST(testHelpers);
+	TEST(testCongestionControl);
+	TEST(testSplitReassembly);
 	TEST(testConnectSendReceive);
+	TEST(testBundlePackets);
+	TEST(testBundlingNegotiation);
+	TEST(testBundlingBenchmark);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -125,6 +135,102 @@ void TestConnection::testHelpers()
 }
 
 
+void TestConnection::testCongestionControl()
+{
+	con::CongestionControl cc;
+
+	// Nothing is known yet: no pacing, channels keep their window
+	UASSERT(cc.canSend(0));
+	UASSERT(cc.canSend(2));
+	UASSERT(cc.getWindowSize(2) == 0);
+
+	// Simulate a path delivering 40 packets of 512 bytes each 20ms
+	// (~1MB/s) with a rtt of 50ms
+	for (u32 step = 0; step < 500; step++) {
+		for (u32 i = 0; i < 40; i++)
+			cc.onAck(0.05, 512);
+		cc.step(0.02);
+	}
+
+	float bw = cc.getBandwidth();
+	UASSERT(bw > 1024000 * 0.9 && bw < 1024000 * 1.1);
+	UASSERT(cc.getMinRTT() == 0.05f);
+
+	// Bulk gets the larger part of the window
+	UASSERT(cc.getWindowSize(2) > cc.getWindowSize(0));
+	UASSERT(cc.getWindowSize(0) == cc.getWindowSize(1));
+
+	// Bulk pacing budget is finite, realtime may still borrow from it
+	u32 sent = 0;
+	while (cc.canSend(2) && sent < 1000) {
+		cc.onSent(2, 512);
+		sent++;
+	}
+	UASSERT(sent < 1000);
+	UASSERT(!cc.canSend(2));
+
+	cc.step(0.01);
+	UASSERT(cc.canSend(0));
+
+	// Rounds the sender ran out of data in don't lower the estimate
+	for (u32 step = 0; step < 500; step++) {
+		for (u32 i = 0; i < 10; i++)
+			cc.onAck(0.05, 512);
+		cc.onSendQueueEmpty();
+		cc.step(0.02);
+	}
+	UASSERT(cc.getBandwidth() > bw * 0.8);
+}
+
+static SharedBuffer<u8> make_split_chunk(u16 seqnum, u16 chunk_count,
+		u16 chunk_num, const u8 *data, u32 size)
+{
+	SharedBuffer<u8> chunk(SPLIT_HEADER_SIZE + size);
+	writeU8(&chunk[0], TYPE_SPLIT);
+	writeU16(&chunk[1], seqnum);
+	writeU16(&chunk[3], chunk_count);
+	writeU16(&chunk[5], chunk_num);
+	memcpy(&chunk[SPLIT_HEADER_SIZE], data, size);
+	return chunk;
+}
+
+void TestConnection::testSplitReassembly()
+{
+	const u32 chunk_size = 100;
+	const u16 chunk_count = 5;
+	const u32 size = chunk_size * (chunk_count - 1) + 42;
+	u8 data[size];
+	for (u32 i = 0; i < size; i++)
+		data[i] = i * 7;
+
+	// Last chunk first, then the others out of order with a duplicate
+	const u16 order[] = { 4, 2, 0, 2, 3, 1 };
+	con::IncomingSplitBuffer buf;
+	SharedBuffer<u8> result;
+	for (u32 i = 0; i < ARRLEN(order); i++) {
+		UASSERT(result.getSize() == 0);
+		u16 num = order[i];
+		u32 len = num == chunk_count - 1 ? 42 : chunk_size;
+		result = buf.insert(make_split_chunk(10, chunk_count, num,
+				&data[num * chunk_size], len), true);
+	}
+	UASSERT(result.getSize() == size);
+	UASSERT(memcmp(*result, data, size) == 0);
+
+	// Incomplete unreliable packets are dropped after the timeout, which
+	// the buffer picks up from the periodic call
+	buf.removeUnreliableTimedOuts(0.0, 1.0);
+	buf.insert(make_split_chunk(11, 2, 0, data, chunk_size), false);
+	for (u32 i = 0; i < 20; i++)
+		buf.removeUnreliableTimedOuts(0.1, 1.0);
+	result = buf.insert(make_split_chunk(11, 2, 1, data, 10), false);
+	UASSERT(result.getSize() == 0);
+
+	// Single chunk packet
+	result = buf.insert(make_split_chunk(12, 1, 0, data, 3), true);
+	UASSERT(result.getSize() == 3 && result[2] == data[2]);
+}
+
 void TestConnection::testConnectSendReceive()
 {
 	DSTACK("TestConnection::Run");
@@ -346,3 +452,261 @@ void TestConnection::testConnectSendReceive()
 	UASSERT(hand_server.count == 1);
 	UASSERT(hand_server.last_id == 2);
 }
+
+
+void TestConnection::testBundlePackets()
+{
+	u32 proto_id = 0x12345678;
+	u16 peer_id = 123;
+	Address a(127, 0, 0, 1, 10);
+
+	// Packets of different types and sizes on every channel
+	std::vector<con::BufferedPacket> packets;
+	for (u8 i = 0; i < 6; i++) {
+		SharedBuffer<u8> data(1 + i * 40);
+		for (u32 j = 0; j < data.getSize(); j++)
+			data[j] = i + j;
+		SharedBuffer<u8> packet = (i % 2) ?
+			con::makeReliablePacket(con::makeOriginalPacket(data), 65500 + i) :
+			con::makeOriginalPacket(data);
+		packets.push_back(con::makePacket(a, packet, proto_id, peer_id,
+			i % CHANNEL_COUNT));
+	}
+
+	con::BufferedPacket bundle = con::makeBundlePacket(packets,
+		proto_id, peer_id);
+	UASSERT(readU32(&bundle.data[0]) == proto_id);
+	UASSERT(readU16(&bundle.data[4]) == peer_id);
+	UASSERT(readU8(&bundle.data[BASE_HEADER_SIZE]) == TYPE_BUNDLE);
+
+	// Every part saves the base header but needs a part header
+	u32 size_unbundled = 0;
+	for (u32 i = 0; i < packets.size(); i++)
+		size_unbundled += packets[i].data.getSize();
+	UASSERTEQ(u32, bundle.data.getSize(), size_unbundled
+		+ BUNDLE_HEADER_SIZE + BASE_HEADER_SIZE
+		- packets.size() * (BASE_HEADER_SIZE - BUNDLE_PART_HEADER_SIZE));
+
+	SharedBuffer<u8> data(&bundle.data[BASE_HEADER_SIZE],
+		bundle.data.getSize() - BASE_HEADER_SIZE);
+	std::vector<con::BundlePart> parts;
+	UASSERT(con::splitBundlePacket(data, parts));
+	UASSERTEQ(size_t, parts.size(), packets.size());
+	for (u32 i = 0; i < parts.size(); i++) {
+		UASSERT(parts[i].channelnum == i % CHANNEL_COUNT);
+		UASSERTEQ(u32, parts[i].data.getSize(),
+			packets[i].data.getSize() - BASE_HEADER_SIZE);
+		UASSERT(memcmp(*parts[i].data, &packets[i].data[BASE_HEADER_SIZE],
+			parts[i].data.getSize()) == 0);
+	}
+
+	// Cut in the middle of a part, the parts before it are kept
+	u32 second_part_end = BUNDLE_HEADER_SIZE
+		+ 2 * BUNDLE_PART_HEADER_SIZE
+		+ parts[0].data.getSize() + parts[1].data.getSize();
+	parts.clear();
+	UASSERT(!con::splitBundlePacket(
+		SharedBuffer<u8>(*data, second_part_end + 5), parts));
+	UASSERTEQ(size_t, parts.size(), 2);
+
+	// Cut in a part header
+	parts.clear();
+	UASSERT(!con::splitBundlePacket(
+		SharedBuffer<u8>(*data, second_part_end + 2), parts));
+	UASSERTEQ(size_t, parts.size(), 2);
+
+	// A part claiming more data than is left
+	SharedBuffer<u8> oversized(*data, data.getSize());
+	writeU16(&oversized[second_part_end + 1], 0xFFFF);
+	parts.clear();
+	UASSERT(!con::splitBundlePacket(oversized, parts));
+	UASSERTEQ(size_t, parts.size(), 2);
+
+	// A channel that doesn't exist
+	SharedBuffer<u8> bad_channel(*data, data.getSize());
+	writeU8(&bad_channel[BUNDLE_HEADER_SIZE], CHANNEL_COUNT);
+	parts.clear();
+	UASSERT(!con::splitBundlePacket(bad_channel, parts));
+	UASSERT(parts.empty());
+
+	// Nested bundles and empty parts are dropped, the rest is kept
+	SharedBuffer<u8> empty;
+	std::vector<con::BufferedPacket> outer;
+	outer.push_back(packets[0]);
+	outer.push_back(bundle);
+	outer.push_back(con::makePacket(a, empty, proto_id, peer_id, 1));
+	outer.push_back(packets[1]);
+	con::BufferedPacket nested = con::makeBundlePacket(outer,
+		proto_id, peer_id);
+	parts.clear();
+	UASSERT(con::splitBundlePacket(SharedBuffer<u8>(
+		&nested.data[BASE_HEADER_SIZE],
+		nested.data.getSize() - BASE_HEADER_SIZE), parts));
+	UASSERTEQ(size_t, parts.size(), 2);
+	UASSERT(parts[0].channelnum == 0 && parts[1].channelnum == 1);
+
+	// Anything else isn't a bundle
+	parts.clear();
+	UASSERT(!con::splitBundlePacket(SharedBuffer<u8>(
+		&packets[0].data[BASE_HEADER_SIZE],
+		packets[0].data.getSize() - BASE_HEADER_SIZE), parts));
+	UASSERT(parts.empty());
+}
+
+/*
+	Helpers for tests running a server and a client connection
+*/
+
+struct ConnectionPair
+{
+	ConnectionPair(u32 proto_id, u16 port) :
+		hand_server("server"),
+		hand_client("client"),
+		server(proto_id, 512, 5.0, false, &hand_server),
+		client(proto_id, 512, 5.0, false, &hand_client),
+		peer_id_client(0)
+	{
+		Address address(0, 0, 0, 0, port);
+		Address server_address(127, 0, 0, 1, port);
+		// See testConnectSendReceive
+		Address bind_addr(0, 0, 0, 0, port);
+		try {
+			bind_addr.Resolve(g_settings->get("bind_address").c_str());
+			if (!bind_addr.isIPv6()) {
+				address = bind_addr;
+				server_address = bind_addr;
+			}
+		} catch (ResolveError &e) {
+		}
+
+		server.Serve(address);
+		sleep_ms(50);
+		client.Connect(server_address);
+	}
+
+	// Returns false if the connection wasn't up within 5 seconds
+	bool waitConnected()
+	{
+		u32 t0 = porting::getTimeMs();
+		while (porting::getTimeMs() - t0 < 5000) {
+			// Both sides must process the peer events
+			receiveAll(client);
+			receiveAll(server);
+			if (client.Connected() && hand_server.count == 1) {
+				peer_id_client = hand_server.last_id;
+				// Leave time for the bundling controls to arrive
+				sleep_ms(100);
+				receiveAll(client);
+				receiveAll(server);
+				return true;
+			}
+			sleep_ms(10);
+		}
+		return false;
+	}
+
+	// Returns the number of data packets received
+	static u32 receiveAll(con::Connection &con)
+	{
+		u32 count = 0;
+		for (;;) {
+			try {
+				NetworkPacket pkt;
+				con.Receive(&pkt);
+				count++;
+			} catch (con::NoIncomingDataException &e) {
+				return count;
+			}
+		}
+	}
+
+	Handler hand_server;
+	Handler hand_client;
+	con::Connection server;
+	con::Connection client;
+	u16 peer_id_client;
+};
+
+/*
+	Sends a burst of small reliable packets from the server to the client
+	on all channels, returns what the server sent for it.
+*/
+static con::SendStats send_burst(ConnectionPair &pair, u32 count)
+{
+	con::SendStats before = pair.server.getSendStats();
+
+	for (u32 i = 0; i < count; i++) {
+		NetworkPacket pkt(0x10, 8);
+		pkt << (u32)i << (u32)0;
+		pair.server.Send(pair.peer_id_client, i % CHANNEL_COUNT, &pkt, true);
+	}
+
+	u32 received = 0;
+	u32 t0 = porting::getTimeMs();
+	while (received < count && porting::getTimeMs() - t0 < 5000) {
+		received += ConnectionPair::receiveAll(pair.client);
+		sleep_ms(1);
+	}
+	UASSERTEQ(u32, received, count);
+
+	con::SendStats after = pair.server.getSendStats();
+	con::SendStats delta;
+	delta.packets   = after.packets - before.packets;
+	delta.datagrams = after.datagrams - before.datagrams;
+	delta.bytes     = after.bytes - before.bytes;
+	return delta;
+}
+
+void TestConnection::testBundlingNegotiation()
+{
+	bool bundling = g_settings->getBool("enable_packet_bundling");
+
+	// A client not announcing bundling while it connects, like an old one
+	g_settings->setBool("enable_packet_bundling", false);
+	ConnectionPair pair(0xad26846b, 30002);
+	bool connected = pair.waitConnected();
+	g_settings->setBool("enable_packet_bundling", true);
+	UASSERT(connected);
+
+	// Every datagram the server sends holds a single packet
+	con::SendStats stats = send_burst(pair, 200);
+	UASSERT(stats.datagrams > 0);
+	UASSERTEQ(u64, stats.packets, stats.datagrams);
+
+	g_settings->setBool("enable_packet_bundling", bundling);
+}
+
+void TestConnection::testBundlingBenchmark()
+{
+	bool bundling = g_settings->getBool("enable_packet_bundling");
+	const u32 count = 1000;
+	// IPv4 and UDP headers of every datagram
+	const u32 ip_udp_header_size = 28;
+
+	con::SendStats stats[2];
+	u32 time_ms[2];
+	for (u32 k = 0; k < 2; k++) {
+		g_settings->setBool("enable_packet_bundling", k == 1);
+		ConnectionPair pair(0xad26846c, 30003 + k);
+		UASSERT(pair.waitConnected());
+
+		u32 t0 = porting::getTimeMs();
+		stats[k] = send_burst(pair, count);
+		time_ms[k] = MYMAX(porting::getTimeMs() - t0, 1);
+
+		infostream << "Packet bundling " << (k ? "on" : "off") << ": "
+			<< stats[k].packets << " packets in " << stats[k].datagrams
+			<< " datagrams (" << stats[k].datagrams * 1000 / time_ms[k]
+			<< "/s), " << stats[k].bytes
+				+ stats[k].datagrams * ip_udp_header_size
+			<< " bytes with IP/UDP headers, "
+			<< stats[k].datagrams * (BASE_HEADER_SIZE + ip_udp_header_size)
+			<< " of them datagram headers" << std::endl;
+	}
+	g_settings->setBool("enable_packet_bundling", bundling);
+
+	UASSERTEQ(u64, stats[0].packets, stats[0].datagrams);
+	UASSERT(stats[1].datagrams < stats[0].datagrams);
+	UASSERT(stats[1].bytes + stats[1].datagrams * ip_udp_header_size <
+		stats[0].bytes + stats[0].datagrams * ip_udp_header_size);
+}
@@ -0,0 +1,134 @@
+/*
+Minetest
+Copyright (C) 2010-2015 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <vector>
+#include "database-dummy.h"
+#include "database-sqlite3.h"
+#include "noise.h"
+#include "porting.h"
+#include "log.h"
+
+class TestDatabase : public TestBase {
+public:
+	TestDatabase() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestDatabase"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testBulkOperations(Database *db);
+	void testSQLite3BulkLoadBenchmark();
+};
+
+static TestDatabase g_test_instance;
+
+void TestDatabase::runTests(IGameDef *gamedef)
+{
+	Database_Dummy dummy;
+	TEST(testBulkOperations, &dummy);
+
+	std::string dir = getTestTempDirectory() + DIR_DELIM "sqlite3";
+	{
+		Database_SQLite3 sqlite(dir);
+		TEST(testBulkOperations, &sqlite);
+	}
+
+	TEST(testSQLite3BulkLoadBenchmark);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static std::string make_block_data(v3s16 p, u32 length)
+{
+	PseudoRandom pr(Database::getBlockAsInteger(p) & 0x7fffffff);
+	std::string data(length, '\0');
+	for (u32 i = 0; i < length; i++)
+		data[i] = pr.next() & 0xff;
+	return data;
+}
+
+
+void TestDatabase::testBulkOperations(Database *db)
+{
+	std::vector<v3s16> positions;
+	std::vector<std::string> data;
+	for (s16 i = 0; i < 200; i++) {
+		v3s16 p(i - 100, i % 7 - 3, -i);
+		positions.push_back(p);
+		data.push_back(make_block_data(p, 50 + i));
+	}
+	UASSERT(db->saveBlocks(positions, data));
+
+	// Mixed with missing and repeated positions, more than one batch
+	std::vector<v3s16> query;
+	for (s16 i = 0; i < 200; i += 3) {
+		query.push_back(positions[i]);
+		query.push_back(v3s16(i, 2000, i));
+		query.push_back(positions[i / 2]);
+	}
+
+	std::vector<std::string> loaded;
+	db->loadBlocks(query, loaded);
+	UASSERTEQ(size_t, loaded.size(), query.size());
+	for (size_t i = 0; i < query.size(); i++)
+		UASSERT(loaded[i] == db->loadBlock(query[i]));
+	UASSERT(loaded[0] == data[0]);
+	UASSERT(loaded[1].empty());
+
+	std::vector<v3s16> none;
+	db->loadBlocks(none, loaded);
+	UASSERT(loaded.empty());
+}
+
+
+void TestDatabase::testSQLite3BulkLoadBenchmark()
+{
+	const s16 size = 20;
+
+	Database_SQLite3 db(getTestTempDirectory() + DIR_DELIM "sqlite3_bench");
+
+	std::vector<v3s16> positions;
+	std::vector<std::string> data;
+	for (s16 z = 0; z < size; z++)
+	for (s16 y = 0; y < size; y++)
+	for (s16 x = 0; x < size; x++) {
+		v3s16 p(x, y - size / 2, z);
+		positions.push_back(p);
+		// Mostly air or stone blocks compress to around this size
+		data.push_back(make_block_data(p, 200));
+	}
+	UASSERT(db.saveBlocks(positions, data));
+
+	u32 t0 = porting::getTimeMs();
+	std::vector<std::string> single(positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		single[i] = db.loadBlock(positions[i]);
+	u32 t1 = porting::getTimeMs();
+	std::vector<std::string> bulk;
+	db.loadBlocks(positions, bulk);
+	u32 t2 = porting::getTimeMs();
+
+	UASSERT(single == data);
+	UASSERT(bulk == data);
+
+	infostream << "TestDatabase: loading " << positions.size()
+		<< " blocks: one by one " << (t1 - t0) << "ms, bulk "
+		<< (t2 - t1) << "ms" << std::endl;
+}
@@ -0,0 +1,211 @@
+/*
+Minetest
+Copyright (C) 2010-2015 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <vector>
+#include "environment.h"
+#include "emerge.h"
+#include "map.h"
+#include "mapblock.h"
+#include "filesys.h"
+#include "util/numeric.h"
+
+class TestEnvironment : public TestBase {
+public:
+	TestEnvironment() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestEnvironment"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testABMBatchOncePerBlock(IGameDef *gamedef);
+	void testABMBatchFiltering(IGameDef *gamedef);
+	void testABMPerNode(IGameDef *gamedef);
+};
+
+static TestEnvironment g_test_instance;
+
+void TestEnvironment::runTests(IGameDef *gamedef)
+{
+	TEST(testABMBatchOncePerBlock, gamedef);
+	TEST(testABMBatchFiltering, gamedef);
+	TEST(testABMPerNode, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// What an ABM got called with, outlives the ABM deleted by the environment
+struct ABMCalls {
+	std::vector<v3s16> node_positions;
+	std::vector<std::vector<v3s16> > batches;
+	std::vector<MapNode> batch_nodes;
+};
+
+class TestABM : public ActiveBlockModifier {
+public:
+	TestABM(ABMCalls *calls, float interval, u32 chance, bool batched):
+		m_calls(calls),
+		m_interval(interval),
+		m_chance(chance),
+		m_batched(batched)
+	{}
+
+	std::set<std::string> getTriggerContents()
+	{
+		std::set<std::string> s;
+		s.insert("default:dirt_with_grass");
+		return s;
+	}
+	float getTriggerInterval() { return m_interval; }
+	u32 getTriggerChance() { return m_chance; }
+	bool getSimpleCatchUp() { return true; }
+	bool getBatched() { return m_batched; }
+
+	void trigger(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count, u32 active_object_count_wider)
+	{
+		m_calls->node_positions.push_back(p);
+	}
+
+	void triggerBatch(ServerEnvironment *env,
+			const std::vector<v3s16> &positions,
+			const std::vector<MapNode> &nodes,
+			u32 active_object_count, u32 active_object_count_wider)
+	{
+		m_calls->batches.push_back(positions);
+		m_calls->batch_nodes.insert(m_calls->batch_nodes.end(),
+			nodes.begin(), nodes.end());
+	}
+
+private:
+	ABMCalls *m_calls;
+	float m_interval;
+	u32 m_chance;
+	bool m_batched;
+};
+
+static bool isTriggerNode(v3s16 p)
+{
+	return (p.X + 2 * p.Y + 3 * p.Z) % 5 == 0;
+}
+
+// Trigger nodes of the test block in the order the ABMs scan them
+static std::vector<v3s16> getTriggerNodes()
+{
+	std::vector<v3s16> positions;
+	v3s16 p;
+	for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++)
+	for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+	for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++) {
+		if (isTriggerNode(p))
+			positions.push_back(p);
+	}
+	return positions;
+}
+
+/*
+	Activates block (0,0,0) of a new dummy world with only the given ABM
+	registered, the block being dtime seconds old. The same seed gives
+	the same random draws for the same ABM settings.
+*/
+static void activateTestBlock(IGameDef *gamedef, const std::string &dir,
+		ActiveBlockModifier *abm, u32 dtime, u32 seed)
+{
+	UASSERT(fs::CreateAllDirs(dir));
+	UASSERT(fs::safeWriteToFile(dir + DIR_DELIM + "world.mt",
+		"backend = dummy\n"));
+
+	EmergeManager emerge(gamedef);
+	ServerEnvironment env(new ServerMap(dir, gamedef, &emerge),
+		NULL, gamedef, dir);
+	env.loadDefaultMeta();
+	env.addActiveBlockModifier(abm);
+
+	MapBlock *block = env.getServerMap().createBlock(v3s16(0, 0, 0));
+	MapNode n_trigger(t_CONTENT_GRASS);
+	MapNode n_other(t_CONTENT_STONE);
+	v3s16 p;
+	for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+	for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+	for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++)
+		block->setNodeNoCheck(p, isTriggerNode(p) ? n_trigger : n_other);
+
+	mysrand(seed);
+	env.activateBlock(block, dtime);
+}
+
+void TestEnvironment::testABMBatchOncePerBlock(IGameDef *gamedef)
+{
+	ABMCalls calls;
+	activateTestBlock(gamedef, getTestTempDirectory() + DIR_DELIM "batch",
+		new TestABM(&calls, 1.0, 1, true), 1, 1);
+
+	std::vector<v3s16> expected = getTriggerNodes();
+	UASSERT(calls.node_positions.empty());
+	UASSERTEQ(size_t, calls.batches.size(), 1);
+	UASSERT(calls.batches[0] == expected);
+	UASSERTEQ(size_t, calls.batch_nodes.size(), expected.size());
+	for (size_t i = 0; i < calls.batch_nodes.size(); i++)
+		UASSERT(calls.batch_nodes[i].getContent() == t_CONTENT_GRASS);
+}
+
+void TestEnvironment::testABMBatchFiltering(IGameDef *gamedef)
+{
+	std::string dir = getTestTempDirectory() + DIR_DELIM "filter";
+	size_t num_nodes = getTriggerNodes().size();
+
+	// Chance 4 and two thirds of an interval: 1 in 6 nodes on average
+	ABMCalls per_node;
+	activateTestBlock(gamedef, dir + "_node",
+		new TestABM(&per_node, 30.0, 4, false), 20, 1234);
+	UASSERT(!per_node.node_positions.empty());
+	UASSERT(per_node.node_positions.size() < num_nodes / 3);
+
+	// The batch gets exactly the nodes the per-node calls got
+	ABMCalls batched;
+	activateTestBlock(gamedef, dir + "_batch",
+		new TestABM(&batched, 30.0, 4, true), 20, 1234);
+	UASSERT(batched.node_positions.empty());
+	UASSERTEQ(size_t, batched.batches.size(), 1);
+	UASSERT(batched.batches[0] == per_node.node_positions);
+
+	// More elapsed intervals catch up with more nodes
+	ABMCalls caught_up;
+	activateTestBlock(gamedef, dir + "_catchup",
+		new TestABM(&caught_up, 30.0, 4, true), 120, 1234);
+	UASSERTEQ(size_t, caught_up.batches.size(), 1);
+	UASSERT(caught_up.batches[0].size() > batched.batches[0].size());
+
+	// No time passed, nothing is due
+	ABMCalls idle;
+	activateTestBlock(gamedef, dir + "_idle",
+		new TestABM(&idle, 30.0, 4, true), 0, 1234);
+	UASSERT(idle.node_positions.empty());
+	UASSERT(idle.batches.empty());
+}
+
+void TestEnvironment::testABMPerNode(IGameDef *gamedef)
+{
+	ABMCalls calls;
+	activateTestBlock(gamedef, getTestTempDirectory() + DIR_DELIM "node",
+		new TestABM(&calls, 1.0, 1, false), 1, 1);
+
+	UASSERT(calls.batches.empty());
+	UASSERT(calls.node_positions == getTriggerNodes());
+}
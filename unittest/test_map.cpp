@@ -0,0 +1,478 @@
+/*
+Minetest
+Copyright (C) 2010-2015 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <vector>
+#include "map.h"
+#include "mapblock.h"
+#include "mapsector.h"
+#include "mapwriter.h"
+#include "voxel.h"
+#include "database-dummy.h"
+#include "noise.h"
+#include "porting.h"
+#include "log.h"
+#include "settings.h"
+
+class TestMap : public TestBase {
+public:
+	TestMap() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMap"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testBlockIndex(IGameDef *gamedef);
+	void testBlockLookupBenchmark(IGameDef *gamedef);
+	void testBlockUnloading(IGameDef *gamedef);
+	void testMapWriteThread(IGameDef *gamedef);
+	void testBlockPacking(IGameDef *gamedef);
+	void testBlockPackingBenchmark(IGameDef *gamedef);
+};
+
+static TestMap g_test_instance;
+
+void TestMap::runTests(IGameDef *gamedef)
+{
+	TEST(testBlockIndex, gamedef);
+	TEST(testBlockLookupBenchmark, gamedef);
+	TEST(testBlockUnloading, gamedef);
+	TEST(testMapWriteThread, gamedef);
+	TEST(testBlockPacking, gamedef);
+	TEST(testBlockPackingBenchmark, gamedef);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static MapSector *addSector(Map &map, IGameDef *gamedef, v2s16 p2d)
+{
+	std::map<v2s16, MapSector*> *sectors = map.getSectorsPtr();
+	std::map<v2s16, MapSector*>::iterator it = sectors->find(p2d);
+	if (it != sectors->end())
+		return it->second;
+	MapSector *sector = new ServerMapSector(&map, p2d, gamedef);
+	(*sectors)[p2d] = sector;
+	return sector;
+}
+
+// Old lookup path, kept here as the reference for the block index
+static MapBlock *getBlockThroughSector(Map &map, v3s16 p)
+{
+	MapSector *sector = map.getSectorNoGenerateNoEx(v2s16(p.X, p.Z));
+	if (sector == NULL)
+		return NULL;
+	return sector->getBlockNoCreateNoEx(p.Y);
+}
+
+
+void TestMap::testBlockIndex(IGameDef *gamedef)
+{
+	Map map(infostream, gamedef);
+
+	MapSector *sector = addSector(map, gamedef, v2s16(1, -2));
+	MapBlock *a = sector->createBlankBlock(0);
+	MapBlock *b = sector->createBlankBlock(-3);
+
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 0, -2)) == a);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, -3, -2)) == b);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 1, -2)) == NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 0, -2)) == NULL);
+
+	// The per-thread last block cache must not outlive a deletion
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 0, -2)) == a);
+	sector->deleteBlock(a);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 0, -2)) == NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, -3, -2)) == b);
+
+	// Nor be shared between maps
+	Map other(infostream, gamedef);
+	UASSERT(other.getBlockNoCreateNoEx(v3s16(1, -3, -2)) == NULL);
+
+	MapBlock *c = new MapBlock(&map, v3s16(1, 5, -2), gamedef);
+	sector->insertBlock(c);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 5, -2)) == c);
+
+	sector->deleteBlocks();
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, 5, -2)) == NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(1, -3, -2)) == NULL);
+}
+
+
+void TestMap::testBlockLookupBenchmark(IGameDef *gamedef)
+{
+	const s16 size_xz = 12, size_y = 6;
+	const u32 num_lookups = 1000000;
+
+	Map map(infostream, gamedef);
+	for (s16 z = -size_xz / 2; z < size_xz / 2; z++)
+	for (s16 x = -size_xz / 2; x < size_xz / 2; x++) {
+		MapSector *sector = addSector(map, gamedef, v2s16(x, z));
+		for (s16 y = -size_y / 2; y < size_y / 2; y++)
+			sector->createBlankBlock(y);
+	}
+
+	v3s16 minp(-size_xz / 2 * MAP_BLOCKSIZE, -size_y / 2 * MAP_BLOCKSIZE,
+		-size_xz / 2 * MAP_BLOCKSIZE);
+	v3s16 extent(size_xz * MAP_BLOCKSIZE, size_y * MAP_BLOCKSIZE,
+		size_xz * MAP_BLOCKSIZE);
+
+	// Random positions, a little outside the loaded area as well
+	PseudoRandom pr(1337);
+	std::vector<v3s16> random_nodes(num_lookups);
+	for (u32 i = 0; i != num_lookups; i++)
+		random_nodes[i] = minp + v3s16(
+			pr.range(-8, extent.X + 7),
+			pr.range(-8, extent.Y + 7),
+			pr.range(-8, extent.Z + 7));
+
+	// Coherent positions, a scan along X as VoxelManipulator and ABMs do
+	std::vector<v3s16> coherent_nodes;
+	coherent_nodes.reserve(num_lookups);
+	for (s16 z = 0; z < extent.Z && coherent_nodes.size() < num_lookups; z++)
+	for (s16 y = 0; y < extent.Y && coherent_nodes.size() < num_lookups; y++)
+	for (s16 x = 0; x < extent.X && coherent_nodes.size() < num_lookups; x++)
+		coherent_nodes.push_back(minp + v3s16(x, y, z));
+
+	const std::vector<v3s16> *sets[] = { &random_nodes, &coherent_nodes };
+	const char *set_names[] = { "random", "coherent" };
+
+	for (u32 s = 0; s != 2; s++) {
+		const std::vector<v3s16> &nodes = *sets[s];
+		u32 found_index = 0, found_sector = 0;
+
+		u32 t0 = porting::getTimeMs();
+		for (size_t i = 0; i != nodes.size(); i++) {
+			bool valid;
+			map.getNodeNoEx(nodes[i], &valid);
+			found_index += valid;
+		}
+		u32 t1 = porting::getTimeMs();
+		for (size_t i = 0; i != nodes.size(); i++) {
+			v3s16 blockpos = getNodeBlockPos(nodes[i]);
+			MapBlock *block = getBlockThroughSector(map, blockpos);
+			if (block) {
+				bool valid;
+				block->getNode(nodes[i] - blockpos * MAP_BLOCKSIZE, &valid);
+				found_sector += valid;
+			}
+		}
+		u32 t2 = porting::getTimeMs();
+
+		UASSERTEQ(u32, found_index, found_sector);
+
+		infostream << "TestMap: " << nodes.size() << " " << set_names[s]
+			<< " node lookups: block index " << (t1 - t0)
+			<< "ms, sectors " << (t2 - t1) << "ms" << std::endl;
+	}
+
+	// Both paths must agree on every block
+	for (s16 z = -size_xz / 2 - 1; z <= size_xz / 2; z++)
+	for (s16 y = -size_y / 2 - 1; y <= size_y / 2; y++)
+	for (s16 x = -size_xz / 2 - 1; x <= size_xz / 2; x++) {
+		v3s16 p(x, y, z);
+		UASSERT(map.getBlockNoCreateNoEx(p) == getBlockThroughSector(map, p));
+	}
+}
+
+
+void TestMap::testBlockUnloading(IGameDef *gamedef)
+{
+	Map map(infostream, gamedef);
+	MapSector *sector = addSector(map, gamedef, v2s16(0, 0));
+	MapSector *other_sector = addSector(map, gamedef, v2s16(1, 0));
+	for (s16 y = 0; y < 8; y++)
+		sector->createBlankBlock(y);
+	other_sector->createBlankBlock(0);
+
+	std::vector<v3s16> unloaded;
+
+	// Nothing is old enough yet
+	map.timerUpdate(1.0, 2.5, U32_MAX, &unloaded);
+	UASSERT(unloaded.empty());
+
+	// Keep blocks 0..3 in use, reference block 4
+	for (s16 y = 0; y < 4; y++)
+		map.getBlockNoCreateNoEx(v3s16(0, y, 0))->resetUsageTimer();
+	MapBlock *referenced = map.getBlockNoCreateNoEx(v3s16(0, 4, 0));
+	referenced->refGrab();
+	map.timerUpdate(2.0, 2.5, U32_MAX, &unloaded);
+
+	UASSERTEQ(size_t, unloaded.size(), 4);
+	for (s16 y = 5; y < 8; y++)
+		UASSERT(map.getBlockNoCreateNoEx(v3s16(0, y, 0)) == NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 4, 0)) == referenced);
+	UASSERT(map.getSectorNoGenerateNoEx(v2s16(1, 0)) == NULL);
+	UASSERT(map.getSectorNoGenerateNoEx(v2s16(0, 0)) == sector);
+
+	// The limit unloads the least recently used unreferenced blocks first
+	unloaded.clear();
+	map.getBlockNoCreateNoEx(v3s16(0, 2, 0))->resetUsageTimer();
+	map.timerUpdate(0.5, 100, 2, &unloaded);
+	UASSERTEQ(size_t, unloaded.size(), 3);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 2, 0)) != NULL);
+	UASSERT(map.getBlockNoCreateNoEx(v3s16(0, 4, 0)) == referenced);
+
+	referenced->refDrop();
+	unloaded.clear();
+	map.unloadUnreferencedBlocks(&unloaded);
+	UASSERTEQ(size_t, unloaded.size(), 2);
+	UASSERT(map.getSectorNoGenerateNoEx(v2s16(0, 0)) == NULL);
+}
+
+
+void TestMap::testMapWriteThread(IGameDef *gamedef)
+{
+	Map map(infostream, gamedef);
+	MapSector *sector = addSector(map, gamedef, v2s16(0, 0));
+	Database_Dummy expected_db, db;
+	MapNode stone(t_CONTENT_STONE), water(t_CONTENT_WATER);
+
+	MapWriteThread writer(&db, BLOCK_CODEC_ZLIB, BLOCK_CODEC_LEVEL_DEFAULT, 4);
+	writer.start();
+
+	// More blocks than the queue holds, so queueing has to wait
+	for (s16 y = 0; y < 16; y++) {
+		MapBlock *block = sector->createBlankBlock(y);
+		block->setNodeNoCheck(v3s16(1, 2, 3), stone);
+		block->setTimestamp(1000 + y);
+
+		MapBlockSnapshot *snapshot = new MapBlockSnapshot;
+		block->takeSnapshot(*snapshot, SER_FMT_VER_HIGHEST_WRITE, true);
+		writer.queueBlock(snapshot);
+
+		// Changing the block after queueing changes nothing written
+		block->setNodeNoCheck(v3s16(1, 2, 3), water);
+
+		// What is pending is what the synchronous path writes
+		std::string blob;
+		if (writer.getPendingBlock(block->getPos(), &blob)) {
+			block->setNodeNoCheck(v3s16(1, 2, 3), stone);
+			ServerMap::saveBlock(block, &expected_db);
+			block->setNodeNoCheck(v3s16(1, 2, 3), water);
+			UASSERT(blob == expected_db.loadBlock(block->getPos()));
+		}
+	}
+
+	writer.queueDelete(v3s16(0, 3, 0));
+	std::string blob = "x";
+	if (writer.getPendingBlock(v3s16(0, 3, 0), &blob))
+		UASSERT(blob.empty());
+
+	writer.flush();
+	UASSERT(!writer.getPendingBlock(v3s16(0, 5, 0), &blob));
+
+	MutexAutoLock lock(writer.getDatabaseMutex());
+	std::vector<v3s16> stored;
+	db.listAllLoadableBlocks(stored);
+	UASSERTEQ(size_t, stored.size(), 15);
+	UASSERT(db.loadBlock(v3s16(0, 3, 0)).empty());
+
+	for (s16 y = 0; y < 16; y++) {
+		if (y == 3)
+			continue;
+		MapBlock *block = map.getBlockNoCreateNoEx(v3s16(0, y, 0));
+		block->setNodeNoCheck(v3s16(1, 2, 3), stone);
+		ServerMap::saveBlock(block, &expected_db);
+		UASSERT(db.loadBlock(v3s16(0, y, 0)) ==
+			expected_db.loadBlock(v3s16(0, y, 0)));
+	}
+}
+
+
+/*
+	Sets the nodes of a block like a generated mapblock: stone with some
+	ore below a noise heightmap, then grass, water and air with sunlight
+	fading out towards the ground.
+*/
+static void fill_test_block(MapBlock *block)
+{
+	v3s16 blockpos = block->getPos();
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++) {
+		v3s16 p = blockpos * MAP_BLOCKSIZE + v3s16(x, 0, z);
+		s16 height = 20 * noise2d_perlin(p.X / 40.0, p.Z / 40.0, 1337, 4, 0.6);
+		for (s16 y = 0; y < MAP_BLOCKSIZE; y++) {
+			s16 abs_y = p.Y + y;
+			MapNode n;
+			if (abs_y < height)
+				n = MapNode(((x * 7 + abs_y * 3 + z) % 61 == 0) ?
+					t_CONTENT_BRICK : t_CONTENT_STONE);
+			else if (abs_y == height)
+				n = MapNode(t_CONTENT_GRASS);
+			else if (abs_y <= 0)
+				n = MapNode(t_CONTENT_WATER, 15 - MYMIN(-abs_y, 15));
+			else
+				n = MapNode(CONTENT_AIR, MYMIN(abs_y - height, LIGHT_SUN));
+			block->setNodeNoCheck(x, y, z, n);
+		}
+	}
+}
+
+
+void TestMap::testBlockPacking(IGameDef *gamedef)
+{
+	bool packing = g_settings->getBool("mapblock_packing");
+	g_settings->setBool("mapblock_packing", true);
+	Map map(infostream, gamedef);
+	g_settings->setBool("mapblock_packing", packing);
+
+	MapSector *sector = addSector(map, gamedef, v2s16(0, 0));
+	MapBlock *block = sector->createBlankBlock(0);
+	MapBlock *air_block = sector->createBlankBlock(4);
+	MapBlock *used_block = sector->createBlankBlock(-4);
+	fill_test_block(block);
+	fill_test_block(air_block);
+	fill_test_block(used_block);
+
+	std::vector<MapNode> expected(MapBlock::nodecount);
+	for (u32 i = 0; i < MapBlock::nodecount; i++)
+		expected[i] = block->getNodeNoEx(v3s16(i % MAP_BLOCKSIZE,
+			i / MapBlock::ystride % MAP_BLOCKSIZE, i / MapBlock::zstride));
+
+	// Blocks in use are left alone
+	map.timerUpdate(1.0, 100, U32_MAX);
+	UASSERT(!block->isPacked());
+
+	// Idle blocks get packed on the second update without writes
+	map.timerUpdate(MAPBLOCK_PACK_IDLE_TIME, 100, U32_MAX);
+	UASSERT(!block->isPacked());
+	used_block->resetUsageTimer();
+	map.timerUpdate(1.0, 100, U32_MAX);
+	UASSERT(block->isPacked() && !block->isDummy());
+	UASSERT(air_block->isPacked());
+	UASSERT(!used_block->isPacked());
+	UASSERT(block->getNodeDataMemoryUsage() < MapBlock::nodecount * sizeof(MapNode) / 2);
+	UASSERTEQ(size_t, air_block->getNodeDataMemoryUsage(), sizeof(MapNode));
+	UASSERT(block->mayContain(t_CONTENT_GRASS));
+
+	for (u32 i = 0; i < MapBlock::nodecount; i++) {
+		v3s16 p(i % MAP_BLOCKSIZE, i / MapBlock::ystride % MAP_BLOCKSIZE,
+			i / MapBlock::zstride);
+		UASSERT(block->getNodeNoEx(p) == expected[i]);
+	}
+
+	// Reading through a VoxelManipulator leaves it packed
+	VoxelManipulator vm;
+	vm.addArea(VoxelArea(v3s16(0, 0, 0),
+		v3s16(1, 5, 1) * MAP_BLOCKSIZE - v3s16(1, 1, 1)));
+	block->copyTo(vm);
+	air_block->copyTo(vm);
+	UASSERT(block->isPacked());
+	for (u32 i = 0; i < MapBlock::nodecount; i++) {
+		v3s16 p(i % MAP_BLOCKSIZE, i / MapBlock::ystride % MAP_BLOCKSIZE,
+			i / MapBlock::zstride);
+		UASSERT(vm.getNodeNoEx(p) == expected[i]);
+		UASSERT(vm.getNodeNoEx(p + v3s16(0, 4 * MAP_BLOCKSIZE, 0)) ==
+			air_block->getNodeNoEx(p));
+	}
+
+	// Writes expand it
+	MapNode n(t_CONTENT_TORCH);
+	block->setNode(v3s16(1, 2, 3), n);
+	UASSERT(!block->isPacked());
+	UASSERT(block->getNodeNoEx(v3s16(1, 2, 3)) == n);
+	UASSERT(block->getNodeNoEx(v3s16(3, 2, 1)) ==
+		expected[1 * MapBlock::zstride + 2 * MapBlock::ystride + 3]);
+
+	vm.setNode(v3s16(0, 4 * MAP_BLOCKSIZE + 5, 0), n);
+	air_block->copyFrom(vm);
+	UASSERT(!air_block->isPacked());
+	UASSERT(air_block->getNodeNoEx(v3s16(0, 5, 0)) == n);
+	UASSERT(air_block->mayContain(t_CONTENT_TORCH));
+
+	// Written to during the last update, stays unpacked
+	map.timerUpdate(1.0, 100, U32_MAX);
+	UASSERT(!block->isPacked());
+	map.timerUpdate(1.0, 100, U32_MAX);
+	UASSERT(block->isPacked());
+	UASSERT(block->getNodeNoEx(v3s16(1, 2, 3)) == n);
+}
+
+
+void TestMap::testBlockPackingBenchmark(IGameDef *gamedef)
+{
+	// A 10x10 block area of terrain, 8 blocks high around the surface
+	const s16 size_xz = 10, size_y = 8;
+	const u32 num_reads = 4;
+
+	bool packing = g_settings->getBool("mapblock_packing");
+	g_settings->setBool("mapblock_packing", true);
+	Map map(infostream, gamedef);
+	g_settings->setBool("mapblock_packing", packing);
+
+	std::vector<MapBlock *> blocks;
+	for (s16 z = -size_xz / 2; z < size_xz / 2; z++)
+	for (s16 x = -size_xz / 2; x < size_xz / 2; x++) {
+		MapSector *sector = addSector(map, gamedef, v2s16(x, z));
+		for (s16 y = -size_y / 2; y < size_y / 2; y++) {
+			blocks.push_back(sector->createBlankBlock(y));
+			fill_test_block(blocks.back());
+		}
+	}
+
+	size_t mem_unpacked = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+		mem_unpacked += blocks[i]->getNodeDataMemoryUsage();
+
+	u32 sum_unpacked = 0;
+	u32 t0 = porting::getTimeMs();
+	for (u32 k = 0; k < num_reads; k++)
+	for (size_t i = 0; i < blocks.size(); i++)
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		sum_unpacked += blocks[i]->getNodeNoEx(v3s16(x, y, z)).param0;
+	u32 t1 = porting::getTimeMs();
+
+	// Each update looks at a limited number of blocks, which are packed
+	// on their second visit
+	map.timerUpdate(MAPBLOCK_PACK_IDLE_TIME + 1, 100, U32_MAX);
+	u32 num_updates = 1;
+	for (; num_updates < 2 * blocks.size() / MAPBLOCK_PACK_MAX_PER_UPDATE + 3;
+			num_updates++)
+		map.timerUpdate(0.1, 100, U32_MAX);
+	u32 t2 = porting::getTimeMs();
+
+	size_t mem_packed = 0;
+	u32 num_packed = 0, num_uniform = 0;
+	for (size_t i = 0; i < blocks.size(); i++) {
+		mem_packed += blocks[i]->getNodeDataMemoryUsage();
+		num_packed += blocks[i]->isPacked();
+		num_uniform += blocks[i]->getNodeDataMemoryUsage() == sizeof(MapNode);
+	}
+	UASSERTEQ(u32, num_packed, blocks.size());
+	UASSERT(mem_packed < mem_unpacked / 4);
+
+	u32 sum_packed = 0;
+	u32 t3 = porting::getTimeMs();
+	for (u32 k = 0; k < num_reads; k++)
+	for (size_t i = 0; i < blocks.size(); i++)
+	for (s16 z = 0; z < MAP_BLOCKSIZE; z++)
+	for (s16 y = 0; y < MAP_BLOCKSIZE; y++)
+	for (s16 x = 0; x < MAP_BLOCKSIZE; x++)
+		sum_packed += blocks[i]->getNodeNoEx(v3s16(x, y, z)).param0;
+	u32 t4 = porting::getTimeMs();
+	UASSERTEQ(u32, sum_packed, sum_unpacked);
+
+	infostream << "Block packing: " << blocks.size() << " blocks, "
+		<< num_uniform << " uniform, node data " << mem_unpacked / 1024
+		<< "KiB unpacked, " << mem_packed / 1024 << "KiB packed in "
+		<< num_updates << " updates, " << (t2 - t1) << "ms; reads " << (t1 - t0) << "ms unpacked, "
+		<< (t4 - t3) << "ms packed" << std::endl;
+}
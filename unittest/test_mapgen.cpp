@@ -0,0 +1,770 @@
+/*
+Minetest
+Copyright (C) 2010-2014 kwolekr, Ryan Kwolek <kwolekr@minetest.net>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <algorithm>
+#include <set>
+#include "gamedef.h"
+#include "nodedef.h"
+#include "map.h"
+#include "mapgen.h"
+#include "mg_biome.h"
+#include "mg_decoration.h"
+#include "mg_ore.h"
+#include "noise.h"
+#include "porting.h"
+#include "log.h"
+#include "util/numeric.h"
+
+class TestMapgen : public TestBase {
+public:
+	TestMapgen() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestMapgen"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testContentFilter();
+	void testBiomeBenchmark(IGameDef *gamedef);
+	void testOreBenchmark(INodeDefManager *ndef);
+	void testOreBiomes(INodeDefManager *ndef);
+	void testDecorationBenchmark(IGameDef *gamedef);
+};
+
+static TestMapgen g_test_instance;
+
+void TestMapgen::runTests(IGameDef *gamedef)
+{
+	IWritableNodeDefManager *ndef =
+		(IWritableNodeDefManager *)gamedef->getNodeDefManager();
+
+	ndef->setNodeRegistrationStatus(true);
+
+	TEST(testContentFilter);
+	TEST(testBiomeBenchmark, gamedef);
+	TEST(testOreBenchmark, ndef);
+	TEST(testOreBiomes, ndef);
+	TEST(testDecorationBenchmark, gamedef);
+
+	ndef->resetNodeResolveState();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// A mapchunk with its shell of overgenerated nodes
+static const v3s16 chunk_min(-16, -16, -16);
+static const v3s16 chunk_max(95, 95, 95);
+
+static void fill_chunk(MMVManip *vm, content_t c_fill, content_t c_other)
+{
+	vm->addArea(VoxelArea(chunk_min, chunk_max));
+
+	u32 volume = vm->m_area.getVolume();
+	for (u32 i = 0; i != volume; i++)
+		vm->m_data[i] = MapNode((i % 7 == 0) ? c_other : c_fill);
+}
+
+
+void TestMapgen::testContentFilter()
+{
+	MapNode nodes[37];
+	for (u32 i = 0; i != ARRLEN(nodes); i++)
+		nodes[i] = MapNode(CONTENT_AIR, i, i);
+
+	std::vector<content_t> ids;
+	ids.push_back(1000);
+	ids.push_back(0xFFFE);
+	ids.push_back(1000);
+
+	ContentFilter filter;
+	filter.set(ids);
+	UASSERT(filter.contains(1000));
+	UASSERT(filter.contains(0xFFFE));
+	UASSERT(!filter.contains(CONTENT_AIR));
+	UASSERT(!filter.contains(1001));
+
+	// Params must not match, only the content
+	UASSERTEQ(u32, filter.find(nodes, 0, ARRLEN(nodes)), ARRLEN(nodes));
+
+	nodes[5].setContent(1000);
+	nodes[35].setContent(0xFFFE);
+	UASSERTEQ(u32, filter.find(nodes, 0, ARRLEN(nodes)), 5);
+	UASSERTEQ(u32, filter.find(nodes, 5, ARRLEN(nodes)), 5);
+	UASSERTEQ(u32, filter.find(nodes, 6, ARRLEN(nodes)), 35);
+	UASSERTEQ(u32, filter.find(nodes, 6, 35), 35);
+	UASSERTEQ(u32, filter.find(nodes, 36, 36), 36);
+
+	// Too many ids for the vector compare, the bitmap still works
+	for (content_t c = 2000; c != 2010; c++)
+		ids.push_back(c);
+	filter.set(ids);
+	nodes[20].setContent(2009);
+	UASSERTEQ(u32, filter.find(nodes, 6, ARRLEN(nodes)), 20);
+}
+
+
+void TestMapgen::testBiomeBenchmark(IGameDef *gamedef)
+{
+	BiomeManager bmgr(gamedef);
+
+	// Some dozen biomes, split in height like the usual ocean/beach/land sets
+	for (u32 i = 0; i != 24; i++) {
+		Biome *b = BiomeManager::create(BIOME_NORMAL);
+		b->name           = "test" + itos(i);
+		b->heat_point     = (i * 37) % 100;
+		b->humidity_point = (i * 59) % 100;
+		b->y_min          = (i % 3 == 0) ? -31000 : (i % 3 == 1) ? -112 : 5;
+		b->y_max          = (i % 3 == 0) ? -113 : (i % 3 == 1) ? 4 : 31000;
+		UASSERT(bmgr.add(b) != OBJDEF_INVALID_HANDLE);
+	}
+
+	NoiseParams np_heat(50, 50, v3f(750.0, 750.0, 750.0), 5349, 3, 0.5, 2.0);
+	NoiseParams np_humidity(50, 50, v3f(750.0, 750.0, 750.0), 842, 3, 0.5, 2.0);
+	const u32 csize = 80;
+	const u32 iterations = 200;
+
+	Noise heat(&np_heat, 1337, csize, csize);
+	Noise humidity(&np_humidity, 1337, csize, csize);
+	heat.perlinMap2D(0, 0);
+	humidity.perlinMap2D(0, 0);
+
+	s16 heightmap[csize * csize];
+	u8 biomemap[csize * csize];
+	for (u32 i = 0; i != csize * csize; i++)
+		heightmap[i] = (s16)(i % 311) - 150;
+
+	u32 t0 = porting::getTimeMs();
+	for (u32 k = 0; k != iterations; k++)
+		bmgr.calcBiomes(csize, csize, heat.result, humidity.result,
+			heightmap, biomemap);
+	u32 t1 = porting::getTimeMs();
+
+	// The per-column search that calcBiomes() has to agree with
+	u8 expected[csize * csize];
+	for (u32 k = 0; k != iterations; k++)
+	for (u32 i = 0; i != csize * csize; i++)
+		expected[i] = bmgr.getBiome(heat.result[i], humidity.result[i],
+			heightmap[i])->index;
+	u32 t2 = porting::getTimeMs();
+
+	for (u32 i = 0; i != csize * csize; i++)
+		UASSERTEQ(u32, biomemap[i], expected[i]);
+
+	infostream << "Mapgen stage biomes: " << iterations << " chunks in "
+		<< (t1 - t0) << "ms, per column " << (t2 - t1) << "ms" << std::endl;
+}
+
+
+template<typename T>
+static T *create_test_ore(INodeDefManager *ndef, NoiseParams np,
+	const std::set<u8> &biomes = std::set<u8>())
+{
+	T *ore = new T;
+	ore->clust_scarcity = 8 * 8 * 8;
+	ore->clust_num_ores = 8;
+	ore->clust_size     = 3;
+	ore->y_min          = -31000;
+	ore->y_max          = 31000;
+	ore->ore_param2     = 0;
+	ore->flags          = 0;
+	ore->nthresh        = 0.0;
+	ore->np             = np;
+	ore->biomes         = biomes;
+
+	ore->m_nodenames.push_back("default:brick");
+	ore->m_nodenames.push_back("default:stone");
+	ore->m_nnlistsizes.push_back(1);
+	ndef->pendNodeResolve(ore);
+
+	return ore;
+}
+
+
+// Scatter, sheet, puff, blob and vein ore, in this order
+static void set_test_ore_params(Ore *ores[5])
+{
+	OreSheet *sheet = (OreSheet *)ores[1];
+	sheet->column_height_min      = 1;
+	sheet->column_height_max      = 16;
+	sheet->column_midpoint_factor = 0.5;
+
+	OrePuff *puff = (OrePuff *)ores[2];
+	puff->np_puff_top    = NoiseParams(4, 2, v3f(40, 40, 40), 47, 3, 0.7, 2.0);
+	puff->np_puff_bottom = NoiseParams(4, 2, v3f(40, 40, 40), 11, 3, 0.7, 2.0);
+
+	OreVein *vein = (OreVein *)ores[4];
+	vein->random_factor = 1.0;
+	vein->nthresh       = 1.2;
+}
+
+
+/*
+	Ore placement from before the wherein and biome lookup tables, kept
+	here as the reference for them: every node is tested with CONTAINS()
+	on c_wherein and every biome with a lookup in the biomes set.
+*/
+class OreScatterRef : public OreScatter {
+public:
+	void generate(MMVManip *vm, int mapseed, u32 blockseed,
+		v3s16 nmin, v3s16 nmax, u8 *biomemap)
+	{
+		PcgRandom pr(blockseed);
+		MapNode n_ore(c_ore, 0, ore_param2);
+
+		u32 sizex  = (nmax.X - nmin.X + 1);
+		u32 volume = (nmax.X - nmin.X + 1) *
+					 (nmax.Y - nmin.Y + 1) *
+					 (nmax.Z - nmin.Z + 1);
+		u32 csize     = clust_size;
+		u32 cvolume   = csize * csize * csize;
+		u32 nclusters = volume / clust_scarcity;
+
+		for (u32 i = 0; i != nclusters; i++) {
+			int x0 = pr.range(nmin.X, nmax.X - csize + 1);
+			int y0 = pr.range(nmin.Y, nmax.Y - csize + 1);
+			int z0 = pr.range(nmin.Z, nmax.Z - csize + 1);
+
+			if ((flags & OREFLAG_USE_NOISE) &&
+				(NoisePerlin3D(&np, x0, y0, z0, mapseed) < nthresh))
+				continue;
+
+			if (biomemap && !biomes.empty()) {
+				u32 index = sizex * (z0 - nmin.Z) + (x0 - nmin.X);
+				if (biomes.find(biomemap[index]) == biomes.end())
+					continue;
+			}
+
+			for (u32 z1 = 0; z1 != csize; z1++)
+			for (u32 y1 = 0; y1 != csize; y1++)
+			for (u32 x1 = 0; x1 != csize; x1++) {
+				if (pr.range(1, cvolume) > clust_num_ores)
+					continue;
+
+				u32 i = vm->m_area.index(x0 + x1, y0 + y1, z0 + z1);
+				if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+					continue;
+
+				vm->m_data[i] = n_ore;
+			}
+		}
+	}
+};
+
+class OreSheetRef : public OreSheet {
+public:
+	void generate(MMVManip *vm, int mapseed, u32 blockseed,
+		v3s16 nmin, v3s16 nmax, u8 *biomemap)
+	{
+		PcgRandom pr(blockseed + 4234);
+		MapNode n_ore(c_ore, 0, ore_param2);
+
+		u16 max_height = column_height_max;
+		int y_start_min = nmin.Y + max_height;
+		int y_start_max = nmax.Y - max_height;
+
+		int y_start = y_start_min < y_start_max ?
+			pr.range(y_start_min, y_start_max) :
+			(y_start_min + y_start_max) / 2;
+
+		if (!noise) {
+			int sx = nmax.X - nmin.X + 1;
+			int sz = nmax.Z - nmin.Z + 1;
+			noise = new Noise(&np, 0, sx, sz);
+		}
+		noise->seed = mapseed + y_start;
+		noise->perlinMap2D(nmin.X, nmin.Z);
+
+		size_t index = 0;
+		for (int z = nmin.Z; z <= nmax.Z; z++)
+		for (int x = nmin.X; x <= nmax.X; x++, index++) {
+			float noiseval = noise->result[index];
+			if (noiseval < nthresh)
+				continue;
+
+			if (biomemap && !biomes.empty() &&
+					biomes.find(biomemap[index]) == biomes.end())
+				continue;
+
+			u16 height = pr.range(column_height_min, column_height_max);
+			int ymidpoint = y_start + noiseval;
+			int y0 = MYMAX(nmin.Y, ymidpoint - height * (1 - column_midpoint_factor));
+			int y1 = MYMIN(nmax.Y, y0 + height - 1);
+
+			for (int y = y0; y <= y1; y++) {
+				u32 i = vm->m_area.index(x, y, z);
+				if (!vm->m_area.contains(i))
+					continue;
+				if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+					continue;
+
+				vm->m_data[i] = n_ore;
+			}
+		}
+	}
+};
+
+class OrePuffRef : public OrePuff {
+public:
+	void generate(MMVManip *vm, int mapseed, u32 blockseed,
+		v3s16 nmin, v3s16 nmax, u8 *biomemap)
+	{
+		PcgRandom pr(blockseed + 4234);
+		MapNode n_ore(c_ore, 0, ore_param2);
+
+		int y_start = pr.range(nmin.Y, nmax.Y);
+
+		if (!noise) {
+			int sx = nmax.X - nmin.X + 1;
+			int sz = nmax.Z - nmin.Z + 1;
+			noise = new Noise(&np, 0, sx, sz);
+			noise_puff_top = new Noise(&np_puff_top, 0, sx, sz);
+			noise_puff_bottom = new Noise(&np_puff_bottom, 0, sx, sz);
+		}
+
+		noise->seed = mapseed + y_start;
+		noise->perlinMap2D(nmin.X, nmin.Z);
+		bool noise_generated = false;
+
+		size_t index = 0;
+		for (int z = nmin.Z; z <= nmax.Z; z++)
+		for (int x = nmin.X; x <= nmax.X; x++, index++) {
+			float noiseval = noise->result[index];
+			if (noiseval < nthresh)
+				continue;
+
+			if (biomemap && !biomes.empty() &&
+					biomes.find(biomemap[index]) == biomes.end())
+				continue;
+
+			if (!noise_generated) {
+				noise_generated = true;
+				noise_puff_top->perlinMap2D(nmin.X, nmin.Z);
+				noise_puff_bottom->perlinMap2D(nmin.X, nmin.Z);
+			}
+
+			float ntop    = noise_puff_top->result[index];
+			float nbottom = noise_puff_bottom->result[index];
+
+			if (!(flags & OREFLAG_PUFF_CLIFFS)) {
+				float ndiff = noiseval - nthresh;
+				if (ndiff < 1.0f) {
+					ntop *= ndiff;
+					nbottom *= ndiff;
+				}
+			}
+
+			int ymid = y_start;
+			int y0 = ymid - nbottom;
+			int y1 = ymid + ntop;
+
+			if ((flags & OREFLAG_PUFF_ADDITIVE) && (y0 > y1))
+				SWAP(int, y0, y1);
+
+			for (int y = y0; y <= y1; y++) {
+				u32 i = vm->m_area.index(x, y, z);
+				if (!vm->m_area.contains(i))
+					continue;
+				if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+					continue;
+
+				vm->m_data[i] = n_ore;
+			}
+		}
+	}
+};
+
+class OreBlobRef : public OreBlob {
+public:
+	void generate(MMVManip *vm, int mapseed, u32 blockseed,
+		v3s16 nmin, v3s16 nmax, u8 *biomemap)
+	{
+		PcgRandom pr(blockseed + 2404);
+		MapNode n_ore(c_ore, 0, ore_param2);
+
+		u32 sizex  = (nmax.X - nmin.X + 1);
+		u32 volume = (nmax.X - nmin.X + 1) *
+					 (nmax.Y - nmin.Y + 1) *
+					 (nmax.Z - nmin.Z + 1);
+		u32 csize  = clust_size;
+		u32 nblobs = volume / clust_scarcity;
+
+		if (!noise)
+			noise = new Noise(&np, mapseed, csize, csize, csize);
+
+		for (u32 i = 0; i != nblobs; i++) {
+			int x0 = pr.range(nmin.X, nmax.X - csize + 1);
+			int y0 = pr.range(nmin.Y, nmax.Y - csize + 1);
+			int z0 = pr.range(nmin.Z, nmax.Z - csize + 1);
+
+			if (biomemap && !biomes.empty()) {
+				u32 bmapidx = sizex * (z0 - nmin.Z) + (x0 - nmin.X);
+				if (biomes.find(biomemap[bmapidx]) == biomes.end())
+					continue;
+			}
+
+			bool noise_generated = false;
+			noise->seed = blockseed + i;
+
+			size_t index = 0;
+			for (u32 z1 = 0; z1 != csize; z1++)
+			for (u32 y1 = 0; y1 != csize; y1++)
+			for (u32 x1 = 0; x1 != csize; x1++, index++) {
+				u32 i = vm->m_area.index(x0 + x1, y0 + y1, z0 + z1);
+				if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+					continue;
+
+				if (!noise_generated) {
+					noise_generated = true;
+					noise->perlinMap3D(x0, y0, z0);
+				}
+
+				float noiseval = noise->result[index];
+
+				float xdist = (s32)x1 - (s32)csize / 2;
+				float ydist = (s32)y1 - (s32)csize / 2;
+				float zdist = (s32)z1 - (s32)csize / 2;
+
+				noiseval -= (sqrt(xdist * xdist + ydist * ydist + zdist * zdist) / csize);
+
+				if (noiseval < nthresh)
+					continue;
+
+				vm->m_data[i] = n_ore;
+			}
+		}
+	}
+};
+
+class OreVeinRef : public OreVein {
+public:
+	void generate(MMVManip *vm, int mapseed, u32 blockseed,
+		v3s16 nmin, v3s16 nmax, u8 *biomemap)
+	{
+		PcgRandom pr(blockseed + 520);
+		MapNode n_ore(c_ore, 0, ore_param2);
+
+		u32 sizex = (nmax.X - nmin.X + 1);
+
+		if (!noise) {
+			int sx = nmax.X - nmin.X + 1;
+			int sy = nmax.Y - nmin.Y + 1;
+			int sz = nmax.Z - nmin.Z + 1;
+			noise  = new Noise(&np, mapseed, sx, sy, sz);
+			noise2 = new Noise(&np, mapseed + 436, sx, sy, sz);
+		}
+		bool noise_generated = false;
+
+		size_t index = 0;
+		for (int z = nmin.Z; z <= nmax.Z; z++)
+		for (int y = nmin.Y; y <= nmax.Y; y++)
+		for (int x = nmin.X; x <= nmax.X; x++, index++) {
+			u32 i = vm->m_area.index(x, y, z);
+			if (!vm->m_area.contains(i))
+				continue;
+			if (!CONTAINS(c_wherein, vm->m_data[i].getContent()))
+				continue;
+
+			if (biomemap && !biomes.empty()) {
+				u32 bmapidx = sizex * (z - nmin.Z) + (x - nmin.X);
+				if (biomes.find(biomemap[bmapidx]) == biomes.end())
+					continue;
+			}
+
+			if (!noise_generated) {
+				noise_generated = true;
+				noise->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
+				noise2->perlinMap3D(nmin.X, nmin.Y, nmin.Z);
+			}
+
+			float randval   = (float)pr.next() / (pr.RANDOM_RANGE / 2) - 1.f;
+			float noiseval  = contour(noise->result[index]);
+			float noiseval2 = contour(noise2->result[index]);
+			if (noiseval * noiseval2 + randval * random_factor < nthresh)
+				continue;
+
+			vm->m_data[i] = n_ore;
+		}
+	}
+};
+
+
+void TestMapgen::testOreBenchmark(INodeDefManager *ndef)
+{
+	content_t c_stone = ndef->getId("default:stone");
+	content_t c_dirt  = ndef->getId("default:dirt_with_grass");
+	content_t c_brick = ndef->getId("default:brick");
+	UASSERT(c_stone != CONTENT_IGNORE && c_brick != CONTENT_IGNORE);
+
+	NoiseParams np(0, 1, v3f(100, 100, 100), 17, 3, 0.7, 2.0);
+	const v3s16 nmin(0, 0, 0);
+	const v3s16 nmax(79, 79, 79);
+	const u32 iterations = 10;
+
+	MMVManip vm(NULL);
+	fill_chunk(&vm, c_stone, c_dirt);
+
+	// Row scan of a whole chunk, bitmap filter against the plain search
+	std::vector<content_t> c_wherein(1, c_dirt);
+	ContentFilter filter;
+	filter.set(c_wherein);
+	u32 volume = vm.m_area.getVolume();
+
+	u32 nfound = 0, nexpected = 0;
+	u32 t0 = porting::getTimeMs();
+	for (u32 k = 0; k != iterations; k++)
+	for (u32 i = filter.find(vm.m_data, 0, volume); i != volume;
+			i = filter.find(vm.m_data, i + 1, volume))
+		nfound++;
+	u32 t1 = porting::getTimeMs();
+	for (u32 k = 0; k != iterations; k++)
+	for (u32 i = 0; i != volume; i++)
+		nexpected += CONTAINS(c_wherein, vm.m_data[i].getContent());
+	u32 t2 = porting::getTimeMs();
+
+	UASSERTEQ(u32, nfound, nexpected);
+	infostream << "Mapgen stage ore scan: " << iterations << " chunks in "
+		<< (t1 - t0) << "ms, per node " << (t2 - t1) << "ms" << std::endl;
+
+	Ore *ores[] = {
+		create_test_ore<OreScatter>(ndef, np),
+		create_test_ore<OreSheet>(ndef, np),
+		create_test_ore<OrePuff>(ndef, np),
+		create_test_ore<OreBlob>(ndef, np),
+		create_test_ore<OreVein>(ndef, np),
+	};
+	const char *names[] = { "scatter", "sheet", "puff", "blob", "vein" };
+	set_test_ore_params(ores);
+
+	for (u32 j = 0; j != ARRLEN(ores); j++) {
+		u32 t = 0;
+		for (u32 k = 0; k != iterations; k++) {
+			fill_chunk(&vm, c_stone, c_dirt);
+
+			u32 tstart = porting::getTimeMs();
+			ores[j]->generate(&vm, 1337, k, nmin, nmax, NULL);
+			t += porting::getTimeMs() - tstart;
+		}
+
+		// Ore may only have replaced stone
+		u32 nore = 0;
+		for (u32 i = 0; i != volume; i++) {
+			content_t c = vm.m_data[i].getContent();
+			UASSERT(c == c_stone || c == c_dirt || c == c_brick);
+			if (c == c_brick) {
+				UASSERT(i % 7 != 0);
+				nore++;
+			}
+		}
+		UASSERT(nore > 0);
+
+		infostream << "Mapgen stage ore " << names[j] << ": "
+			<< iterations << " chunks in " << t << "ms" << std::endl;
+		delete ores[j];
+	}
+}
+
+
+void TestMapgen::testOreBiomes(INodeDefManager *ndef)
+{
+	content_t c_stone = ndef->getId("default:stone");
+	content_t c_dirt  = ndef->getId("default:dirt_with_grass");
+	content_t c_brick = ndef->getId("default:brick");
+
+	NoiseParams np(0, 1, v3f(100, 100, 100), 17, 3, 0.7, 2.0);
+	const v3s16 nmin(0, 0, 0);
+	const v3s16 nmax(79, 79, 79);
+	const u32 iterations = 4;
+
+	// Patches of 8x8 columns of ten biomes, ores in four of them
+	u8 biomemap[80 * 80];
+	for (u32 z = 0; z != 80; z++)
+	for (u32 x = 0; x != 80; x++)
+		biomemap[z * 80 + x] = ((x / 8) * 7 + (z / 8) * 3) % 10;
+
+	std::set<u8> biomes;
+	biomes.insert(0);
+	biomes.insert(3);
+	biomes.insert(6);
+	biomes.insert(9);
+
+	Ore *ores[] = {
+		create_test_ore<OreScatter>(ndef, np, biomes),
+		create_test_ore<OreSheet>(ndef, np, biomes),
+		create_test_ore<OrePuff>(ndef, np, biomes),
+		create_test_ore<OreBlob>(ndef, np, biomes),
+		create_test_ore<OreVein>(ndef, np, biomes),
+	};
+	Ore *ores_ref[] = {
+		create_test_ore<OreScatterRef>(ndef, np, biomes),
+		create_test_ore<OreSheetRef>(ndef, np, biomes),
+		create_test_ore<OrePuffRef>(ndef, np, biomes),
+		create_test_ore<OreBlobRef>(ndef, np, biomes),
+		create_test_ore<OreVeinRef>(ndef, np, biomes),
+	};
+	set_test_ore_params(ores);
+	set_test_ore_params(ores_ref);
+
+	MMVManip vm(NULL);
+	MMVManip vm_ref(NULL);
+
+	for (u32 j = 0; j != ARRLEN(ores); j++) {
+		u32 nore = 0;
+		for (u32 k = 0; k != iterations; k++) {
+			fill_chunk(&vm, c_stone, c_dirt);
+			fill_chunk(&vm_ref, c_stone, c_dirt);
+			ores[j]->generate(&vm, 1337, k, nmin, nmax, biomemap);
+			ores_ref[j]->generate(&vm_ref, 1337, k, nmin, nmax, biomemap);
+
+			u32 volume = vm.m_area.getVolume();
+			for (u32 i = 0; i != volume; i++) {
+				UASSERT(vm.m_data[i] == vm_ref.m_data[i]);
+				nore += (vm.m_data[i].getContent() == c_brick);
+			}
+
+			// Scatter and blob ores only check the biome of the cluster
+			// origin, the others that of every column they place ore in
+			if (j == 0 || j == 3)
+				continue;
+			for (s16 z = nmin.Z; z <= nmax.Z; z++)
+			for (s16 y = nmin.Y; y <= nmax.Y; y++)
+			for (s16 x = nmin.X; x <= nmax.X; x++) {
+				u8 biome = biomemap[(z - nmin.Z) * 80 + (x - nmin.X)];
+				if (biomes.count(biome))
+					continue;
+				u32 i = vm.m_area.index(x, y, z);
+				UASSERT(vm.m_data[i].getContent() != c_brick);
+			}
+		}
+		UASSERT(nore > 0);
+
+		delete ores[j];
+		delete ores_ref[j];
+	}
+}
+
+
+// Stone up to a rolling ground level, topped with a layer of grass
+static void fill_terrain(MMVManip *vm, content_t c_stone, content_t c_grass)
+{
+	vm->addArea(VoxelArea(chunk_min, chunk_max));
+
+	u32 i = 0;
+	for (s16 z = chunk_min.Z; z <= chunk_max.Z; z++)
+	for (s16 y = chunk_min.Y; y <= chunk_max.Y; y++)
+	for (s16 x = chunk_min.X; x <= chunk_max.X; x++, i++) {
+		s16 ground = 30 + (x * 3 + z * 5) % 11 + (x / 16) * 2;
+		vm->m_data[i] = MapNode((y < ground) ? c_stone :
+			(y == ground) ? c_grass : CONTENT_AIR);
+	}
+}
+
+
+void TestMapgen::testDecorationBenchmark(IGameDef *gamedef)
+{
+	INodeDefManager *ndef = gamedef->getNodeDefManager();
+	content_t c_stone = ndef->getId("default:stone");
+	content_t c_grass = ndef->getId("default:dirt_with_grass");
+	content_t c_torch = ndef->getId("default:torch");
+	UASSERT(c_torch != CONTENT_IGNORE);
+
+	// A default game's worth of plants: sets of grasses sharing their
+	// noise, flowers with noise of their own and some fixed ratio ones
+	DecorationManager decomgr(gamedef);
+	for (u32 i = 0; i != 40; i++) {
+		DecoSimple *deco = (DecoSimple *)DecorationManager::create(DECO_SIMPLE);
+		deco->name            = "test" + itos(i);
+		deco->mapseed         = 1337 + i / 5;
+		deco->sidelen         = (i % 3 == 0) ? 16 : (i % 3 == 1) ? 8 : 1;
+		deco->y_min           = -31000;
+		deco->y_max           = 31000;
+		deco->fill_ratio      = 0.002;
+		deco->deco_height     = 1;
+		deco->deco_height_max = (i % 4 == 0) ? 3 : 0;
+		deco->nspawnby        = -1;
+		if (i < 30) {
+			deco->flags = DECO_USE_NOISE;
+			deco->np = NoiseParams(0.005, 0.02, v3f(200, 200, 200),
+				329 + i / 5, 3, 0.6, 2.0);
+		}
+
+		deco->m_nodenames.push_back("default:dirt_with_grass");
+		deco->m_nodenames.push_back("default:torch");
+		deco->m_nnlistsizes.push_back(1);
+		deco->m_nnlistsizes.push_back(1);
+		deco->m_nnlistsizes.push_back(0);
+		ndef->pendNodeResolve(deco);
+
+		UASSERT(decomgr.add(deco) != OBJDEF_INVALID_HANDLE);
+	}
+
+	const v3s16 nmin(0, 0, 0);
+	const v3s16 nmax(79, 79, 79);
+	const u32 iterations = 50;
+	s16 heightmap[80 * 80];
+
+	MMVManip vm(NULL);
+	MMVManip vm_expected(NULL);
+	Mapgen mg;
+	mg.ndef = ndef;
+
+	// As placed by the mapgens, from the heightmap of the terrain
+	u32 t = 0;
+	for (u32 k = 0; k != iterations; k++) {
+		fill_terrain(&vm, c_stone, c_grass);
+		mg.vm        = &vm;
+		mg.heightmap = heightmap;
+		mg.updateHeightmap(nmin, nmax);
+
+		u32 tstart = porting::getTimeMs();
+		decomgr.placeAllDecos(&mg, 1000 + k, nmin, nmax);
+		t += porting::getTimeMs() - tstart;
+	}
+
+	// As placed by minetest.generate_decorations(), which has no heightmap
+	u32 t_noheightmap = 0;
+	for (u32 k = 0; k != iterations; k++) {
+		fill_terrain(&vm_expected, c_stone, c_grass);
+		mg.vm        = &vm_expected;
+		mg.heightmap = NULL;
+
+		u32 tstart = porting::getTimeMs();
+		decomgr.placeAllDecos(&mg, 1000 + k, nmin, nmax);
+		t_noheightmap += porting::getTimeMs() - tstart;
+	}
+
+	// Both see the same surface, and decorations only go on top of it
+	u32 volume = vm.m_area.getVolume();
+	u32 nplaced = 0;
+	v3s16 em = vm.m_area.getExtent();
+	for (u32 i = 0; i != volume; i++) {
+		UASSERT(vm.m_data[i] == vm_expected.m_data[i]);
+		if (vm.m_data[i].getContent() != c_torch)
+			continue;
+
+		u32 vi = i;
+		while (vm.m_data[vi].getContent() == c_torch)
+			vm.m_area.add_y(em, vi, -1);
+		UASSERT(vm.m_data[vi].getContent() == c_grass);
+		nplaced++;
+	}
+	UASSERT(nplaced > 0);
+
+	infostream << "Mapgen stage decorations: " << iterations << " chunks in "
+		<< t << "ms, without heightmap " << t_noheightmap << "ms" << std::endl;
+}
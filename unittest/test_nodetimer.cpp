@@ -0,0 +1,123 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "test.h"
+
+#include <sstream>
+#include "nodetimer.h"
+
+class TestNodeTimer : public TestBase {
+public:
+	TestNodeTimer() { TestManager::registerTestModule(this); }
+	const char *getName() { return "TestNodeTimer"; }
+
+	void runTests(IGameDef *gamedef);
+
+	void testWheel();
+	void testAttachedList();
+};
+
+static TestNodeTimer g_test_instance;
+
+void TestNodeTimer::runTests(IGameDef *gamedef)
+{
+	TEST(testWheel);
+	TEST(testAttachedList);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestNodeTimer::testWheel()
+{
+	NodeTimerWheel wheel(0.5);
+
+	// Delays in ticks, spread over all levels of the wheel
+	static const u32 delays[] = {1, 3, 63, 64, 65, 4095, 4097, 300000};
+	static const u32 num_delays = sizeof(delays) / sizeof(delays[0]);
+	for (u32 i = 0; i < num_delays; i++)
+		UASSERTEQ(u64, wheel.schedule(v3s16(0, 0, 0), v3s16(i, 0, 0),
+			delays[i] * 0.5), delays[i]);
+	UASSERTEQ(u32, wheel.size(), num_delays);
+
+	// Already expired timers go into the next tick
+	UASSERTEQ(u64, wheel.schedule(v3s16(0, 0, 0), v3s16(0, 1, 0), -3.0), 1);
+
+	std::vector<NodeTimerWheel::Entry> expired;
+	u32 next = 0;
+	for (u64 tick = 1; tick <= 300000; tick++) {
+		expired.clear();
+		wheel.step(expired);
+		for (size_t j = 0; j < expired.size(); j++) {
+			UASSERTEQ(u64, expired[j].tick, tick);
+			if (expired[j].p.Y == 1)
+				continue;
+			UASSERT(next < num_delays);
+			UASSERTEQ(s16, expired[j].p.X, next);
+			UASSERTEQ(u64, tick, delays[next]);
+			next++;
+		}
+	}
+	UASSERTEQ(u32, next, num_delays);
+	UASSERTEQ(u32, wheel.size(), 0);
+}
+
+void TestNodeTimer::testAttachedList()
+{
+	NodeTimerWheel wheel(1.0);
+	NodeTimerList list;
+	v3s16 blockpos(1, 2, 3);
+	v3s16 p(4, 5, 6);
+	std::vector<NodeTimerWheel::Entry> expired;
+
+	list.set(p, NodeTimer(3.0, 1.0));
+	list.attach(&wheel, blockpos);
+	UASSERT(list.get(p).elapsed == 1.0);
+
+	// Elapsed time follows the wheel and survives detaching
+	wheel.step(expired);
+	UASSERT(expired.empty());
+	UASSERT(list.get(p).elapsed == 2.0);
+	list.detach();
+	wheel.step(expired);
+	wheel.step(expired);
+	UASSERT(list.get(p).elapsed == 2.0);
+
+	// The entry of the detached timer is stale
+	UASSERTEQ(size_t, expired.size(), 1);
+	NodeTimer t;
+	UASSERT(!list.takeExpired(p, expired[0].tick, t));
+
+	// Serialization keeps the elapsed time of attached timers
+	list.attach(&wheel, blockpos);
+	std::ostringstream os(std::ios_base::binary);
+	list.serialize(os, 25);
+	NodeTimerList list2;
+	std::istringstream is(os.str(), std::ios_base::binary);
+	list2.deSerialize(is, 25);
+	UASSERT(list2.get(p).timeout == 3.0);
+	UASSERT(list2.get(p).elapsed == 2.0);
+
+	expired.clear();
+	wheel.step(expired);
+	UASSERTEQ(size_t, expired.size(), 1);
+	UASSERT(expired[0].blockpos == blockpos && expired[0].p == p);
+	UASSERT(list.takeExpired(p, expired[0].tick, t));
+	UASSERT(t.timeout == 3.0 && t.elapsed == 3.0);
+	UASSERT(list.get(p).timeout == 0);
+}
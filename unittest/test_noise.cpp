@@ -20,7 +20,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "test.h"
 
 #include "exceptions.h"
+#include "log.h"
+#include "mapgen.h"
 #include "noise.h"
+#include "porting.h"
+#include "util/basic_macros.h"
 
 class TestNoise : public TestBase {
 public:
@@ -34,6 +38,9 @@ public:
 	void testNoise3dPoint();
 	void testNoise3dBulk();
 	void testNoiseInvalidParams();
+	void testNoiseKernels();
+	void testNoiseKernelBenchmark();
+	void testNoiseMapCache();
 
 	static const float expected_2d_results[10 * 10];
 	static const float expected_3d_results[10 * 10 * 10];
@@ -48,6 +55,9 @@ void TestNoise::runTests(IGameDef *gamedef)
 	TEST(testNoise3dPoint);
 	TEST(testNoise3dBulk);
 	TEST(testNoiseInvalidParams);
+	TEST(testNoiseKernels);
+	TEST(testNoiseKernelBenchmark);
+	TEST(testNoiseMapCache);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -120,6 +130,162 @@ void TestNoise::testNoiseInvalidParams()
 	UASSERT(exception_thrown);
 }
 
+static const NoiseKernel noise_kernels[] = {
+	NOISE_KERNEL_SCALAR, NOISE_KERNEL_SSE2, NOISE_KERNEL_AVX2
+};
+static const char *noise_kernel_names[] = { "scalar", "sse2", "avx2" };
+
+// Kernels match the scalar code exactly, except that -ffast-math lets the
+// compiler reorder the scalar math, which costs a few ulp
+static bool noise_kernel_results_match(const float *actual,
+	const float *expected, u32 n)
+{
+	for (u32 i = 0; i != n; i++) {
+#ifdef __FAST_MATH__
+		float limit = MYMAX(fabs(expected[i]), 1.f) * 0.00002;
+		if (fabs(actual[i] - expected[i]) > limit)
+			return false;
+#else
+		if (actual[i] != expected[i])
+			return false;
+#endif
+	}
+	return true;
+}
+
+void TestNoise::testNoiseKernels()
+{
+	UASSERT(noise_kernel_supported(NOISE_KERNEL_SCALAR));
+	UASSERT(noise_kernel_supported(noise_best_kernel()));
+
+	// Sizes not a multiple of the vector width, offsets off the lattice,
+	// and each flag combination of the bulk loops
+	NoiseParams np_2d(20, 40, v3f(50, 50, 50), 9, 5, 0.6, 2.0);
+	NoiseParams np_2d_abs(0, 1, v3f(7, 7, 7), 3, 3, 0.5, 3.0,
+		NOISE_FLAG_ABSVALUE);
+	NoiseParams np_3d(20, 40, v3f(50, 50, 50), 9, 5, 0.6, 2.0, 0);
+	NoiseParams np_3d_eased(-5, 10, v3f(13, 29, 13), 11, 3, 0.7, 2.0,
+		NOISE_FLAG_EASED | NOISE_FLAG_ABSVALUE);
+
+	float persistence_map[23 * 19 * 5];
+	for (u32 i = 0; i != ARRLEN(persistence_map); i++)
+		persistence_map[i] = 0.4 + (i % 7) * 0.05;
+
+	Noise ref_2d(&np_2d, 1337, 23, 19);
+	Noise ref_2d_abs(&np_2d_abs, 1337, 23, 19);
+	Noise ref_3d(&np_3d, 1337, 23, 19, 5);
+	Noise ref_3d_eased(&np_3d_eased, 1337, 23, 19, 5);
+	ref_2d.kernel       = NOISE_KERNEL_SCALAR;
+	ref_2d_abs.kernel   = NOISE_KERNEL_SCALAR;
+	ref_3d.kernel       = NOISE_KERNEL_SCALAR;
+	ref_3d_eased.kernel = NOISE_KERNEL_SCALAR;
+
+	for (u32 k = 1; k != ARRLEN(noise_kernels); k++) {
+		if (!noise_kernel_supported(noise_kernels[k]))
+			continue;
+
+		Noise noise_2d(&np_2d, 1337, 23, 19);
+		Noise noise_2d_abs(&np_2d_abs, 1337, 23, 19);
+		Noise noise_3d(&np_3d, 1337, 23, 19, 5);
+		Noise noise_3d_eased(&np_3d_eased, 1337, 23, 19, 5);
+		noise_2d.kernel       = noise_kernels[k];
+		noise_2d_abs.kernel   = noise_kernels[k];
+		noise_3d.kernel       = noise_kernels[k];
+		noise_3d_eased.kernel = noise_kernels[k];
+
+		const float *expected = ref_2d.perlinMap2D(-3.7, 100.2);
+		const float *actual   = noise_2d.perlinMap2D(-3.7, 100.2);
+		UASSERT(noise_kernel_results_match(actual, expected, 23 * 19));
+
+		expected = ref_2d_abs.perlinMap2D(5, -5, persistence_map);
+		actual   = noise_2d_abs.perlinMap2D(5, -5, persistence_map);
+		UASSERT(noise_kernel_results_match(actual, expected, 23 * 19));
+
+		expected = ref_3d.perlinMap3D(-3.7, 100.2, 0.5);
+		actual   = noise_3d.perlinMap3D(-3.7, 100.2, 0.5);
+		UASSERT(noise_kernel_results_match(actual, expected, 23 * 19 * 5));
+
+		expected = ref_3d_eased.perlinMap3D(-40, 0, 40, persistence_map);
+		actual   = noise_3d_eased.perlinMap3D(-40, 0, 40, persistence_map);
+		UASSERT(noise_kernel_results_match(actual, expected, 23 * 19 * 5));
+	}
+}
+
+void TestNoise::testNoiseKernelBenchmark()
+{
+	// Mapchunk sized maps with the terrain noise of mapgen v7
+	NoiseParams np_2d(4, 70, v3f(600, 600, 600), 82341, 5, 0.6, 2.0);
+	NoiseParams np_3d(0, 1, v3f(100, 100, 100), 5333, 5, 0.63, 2.0, 0);
+	const u32 csize = 80;
+	const u32 iterations = 10;
+
+	for (u32 k = 0; k != ARRLEN(noise_kernels); k++) {
+		if (!noise_kernel_supported(noise_kernels[k]))
+			continue;
+
+		Noise noise_2d(&np_2d, 1337, csize, csize);
+		Noise noise_3d(&np_3d, 1337, csize, csize + 2, csize);
+		noise_2d.kernel = noise_kernels[k];
+		noise_3d.kernel = noise_kernels[k];
+
+		u32 t0 = porting::getTimeMs();
+		for (u32 i = 0; i != iterations * 50; i++)
+			noise_2d.perlinMap2D(i * csize, 0);
+		u32 t1 = porting::getTimeMs();
+		for (u32 i = 0; i != iterations; i++)
+			noise_3d.perlinMap3D(i * csize, 0, 0);
+		u32 t2 = porting::getTimeMs();
+
+		infostream << "Noise kernel " << noise_kernel_names[k] << ": "
+			<< iterations * 50 << " 2D maps in " << (t1 - t0) << "ms, "
+			<< iterations << " 3D maps in " << (t2 - t1) << "ms" << std::endl;
+	}
+}
+
+void TestNoise::testNoiseMapCache()
+{
+	NoiseParams np_persist(0.6, 0.1, v3f(200, 200, 200), 539, 3, 0.6, 2.0);
+	NoiseParams np_terrain(4, 70, v3f(600, 600, 600), 82341, 5, 0.6, 2.0);
+	NoiseParams np_other(4, 70, v3f(600, 600, 600), 5934, 5, 0.6, 2.0);
+	Noise ref(&np_terrain, 1337, 16, 16);
+	Noise persist(&np_persist, 1337, 16, 16);
+	Noise terrain(&np_terrain, 1337, 16, 16);
+	Noise other(&np_other, 1337, 16, 16);
+
+	NoiseMapCache cache(2);
+
+	// A miss computes the map, a hit copies the same map back
+	cache.perlinMap2D(&terrain, 16, 32);
+	ref.perlinMap2D(16, 32);
+	for (u32 i = 0; i != 16 * 16; i++)
+		UASSERT(terrain.result[i] == ref.result[i]);
+	memset(terrain.result, 0, 16 * 16 * sizeof(float));
+	cache.perlinMap2D(&terrain, 16, 32);
+	for (u32 i = 0; i != 16 * 16; i++)
+		UASSERT(terrain.result[i] == ref.result[i]);
+	UASSERT(cache.getHits() == 1);
+	UASSERT(cache.getMisses() == 1);
+
+	// Other noises, spots and persistence maps are other maps
+	cache.perlinMap2D(&other, 16, 32);
+	cache.perlinMap2D(&terrain, 32, 32);
+	UASSERT(cache.getHits() == 1);
+
+	persist.perlinMap2D(16, 32);
+	cache.perlinMap2D(&terrain, 16, 32, &persist);
+	ref.perlinMap2D(16, 32, persist.result);
+	for (u32 i = 0; i != 16 * 16; i++)
+		UASSERT(terrain.result[i] == ref.result[i]);
+	UASSERT(cache.getHits() == 1);
+	UASSERT(cache.getMisses() == 4);
+
+	// Only the two most recently used maps are kept
+	cache.perlinMap2D(&terrain, 32, 32);
+	UASSERT(cache.getHits() == 2);
+	cache.perlinMap2D(&other, 16, 32);
+	UASSERT(cache.getMisses() == 5);
+}
+
 const float TestNoise::expected_2d_results[10 * 10] = {
 	19.11726, 18.49626, 16.48476, 15.02135, 14.75713, 16.26008, 17.54822,
 	18.06860, 18.57016, 18.48407, 18.49649, 17.89160, 15.94162, 14.54901,
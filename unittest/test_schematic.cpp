@@ -22,6 +22,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mg_schematic.h"
 #include "gamedef.h"
 #include "nodedef.h"
+#include "map.h"
+#include "porting.h"
+#include "log.h"
 
 class TestSchematic : public TestBase {
 public:
@@ -33,6 +36,8 @@ public:
 	void testMtsSerializeDeserialize(INodeDefManager *ndef);
 	void testLuaTableSerialize(INodeDefManager *ndef);
 	void testFileSerializeDeserialize(INodeDefManager *ndef);
+	void testBlitSpans(INodeDefManager *ndef);
+	void testBlitSpansBenchmark(INodeDefManager *ndef);
 
 	static const content_t test_schem1_data[7 * 6 * 4];
 	static const content_t test_schem2_data[3 * 3 * 3];
@@ -52,6 +57,8 @@ void TestSchematic::runTests(IGameDef *gamedef)
 	TEST(testMtsSerializeDeserialize, ndef);
 	TEST(testLuaTableSerialize, ndef);
 	TEST(testFileSerializeDeserialize, ndef);
+	TEST(testBlitSpans, ndef);
+	TEST(testBlitSpansBenchmark, ndef);
 
 	ndef->resetNodeResolveState();
 }
@@ -181,6 +188,150 @@ void TestSchematic::testFileSerializeDeserialize(INodeDefManager *ndef)
 }
 
 
+static void fill_test_vmanip(MMVManip *vm, const VoxelArea &area)
+{
+	vm->addArea(area);
+
+	const content_t c_fill[] = { CONTENT_AIR, CONTENT_IGNORE, t_CONTENT_BRICK };
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++)
+	for (s16 x = area.MinEdge.X; x <= area.MaxEdge.X; x++) {
+		content_t c = c_fill[(x + 2 * y + 3 * z + 300) % 3];
+		vm->m_data[area.index(x, y, z)] = MapNode(c);
+	}
+}
+
+
+void TestSchematic::testBlitSpans(INodeDefManager *ndef)
+{
+	static const v3s16 size(7, 6, 4);
+	static const u32 volume = size.X * size.Y * size.Z;
+	const content_t content_map[] = {
+		CONTENT_AIR,
+		t_CONTENT_STONE,
+		t_CONTENT_TORCH,
+		CONTENT_IGNORE,
+	};
+
+	Schematic schem_plain, schem_spans;
+	Schematic *schems[] = { &schem_plain, &schem_spans };
+
+	for (u32 j = 0; j != ARRLEN(schems); j++) {
+		Schematic *schem = schems[j];
+		schem->m_ndef      = ndef;
+		schem->size        = size;
+		schem->schemdata   = new MapNode[volume];
+		schem->slice_probs = new u8[size.Y];
+
+		for (size_t i = 0; i != volume; i++) {
+			u8 prob = (i % 5 == 0) ? MTSCHEM_PROB_NEVER : MTSCHEM_PROB_ALWAYS;
+			if (i % 3 == 0)
+				prob |= MTSCHEM_FORCE_PLACE;
+			schem->schemdata[i] = MapNode(
+				content_map[test_schem1_data[i]], prob, i % 4);
+		}
+		for (s16 y = 0; y != size.Y; y++)
+			schem->slice_probs[y] = MTSCHEM_PROB_ALWAYS;
+	}
+
+	schem_spans.compileSpans();
+
+	// The spans have to place the same nodes as the plain node walk,
+	// and clip to the vmanip the schematic sticks out of
+	const VoxelArea area_big(v3s16(-10, -10, -10), v3s16(20, 20, 20));
+	const VoxelArea area_small(v3s16(0, 0, 0), v3s16(4, 4, 4));
+	const v3s16 p(-2, 1, -1);
+
+	// Also with slices that are never placed, which collapse so that the
+	// slices above move down
+	for (int skip = 0; skip != 2; skip++)
+	for (int rot = ROTATE_0; rot <= ROTATE_270; rot++)
+	for (int force = 0; force != 2; force++) {
+		for (u32 j = 0; j != ARRLEN(schems); j++) {
+			schems[j]->slice_probs[1] = skip ?
+				MTSCHEM_PROB_NEVER : MTSCHEM_PROB_ALWAYS;
+			schems[j]->slice_probs[3] = skip ?
+				MTSCHEM_PROB_NEVER : MTSCHEM_PROB_ALWAYS;
+		}
+
+		MMVManip vm_big(NULL), vm_small(NULL);
+		fill_test_vmanip(&vm_big, area_big);
+		fill_test_vmanip(&vm_small, area_small);
+
+		mysrand(1337);
+		schem_plain.blitToVManip(&vm_big, p, (Rotation)rot, force);
+		mysrand(1337);
+		schem_spans.blitToVManip(&vm_small, p, (Rotation)rot, force);
+
+		for (s16 z = area_small.MinEdge.Z; z <= area_small.MaxEdge.Z; z++)
+		for (s16 y = area_small.MinEdge.Y; y <= area_small.MaxEdge.Y; y++)
+		for (s16 x = area_small.MinEdge.X; x <= area_small.MaxEdge.X; x++) {
+			v3s16 pos(x, y, z);
+			UASSERT(vm_small.m_data[area_small.index(pos)] ==
+				vm_big.m_data[area_big.index(pos)]);
+		}
+	}
+}
+
+
+void TestSchematic::testBlitSpansBenchmark(INodeDefManager *ndef)
+{
+	// A tree: trunk, a ball of leaves, and air that is never placed
+	static const v3s16 size(7, 8, 7);
+	static const u32 volume = size.X * size.Y * size.Z;
+	const u32 iterations = 20000;
+
+	Schematic schem_plain, schem_spans;
+	Schematic *schems[] = { &schem_plain, &schem_spans };
+
+	for (u32 j = 0; j != ARRLEN(schems); j++) {
+		Schematic *schem = schems[j];
+		schem->m_ndef      = ndef;
+		schem->size        = size;
+		schem->schemdata   = new MapNode[volume];
+		schem->slice_probs = new u8[size.Y];
+
+		u32 i = 0;
+		for (s16 z = 0; z != size.Z; z++)
+		for (s16 y = 0; y != size.Y; y++)
+		for (s16 x = 0; x != size.X; x++, i++) {
+			s16 dx = x - 3, dy = y - 5, dz = z - 3;
+			if (dx == 0 && dz == 0 && y < 6)
+				schem->schemdata[i] = MapNode(t_CONTENT_STONE,
+					MTSCHEM_PROB_ALWAYS | MTSCHEM_FORCE_PLACE, 0);
+			else if (dx * dx + dy * dy + dz * dz <= 9)
+				schem->schemdata[i] = MapNode(t_CONTENT_GRASS,
+					MTSCHEM_PROB_ALWAYS, 0);
+			else
+				schem->schemdata[i] = MapNode(CONTENT_AIR,
+					MTSCHEM_PROB_NEVER, 0);
+		}
+		for (s16 y = 0; y != size.Y; y++)
+			schem->slice_probs[y] = MTSCHEM_PROB_ALWAYS;
+	}
+
+	schem_spans.compileSpans();
+
+	const VoxelArea area(v3s16(0, 0, 0), v3s16(79, 15, 79));
+	MMVManip vm(NULL);
+	fill_test_vmanip(&vm, area);
+
+	u32 times[2];
+	for (u32 j = 0; j != ARRLEN(schems); j++) {
+		u32 t0 = porting::getTimeMs();
+		for (u32 i = 0; i != iterations; i++) {
+			v3s16 p((i * 7) % 72, 4, (i * 13) % 72);
+			schems[j]->blitToVManip(&vm, p, (Rotation)(i % 4), false);
+		}
+		times[j] = porting::getTimeMs() - t0;
+	}
+
+	infostream << "Schematic placement: " << iterations << " trees in "
+		<< times[0] << "ms per node, " << times[1] << "ms with spans"
+		<< std::endl;
+}
+
+
 // Should form a cross-shaped-thing...?
 const content_t TestSchematic::test_schem1_data[7 * 6 * 4] = {
 	3, 3, 1, 1, 1, 3, 3, // Y=0, Z=0
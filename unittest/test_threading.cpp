@@ -22,6 +22,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "threading/atomic.h"
 #include "threading/semaphore.h"
 #include "threading/thread.h"
+#include "util/container.h"
+#include "util/thread.h"
+#include "log.h"
 
 
 class TestThreading : public TestBase {
@@ -33,6 +36,8 @@ public:
 	void testStartStopWait();
 	void testThreadKill();
 	void testAtomicSemaphoreThread();
+	void testMPSCQueue();
+	void testWorkerPoolShared();
 };
 
 static TestThreading g_test_instance;
@@ -42,6 +47,8 @@ void TestThreading::runTests(IGameDef *gamedef)
 	TEST(testStartStopWait);
 	TEST(testThreadKill);
 	TEST(testAtomicSemaphoreThread);
+	TEST(testMPSCQueue);
+	TEST(testWorkerPoolShared);
 }
 
 class SimpleTestThread : public Thread {
@@ -180,3 +187,215 @@ void TestThreading::testAtomicSemaphoreThread()
 	UASSERT(val == num_threads * 0x10000);
 }
 
+
+
+/*
+	Producers push (thread index << 24 | counter) so the consumer can check
+	that every producer's elements arrive complete and in order.
+*/
+static const u32 queue_test_items = 0x10000;
+
+template<typename Q>
+class QueueProducerThread : public Thread {
+public:
+	QueueProducerThread(Q &q, u32 index, Semaphore &trigger) :
+		Thread("QueueProducer"),
+		m_queue(q),
+		m_index(index),
+		m_trigger(trigger)
+	{
+	}
+
+private:
+	void *run()
+	{
+		m_trigger.wait();
+		for (u32 i = 0; i < queue_test_items; i++)
+			push(m_queue, (m_index << 24) | i);
+		return NULL;
+	}
+
+	static void push(MPSCQueue<u32> &q, u32 v)
+	{
+		while (!q.push(v))
+			sleep_ms(0);
+	}
+
+	static void push(MutexedQueue<u32> &q, u32 v)
+	{
+		q.push_back(v);
+	}
+
+	Q &m_queue;
+	u32 m_index;
+	Semaphore &m_trigger;
+};
+
+static bool queue_pop(MPSCQueue<u32> &q, u32 &v)
+{
+	return q.pop(v, 100);
+}
+
+static bool queue_pop(MutexedQueue<u32> &q, u32 &v)
+{
+	try {
+		v = q.pop_front(100);
+		return true;
+	} catch (ItemNotFoundException &e) {
+		return false;
+	}
+}
+
+// Returns the time the consumer needed in ms, or U32_MAX on error
+template<typename Q>
+static u32 run_queue_contention(Q &q, u8 num_threads)
+{
+	Semaphore trigger;
+	QueueProducerThread<Q> *threads[8];
+	u32 next[8];
+
+	for (u8 i = 0; i < num_threads; i++) {
+		threads[i] = new QueueProducerThread<Q>(q, i, trigger);
+		threads[i]->start();
+		next[i] = 0;
+	}
+
+	u32 t1 = porting::getTimeMs();
+	trigger.post(num_threads);
+
+	bool ok = true;
+	u32 v;
+	for (u32 received = 0; received < num_threads * queue_test_items; ) {
+		if (!queue_pop(q, v))
+			continue;
+		u32 index = v >> 24;
+		if (index >= num_threads || (v & 0xFFFFFF) != next[index]++)
+			ok = false;
+		received++;
+	}
+	u32 tdiff = porting::getTimeMs() - t1;
+
+	for (u8 i = 0; i < num_threads; i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+	return ok ? tdiff : U32_MAX;
+}
+
+void TestThreading::testMPSCQueue()
+{
+	// Single threaded behaviour
+	MPSCQueue<u32> small(3);
+	u32 v = 0;
+	UASSERT(small.empty());
+	UASSERT(!small.pop(v));
+	for (u32 i = 0; i < 4; i++)
+		UASSERT(small.push(i));
+	UASSERT(!small.push(4));
+	UASSERT(small.pop(v) && v == 0);
+	UASSERT(small.push(4));
+
+	std::vector<u32> batch;
+	UASSERT(small.popBatch(batch, 10) == 4);
+	UASSERT(batch[0] == 1 && batch[3] == 4);
+	UASSERT(small.empty());
+
+	// Unbounded pushes spill over in order and never block
+	MPSCQueue<u32> spill(3);
+	for (u32 i = 0; i < 10; i++)
+		spill.pushUnbounded(i);
+	UASSERT(!spill.empty());
+	UASSERT(spill.pop(v) && v == 0);
+	spill.pushUnbounded(10);
+	batch.clear();
+	UASSERT(spill.popBatch(batch, 20) == 10);
+	for (u32 i = 0; i < 10; i++)
+		UASSERT(batch[i] == i + 1);
+	UASSERT(spill.empty());
+
+	// Contention microbenchmark against the mutex based queue
+	static const u8 num_threads = 4;
+
+	MPSCQueue<u32> lockfree(0x1000);
+	u32 time_lockfree = run_queue_contention(lockfree, num_threads);
+	UASSERT(time_lockfree != U32_MAX);
+
+	MutexedQueue<u32> mutexed;
+	u32 time_mutexed = run_queue_contention(mutexed, num_threads);
+	UASSERT(time_mutexed != U32_MAX);
+
+	infostream << "MPSCQueue: " << num_threads << " producers, "
+		<< num_threads * queue_test_items << " items: lock-free "
+		<< time_lockfree << "ms, mutexed " << time_mutexed << "ms"
+		<< std::endl;
+}
+
+
+class CountingJob : public WorkerPool::Job {
+public:
+	CountingJob(Atomic<u32> *counts) : m_counts(counts) {}
+
+	void run(u32 index)
+	{
+		m_counts[index]++;
+	}
+
+private:
+	Atomic<u32> *m_counts;
+};
+
+static const u32 pool_test_jobs = 256;
+static const u32 pool_test_batches = 200;
+
+class PoolCallerThread : public Thread {
+public:
+	PoolCallerThread(WorkerPool *pool, Atomic<u32> *counts, Semaphore &trigger) :
+		Thread("PoolCaller"),
+		m_pool(pool),
+		m_counts(counts),
+		m_trigger(trigger)
+	{
+	}
+
+private:
+	void *run()
+	{
+		m_trigger.wait();
+		CountingJob job(m_counts);
+		for (u32 i = 0; i < pool_test_batches; i++)
+			m_pool->run(&job, pool_test_jobs);
+		return NULL;
+	}
+
+	WorkerPool *m_pool;
+	Atomic<u32> *m_counts;
+	Semaphore &m_trigger;
+};
+
+void TestThreading::testWorkerPoolShared()
+{
+	static const u8 num_callers = 4;
+
+	// Batches from callers that don't get the workers run inline, but every
+	// index of every batch still has to run exactly once
+	WorkerPool pool("Test", 3);
+	Semaphore trigger;
+	Atomic<u32> counts[num_callers][pool_test_jobs];
+
+	PoolCallerThread *threads[num_callers];
+	for (u8 i = 0; i < num_callers; i++) {
+		threads[i] = new PoolCallerThread(&pool, counts[i], trigger);
+		UASSERT(threads[i]->start());
+	}
+
+	trigger.post(num_callers);
+
+	for (u8 i = 0; i < num_callers; i++) {
+		threads[i]->wait();
+		delete threads[i];
+	}
+
+	for (u8 i = 0; i < num_callers; i++)
+	for (u32 j = 0; j < pool_test_jobs; j++)
+		UASSERTEQ(u32, counts[i][j], pool_test_batches);
+}
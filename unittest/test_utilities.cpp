@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "util/numeric.h"
 #include "util/string.h"
+#include "util/container.h"
+#include "noise.h"
 
 class TestUtilities : public TestBase {
 public:
@@ -50,6 +52,7 @@ public:
 	void testIsNumber();
 	void testIsPowerOfTwo();
 	void testMyround();
+	void testFlatHashSet();
 };
 
 static TestUtilities g_test_instance;
@@ -77,6 +80,7 @@ void TestUtilities::runTests(IGameDef *gamedef)
 	TEST(testIsNumber);
 	TEST(testIsPowerOfTwo);
 	TEST(testMyround);
+	TEST(testFlatHashSet);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -326,3 +330,52 @@ void TestUtilities::testMyround()
 	UASSERT(myround(-6.5f) == -7);
 }
 
+void TestUtilities::testFlatHashSet()
+{
+	// Random inserts and erases, checked against std::set
+	FlatHashSet<v3s16, V3s16Hash> flat;
+	std::set<v3s16> ref;
+	PcgRandom pr(42);
+	for (u32 i = 0; i < 20000; i++) {
+		v3s16 p(pr.range(-20, 20), pr.range(-4, 4), pr.range(-20, 20));
+		if (pr.range(0, 2) == 0)
+			UASSERTEQ(size_t, flat.erase(p), ref.erase(p));
+		else
+			UASSERT(flat.insert(p).second == ref.insert(p).second);
+		UASSERTEQ(size_t, flat.size(), ref.size());
+	}
+	for (s16 x = -20; x <= 20; x++)
+	for (s16 z = -20; z <= 20; z++) {
+		v3s16 p(x, 0, z);
+		UASSERTEQ(size_t, flat.count(p), ref.count(p));
+	}
+
+	UniqueQueue<v3s16, FlatHashSet<v3s16, V3s16Hash> > queue;
+	UASSERT(queue.push_back(v3s16(1, 2, 3)));
+	UASSERT(!queue.push_back(v3s16(1, 2, 3)));
+	UASSERT(queue.push_back(v3s16(-1, 2, 3)));
+	queue.pop_front();
+	UASSERT(queue.front() == v3s16(-1, 2, 3));
+	UASSERT(queue.push_back(v3s16(1, 2, 3)));
+	UASSERTEQ(u32, queue.size(), 2);
+
+	// The map shares the table, checked against std::map
+	FlatHashMap<v3s16, u32, V3s16Hash> flat_map;
+	std::map<v3s16, u32> ref_map;
+	for (u32 i = 0; i < 20000; i++) {
+		v3s16 p(pr.range(-20, 20), pr.range(-4, 4), pr.range(-20, 20));
+		if (pr.range(0, 2) == 0) {
+			UASSERTEQ(size_t, flat_map.erase(p), ref_map.erase(p));
+		} else {
+			flat_map.set(p, i);
+			ref_map[p] = i;
+		}
+		UASSERTEQ(size_t, flat_map.size(), ref_map.size());
+	}
+	for (std::map<v3s16, u32>::const_iterator it = ref_map.begin();
+			it != ref_map.end(); ++it) {
+		const u32 *value = flat_map.find(it->first);
+		UASSERT(value && *value == it->second);
+	}
+	UASSERT(flat_map.find(v3s16(100, 0, 0)) == NULL);
+}
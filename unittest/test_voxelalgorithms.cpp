@@ -21,6 +21,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "gamedef.h"
 #include "voxelalgorithms.h"
+#include "porting.h"
+#include "log.h"
+#include "noise.h"
+#include "util/directiontables.h"
 
 class TestVoxelAlgorithms : public TestBase {
 public:
@@ -31,6 +35,7 @@ public:
 
 	void testPropogateSunlight(INodeDefManager *ndef);
 	void testClearLightAndCollectSources(INodeDefManager *ndef);
+	void testLightEditTrace(INodeDefManager *ndef);
 };
 
 static TestVoxelAlgorithms g_test_instance;
@@ -41,6 +46,7 @@ void TestVoxelAlgorithms::runTests(IGameDef *gamedef)
 
 	TEST(testPropogateSunlight, ndef);
 	TEST(testClearLightAndCollectSources, ndef);
+	TEST(testLightEditTrace, ndef);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -202,3 +208,146 @@ void TestVoxelAlgorithms::testClearLightAndCollectSources(INodeDefManager *ndef)
 		UASSERT(unlight_from.size() == 1);
 	}
 }
+
+/*
+	The recursive, std::set based light spreading that was used before
+	voxalgo::spreadLight, kept as reference for the edit trace test
+*/
+static void ref_unspreadLight(VoxelManipulator &v, enum LightBank bank,
+		v3s16 p, u8 oldlight, std::set<v3s16> &light_sources,
+		INodeDefManager *ndef)
+{
+	for (u16 i = 0; i < 6; i++) {
+		v3s16 n2pos = p + g_6dirs[i];
+		if (!v.m_area.contains(n2pos))
+			continue;
+		MapNode &n2 = v.getNodeRefUnsafe(n2pos);
+		u8 light2 = n2.getLight(bank, ndef);
+		if (light2 < oldlight) {
+			if (ndef->get(n2).light_propagates && light2 != 0) {
+				n2.setLight(bank, 0, ndef);
+				ref_unspreadLight(v, bank, n2pos, light2, light_sources, ndef);
+			}
+		} else {
+			light_sources.insert(n2pos);
+		}
+	}
+}
+
+static void ref_spreadLight(VoxelManipulator &v, enum LightBank bank,
+		std::set<v3s16> &from_nodes, INodeDefManager *ndef)
+{
+	if (from_nodes.empty())
+		return;
+
+	std::set<v3s16> lighted_nodes;
+	for (std::set<v3s16>::iterator
+			j = from_nodes.begin(); j != from_nodes.end(); ++j) {
+		if (!v.m_area.contains(*j))
+			continue;
+		u8 oldlight = v.getNodeRefUnsafe(*j).getLight(bank, ndef);
+		u8 newlight = diminish_light(oldlight);
+		for (u16 i = 0; i < 6; i++) {
+			v3s16 n2pos = *j + g_6dirs[i];
+			if (!v.m_area.contains(n2pos))
+				continue;
+			MapNode &n2 = v.getNodeRefUnsafe(n2pos);
+			u8 light2 = n2.getLight(bank, ndef);
+			if (light2 > undiminish_light(oldlight))
+				lighted_nodes.insert(n2pos);
+			if (light2 < newlight && ndef->get(n2).light_propagates) {
+				n2.setLight(bank, newlight, ndef);
+				lighted_nodes.insert(n2pos);
+			}
+		}
+	}
+	ref_spreadLight(v, bank, lighted_nodes, ndef);
+}
+
+/*
+	Places and digs torches and stone at random positions of a dense
+	build and updates the light like Map does, returns the time in ms
+*/
+static u32 run_light_edit_trace(VoxelManipulator &v, INodeDefManager *ndef,
+		bool reference)
+{
+	const VoxelArea &a = v.m_area;
+	v3s16 extent = a.getExtent();
+	PcgRandom pr(1234);
+
+	u32 t1 = porting::getTimeMs();
+	for (u32 i = 0; i < 1000; i++) {
+		v3s16 p = a.MinEdge + v3s16(pr.range(0, extent.X - 1),
+			pr.range(0, extent.Y - 1), pr.range(0, extent.Z - 1));
+		MapNode &n = v.getNodeRefUnsafe(p);
+
+		std::set<v3s16> light_sources;
+		std::map<v3s16, u8> unlight_from;
+		if (n.getContent() != CONTENT_AIR) {
+			unlight_from[p] = n.getLight(LIGHTBANK_NIGHT, ndef);
+			n = MapNode(CONTENT_AIR);
+			for (u16 j = 0; j < 6; j++)
+				light_sources.insert(p + g_6dirs[j]);
+		} else if (pr.range(0, 1)) {
+			n = MapNode(t_CONTENT_TORCH);
+			light_sources.insert(p);
+		} else {
+			n = MapNode(t_CONTENT_STONE);
+			unlight_from[p] = LIGHT_SUN;
+		}
+
+		if (reference) {
+			for (std::map<v3s16, u8>::iterator j = unlight_from.begin();
+					j != unlight_from.end(); ++j)
+				ref_unspreadLight(v, LIGHTBANK_NIGHT, j->first, j->second,
+					light_sources, ndef);
+			ref_spreadLight(v, LIGHTBANK_NIGHT, light_sources, ndef);
+		} else {
+			v.unspreadLight(LIGHTBANK_NIGHT, unlight_from, light_sources, ndef);
+			v.spreadLight(LIGHTBANK_NIGHT, light_sources, ndef);
+		}
+	}
+	return porting::getTimeMs() - t1;
+}
+
+void TestVoxelAlgorithms::testLightEditTrace(INodeDefManager *ndef)
+{
+	VoxelArea a(v3s16(0, 0, 0), v3s16(31, 31, 31));
+	VoxelManipulator v, v_ref;
+	v.addArea(a);
+	v_ref.addArea(a);
+
+	// A dense build with some torches in it
+	PcgRandom pr(42);
+	std::set<v3s16> light_sources;
+	for (s16 z = 0; z < 32; z++)
+	for (s16 y = 0; y < 32; y++)
+	for (s16 x = 0; x < 32; x++) {
+		v3s16 p(x, y, z);
+		s32 r = pr.range(0, 99);
+		MapNode n(CONTENT_AIR);
+		if (r < 30) {
+			n = MapNode(t_CONTENT_STONE);
+		} else if (r < 31) {
+			n = MapNode(t_CONTENT_TORCH);
+			light_sources.insert(p);
+		}
+		n.setLight(LIGHTBANK_NIGHT, 0, ndef);
+		v.setNodeNoRef(p, n);
+		v_ref.setNodeNoRef(p, n);
+	}
+	v.spreadLight(LIGHTBANK_NIGHT, light_sources, ndef);
+	v_ref.spreadLight(LIGHTBANK_NIGHT, light_sources, ndef);
+
+	u32 time_bfs = run_light_edit_trace(v, ndef, false);
+	u32 time_ref = run_light_edit_trace(v_ref, ndef, true);
+
+	// Both have to end up with the same light
+	for (s32 i = 0; i < a.getVolume(); i++) {
+		UASSERT(v.m_data[i].getContent() == v_ref.m_data[i].getContent());
+		UASSERT(v.m_data[i].param1 == v_ref.m_data[i].param1);
+	}
+
+	infostream << "Light edit trace: queue based " << time_bfs
+		<< "ms, recursive " << time_ref << "ms" << std::endl;
+}
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "gamedef.h"
 #include "log.h"
+#include "porting.h"
 #include "voxel.h"
 
 class TestVoxelManipulator : public TestBase {
@@ -34,6 +35,8 @@ public:
 
 	void testVoxelArea();
 	void testVoxelManipulator(INodeDefManager *nodedef);
+	void testVoxelBufferPool();
+	void testVoxelBufferPoolBenchmark();
 };
 
 static TestVoxelManipulator g_test_instance;
@@ -42,6 +45,8 @@ void TestVoxelManipulator::runTests(IGameDef *gamedef)
 {
 	TEST(testVoxelArea);
 	TEST(testVoxelManipulator, gamedef->getNodeDefManager());
+	TEST(testVoxelBufferPool);
+	TEST(testVoxelBufferPoolBenchmark);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -106,3 +111,82 @@ void TestVoxelManipulator::testVoxelManipulator(INodeDefManager *nodedef)
 	UASSERT(v.getNode(v3s16(-1,0,-1)).getContent() == t_CONTENT_GRASS);
 	EXCEPTION_CHECK(InvalidPositionException, v.getNode(v3s16(0,1,1)));
 }
+
+
+void TestVoxelManipulator::testVoxelBufferPool()
+{
+	VoxelBufferPool *pool = VoxelBufferPool::get();
+	VoxelArea a(v3s16(0,0,0), v3s16(15,15,15));
+	pool->clear();
+
+	u32 allocated = pool->getNumAllocated();
+	u32 reused = pool->getNumReused();
+	{
+		VoxelManipulator v;
+		v.addArea(a);
+		v.setNodeNoRef(v3s16(1,2,3), MapNode(t_CONTENT_GRASS));
+	}
+
+	// The buffer is reused, but nothing of its last user shows
+	{
+		VoxelManipulator v;
+		v.addArea(a);
+		UASSERT(v.m_flags[v.m_area.index(v3s16(1,2,3))] & VOXELFLAG_NO_DATA);
+		for (u32 i = 0; i != a.getVolume(); i++)
+			UASSERT(v.m_data[i].getContent() == CONTENT_AIR);
+		EXCEPTION_CHECK(InvalidPositionException, v.getNode(v3s16(1,2,3)));
+
+		// Growing keeps the nodes and gives the old buffer back
+		v.setNodeNoRef(v3s16(1,2,3), MapNode(t_CONTENT_GRASS));
+		v.addArea(VoxelArea(v3s16(-16,0,0), v3s16(15,15,15)));
+		UASSERT(v.getNode(v3s16(1,2,3)).getContent() == t_CONTENT_GRASS);
+		EXCEPTION_CHECK(InvalidPositionException, v.getNode(v3s16(-1,2,3)));
+	}
+	UASSERTEQ(u32, pool->getNumAllocated() - allocated, 2);
+	UASSERTEQ(u32, pool->getNumReused() - reused, 1);
+
+	// Much smaller manipulators don't take the big buffers
+	{
+		VoxelManipulator v;
+		v.addArea(VoxelArea(v3s16(0,0,0), v3s16(1,1,1)));
+		UASSERT(v.m_capacity < a.getVolume());
+	}
+	pool->clear();
+}
+
+
+void TestVoxelManipulator::testVoxelBufferPoolBenchmark()
+{
+	// A mapchunk with its shell, as made for every chunk the mapgen makes
+	VoxelArea chunk(v3s16(-16,-16,-16), v3s16(95,95,95));
+	const u32 iterations = 20;
+	VoxelBufferPool *pool = VoxelBufferPool::get();
+
+	// Every manipulator allocates anew
+	u32 t0 = porting::getTimeMs();
+	for (u32 k = 0; k < iterations; k++) {
+		{
+			VoxelManipulator v;
+			v.addArea(chunk);
+			std::fill(v.m_data, v.m_data + chunk.getVolume(),
+				MapNode(CONTENT_AIR));
+		}
+		pool->clear();
+	}
+	u32 t1 = porting::getTimeMs();
+
+	u32 allocated = pool->getNumAllocated();
+	for (u32 k = 0; k < iterations; k++) {
+		VoxelManipulator v;
+		v.addArea(chunk);
+		std::fill(v.m_data, v.m_data + chunk.getVolume(),
+			MapNode(CONTENT_AIR));
+	}
+	u32 t2 = porting::getTimeMs();
+	UASSERTEQ(u32, pool->getNumAllocated() - allocated, 1);
+	pool->clear();
+
+	infostream << "Voxel buffers: " << iterations << " mapchunk manipulators in "
+		<< (t1 - t0) << "ms allocating, " << (t2 - t1) << "ms pooled"
+		<< std::endl;
+}
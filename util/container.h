@@ -25,17 +25,207 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../threading/mutex.h"
 #include "../threading/mutex_auto_lock.h"
 #include "../threading/semaphore.h"
+#include "../threading/atomic.h"
 #include <list>
 #include <vector>
 #include <map>
 #include <set>
 #include <queue>
 
+/*
+Table stored in a single array using open addressing with linear probing,
+the common part of FlatHashSet and FlatHashMap. Needs no allocation per
+element, unlike std::set and std::map. KeyOf is a functor returning the
+Key of an Entry, Hash a functor returning size_t for a Key.
+*/
+
+template<typename Key, typename Entry, typename KeyOf, typename Hash>
+class FlatHashTable
+{
+public:
+	FlatHashTable():
+		m_size(0)
+	{
+	}
+
+	// Returns the entry of key, or NULL
+	Entry *find(const Key &key)
+	{
+		if (m_size == 0)
+			return NULL;
+		size_t i = findSlot(key);
+		return m_used[i] ? &m_entries[i] : NULL;
+	}
+
+	const Entry *find(const Key &key) const
+	{
+		if (m_size == 0)
+			return NULL;
+		size_t i = findSlot(key);
+		return m_used[i] ? &m_entries[i] : NULL;
+	}
+
+	// Returns the stored entry with the key of entry and whether entry
+	// was inserted, like std::set
+	std::pair<Entry *, bool> insert(const Entry &entry)
+	{
+		if ((m_size + 1) * 2 > m_entries.size())
+			grow();
+		size_t i = findSlot(KeyOf()(entry));
+		if (m_used[i])
+			return std::make_pair(&m_entries[i], false);
+		m_entries[i] = entry;
+		m_used[i] = true;
+		m_size++;
+		return std::make_pair(&m_entries[i], true);
+	}
+
+	size_t erase(const Key &key)
+	{
+		if (m_size == 0)
+			return 0;
+		size_t i = findSlot(key);
+		if (!m_used[i])
+			return 0;
+		// Shift following entries of the probe sequence back into the gap
+		size_t mask = m_entries.size() - 1;
+		for (size_t j = (i + 1) & mask; m_used[j]; j = (j + 1) & mask) {
+			size_t home = Hash()(KeyOf()(m_entries[j])) & mask;
+			if (((j - home) & mask) >= ((j - i) & mask)) {
+				m_entries[i] = m_entries[j];
+				i = j;
+			}
+		}
+		m_used[i] = false;
+		m_size--;
+		return 1;
+	}
+
+	void clear()
+	{
+		m_entries.clear();
+		m_used.clear();
+		m_size = 0;
+	}
+
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+
+private:
+	// Slot of key, or of the free slot it would go into
+	size_t findSlot(const Key &key) const
+	{
+		size_t mask = m_entries.size() - 1;
+		size_t i = Hash()(key) & mask;
+		while (m_used[i] && !(KeyOf()(m_entries[i]) == key))
+			i = (i + 1) & mask;
+		return i;
+	}
+
+	void grow()
+	{
+		std::vector<Entry> entries;
+		std::vector<bool> used;
+		entries.swap(m_entries);
+		used.swap(m_used);
+		size_t capacity = entries.empty() ? 16 : entries.size() * 2;
+		m_entries.resize(capacity);
+		m_used.resize(capacity, false);
+		m_size = 0;
+		for (size_t i = 0; i < entries.size(); i++)
+			if (used[i])
+				insert(entries[i]);
+	}
+
+	std::vector<Entry> m_entries;
+	std::vector<bool> m_used;
+	size_t m_size;
+};
+
+/*
+Set on a FlatHashTable, for use in place of std::set
+*/
+
+template<typename Key, typename Hash>
+class FlatHashSet
+{
+public:
+	// Returns the stored key and whether it was inserted, like std::set
+	std::pair<const Key *, bool> insert(const Key &key)
+	{
+		std::pair<Key *, bool> r = m_table.insert(key);
+		return std::make_pair(r.first, r.second);
+	}
+
+	size_t count(const Key &key) const
+	{
+		return m_table.find(key) ? 1 : 0;
+	}
+
+	size_t erase(const Key &key) { return m_table.erase(key); }
+	void clear() { m_table.clear(); }
+
+	size_t size() const { return m_table.size(); }
+	bool empty() const { return m_table.empty(); }
+
+private:
+	struct KeyOf {
+		const Key &operator()(const Key &key) const { return key; }
+	};
+
+	FlatHashTable<Key, Key, KeyOf, Hash> m_table;
+};
+
+/*
+Map on a FlatHashTable, the key/value counterpart of FlatHashSet
+*/
+
+template<typename Key, typename Value, typename Hash>
+class FlatHashMap
+{
+public:
+	// Returns a pointer to the value of key, or NULL
+	Value *find(const Key &key)
+	{
+		std::pair<Key, Value> *entry = m_table.find(key);
+		return entry ? &entry->second : NULL;
+	}
+
+	const Value *find(const Key &key) const
+	{
+		const std::pair<Key, Value> *entry = m_table.find(key);
+		return entry ? &entry->second : NULL;
+	}
+
+	// Inserts or replaces the value of key
+	void set(const Key &key, const Value &value)
+	{
+		std::pair<std::pair<Key, Value> *, bool> r =
+			m_table.insert(std::make_pair(key, value));
+		if (!r.second)
+			r.first->second = value;
+	}
+
+	size_t erase(const Key &key) { return m_table.erase(key); }
+	void clear() { m_table.clear(); }
+
+	size_t size() const { return m_table.size(); }
+	bool empty() const { return m_table.empty(); }
+
+private:
+	struct KeyOf {
+		const Key &operator()(const std::pair<Key, Value> &entry) const
+		{ return entry.first; }
+	};
+
+	FlatHashTable<Key, std::pair<Key, Value>, KeyOf, Hash> m_table;
+};
+
 /*
 Queue with unique values with fast checking of value existence
 */
 
-template<typename Value>
+template<typename Value, typename Set = std::set<Value> >
 class UniqueQueue
 {
 public:
@@ -73,7 +263,7 @@ public:
 	}
 
 private:
-	std::set<Value> m_set;
+	Set m_set;
 	std::queue<Value> m_queue;
 };
 
@@ -234,6 +424,212 @@ protected:
 	Semaphore m_signal;
 };
 
+/*
+	Bounded lock-free queue for many producers and a single consumer.
+
+	Producers claim a slot with a compare-and-swap on the enqueue position,
+	every slot carries a sequence number telling whether it's free for the
+	current lap or holds data (D. Vyukov's bounded queue). The consumer
+	doesn't need any atomic read-modify-write at all.
+
+	push() fails if the queue is full, it's up to the producer to back off.
+	Producers that must not block use pushUnbounded() instead, which puts
+	the element on a mutexed overflow list while the queue is full.
+	The semaphore is only posted when the consumer is actually sleeping in
+	pop(wait_time_max_ms), so uncontended pushes never enter the kernel.
+	T must be default constructible and assignable.
+*/
+template<typename T>
+class MPSCQueue
+{
+public:
+	// capacity is rounded up to a power of two
+	MPSCQueue(u32 capacity) :
+		m_enqueue_pos(0),
+		m_dequeue_pos(0),
+		m_consumer_waiting(0),
+		m_overflow_size(0)
+	{
+		u32 size = 2;
+		while (size < capacity)
+			size <<= 1;
+		m_mask = size - 1;
+		m_cells = new Cell[size];
+		for (u32 i = 0; i < size; i++)
+			m_cells[i].sequence = i;
+	}
+
+	~MPSCQueue()
+	{
+		delete[] m_cells;
+	}
+
+	// May be called from any thread; returns false if the queue is full
+	bool push(const T &t)
+	{
+		Cell *cell;
+		u32 pos = m_enqueue_pos;
+		for (;;) {
+			cell = &m_cells[pos & m_mask];
+			s32 diff = (s32)((u32)cell->sequence - pos);
+			if (diff == 0) {
+				if (m_enqueue_pos.compare_exchange_strong(pos, pos + 1))
+					break;
+				pos = m_enqueue_pos;
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = m_enqueue_pos;
+			}
+		}
+
+		cell->data = t;
+		cell->sequence = pos + 1;
+
+		wakeConsumer();
+		return true;
+	}
+
+	/*
+		May be called from any thread; never fails nor blocks on the
+		consumer. Once an element went to the overflow list, the following
+		ones do too until the consumer has taken the list, so the elements
+		of one producer stay in order. Don't mix with push() on one queue.
+	*/
+	void pushUnbounded(const T &t)
+	{
+		if (m_overflow_size == 0 && push(t))
+			return;
+
+		{
+			MutexAutoLock lock(m_overflow_mutex);
+			if (!m_overflow.empty() || !push(t)) {
+				m_overflow.push_back(t);
+				m_overflow_size = m_overflow.size();
+			}
+		}
+		wakeConsumer();
+	}
+
+	// Consumer only; returns false if the queue is empty
+	bool pop(T &t)
+	{
+		if (!m_pending.empty()) {
+			t = m_pending.front();
+			m_pending.pop_front();
+			return true;
+		}
+
+		Cell *cell = &m_cells[m_dequeue_pos & m_mask];
+		s32 diff = (s32)((u32)cell->sequence - (m_dequeue_pos + 1));
+		if (diff < 0)
+			return popOverflow(t);
+
+		t = cell->data;
+		cell->data = T();
+		cell->sequence = m_dequeue_pos + m_mask + 1;
+		m_dequeue_pos++;
+		return true;
+	}
+
+	/*
+		Consumer only; waits up to wait_time_max_ms for an element.
+		May return false early if woken up by a push that was already
+		consumed.
+	*/
+	bool pop(T &t, u32 wait_time_max_ms)
+	{
+		if (pop(t))
+			return true;
+		if (wait_time_max_ms == 0)
+			return false;
+
+		m_consumer_waiting = 1;
+		// a producer may have pushed before it saw the flag
+		if (pop(t)) {
+			m_consumer_waiting = 0;
+			return true;
+		}
+		m_signal.wait(wait_time_max_ms);
+		m_consumer_waiting = 0;
+		return pop(t);
+	}
+
+	// Consumer only; moves up to max elements to dst, returns their count
+	u32 popBatch(std::vector<T> &dst, u32 max)
+	{
+		u32 count = 0;
+		T t;
+		while (count < max && pop(t)) {
+			dst.push_back(t);
+			count++;
+		}
+		return count;
+	}
+
+	// Only a hint when producers are active
+	bool empty()
+	{
+		Cell *cell = &m_cells[m_dequeue_pos & m_mask];
+		return m_pending.empty() && m_overflow_size == 0 &&
+			(s32)((u32)cell->sequence - (m_dequeue_pos + 1)) < 0;
+	}
+
+private:
+	void wakeConsumer()
+	{
+		u32 waiting = 1;
+		if (m_consumer_waiting.compare_exchange_strong(waiting, 0))
+			m_signal.post();
+	}
+
+	/*
+		Only taken once the queue ran empty, including slots claimed but
+		not yet filled: everything pushed to it before the overflow started
+		has been consumed then, and everything pushed after the list is
+		taken comes after m_pending.
+	*/
+	bool popOverflow(T &t)
+	{
+		if (m_overflow_size == 0 || m_enqueue_pos != m_dequeue_pos)
+			return false;
+
+		{
+			MutexAutoLock lock(m_overflow_mutex);
+			m_pending.swap(m_overflow);
+			m_overflow_size = 0;
+		}
+		if (m_pending.empty())
+			return false;
+
+		t = m_pending.front();
+		m_pending.pop_front();
+		return true;
+	}
+
+	struct Cell {
+		Cell() : sequence(0) {}
+		Atomic<u32> sequence;
+		T data;
+	};
+
+	Cell *m_cells;
+	u32 m_mask;
+	Atomic<u32> m_enqueue_pos;
+	u32 m_dequeue_pos;
+	Atomic<u32> m_consumer_waiting;
+	Semaphore m_signal;
+
+	// Filled by pushUnbounded() while the queue is full
+	Mutex m_overflow_mutex;
+	std::deque<T> m_overflow;
+	Atomic<u32> m_overflow_size;
+	// Consumer only; the overflow list taken over by popOverflow()
+	std::deque<T> m_pending;
+
+	DISABLE_CLASS_COPY(MPSCQueue);
+};
+
 template<typename K, typename V>
 class LRUCache
 {
@@ -272,6 +272,17 @@ inline u32 calc_parity(u32 v)
 
 u64 murmur_hash_64_ua(const void *key, int len, unsigned int seed);
 
+// Hash for v3s16 keys in hash containers, mixes all bits of the position
+struct V3s16Hash
+{
+	size_t operator()(const v3s16 &p) const
+	{
+		u64 h = ((u64)(u16)p.X << 32) | ((u64)(u16)p.Y << 16) | (u16)p.Z;
+		h *= 0x9E3779B97F4A7C15ULL;
+		return (size_t)(h ^ (h >> 29));
+	}
+};
+
 bool isBlockInSight(v3s16 blockpos_b, v3f camera_pos, v3f camera_dir,
 		f32 camera_fov, f32 range, f32 *distance_ptr=NULL);
 
@@ -277,6 +277,15 @@ public:
 	{
 		return m_size;
 	}
+	/*
+		Shrinks the visible size without reallocating. Only affects this
+		reference, not other ones sharing the data.
+	*/
+	void truncate(unsigned int size)
+	{
+		assert(size <= m_size);
+		m_size = size;
+	}
 	operator Buffer<T>() const
 	{
 		return Buffer<T>(data, m_size);
@@ -0,0 +1,128 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "thread.h"
+
+class WorkerPool::WorkerThread : public Thread
+{
+public:
+	WorkerThread(const std::string &name, WorkerPool *pool) :
+		Thread(name),
+		m_pool(pool)
+	{
+	}
+
+	void *run()
+	{
+		DSTACK(FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		for (;;) {
+			m_pool->m_start.wait();
+			if (m_pool->m_stopping)
+				break;
+			m_pool->work();
+			m_pool->m_done.post();
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER
+
+		return NULL;
+	}
+
+private:
+	WorkerPool *m_pool;
+};
+
+
+WorkerPool::WorkerPool(const std::string &name, u32 num_threads) :
+	m_job(NULL),
+	m_count(0),
+	m_next(0),
+	m_busy(0),
+	m_stopping(false)
+{
+	for (u32 i = 0; i < num_threads; i++) {
+		WorkerThread *thread = new WorkerThread(name + "Worker", this);
+		if (!thread->start()) {
+			errorstream << "WorkerPool: Failed to start " << name
+				<< " worker thread" << std::endl;
+			delete thread;
+			break;
+		}
+		m_threads.push_back(thread);
+	}
+}
+
+u32 WorkerPool::getDefaultThreadCount(bool server_thread)
+{
+	s32 spare = (s32)Thread::getNumberOfProcessors() - 2;
+	if (spare <= 0)
+		return 0;
+	return server_thread ? spare - spare / 2 : spare / 2;
+}
+
+WorkerPool::~WorkerPool()
+{
+	m_stopping = true;
+	m_start.post(m_threads.size());
+	for (u32 i = 0; i < m_threads.size(); i++) {
+		m_threads[i]->wait();
+		delete m_threads[i];
+	}
+}
+
+void WorkerPool::run(Job *job, u32 count)
+{
+	if (count == 0)
+		return;
+
+	// Someone else owns the workers right now, don't wait for them
+	u32 idle = 0;
+	if (count == 1 || m_threads.empty() ||
+			!m_busy.compare_exchange_strong(idle, 1)) {
+		for (u32 i = 0; i < count; i++)
+			job->run(i);
+		return;
+	}
+
+	m_job = job;
+	m_count = count;
+	m_next = 0;
+
+	// Not worth waking anybody up for a single job
+	u32 num_woken = MYMIN(count - 1, (u32)m_threads.size());
+	m_start.post(num_woken);
+	work();
+	for (u32 i = 0; i < num_woken; i++)
+		m_done.wait();
+
+	m_job = NULL;
+	m_busy = 0;
+}
+
+void WorkerPool::work()
+{
+	for (;;) {
+		u32 i = m_next++;
+		if (i >= m_count)
+			break;
+		m_job->run(i);
+	}
+}
@@ -24,8 +24,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "../threading/thread.h"
 #include "../threading/mutex.h"
 #include "../threading/mutex_auto_lock.h"
+#include "../threading/semaphore.h"
+#include "../threading/atomic.h"
 #include "porting.h"
 #include "log.h"
+#include <vector>
 
 template<typename T>
 class MutexedVariable {
@@ -235,5 +238,57 @@ private:
 	Semaphore m_update_sem;
 };
 
+/*
+	A fixed set of worker threads for data parallel server work.
+
+	run() calls job->run(i) for every i in [0, count) spread over the
+	workers and the calling thread, and returns once all of them are done.
+	Indices are handed out one by one, so jobs of uneven size balance out.
+	A pool may be shared by several threads: if a batch is already running
+	when run() is called, the new batch is done inline by the caller.
+*/
+class WorkerPool
+{
+public:
+	class Job
+	{
+	public:
+		virtual ~Job() {}
+		virtual void run(u32 index) = 0;
+	};
+
+	// num_threads additional threads are started, 0 runs everything inline
+	WorkerPool(const std::string &name, u32 num_threads);
+	~WorkerPool();
+
+	u32 getThreadCount() const { return m_threads.size(); }
+
+	/*
+		Size of pools left to the engine. One processor is left for the
+		server thread and one for the others. The mapgen pool gets half of
+		the rest, the pools run by the server thread get the other half:
+		they never run at the same time, so each of them may take it all.
+	*/
+	static u32 getDefaultThreadCount(bool server_thread);
+
+	void run(Job *job, u32 count);
+
+private:
+	class WorkerThread;
+
+	// Runs jobs until the batch is exhausted
+	void work();
+
+	std::vector<WorkerThread *> m_threads;
+	Semaphore m_start;
+	Semaphore m_done;
+
+	Job *m_job;
+	u32 m_count;
+	Atomic<u32> m_next;
+	Atomic<u32> m_busy;
+	bool m_stopping;
+};
+
 #endif
 
@@ -21,8 +21,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "gettime.h"
 #include "nodedef.h"
+#include "voxelalgorithms.h"
 #include "util/timetaker.h"
+#include "threading/mutex_auto_lock.h"
 #include <string.h>  // memcpy, memset
+#include <algorithm>
 
 /*
 	Debug stuff
@@ -37,9 +40,114 @@ u32 updateareawaterpressure_time = 0;
 u32 flowwater_pre_time = 0;
 
 
+/*
+	VoxelBufferPool
+*/
+
+// Most memory kept for reuse, enough for a few mapchunks of 5 blocks
+#define VOXEL_BUFFER_POOL_MAX_SIZE (64 * 1024 * 1024)
+
+VoxelBufferPool::VoxelBufferPool():
+	m_size(0),
+	m_num_allocated(0),
+	m_num_reused(0)
+{
+}
+
+VoxelBufferPool::~VoxelBufferPool()
+{
+	clear();
+}
+
+VoxelBufferPool *VoxelBufferPool::get()
+{
+	static VoxelBufferPool pool;
+	return &pool;
+}
+
+bool VoxelBufferPool::take(u32 size, MapNode **data, u8 **flags, u32 *capacity)
+{
+	{
+		MutexAutoLock lock(m_mutex);
+
+		// The smallest buffer that fits, unless it's more than twice as big
+		size_t best = m_buffers.size();
+		for (size_t i = 0; i < m_buffers.size(); i++) {
+			u32 c = m_buffers[i].capacity;
+			if (c >= size && c / 2 <= size &&
+					(best == m_buffers.size() || c < m_buffers[best].capacity))
+				best = i;
+		}
+
+		if (best != m_buffers.size()) {
+			Buffer &buffer = m_buffers[best];
+			*data = buffer.data;
+			*flags = buffer.flags;
+			*capacity = buffer.capacity;
+			m_size -= (size_t)buffer.capacity * (sizeof(MapNode) + 1);
+			buffer = m_buffers.back();
+			m_buffers.pop_back();
+			m_num_reused++;
+			return true;
+		}
+
+		m_num_allocated++;
+	}
+
+	*data = new MapNode[size];
+	*flags = new u8[size];
+	*capacity = size;
+	return false;
+}
+
+void VoxelBufferPool::give(MapNode *data, u8 *flags, u32 capacity)
+{
+	size_t buffer_size = (size_t)capacity * (sizeof(MapNode) + 1);
+	{
+		MutexAutoLock lock(m_mutex);
+		if (m_size + buffer_size <= VOXEL_BUFFER_POOL_MAX_SIZE) {
+			Buffer buffer = { data, flags, capacity };
+			m_buffers.push_back(buffer);
+			m_size += buffer_size;
+			return;
+		}
+	}
+
+	delete[] data;
+	delete[] flags;
+}
+
+void VoxelBufferPool::clear()
+{
+	MutexAutoLock lock(m_mutex);
+	for (size_t i = 0; i < m_buffers.size(); i++) {
+		delete[] m_buffers[i].data;
+		delete[] m_buffers[i].flags;
+	}
+	m_buffers.clear();
+	m_size = 0;
+}
+
+u32 VoxelBufferPool::getNumAllocated()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_num_allocated;
+}
+
+u32 VoxelBufferPool::getNumReused()
+{
+	MutexAutoLock lock(m_mutex);
+	return m_num_reused;
+}
+
+/*
+	VoxelManipulator
+*/
+
 VoxelManipulator::VoxelManipulator():
 	m_data(NULL),
-	m_flags(NULL)
+	m_flags(NULL),
+	m_capacity(0)
 {
 }
 
@@ -52,10 +160,11 @@ void VoxelManipulator::clear()
 {
 	// Reset area to volume=0
 	m_area = VoxelArea();
-	delete[] m_data;
+	if (m_data)
+		VoxelBufferPool::get()->give(m_data, m_flags, m_capacity);
 	m_data = NULL;
-	delete[] m_flags;
 	m_flags = NULL;
+	m_capacity = 0;
 }
 
 void VoxelManipulator::print(std::ostream &o, INodeDefManager *ndef,
@@ -173,11 +282,14 @@ void VoxelManipulator::addArea(const VoxelArea &area)
 	dstream<<", new_size="<<new_size;
 	dstream<<std::endl;*/
 
-	// Allocate new data and clear flags
-	MapNode *new_data = new MapNode[new_size];
-	assert(new_data);
-	u8 *new_flags = new u8[new_size];
-	assert(new_flags);
+	// Get new data and clear flags. Nodes without data are air, as
+	// they are in a freshly allocated buffer.
+	VoxelBufferPool *pool = VoxelBufferPool::get();
+	MapNode *new_data;
+	u8 *new_flags;
+	u32 new_capacity;
+	if (pool->take(new_size, &new_data, &new_flags, &new_capacity))
+		std::fill(new_data, new_data + new_size, MapNode());
 	memset(new_flags, VOXELFLAG_NO_DATA, new_size);
 
 	// Copy old data
@@ -204,11 +316,14 @@ void VoxelManipulator::addArea(const VoxelArea &area)
 	/*dstream<<"old_data="<<(int)old_data<<", new_data="<<(int)new_data
 	<<", old_flags="<<(int)m_flags<<", new_flags="<<(int)new_flags<<std::endl;*/
 
+	u32 old_capacity = m_capacity;
+
 	m_data = new_data;
 	m_flags = new_flags;
+	m_capacity = new_capacity;
 
-	delete[] old_data;
-	delete[] old_flags;
+	if (old_data)
+		pool->give(old_data, old_flags, old_capacity);
 
 	//dstream<<"addArea done"<<std::endl;
 }
@@ -328,82 +443,13 @@ void VoxelManipulator::clearFlag(u8 flags)
 void VoxelManipulator::unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
 		std::set<v3s16> & light_sources, INodeDefManager *nodemgr)
 {
-	v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	VoxelArea voxel_area(p - v3s16(1,1,1), p + v3s16(1,1,1));
-	addArea(voxel_area);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		/*
-			If the neighbor is dimmer than what was specified
-			as oldlight (the light of the previous node)
-		*/
-		u8 light2 = n2.getLight(bank, nodemgr);
-		if(light2 < oldlight)
-		{
-			/*
-				And the neighbor is transparent and it has some light
-			*/
-			if(nodemgr->get(n2).light_propagates && light2 != 0)
-			{
-				/*
-					Set light to 0 and add to queue
-				*/
-
-				n2.setLight(bank, 0, nodemgr);
-
-				unspreadLight(bank, n2pos, light2, light_sources, nodemgr);
-
-				/*
-					Remove from light_sources if it is there
-					NOTE: This doesn't happen nearly at all
-				*/
-				/*if(light_sources.find(n2pos))
-				{
-					std::cout<<"Removed from light_sources"<<std::endl;
-					light_sources.remove(n2pos);
-				}*/
-			}
-		}
-		else{
-			light_sources.insert(n2pos);
-		}
-	}
+	std::map<v3s16, u8> from_nodes;
+	from_nodes[p] = oldlight;
+	unspreadLight(bank, from_nodes, light_sources, nodemgr);
 }
 
 /*
-	Goes recursively through the neighbours of the node.
-
-	Alters only transparent nodes.
-
-	If the lighting of the neighbour is lower than the lighting of
-	the node was (before changing it to 0 at the step before), the
-	lighting of the neighbour is set to 0 and then the same stuff
-	repeats for the neighbour.
-
-	The ending nodes of the routine are stored in light_sources.
-	This is useful when a light is removed. In such case, this
-	routine can be called for the light node and then again for
-	light_sources to re-light the area without the removed light.
+	See voxalgo::unspreadLight.
 
 	values of from_nodes are lighting values.
 */
@@ -411,173 +457,29 @@ void VoxelManipulator::unspreadLight(enum LightBank bank,
 		std::map<v3s16, u8> & from_nodes,
 		std::set<v3s16> & light_sources, INodeDefManager *nodemgr)
 {
-	if(from_nodes.empty())
-		return;
-
-	for(std::map<v3s16, u8>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
-	{
-		unspreadLight(bank, j->first, j->second, light_sources, nodemgr);
-	}
+	voxalgo::VoxelLightNodes nodes(*this);
+	voxalgo::unspreadLight(nodes, bank, nodemgr, from_nodes, light_sources);
 }
 
 void VoxelManipulator::spreadLight(enum LightBank bank, v3s16 p,
 		INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	VoxelArea voxel_area(p - v3s16(1,1,1), p + v3s16(1,1,1));
-	addArea(voxel_area);
-
-	u32 i = m_area.index(p);
-
-	if(m_flags[i] & VOXELFLAG_NO_DATA)
-		return;
-
-	MapNode &n = m_data[i];
-
-	u8 oldlight = n.getLight(bank, nodemgr);
-	u8 newlight = diminish_light(oldlight);
-
-	// Loop through 6 neighbors
-	for(u16 i=0; i<6; i++)
-	{
-		// Get the position of the neighbor node
-		v3s16 n2pos = p + dirs[i];
-
-		u32 n2i = m_area.index(n2pos);
-
-		if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n2 = m_data[n2i];
-
-		u8 light2 = n2.getLight(bank, nodemgr);
-
-		/*
-			If the neighbor is brighter than the current node,
-			add to list (it will light up this node on its turn)
-		*/
-		if(light2 > undiminish_light(oldlight))
-		{
-			spreadLight(bank, n2pos, nodemgr);
-		}
-		/*
-			If the neighbor is dimmer than how much light this node
-			would spread on it, add to list
-		*/
-		if(light2 < newlight)
-		{
-			if(nodemgr->get(n2).light_propagates)
-			{
-				n2.setLight(bank, newlight, nodemgr);
-				spreadLight(bank, n2pos, nodemgr);
-			}
-		}
-	}
+	std::set<v3s16> from_nodes;
+	from_nodes.insert(p);
+	spreadLight(bank, from_nodes, nodemgr);
 }
 
 
 const MapNode VoxelManipulator::ContentIgnoreNode = MapNode(CONTENT_IGNORE);
 
 /*
-	Lights neighbors of from_nodes, collects all them and then
-	goes on recursively.
+	See voxalgo::spreadLight.
 */
 void VoxelManipulator::spreadLight(enum LightBank bank,
 		std::set<v3s16> & from_nodes, INodeDefManager *nodemgr)
 {
-	const v3s16 dirs[6] = {
-		v3s16(0,0,1), // back
-		v3s16(0,1,0), // top
-		v3s16(1,0,0), // right
-		v3s16(0,0,-1), // front
-		v3s16(0,-1,0), // bottom
-		v3s16(-1,0,0), // left
-	};
-
-	if(from_nodes.empty())
-		return;
-
-	std::set<v3s16> lighted_nodes;
-
-	for(std::set<v3s16>::iterator j = from_nodes.begin();
-		j != from_nodes.end(); ++j)
-	{
-		v3s16 pos = *j;
-
-		VoxelArea voxel_area(pos - v3s16(1,1,1), pos + v3s16(1,1,1));
-		addArea(voxel_area);
-
-		u32 i = m_area.index(pos);
-
-		if(m_flags[i] & VOXELFLAG_NO_DATA)
-			continue;
-
-		MapNode &n = m_data[i];
-
-		u8 oldlight = n.getLight(bank, nodemgr);
-		u8 newlight = diminish_light(oldlight);
-
-		// Loop through 6 neighbors
-		for(u16 i=0; i<6; i++)
-		{
-			// Get the position of the neighbor node
-			v3s16 n2pos = pos + dirs[i];
-
-			try
-			{
-				u32 n2i = m_area.index(n2pos);
-
-				if(m_flags[n2i] & VOXELFLAG_NO_DATA)
-					continue;
-
-				MapNode &n2 = m_data[n2i];
-
-				u8 light2 = n2.getLight(bank, nodemgr);
-
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(light2 > undiminish_light(oldlight))
-				{
-					lighted_nodes.insert(n2pos);
-				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(light2 < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						lighted_nodes.insert(n2pos);
-					}
-				}
-			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
-			}
-		}
-	}
-
-	/*dstream<<"spreadLight(): Changed block "
-			<<blockchangecount<<" times"
-			<<" for "<<from_nodes.size()<<" nodes"
-			<<std::endl;*/
-
-	if(!lighted_nodes.empty())
-		spreadLight(bank, lighted_nodes, nodemgr);
+	voxalgo::VoxelLightNodes nodes(*this);
+	voxalgo::spreadLight(nodes, bank, nodemgr, from_nodes);
 }
 
 //END
@@ -29,6 +29,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <vector>
+#include "threading/mutex.h"
 
 class INodeDefManager;
 
@@ -350,6 +352,46 @@ enum VoxelPrintMode
 	VOXELPRINT_LIGHT_DAY,
 };
 
+/*
+	Keeps the node and flag buffers of cleared VoxelManipulators for the
+	next ones. Mapgen and mods create and drop manipulators of the same
+	few sizes many times a second, and each used to allocate and fault in
+	megabytes of fresh memory.
+*/
+class VoxelBufferPool
+{
+public:
+	VoxelBufferPool();
+	~VoxelBufferPool();
+
+	static VoxelBufferPool *get();
+
+	// Buffers for at least size nodes. Returns true if they were reused,
+	// in which case they hold whatever their last user left in them.
+	bool take(u32 size, MapNode **data, u8 **flags, u32 *capacity);
+	// Keeps the buffers unless the pool is full, then frees them
+	void give(MapNode *data, u8 *flags, u32 capacity);
+	// Frees all kept buffers
+	void clear();
+
+	// Number of buffers allocated and reused since the pool was made
+	u32 getNumAllocated();
+	u32 getNumReused();
+
+private:
+	struct Buffer {
+		MapNode *data;
+		u8 *flags;
+		u32 capacity;
+	};
+
+	Mutex m_mutex;
+	std::vector<Buffer> m_buffers;
+	size_t m_size;
+	u32 m_num_allocated;
+	u32 m_num_reused;
+};
+
 class VoxelManipulator /*: public NodeContainer*/
 {
 public:
@@ -542,8 +584,7 @@ public:
 
 	void clearFlag(u8 flag);
 
-	// TODO: Move to voxelalgorithms.h
-
+	// Wrappers of voxalgo::unspreadLight and voxalgo::spreadLight
 	void unspreadLight(enum LightBank bank, v3s16 p, u8 oldlight,
 			std::set<v3s16> & light_sources, INodeDefManager *nodemgr);
 	void unspreadLight(enum LightBank bank,
@@ -580,6 +621,9 @@ public:
 	*/
 	u8 *m_flags;
 
+	// Number of nodes m_data and m_flags have room for, see VoxelBufferPool
+	u32 m_capacity;
+
 	static const MapNode ContentIgnoreNode;
 
 	//TODO: Use these or remove them
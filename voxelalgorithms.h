@@ -22,13 +22,151 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "voxel.h"
 #include "mapnode.h"
+#include "nodedef.h"
+#include "util/directiontables.h"
 #include <set>
 #include <map>
+#include <vector>
 
 namespace voxalgo
 {
 
-// TODO: Move unspreadLight and spreadLight from VoxelManipulator to here
+/*
+	Breadth-first light propagation, shared by VoxelManipulator and Map.
+
+	Nodes is the node storage the light is spread in, it provides
+		bool get(v3s16 p, MapNode &n); // false if there is no data at p
+		void set(v3s16 p, MapNode &n);
+*/
+
+/*
+	Goes through the neighbours of from_nodes, altering only transparent
+	nodes. Neighbours dimmer than the light the node had before (the
+	value in from_nodes) are darkened and processed the same way.
+	Brighter ones are collected to light_sources, so the area can be
+	re-lit with spreadLight afterwards.
+*/
+template <typename Nodes>
+void unspreadLight(Nodes &nodes, enum LightBank bank, INodeDefManager *ndef,
+		const std::map<v3s16, u8> &from_nodes,
+		std::set<v3s16> &light_sources)
+{
+	// Nodes to process with the light they had, in the order they
+	// were darkened
+	std::vector<std::pair<v3s16, u8> > queue(from_nodes.begin(),
+		from_nodes.end());
+	MapNode n;
+
+	for (size_t head = 0; head < queue.size(); head++) {
+		v3s16 pos = queue[head].first;
+		u8 oldlight = queue[head].second;
+		if (!nodes.get(pos, n))
+			continue;
+
+		for (u16 i = 0; i < 6; i++) {
+			v3s16 n2pos = pos + g_6dirs[i];
+			MapNode n2;
+			if (!nodes.get(n2pos, n2))
+				continue;
+
+			u8 light2 = n2.getLight(bank, ndef);
+			if (light2 < oldlight) {
+				if (ndef->get(n2).light_propagates && light2 != 0) {
+					n2.setLight(bank, 0, ndef);
+					nodes.set(n2pos, n2);
+					queue.push_back(std::make_pair(n2pos, light2));
+				}
+			} else {
+				light_sources.insert(n2pos);
+			}
+		}
+	}
+}
+
+/*
+	Lights the neighbours of from_nodes and goes on from every node that
+	got brighter. Nodes are kept in one queue per light level and the
+	brightest are processed first, so most nodes are only set once.
+*/
+template <typename Nodes>
+void spreadLight(Nodes &nodes, enum LightBank bank, INodeDefManager *ndef,
+		const std::set<v3s16> &from_nodes)
+{
+	std::vector<v3s16> queues[LIGHT_SUN + 1];
+	s32 level = 0;
+	MapNode n;
+
+	for (std::set<v3s16>::const_iterator
+			i = from_nodes.begin(); i != from_nodes.end(); ++i) {
+		if (!nodes.get(*i, n))
+			continue;
+		u8 light = n.getLight(bank, ndef);
+		queues[light].push_back(*i);
+		level = MYMAX(level, light);
+	}
+
+	while (level >= 0) {
+		std::vector<v3s16> &queue = queues[level];
+		if (queue.empty()) {
+			level--;
+			continue;
+		}
+		v3s16 pos = queue.back();
+		queue.pop_back();
+		if (!nodes.get(pos, n))
+			continue;
+
+		u8 oldlight = n.getLight(bank, ndef);
+		u8 newlight = diminish_light(oldlight);
+
+		for (u16 i = 0; i < 6; i++) {
+			v3s16 n2pos = pos + g_6dirs[i];
+			MapNode n2;
+			if (!nodes.get(n2pos, n2))
+				continue;
+
+			u8 light2 = n2.getLight(bank, ndef);
+			// A brighter neighbour lights up this node on its turn
+			if (light2 > undiminish_light(oldlight)) {
+				queues[light2].push_back(n2pos);
+				level = MYMAX(level, light2);
+			}
+			if (light2 < newlight && ndef->get(n2).light_propagates) {
+				n2.setLight(bank, newlight, ndef);
+				nodes.set(n2pos, n2);
+				queues[newlight].push_back(n2pos);
+			}
+		}
+	}
+}
+
+// Node access for the above inside the area of a VoxelManipulator
+class VoxelLightNodes
+{
+public:
+	VoxelLightNodes(VoxelManipulator &v):
+		m_v(v)
+	{}
+
+	bool get(v3s16 p, MapNode &n)
+	{
+		if (!m_v.m_area.contains(p))
+			return false;
+		u32 i = m_v.m_area.index(p);
+		if (m_v.m_flags[i] & VOXELFLAG_NO_DATA)
+			return false;
+		n = m_v.m_data[i];
+		return true;
+	}
+
+	void set(v3s16 p, MapNode &n)
+	{
+		m_v.m_data[m_v.m_area.index(p)] = n;
+	}
+
+private:
+	VoxelManipulator &m_v;
+};
 
 void setLight(VoxelManipulator &v, VoxelArea a, u8 light,
 		INodeDefManager *ndef);